@@ -145,6 +145,7 @@ void init_scene(trace_scene* scene, sceneio_scene* ioscene,
     camera->orthographic = iocamera->orthographic;
     camera->aperture     = iocamera->aperture;
     camera->focus        = iocamera->focus;
+    camera->shutter      = iocamera->shutter;
     camera_map[iocamera] = camera;
   }
 
@@ -226,6 +227,7 @@ void init_scene(trace_scene* scene, sceneio_scene* ioscene,
       progress_cb("converting instances", progress.x++, progress.y);
     auto instance      = add_instance(scene);
     instance->frame    = ioinstance->frame;
+    instance->frames   = ioinstance->frames;
     instance->shape    = shape_map.at(ioinstance->shape);
     instance->material = material_map.at(ioinstance->material);
   }
@@ -590,6 +592,7 @@ void draw_widgets(gui_window* win, app_states* apps, const gui_input& input) {
       camera->orthographic = iocamera->orthographic;
       camera->aperture     = iocamera->aperture;
       camera->focus        = iocamera->focus;
+      camera->shutter      = iocamera->shutter;
       reset_display(app);
     }
     end_header(win);
@@ -619,8 +622,9 @@ void draw_widgets(gui_window* win, app_states* apps, const gui_input& input) {
       auto ioinstance = app->selected_instance;
       auto instance   = get_element(
           ioinstance, app->ioscene->instances, app->scene->instances);
-      instance->frame = ioinstance->frame;
-      instance->shape = get_element(
+      instance->frame  = ioinstance->frame;
+      instance->frames = ioinstance->frames;
+      instance->shape  = get_element(
           ioinstance->shape, app->ioscene->shapes, app->scene->shapes);
       instance->material = get_element(
           ioinstance->material, app->ioscene->materials, app->scene->materials);
@@ -696,10 +700,13 @@ void draw_widgets(gui_window* win, app_states* apps, const gui_input& input) {
     draw_combobox(win, "textures##2", app->selected_texture,
         app->ioscene->textures, true);
     if (draw_widgets(win, app->ioscene, app->selected_texture)) {
+      // mip levels are read without locking, so the render must be stopped
+      // before they are cleared with the images
       stop_display(app);
       auto iotexture = app->selected_texture;
       auto texture   = get_element(
           iotexture, app->ioscene->textures, app->scene->textures);
+      clear_mipmaps(texture);
       texture->hdr = iotexture->hdr;
       texture->ldr = iotexture->ldr;
       reset_display(app);
@@ -771,6 +778,9 @@ int main(int argc, const char* argv[]) {
   add_option(cli, "--env-hidden/--no-env-hidden", apps->params.envhidden,
       "Environments are hidden in renderer");
   add_option(cli, "--bvh", apps->params.bvh, "Bvh type", trace_bvh_names);
+  add_option(cli, "--bvh-cache", apps->params.bvhcache, "Bvh cache directory.");
+  add_option(cli, "--mipmaps/--no-mipmaps", apps->params.mipmaps,
+      "Filter textures with mipmaps.");
   add_option(cli, "--skyenv/--no-skyenv", add_skyenv, "Add sky envmap");
   add_option(cli, "scenes", filenames, "Scene filenames", true);
   parse_cli(cli, argc, argv);
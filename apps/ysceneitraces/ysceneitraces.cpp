@@ -133,6 +133,7 @@ void init_scene(trace_scene* scene, sceneio_scene* ioscene,
     camera->orthographic = iocamera->orthographic;
     camera->aperture     = iocamera->aperture;
     camera->focus        = iocamera->focus;
+    camera->shutter      = iocamera->shutter;
     camera_map[iocamera] = camera;
   }
 
@@ -214,6 +215,7 @@ void init_scene(trace_scene* scene, sceneio_scene* ioscene,
       progress_cb("converting instances", progress.x++, progress.y);
     auto instance      = add_instance(scene);
     instance->frame    = ioinstance->frame;
+    instance->frames   = ioinstance->frames;
     instance->shape    = shape_map.at(ioinstance->shape);
     instance->material = material_map.at(ioinstance->material);
   }
@@ -261,6 +263,9 @@ int main(int argc, const char* argv[]) {
   add_option(cli, "--env-hidden/--no-env-hidden", app->params.envhidden,
       "Environments are hidden in renderer");
   add_option(cli, "--bvh", app->params.bvh, "Bvh type", trace_bvh_names);
+  add_option(cli, "--bvh-cache", app->params.bvhcache, "Bvh cache directory.");
+  add_option(cli, "--mipmaps/--no-mipmaps", app->params.mipmaps,
+      "Filter textures with mipmaps.");
   add_option(cli, "--skyenv/--no-skyenv", add_skyenv, "Add sky envmap");
   add_option(cli, "--output,-o", app->imagename, "Image output");
   add_option(cli, "scene", app->filename, "Scene filename", true);
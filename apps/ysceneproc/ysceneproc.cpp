@@ -824,18 +824,19 @@ int main(int argc, const char* argv[]) {
     for (auto stat : scene_stats(scene)) print_info(stat);
   }
 
-  // tesselate if needed
-  if (path_extension(output) != ".json") {
+  // tesselate if needed, binary scenes keep subdivision data like json ones
+  auto ext = path_extension(output);
+  if (ext != ".json" && ext != ".ybin") {
     tesselate_shapes(scene, print_progress);
   }
 
-  // make a directory if needed
+  // make a directory if needed, binary scenes are stored in a single file
   if (!make_directory(path_dirname(output), ioerror)) print_fatal(ioerror);
-  if (!scene->shapes.empty()) {
+  if (ext != ".ybin" && !scene->shapes.empty()) {
     if (!make_directory(path_join(path_dirname(output), "shapes"), ioerror))
       print_fatal(ioerror);
   }
-  if (!scene->textures.empty()) {
+  if (ext != ".ybin" && !scene->textures.empty()) {
     if (!make_directory(path_join(path_dirname(output), "textures"), ioerror))
       print_fatal(ioerror);
   }
@@ -33,12 +33,14 @@
 #include <yocto/yocto_trace.h>
 using namespace yocto;
 
+#include <chrono>
 #include <map>
 #include <memory>
 #include <unordered_map>
 using std::unordered_map;
 
-// Construct a scene from io
+// Construct a scene from io. Shape and texture buffers are moved, since the
+// io scene is discarded after conversion.
 void init_scene(trace_scene* scene, sceneio_scene* ioscene,
     trace_camera*& camera, sceneio_camera* iocamera,
     progress_callback progress_cb = {}) {
@@ -61,6 +63,7 @@ void init_scene(trace_scene* scene, sceneio_scene* ioscene,
     camera->orthographic = iocamera->orthographic;
     camera->aperture     = iocamera->aperture;
     camera->focus        = iocamera->focus;
+    camera->shutter      = iocamera->shutter;
     camera_map[iocamera] = camera;
   }
 
@@ -70,8 +73,8 @@ void init_scene(trace_scene* scene, sceneio_scene* ioscene,
     if (progress_cb)
       progress_cb("converting textures", progress.x++, progress.y);
     auto texture           = add_texture(scene);
-    texture->hdr           = iotexture->hdr;
-    texture->ldr           = iotexture->ldr;
+    texture->hdr           = std::move(iotexture->hdr);
+    texture->ldr           = std::move(iotexture->ldr);
     texture_map[iotexture] = texture;
   }
 
@@ -116,19 +119,19 @@ void init_scene(trace_scene* scene, sceneio_scene* ioscene,
   for (auto ioshape : ioscene->shapes) {
     if (progress_cb) progress_cb("converting shapes", progress.x++, progress.y);
     auto shape              = add_shape(scene);
-    shape->points           = ioshape->points;
-    shape->lines            = ioshape->lines;
-    shape->triangles        = ioshape->triangles;
-    shape->quads            = ioshape->quads;
-    shape->quadspos         = ioshape->quadspos;
-    shape->quadsnorm        = ioshape->quadsnorm;
-    shape->quadstexcoord    = ioshape->quadstexcoord;
-    shape->positions        = ioshape->positions;
-    shape->normals          = ioshape->normals;
-    shape->texcoords        = ioshape->texcoords;
-    shape->colors           = ioshape->colors;
-    shape->radius           = ioshape->radius;
-    shape->tangents         = ioshape->tangents;
+    shape->points           = std::move(ioshape->points);
+    shape->lines            = std::move(ioshape->lines);
+    shape->triangles        = std::move(ioshape->triangles);
+    shape->quads            = std::move(ioshape->quads);
+    shape->quadspos         = std::move(ioshape->quadspos);
+    shape->quadsnorm        = std::move(ioshape->quadsnorm);
+    shape->quadstexcoord    = std::move(ioshape->quadstexcoord);
+    shape->positions        = std::move(ioshape->positions);
+    shape->normals          = std::move(ioshape->normals);
+    shape->texcoords        = std::move(ioshape->texcoords);
+    shape->colors           = std::move(ioshape->colors);
+    shape->radius           = std::move(ioshape->radius);
+    shape->tangents         = std::move(ioshape->tangents);
     shape->subdivisions     = ioshape->subdivisions;
     shape->catmullclark     = ioshape->catmullclark;
     shape->smooth           = ioshape->smooth;
@@ -142,6 +145,7 @@ void init_scene(trace_scene* scene, sceneio_scene* ioscene,
       progress_cb("converting instances", progress.x++, progress.y);
     auto instance      = add_instance(scene);
     instance->frame    = ioinstance->frame;
+    instance->frames   = ioinstance->frames;
     instance->shape    = shape_map.at(ioinstance->shape);
     instance->material = material_map.at(ioinstance->material);
   }
@@ -171,6 +175,8 @@ int main(int argc, const char* argv[]) {
   auto imfilename     = "out.hdr"s;
   auto filename       = "scene.json"s;
   auto feature_images = false;
+  auto print_bvh      = false;
+  auto print_load     = false;
 
   // parse command line
   auto cli = make_cli("yscntrace", "Offline path tracing");
@@ -188,6 +194,28 @@ int main(int argc, const char* argv[]) {
       "Environments are hidden in renderer");
   add_option(cli, "--save-batch", save_batch, "Save images progressively");
   add_option(cli, "--bvh", params.bvh, "Bvh type", trace_bvh_names);
+  add_option(cli, "--bvh-cache", params.bvhcache, "Bvh cache directory.");
+  add_option(cli, "--mipmaps/--no-mipmaps", params.mipmaps,
+      "Filter textures with mipmaps.");
+  add_option(cli, "--bvh-stats", print_bvh, "Print bvh statistics.");
+  add_option(cli, "--load-stats", print_load, "Print loading statistics.");
+  add_option(cli, "--bvh-precompute/--no-bvh-precompute", params.precompute,
+      "Precompute shape elements for intersection.");
+  add_option(cli, "--tile-size", params.tilesize, "Tile size in pixels.");
+  add_option(cli, "--tile-samples", params.tilesamples,
+      "Samples per tile before moving on.");
+  add_option(cli, "--tile-order", params.tileorder, "Tile rendering order.",
+      trace_tileorder_names);
+  add_option(cli, "--adaptive/--no-adaptive", params.adaptive,
+      "Stop sampling converged pixels.");
+  add_option(cli, "--min-samples", params.minsamples,
+      "Minimum number of samples for adaptive sampling.");
+  add_option(cli, "--target-error", params.targeterror,
+      "Relative error target for adaptive sampling.");
+  add_option(cli, "--max-ratio", params.maxratio,
+      "Maximum samples per pixel for adaptive sampling, times samples.");
+  add_option(cli, "--time-limit", params.timelimit,
+      "Rendering time limit in seconds.");
   add_option(cli, "--skyenv/--no-skyenv", add_skyenv, "Add sky envmap");
   add_option(cli, "--output-image,-o", imfilename, "Image filename");
   add_option(cli, "scene", filename, "Scene filename", true);
@@ -199,8 +227,19 @@ int main(int argc, const char* argv[]) {
   auto ioscene_guard = std::make_unique<sceneio_scene>();
   auto ioscene       = ioscene_guard.get();
   auto ioerror       = ""s;
+  auto load_start    = std::chrono::steady_clock::now();
   if (!load_scene(filename, ioscene, ioerror, print_progress))
     print_fatal(ioerror);
+  auto load_time = std::chrono::nanoseconds(
+      std::chrono::steady_clock::now() - load_start);
+
+  // print loading stats
+  if (print_load) {
+    print_info("load stats -----------");
+    print_info("load time:   " + format_duration(load_time.count()));
+    print_info(
+        "peak memory: " + std::to_string(get_peak_memory()) + " bytes");
+  }
 
   // add sky
   if (add_skyenv) add_sky(ioscene);
@@ -223,7 +262,25 @@ int main(int argc, const char* argv[]) {
   // build bvh
   auto bvh_guard = std::make_unique<trace_bvh>();
   auto bvh       = bvh_guard.get();
+  auto bvh_start = std::chrono::steady_clock::now();
   init_bvh(bvh, scene, params, print_progress);
+  auto bvh_time = std::chrono::nanoseconds(
+      std::chrono::steady_clock::now() - bvh_start);
+
+  // print bvh stats
+  if (print_bvh) {
+    auto stats = get_bvh_stats(bvh);
+    print_info("bvh stats ------------");
+    print_info("build time: " + format_duration(bvh_time.count()));
+    print_info("nodes:      " + std::to_string(stats.nodes));
+    print_info("leaves:     " + std::to_string(stats.leaves));
+    print_info("depth:      " + std::to_string(stats.depth));
+    print_info("sah cost:   " + std::to_string(stats.sah_cost));
+    print_info("memory:     " + std::to_string(stats.memory) + " bytes");
+    if (stats.elements != 0)
+      print_info("bytes/elem: " +
+                 std::to_string((double)stats.memory / stats.elements));
+  }
 
   // init renderer
   auto lights_guard = std::make_unique<trace_lights>();
@@ -35,13 +35,16 @@
 #include <algorithm>
 #include <array>
 #include <atomic>
+#include <cstdio>
 #include <cstring>
 #include <deque>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <string>
 #include <utility>
 
+#include "yocto_commonio.h"
 #include "yocto_geometry.h"
 #include "yocto_parallel.h"
 
@@ -49,6 +52,10 @@
 #include <embree3/rtcore.h>
 #endif
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 // -----------------------------------------------------------------------------
 // USING DIRECTIVES
 // -----------------------------------------------------------------------------
@@ -324,6 +331,7 @@ void set_shape(bvh_scene* bvh, int shape_id, const vector<int>& points,
                              : bvh_span{shape->positions_data};
   shape->radius_data = as_view ? vector<float>{} : radius;
   shape->radius = as_view ? bvh_span{radius} : bvh_span{shape->radius_data};
+  shape->bvh.ordered = false;
 }
 
 // Set instances
@@ -351,58 +359,205 @@ void set_instances(bvh_scene* bvh, int num_instances,
 // -----------------------------------------------------------------------------
 namespace yocto {
 
+// Surface area of a bounding box
+static float bbox_area(const bbox3f& bbox) {
+  auto size = bbox.max - bbox.min;
+  return 2 * (size.x * size.y + size.x * size.z + size.y * size.z);
+}
+
+// Number of bins used by the SAH split.
+const int bvh_sah_bins = 16;
+
+// Number of primitives processed by each task when large nodes are binned
+// in parallel.
+const int bvh_parallel_prims = 16384;
+
+// Reduces the primitives in [start, end) with `func(result, start, end)`.
+// Large ranges are split into chunks that are reduced in parallel, and
+// then combined with `merge(result, chunk_result)`.
+template <typename T, typename Func, typename Merge>
+static T reduce_primitives(
+    int start, int end, bool parallel, Func&& func, Merge&& merge) {
+  auto nchunks = parallel ? (end - start) / bvh_parallel_prims : 0;
+  if (nchunks < 2) {
+    auto result = T{};
+    func(result, start, end);
+    return result;
+  }
+  auto results = vector<T>(nchunks);
+  parallel_for(
+      nchunks,
+      [&](int chunk) {
+        func(results[chunk],
+            start + (int)((int64_t)(end - start) * chunk / nchunks),
+            start + (int)((int64_t)(end - start) * (chunk + 1) / nchunks));
+      },
+      1);
+  for (auto chunk = 1; chunk < nchunks; chunk++)
+    merge(results[0], results[chunk]);
+  return results[0];
+}
+
+// Partitions the primitives in [start, end) so that the ones that satisfy
+// `pred` come first. Returns the index of the first primitive of the second
+// group. Large ranges are partitioned in parallel, preserving the relative
+// order of the primitives in each group.
+template <typename Pred>
+static int partition_primitives(
+    vector<int>& primitives, int start, int end, bool parallel, Pred&& pred) {
+  auto nchunks = parallel ? (end - start) / bvh_parallel_prims : 0;
+  if (nchunks < 2) {
+    return (int)(std::partition(primitives.data() + start,
+                     primitives.data() + end, pred) -
+                 primitives.data());
+  }
+  auto chunk_start = [start, end, nchunks](int chunk) {
+    return start + (int)((int64_t)(end - start) * chunk / nchunks);
+  };
+
+  // count the primitives that go to the first group in each chunk
+  auto counts = vector<int>(nchunks);
+  parallel_for(
+      nchunks,
+      [&](int chunk) {
+        for (auto i = chunk_start(chunk); i < chunk_start(chunk + 1); i++)
+          if (pred(primitives[i])) counts[chunk] += 1;
+      },
+      1);
+
+  // compute where each chunk writes its primitives
+  auto mid     = start;
+  auto offsets = vector<vec2i>(nchunks);
+  for (auto chunk = 0; chunk < nchunks; chunk++) mid += counts[chunk];
+  for (auto chunk = 0, left = start, right = mid; chunk < nchunks; chunk++) {
+    offsets[chunk] = {left, right};
+    left += counts[chunk];
+    right += chunk_start(chunk + 1) - chunk_start(chunk) - counts[chunk];
+  }
+
+  // scatter primitives and copy them back
+  auto partitioned = vector<int>(end - start);
+  parallel_for(
+      nchunks,
+      [&](int chunk) {
+        auto [left, right] = offsets[chunk];
+        for (auto i = chunk_start(chunk); i < chunk_start(chunk + 1); i++) {
+          if (pred(primitives[i])) {
+            partitioned[(left++) - start] = primitives[i];
+          } else {
+            partitioned[(right++) - start] = primitives[i];
+          }
+        }
+      },
+      1);
+  parallel_for(
+      nchunks,
+      [&](int chunk) {
+        for (auto i = chunk_start(chunk); i < chunk_start(chunk + 1); i++)
+          primitives[i] = partitioned[i - start];
+      },
+      1);
+  return mid;
+}
+
+// Primitive counts and bounds of the SAH bins along the three axes.
+struct bvh_sah_binning {
+  array<array<bbox3f, bvh_sah_bins>, 3> bboxes = {};
+  array<array<int, bvh_sah_bins>, 3>    counts = {};
+};
+
+// Bin index of a primitive center along an axis.
+static int sah_bin(const vec3f& center, const bbox3f& cbbox,
+    const vec3f& scale, int axis) {
+  auto bin = (int)((center[axis] - cbbox.min[axis]) * scale[axis]);
+  return clamp(bin, 0, bvh_sah_bins - 1);
+}
+
 // Splits a BVH node using the SAH heuristic. Returns split position and axis.
+// Primitives are binned along all axes in a single pass, and the cost of
+// all bin boundaries is evaluated with a prefix and a suffix sweep.
 static pair<int, int> split_sah(vector<int>& primitives,
     const vector<bbox3f>& bboxes, const vector<vec3f>& centers, int start,
-    int end) {
+    int end, bool parallel) {
   // initialize split axis and position
   auto split_axis = 0;
   auto mid        = (start + end) / 2;
 
   // compute primintive bounds and size
-  auto cbbox = invalidb3f;
-  for (auto i = start; i < end; i++)
-    cbbox = merge(cbbox, centers[primitives[i]]);
+  auto cbbox = reduce_primitives<bbox3f>(
+      start, end, parallel,
+      [&](bbox3f& bbox, int start, int end) {
+        for (auto i = start; i < end; i++)
+          bbox = merge(bbox, centers[primitives[i]]);
+      },
+      [](bbox3f& bbox, const bbox3f& chunk) { bbox = merge(bbox, chunk); });
   auto csize = cbbox.max - cbbox.min;
   if (csize == zero3f) return {mid, split_axis};
 
-  // consider N bins, compute their cost and keep the minimum
-  const int nbins    = 16;
-  auto      middle   = 0.0f;
-  auto      min_cost = flt_max;
-  auto      area     = [](auto& b) {
-    auto size = b.max - b.min;
-    return 1e-12f + 2 * size.x * size.y + 2 * size.x * size.z +
-           2 * size.y * size.z;
-  };
-  for (auto saxis = 0; saxis < 3; saxis++) {
-    for (auto b = 1; b < nbins; b++) {
-      auto split     = cbbox.min[saxis] + b * csize[saxis] / nbins;
-      auto left_bbox = invalidb3f, right_bbox = invalidb3f;
-      auto left_nprims = 0, right_nprims = 0;
-      for (auto i = start; i < end; i++) {
-        if (centers[primitives[i]][saxis] < split) {
-          left_bbox = merge(left_bbox, bboxes[primitives[i]]);
-          left_nprims += 1;
-        } else {
-          right_bbox = merge(right_bbox, bboxes[primitives[i]]);
-          right_nprims += 1;
+  // bin primitives along all axes
+  auto scale = zero3f;
+  for (auto axis = 0; axis < 3; axis++) {
+    if (csize[axis] > 0) scale[axis] = bvh_sah_bins / csize[axis];
+  }
+  auto binning = reduce_primitives<bvh_sah_binning>(
+      start, end, parallel,
+      [&](bvh_sah_binning& binning, int start, int end) {
+        for (auto i = start; i < end; i++) {
+          auto& center = centers[primitives[i]];
+          auto& bbox   = bboxes[primitives[i]];
+          for (auto axis = 0; axis < 3; axis++) {
+            auto bin                  = sah_bin(center, cbbox, scale, axis);
+            binning.bboxes[axis][bin] = merge(binning.bboxes[axis][bin], bbox);
+            binning.counts[axis][bin] += 1;
+          }
         }
-      }
-      auto cost = 1 + left_nprims * area(left_bbox) / area(cbbox) +
-                  right_nprims * area(right_bbox) / area(cbbox);
+      },
+      [](bvh_sah_binning& binning, const bvh_sah_binning& chunk) {
+        for (auto axis = 0; axis < 3; axis++) {
+          for (auto bin = 0; bin < bvh_sah_bins; bin++) {
+            binning.bboxes[axis][bin] = merge(
+                binning.bboxes[axis][bin], chunk.bboxes[axis][bin]);
+            binning.counts[axis][bin] += chunk.counts[axis][bin];
+          }
+        }
+      });
+
+  // evaluate the cost of splitting at each bin boundary
+  auto split_bin = 0;
+  auto min_cost  = flt_max;
+  for (auto axis = 0; axis < 3; axis++) {
+    if (csize[axis] == 0) continue;
+    // suffix sweep from the right, storing the cost of the right side
+    auto right_costs = array<float, bvh_sah_bins>{};
+    auto right_bbox  = invalidb3f;
+    auto right_count = 0;
+    for (auto bin = bvh_sah_bins - 1; bin > 0; bin--) {
+      right_bbox = merge(right_bbox, binning.bboxes[axis][bin]);
+      right_count += binning.counts[axis][bin];
+      right_costs[bin] = right_count ? right_count * bbox_area(right_bbox) : 0;
+    }
+    // prefix sweep from the left, combining both sides
+    auto left_bbox  = invalidb3f;
+    auto left_count = 0;
+    for (auto bin = 1; bin < bvh_sah_bins; bin++) {
+      left_bbox = merge(left_bbox, binning.bboxes[axis][bin - 1]);
+      left_count += binning.counts[axis][bin - 1];
+      auto cost = (left_count ? left_count * bbox_area(left_bbox) : 0) +
+                  right_costs[bin];
       if (cost < min_cost) {
         min_cost   = cost;
-        middle     = split;
-        split_axis = saxis;
+        split_bin  = bin;
+        split_axis = axis;
       }
     }
   }
+
   // split
-  mid = (int)(std::partition(primitives.data() + start, primitives.data() + end,
-                  [split_axis, middle, &centers](
-                      auto a) { return centers[a][split_axis] < middle; }) -
-              primitives.data());
+  mid = partition_primitives(
+      primitives, start, end, parallel, [&](int primitive) {
+        return sah_bin(centers[primitive], cbbox, scale, split_axis) <
+               split_bin;
+      });
 
   // if we were not able to split, just break the primitives in half
   if (mid == start || mid == end) {
@@ -457,15 +612,19 @@ static pair<int, int> split_balanced(vector<int>& primitives,
 // axis.
 static pair<int, int> split_middle(vector<int>& primitives,
     const vector<bbox3f>& bboxes, const vector<vec3f>& centers, int start,
-    int end) {
+    int end, bool parallel) {
   // initialize split axis and position
   auto axis = 0;
   auto mid  = (start + end) / 2;
 
   // compute primintive bounds and size
-  auto cbbox = invalidb3f;
-  for (auto i = start; i < end; i++)
-    cbbox = merge(cbbox, centers[primitives[i]]);
+  auto cbbox = reduce_primitives<bbox3f>(
+      start, end, parallel,
+      [&](bbox3f& bbox, int start, int end) {
+        for (auto i = start; i < end; i++)
+          bbox = merge(bbox, centers[primitives[i]]);
+      },
+      [](bbox3f& bbox, const bbox3f& chunk) { bbox = merge(bbox, chunk); });
   auto csize = cbbox.max - cbbox.min;
   if (csize == zero3f) return {mid, axis};
 
@@ -477,10 +636,8 @@ static pair<int, int> split_middle(vector<int>& primitives,
   // split the space in the middle along the largest axis
   auto cmiddle = (cbbox.max + cbbox.min) / 2;
   auto middle  = cmiddle[axis];
-  mid = (int)(std::partition(primitives.data() + start, primitives.data() + end,
-                  [axis, middle, &centers](
-                      auto a) { return centers[a][axis] < middle; }) -
-              primitives.data());
+  mid = partition_primitives(primitives, start, end, parallel,
+      [axis, middle, &centers](int a) { return centers[a][axis] < middle; });
 
   // if we were not able to split, just break the primitives in half
   if (mid == start || mid == end) {
@@ -495,16 +652,21 @@ static pair<int, int> split_middle(vector<int>& primitives,
 // Split bvh nodes according to a type
 static pair<int, int> split_nodes(vector<int>& primitives,
     const vector<bbox3f>& bboxes, const vector<vec3f>& centers, int start,
-    int end, bvh_build_type type) {
-  switch (type) {
+    int end, const bvh_params& params) {
+  auto parallel = !params.noparallel;
+  switch (params.bvh) {
     case bvh_build_type::default_:
-      return split_middle(primitives, bboxes, centers, start, end);
+      return split_middle(primitives, bboxes, centers, start, end, parallel);
     case bvh_build_type::highquality:
-      return split_sah(primitives, bboxes, centers, start, end);
+      return split_sah(primitives, bboxes, centers, start, end, parallel);
     case bvh_build_type::middle:
-      return split_middle(primitives, bboxes, centers, start, end);
+      return split_middle(primitives, bboxes, centers, start, end, parallel);
     case bvh_build_type::balanced:
       return split_balanced(primitives, bboxes, centers, start, end);
+    case bvh_build_type::wide:
+      return split_sah(primitives, bboxes, centers, start, end, parallel);
+    case bvh_build_type::compressed:
+      return split_sah(primitives, bboxes, centers, start, end, parallel);
     default: throw std::runtime_error("should not have gotten here");
   }
 }
@@ -547,15 +709,19 @@ static void build_bvh_serial(
     auto& node = nodes[nodeid];
 
     // compute bounds
-    node.bbox = invalidb3f;
-    for (auto i = start; i < end; i++)
-      node.bbox = merge(node.bbox, bboxes[primitives[i]]);
+    node.bbox = reduce_primitives<bbox3f>(
+        start, end, !params.noparallel,
+        [&](bbox3f& bbox, int start, int end) {
+          for (auto i = start; i < end; i++)
+            bbox = merge(bbox, bboxes[primitives[i]]);
+        },
+        [](bbox3f& bbox, const bbox3f& chunk) { bbox = merge(bbox, chunk); });
 
     // split into two children
     if (end - start > bvh_max_prims) {
       // get split
       auto [mid, axis] = split_nodes(
-          primitives, bboxes, centers, start, end, params.bvh);
+          primitives, bboxes, centers, start, end, params);
 
       // make an internal node
       node.internal = true;
@@ -578,219 +744,754 @@ static void build_bvh_serial(
   nodes.shrink_to_fit();
 }
 
-#if 0
+// Minimum number of primitives for building a subtree as a separate task.
+const int bvh_parallel_subtree = 4096;
 
-// Build BVH nodes
+// Build the BVH node `nodeid` for the primitives in [start, end), and
+// recursively its children. Large subtrees are built in parallel, with
+// children nodes allocated atomically after their parent.
+static void build_bvh_node(bvh_tree& bvh, atomic<int>& num_nodes,
+    const vector<bbox3f>& bboxes, const vector<vec3f>& centers, int nodeid,
+    int start, int end, const bvh_params& params) {
+  // get values
+  auto& nodes      = bvh.nodes;
+  auto& primitives = bvh.primitives;
+
+  // grab node
+  auto& node = nodes[nodeid];
+
+  // compute bounds
+  node.bbox = reduce_primitives<bbox3f>(
+      start, end, true,
+      [&](bbox3f& bbox, int start, int end) {
+        for (auto i = start; i < end; i++)
+          bbox = merge(bbox, bboxes[primitives[i]]);
+      },
+      [](bbox3f& bbox, const bbox3f& chunk) { bbox = merge(bbox, chunk); });
+
+  // split into two children
+  if (end - start > bvh_max_prims) {
+    // get split
+    auto [mid, axis] = split_nodes(
+        primitives, bboxes, centers, start, end, params);
+
+    // make an internal node
+    node.internal = true;
+    node.axis     = (uint8_t)axis;
+    node.num      = 2;
+    node.start    = num_nodes.fetch_add(2);
+
+    // build children, in parallel if large enough
+    auto children = array<vec3i, 2>{
+        vec3i{node.start + 0, start, mid}, vec3i{node.start + 1, mid, end}};
+    auto build_child = [&](int idx) {
+      auto& child = children[idx];
+      build_bvh_node(bvh, num_nodes, bboxes, centers, child.x, child.y,
+          child.z, params);
+    };
+    if (end - start > bvh_parallel_subtree) {
+      parallel_for(2, build_child, 1);
+    } else {
+      for (auto idx = 0; idx < 2; idx++) build_child(idx);
+    }
+  } else {
+    // Make a leaf node
+    node.internal = false;
+    node.num      = (int16_t)(end - start);
+    node.start    = start;
+  }
+}
+
+// Build BVH nodes in parallel.
 static void build_bvh_parallel(
-    bvh_tree_& bvh, const vector<bbox3f>& bboxes, bvh_build_type type) {
+    bvh_tree& bvh, const vector<bbox3f>& bboxes, const bvh_params& params) {
   // get values
   auto& nodes      = bvh.nodes;
   auto& primitives = bvh.primitives;
 
-  // prepare to build nodes
+  // prepare to build nodes, which are at most twice the primitives
   nodes.clear();
-  nodes.reserve(bboxes.size() * 2);
-
-  // prepare primitives
-  bvh.primitives.resize(bboxes.size());
-  for (auto idx = 0; idx < bboxes.size(); idx++) bvh.primitives[idx] = idx;
+  nodes.resize(std::max((size_t)1, bboxes.size() * 2));
 
-  // prepare centers
+  // prepare primitives and centers
+  primitives.resize(bboxes.size());
   auto centers = vector<vec3f>(bboxes.size());
-  for (auto idx = 0; idx < bboxes.size(); idx++)
-    centers[idx] = center(bboxes[idx]);
+  parallel_for((int)bboxes.size(), [&](int idx) {
+    primitives[idx] = idx;
+    centers[idx]    = center(bboxes[idx]);
+  });
 
-  // queue up first node
-  auto queue = deque<vec3i>{{0, 0, (int)primitives.size()}};
-  nodes.emplace_back();
+  // build nodes from the root
+  auto num_nodes = atomic<int>{1};
+  build_bvh_node(
+      bvh, num_nodes, bboxes, centers, 0, 0, (int)bboxes.size(), params);
+
+  // cleanup
+  nodes.resize(num_nodes);
+  nodes.shrink_to_fit();
+}
 
-  // synchronization
-  atomic<int>          num_processed_prims(0);
-  std::mutex           queue_mutex;
-  vector<future<void>> futures;
-  auto                 nthreads = std::thread::hardware_concurrency();
+// Reference to a primitive in a spatial split bvh, with the primitive bounds
+// clipped to the node.
+struct bvh_reference {
+  bbox3f bbox      = invalidb3f;
+  int    primitive = -1;
+};
+
+// Spatial splits are tried only if the children of the best object split
+// overlap by more than this fraction of the root area.
+const float bvh_spatial_overlap = 1e-5f;
+
+// Maximum number of references added by spatial splits, as a fraction of
+// the number of primitives.
+const float bvh_spatial_budget = 0.5f;
+
+// Intersection of two bounding boxes
+static bbox3f clip_bbox(const bbox3f& a, const bbox3f& b) {
+  auto bbox = bbox3f{max(a.min, b.min), min(a.max, b.max)};
+  if (bbox.min.x > bbox.max.x || bbox.min.y > bbox.max.y ||
+      bbox.min.z > bbox.max.z)
+    return invalidb3f;
+  return bbox;
+}
 
-  // create nodes until the queue is empty
-  for (auto thread_id = 0; thread_id < nthreads; thread_id++) {
-    futures.emplace_back(std::async(
-        std::launch::async, [&nodes, &primitives, &bboxes, &centers, &type,
-                                &num_processed_prims, &queue_mutex, &queue] {
-          while (true) {
-            // exit if needed
-            if (num_processed_prims >= primitives.size()) return;
-
-            // grab node to work on
-            auto next = zero3i;
-            {
-              std::lock_guard<std::mutex> lock{queue_mutex};
-              if (!queue.empty()) {
-                next = queue.front();
-                queue.pop_front();
-              }
-            }
+// Splits a reference at `position` along `axis` by clipping its bounds.
+// Used for primitives whose geometry is not clipped, like instances.
+static pair<bbox3f, bbox3f> split_reference(
+    const bvh_reference& reference, int axis, float position) {
+  auto left = reference.bbox, right = reference.bbox;
+  left.max[axis]  = min(left.max[axis], position);
+  right.min[axis] = max(right.min[axis], position);
+  return {left, right};
+}
 
-            // wait a bit if needed
-            if (next == zero3i) {
-              std::this_thread::sleep_for(std::chrono::microseconds(10));
-              continue;
-            }
+// Splits a polygon at `position` along `axis`. The bounds of each side
+// include the vertices on that side and the crossings of the edges with
+// the split plane, and are clipped to the reference bounds.
+static pair<bbox3f, bbox3f> split_polygon(const bvh_reference& reference,
+    int axis, float position, const vec3f* vertices, int num) {
+  auto left = invalidb3f, right = invalidb3f;
+  for (auto idx = 0; idx < num; idx++) {
+    auto& v0 = vertices[idx];
+    auto& v1 = vertices[(idx + 1) % num];
+    if (v0[axis] <= position) left = merge(left, v0);
+    if (v0[axis] >= position) right = merge(right, v0);
+    if ((v0[axis] < position && v1[axis] > position) ||
+        (v0[axis] > position && v1[axis] < position)) {
+      auto t = (position - v0[axis]) / (v1[axis] - v0[axis]);
+      auto p = v0 + (v1 - v0) * clamp(t, 0.0f, 1.0f);
+      p[axis] = position;
+      left    = merge(left, p);
+      right   = merge(right, p);
+    }
+  }
+  return {clip_bbox(left, reference.bbox), clip_bbox(right, reference.bbox)};
+}
 
-            // grab node
-            auto  nodeid = next.x, start = next.y, end = next.z;
-            auto& node = nodes[nodeid];
-
-            // compute bounds
-            node.bbox = invalidb3f;
-            for (auto i = start; i < end; i++)
-              node.bbox = merge(node.bbox, bboxes[primitives[i]]);
-
-            // split into two children
-            if (end - start > bvh_max_prims) {
-              // get split
-              auto [mid, axis] = split_nodes(
-                  primitives, bboxes, centers, start, end, type);
-
-              // make an internal node
-              {
-                std::lock_guard<std::mutex> lock{queue_mutex};
-                node.internal = true;
-                node.axis     = (int8_t)axis;
-                node.num      = 2;
-                node.start    = (int)nodes.size();
-                nodes.emplace_back();
-                nodes.emplace_back();
-                queue.push_back({node.start + 0, start, mid});
-                queue.push_back({node.start + 1, mid, end});
-              }
-            } else {
-              // Make a leaf node
-              node.internal = false;
-              node.num      = (int16_t)(end - start);
-              node.start    = start;
-              num_processed_prims += node.num;
-            }
-          }
-        }));
+// Build the spatial split bvh node `nodeid` for the references, and
+// recursively its children. Nodes are split by either partitioning their
+// references with a binned SAH, as in split_sah, or by splitting space with
+// a binned SAH over the node bounds, duplicating the references that
+// straddle the split plane. Spatial splits are tried only if the children
+// of the object split overlap and are used if cheaper and within budget.
+template <typename Split>
+static void build_spatial_node(bvh_tree& bvh, atomic<int>& num_nodes,
+    atomic<int>& num_primitives, atomic<int>& budget,
+    vector<bvh_reference>& references, int nodeid, float root_area,
+    const bvh_params& params, Split&& split_reference) {
+  // compute bounds
+  auto& node  = bvh.nodes[nodeid];
+  auto  cbbox = invalidb3f;
+  node.bbox   = invalidb3f;
+  for (auto& reference : references) {
+    node.bbox = merge(node.bbox, reference.bbox);
+    cbbox     = merge(cbbox, center(reference.bbox));
   }
-  for (auto& f : futures) f.get();
 
-  // cleanup
-  nodes.shrink_to_fit();
-}
+  // make a leaf node
+  auto num = (int)references.size();
+  if (num <= bvh_max_prims) {
+    node.internal = false;
+    node.num      = (int16_t)num;
+    node.start    = num_primitives.fetch_add(num);
+    for (auto idx = 0; idx < num; idx++)
+      bvh.primitives[node.start + idx] = references[idx].primitive;
+    return;
+  }
 
-#endif
+  // object split, binning reference centers
+  auto object_cost  = flt_max;
+  auto object_axis  = -1;
+  auto object_bin   = 0;
+  auto object_left  = invalidb3f;
+  auto object_right = invalidb3f;
+  auto csize        = cbbox.max - cbbox.min;
+  auto scale        = zero3f;
+  for (auto axis = 0; axis < 3; axis++) {
+    if (csize[axis] > 0) scale[axis] = bvh_sah_bins / csize[axis];
+  }
+  auto binning = bvh_sah_binning{};
+  for (auto& reference : references) {
+    auto rcenter = center(reference.bbox);
+    for (auto axis = 0; axis < 3; axis++) {
+      auto bin = sah_bin(rcenter, cbbox, scale, axis);
+      binning.bboxes[axis][bin] = merge(
+          binning.bboxes[axis][bin], reference.bbox);
+      binning.counts[axis][bin] += 1;
+    }
+  }
+  for (auto axis = 0; axis < 3; axis++) {
+    if (csize[axis] == 0) continue;
+    auto right_bboxes = array<bbox3f, bvh_sah_bins>{};
+    auto right_costs  = array<float, bvh_sah_bins>{};
+    auto right_bbox   = invalidb3f;
+    auto right_count  = 0;
+    for (auto bin = bvh_sah_bins - 1; bin > 0; bin--) {
+      right_bbox = merge(right_bbox, binning.bboxes[axis][bin]);
+      right_count += binning.counts[axis][bin];
+      right_bboxes[bin] = right_bbox;
+      right_costs[bin] = right_count ? right_count * bbox_area(right_bbox) : 0;
+    }
+    auto left_bbox  = invalidb3f;
+    auto left_count = 0;
+    for (auto bin = 1; bin < bvh_sah_bins; bin++) {
+      left_bbox = merge(left_bbox, binning.bboxes[axis][bin - 1]);
+      left_count += binning.counts[axis][bin - 1];
+      auto cost = (left_count ? left_count * bbox_area(left_bbox) : 0) +
+                  right_costs[bin];
+      if (cost < object_cost) {
+        object_cost  = cost;
+        object_axis  = axis;
+        object_bin   = bin;
+        object_left  = left_bbox;
+        object_right = right_bboxes[bin];
+      }
+    }
+  }
 
-// Update bvh
-static void update_bvh(bvh_tree& bvh, const vector<bbox3f>& bboxes) {
-  for (auto nodeid = (int)bvh.nodes.size() - 1; nodeid >= 0; nodeid--) {
-    auto& node = bvh.nodes[nodeid];
-    node.bbox  = invalidb3f;
-    if (node.internal) {
-      for (auto idx = 0; idx < 2; idx++) {
-        node.bbox = merge(node.bbox, bvh.nodes[node.start + idx].bbox);
+  // spatial split, binning references clipped to each bin
+  auto spatial_cost     = flt_max;
+  auto spatial_axis     = -1;
+  auto spatial_position = 0.0f;
+  auto overlap          = clip_bbox(object_left, object_right);
+  auto overlap_area = overlap.min.x <= overlap.max.x ? bbox_area(overlap) : 0;
+  if (budget > 0 && (object_axis < 0 ||
+                        overlap_area > bvh_spatial_overlap * root_area)) {
+    auto size = node.bbox.max - node.bbox.min;
+    for (auto axis = 0; axis < 3; axis++) {
+      if (size[axis] <= 0) continue;
+      auto bin_size = size[axis] / bvh_sah_bins;
+      auto bboxes   = array<bbox3f, bvh_sah_bins>{};
+      auto entries  = array<int, bvh_sah_bins>{};
+      auto exits    = array<int, bvh_sah_bins>{};
+      for (auto& reference : references) {
+        auto first = clamp(
+            (int)((reference.bbox.min[axis] - node.bbox.min[axis]) / bin_size),
+            0, bvh_sah_bins - 1);
+        auto last = clamp(
+            (int)((reference.bbox.max[axis] - node.bbox.min[axis]) / bin_size),
+            first, bvh_sah_bins - 1);
+        auto rest = reference;
+        for (auto bin = first; bin < last; bin++) {
+          auto position = node.bbox.min[axis] + bin_size * (bin + 1);
+          auto [left, right] = split_reference(rest, axis, position);
+          bboxes[bin]        = merge(bboxes[bin], left);
+          rest.bbox          = right;
+        }
+        bboxes[last] = merge(bboxes[last], rest.bbox);
+        entries[first] += 1;
+        exits[last] += 1;
+      }
+      auto right_costs = array<float, bvh_sah_bins>{};
+      auto right_bbox  = invalidb3f;
+      auto right_count = 0;
+      for (auto bin = bvh_sah_bins - 1; bin > 0; bin--) {
+        right_bbox = merge(right_bbox, bboxes[bin]);
+        right_count += exits[bin];
+        right_costs[bin] = right_count ? right_count * bbox_area(right_bbox)
+                                       : 0;
+      }
+      auto left_bbox  = invalidb3f;
+      auto left_count = 0;
+      for (auto bin = 1; bin < bvh_sah_bins; bin++) {
+        left_bbox = merge(left_bbox, bboxes[bin - 1]);
+        left_count += entries[bin - 1];
+        auto cost = (left_count ? left_count * bbox_area(left_bbox) : 0) +
+                    right_costs[bin];
+        if (cost < spatial_cost) {
+          spatial_cost     = cost;
+          spatial_axis     = axis;
+          spatial_position = node.bbox.min[axis] + bin_size * bin;
+        }
+      }
+    }
+  }
+
+  // split references in space, if cheaper and within budget
+  auto left_references  = vector<bvh_reference>{};
+  auto right_references = vector<bvh_reference>{};
+  auto split_axis       = 0;
+  if (spatial_cost < object_cost) {
+    for (auto& reference : references) {
+      if (reference.bbox.max[spatial_axis] <= spatial_position) {
+        left_references.push_back(reference);
+      } else if (reference.bbox.min[spatial_axis] >= spatial_position) {
+        right_references.push_back(reference);
+      } else {
+        auto [left, right] = split_reference(
+            reference, spatial_axis, spatial_position);
+        if (left.min.x <= left.max.x)
+          left_references.push_back({left, reference.primitive});
+        if (right.min.x <= right.max.x)
+          right_references.push_back({right, reference.primitive});
       }
+    }
+    auto num_left   = (int)left_references.size();
+    auto num_right  = (int)right_references.size();
+    auto duplicates = num_left + num_right - num;
+    auto valid      = num_left < num && num_right < num;
+    if (valid && budget.fetch_sub(duplicates) >= duplicates) {
+      split_axis = spatial_axis;
     } else {
-      for (auto idx = 0; idx < node.num; idx++) {
-        node.bbox = merge(node.bbox, bboxes[bvh.primitives[node.start + idx]]);
+      if (valid) budget.fetch_add(duplicates);
+      left_references.clear();
+      right_references.clear();
+    }
+  }
+
+  // otherwise partition references, or break them in half if not possible
+  if (left_references.empty() && right_references.empty()) {
+    if (object_axis >= 0) {
+      for (auto& reference : references) {
+        if (sah_bin(center(reference.bbox), cbbox, scale, object_axis) <
+            object_bin) {
+          left_references.push_back(reference);
+        } else {
+          right_references.push_back(reference);
+        }
       }
+      split_axis = object_axis;
     }
+    if (left_references.empty() || right_references.empty()) {
+      left_references.assign(references.begin(), references.begin() + num / 2);
+      right_references.assign(references.begin() + num / 2, references.end());
+      split_axis = 0;
+    }
+  }
+  references = {};
+
+  // make an internal node
+  node.internal = true;
+  node.axis     = (uint8_t)split_axis;
+  node.num      = 2;
+  node.start    = num_nodes.fetch_add(2);
+
+  // build children, in parallel if large enough
+  auto children = array<vector<bvh_reference>*, 2>{
+      &left_references, &right_references};
+  auto start       = node.start;
+  auto build_child = [&](int idx) {
+    build_spatial_node(bvh, num_nodes, num_primitives, budget,
+        *children[idx], start + idx, root_area, params, split_reference);
+  };
+  if (num > bvh_parallel_subtree && !params.noparallel) {
+    parallel_for(2, build_child, 1);
+  } else {
+    for (auto idx = 0; idx < 2; idx++) build_child(idx);
   }
 }
 
-static void build_bvh(bvh_shape* shape, const bvh_params& params) {
-#ifdef YOCTO_EMBREE
-  if (params.bvh == bvh_build_type::embree_default ||
-      params.bvh == bvh_build_type::embree_highquality ||
-      params.bvh == bvh_build_type::embree_compact) {
-    return init_embree_bvh(shape, params);
+// Build a spatial split BVH, splitting references with `split_reference`.
+template <typename Split>
+static void build_bvh_spatial(bvh_tree& bvh, const vector<bbox3f>& bboxes,
+    const bvh_params& params, Split&& split_reference) {
+  // prepare references, skipping empty primitives
+  auto references = vector<bvh_reference>{};
+  references.reserve(bboxes.size());
+  auto root_bbox = invalidb3f;
+  for (auto idx = 0; idx < bboxes.size(); idx++) {
+    if (bboxes[idx].min.x > bboxes[idx].max.x) continue;
+    references.push_back({bboxes[idx], idx});
+    root_bbox = merge(root_bbox, bboxes[idx]);
   }
-#endif
 
-  // build primitives
-  auto bboxes = vector<bbox3f>{};
-  if (!shape->points.empty()) {
-    bboxes = vector<bbox3f>(shape->points.size());
-    for (auto idx = 0; idx < bboxes.size(); idx++) {
-      auto& p     = shape->points[idx];
-      bboxes[idx] = point_bounds(shape->positions[p], shape->radius[p]);
-    }
-  } else if (!shape->lines.empty()) {
-    bboxes = vector<bbox3f>(shape->lines.size());
-    for (auto idx = 0; idx < bboxes.size(); idx++) {
-      auto& l     = shape->lines[idx];
-      bboxes[idx] = line_bounds(shape->positions[l.x], shape->positions[l.y],
-          shape->radius[l.x], shape->radius[l.y]);
+  // prepare nodes and primitives for the maximum number of references
+  auto num_references = (int)references.size();
+  auto budget = atomic<int>{(int)(num_references * bvh_spatial_budget)};
+  auto max_references = num_references + budget;
+  bvh.nodes.clear();
+  bvh.nodes.resize(std::max(1, max_references * 2));
+  bvh.primitives.clear();
+  bvh.primitives.resize(max_references);
+
+  // build nodes from the root
+  auto num_nodes      = atomic<int>{1};
+  auto num_primitives = atomic<int>{0};
+  auto root_area      = references.empty() ? 1 : bbox_area(root_bbox);
+  build_spatial_node(bvh, num_nodes, num_primitives, budget, references, 0,
+      root_area, params, split_reference);
+
+  // cleanup
+  bvh.nodes.resize(num_nodes);
+  bvh.nodes.shrink_to_fit();
+  bvh.primitives.resize(num_primitives);
+  bvh.primitives.shrink_to_fit();
+}
+
+// Depth of a wide bvh, in nodes. Children are stored after their parents,
+// so depths are computed in a single forward pass.
+template <typename Node>
+static int get_wide_depth(const vector<Node>& nodes) {
+  if (nodes.empty()) return 0;
+  auto depths = vector<int>(nodes.size(), 1);
+  auto depth  = 1;
+  for (auto node_id = 0; node_id < (int)nodes.size(); node_id++) {
+    auto& node = nodes[node_id];
+    for (auto idx = 0; idx < 4; idx++) {
+      if (node.start[idx] < 0 || node.num[idx] != 0) continue;
+      depths[node.start[idx]] = depths[node_id] + 1;
+      depth = max(depth, depths[node_id] + 1);
     }
-  } else if (!shape->triangles.empty()) {
-    bboxes = vector<bbox3f>(shape->triangles.size());
-    for (auto idx = 0; idx < bboxes.size(); idx++) {
-      auto& t     = shape->triangles[idx];
-      bboxes[idx] = triangle_bounds(
-          shape->positions[t.x], shape->positions[t.y], shape->positions[t.z]);
+  }
+  return depth;
+}
+
+// Set the bounds of a child of a wide node.
+static void set_child_bbox(bvh_node4& node, int idx, const bbox3f& bbox) {
+  node.min_x[idx] = bbox.min.x;
+  node.min_y[idx] = bbox.min.y;
+  node.min_z[idx] = bbox.min.z;
+  node.max_x[idx] = bbox.max.x;
+  node.max_y[idx] = bbox.max.y;
+  node.max_z[idx] = bbox.max.z;
+}
+
+// Collapse the binary bvh into a wide bvh with four children per node.
+// Each wide node is made by opening the binary internal nodes with the
+// largest surface area, until there are four children.
+static void build_wide_bvh(bvh_tree& bvh) {
+  // get values
+  auto& nodes      = bvh.nodes;
+  auto& wide_nodes = bvh.wide_nodes;
+
+  // prepare to build nodes
+  wide_nodes.clear();
+  if (nodes.empty()) return;
+  wide_nodes.reserve(nodes.size() / 2 + 1);
+
+  // queue up first node, as pairs of wide and binary node indices
+  auto queue = deque<vec2i>{{0, 0}};
+  wide_nodes.emplace_back();
+
+  // create nodes until the queue is empty
+  while (!queue.empty()) {
+    // grab node to work on
+    auto next = queue.front();
+    queue.pop_front();
+    auto wide_id = next.x, node_id = next.y;
+
+    // collect children
+    auto children  = array<int, 4>{};
+    auto nchildren = 0;
+    if (!nodes[node_id].internal) {
+      children[nchildren++] = node_id;
+    } else {
+      children[nchildren++] = nodes[node_id].start + 0;
+      children[nchildren++] = nodes[node_id].start + 1;
+      while (nchildren < 4) {
+        auto largest = -1;
+        auto area    = -1.0f;
+        for (auto idx = 0; idx < nchildren; idx++) {
+          auto& child = nodes[children[idx]];
+          if (!child.internal || bbox_area(child.bbox) <= area) continue;
+          largest = idx;
+          area    = bbox_area(child.bbox);
+        }
+        if (largest < 0) break;
+        auto& child           = nodes[children[largest]];
+        children[largest]     = child.start + 0;
+        children[nchildren++] = child.start + 1;
+      }
     }
-  } else if (!shape->quads.empty()) {
-    bboxes = vector<bbox3f>(shape->quads.size());
-    for (auto idx = 0; idx < bboxes.size(); idx++) {
-      auto& q     = shape->quads[idx];
-      bboxes[idx] = quad_bounds(shape->positions[q.x], shape->positions[q.y],
-          shape->positions[q.z], shape->positions[q.w]);
+
+    // set children bounds and indices
+    for (auto idx = 0; idx < nchildren; idx++) {
+      auto& child = nodes[children[idx]];
+      if (!child.internal && child.num == 0) continue;
+      auto child_wide_id = (int)wide_nodes.size();
+      if (child.internal) {
+        wide_nodes.emplace_back();
+        queue.push_back({child_wide_id, children[idx]});
+      }
+      auto& node = wide_nodes[wide_id];
+      set_child_bbox(node, idx, child.bbox);
+      node.start[idx] = child.internal ? child_wide_id : child.start;
+      node.num[idx]   = child.internal ? 0 : child.num;
     }
   }
 
-  // build nodes
-  build_bvh_serial(shape->bvh, bboxes, params);
+  // cleanup
+  wide_nodes.shrink_to_fit();
+  bvh.wide_depth = get_wide_depth(wide_nodes);
 }
 
-void build_bvh(bvh_scene* scene, const bvh_params& params) {
-  // embree
-#ifdef YOCTO_EMBREE
-  if (params.bvh == bvh_build_type::embree_default ||
-      params.bvh == bvh_build_type::embree_highquality ||
-      params.bvh == bvh_build_type::embree_compact) {
-    return init_embree_bvh(scene, params);
+// Power of two as a float, for exponents in [-126, 127].
+static float bvh_exp2(int exponent) {
+  auto bits  = (uint32_t)(exponent + 127) << 23;
+  auto value = 0.0f;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+// Quantize the children bounds of a wide node relative to the node bounds.
+// The grid cells are powers of two, so that decoding multiplies exactly,
+// and quantized values are adjusted until the decoded bounds, computed as in
+// traversal, contain the original ones.
+static bvh_qnode4 quantize_node(const bvh_node4& wide) {
+  auto node = bvh_qnode4{};
+  auto bbox = invalidb3f;
+  for (auto idx = 0; idx < 4; idx++) {
+    node.start[idx] = wide.start[idx];
+    node.num[idx]   = (uint8_t)wide.num[idx];
+    if (wide.start[idx] < 0) continue;
+    bbox = merge(bbox,
+        bbox3f{{wide.min_x[idx], wide.min_y[idx], wide.min_z[idx]},
+            {wide.max_x[idx], wide.max_y[idx], wide.max_z[idx]}});
   }
-#endif
+  if (bbox.min.x > bbox.max.x) return node;
+  node.origin = bbox.min;
+
+  // quantize one axis of the four children
+  auto quantize = [&node](int axis, const array<float, 4>& min,
+                      const array<float, 4>& max, array<uint8_t, 4>& qmin,
+                      array<uint8_t, 4>& qmax, float bmax) {
+    auto origin   = node.origin[axis];
+    auto extent   = bmax - origin;
+    auto exponent = extent > 0 ? (int)std::ceil(std::log2(extent / 255)) : -126;
+    exponent      = clamp(exponent, -126, 127);
+    while (exponent < 127 && origin + 255 * bvh_exp2(exponent) < bmax)
+      exponent += 1;
+    node.exponent[axis] = (int8_t)exponent;
+    auto scale          = bvh_exp2(exponent);
+    for (auto idx = 0; idx < 4; idx++) {
+      if (node.start[idx] < 0) continue;
+      auto lo = clamp((int)std::floor((min[idx] - origin) / scale), 0, 255);
+      auto hi = clamp((int)std::ceil((max[idx] - origin) / scale), 0, 255);
+      while (lo > 0 && origin + lo * scale > min[idx]) lo -= 1;
+      while (hi < 255 && origin + hi * scale < max[idx]) hi += 1;
+      qmin[idx] = (uint8_t)lo;
+      qmax[idx] = (uint8_t)hi;
+    }
+  };
+  quantize(0, wide.min_x, wide.max_x, node.min_x, node.max_x, bbox.max.x);
+  quantize(1, wide.min_y, wide.max_y, node.min_y, node.max_y, bbox.max.y);
+  quantize(2, wide.min_z, wide.max_z, node.min_z, node.max_z, bbox.max.z);
+  return node;
+}
 
-  // instance bboxes
-  auto bboxes = vector<bbox3f>(scene->num_instances);
-  for (auto idx = 0; idx < bboxes.size(); idx++) {
-    auto  instance = scene->instance_cb(idx);
-    auto& shape    = scene->shapes[instance.shape];
-    bboxes[idx]    = shape->bvh.nodes.empty() ? invalidb3f
-                                           : transform_bbox(instance.frame,
-                                                 shape->bvh.nodes[0].bbox);
+// Decode the bounds of a child of a compressed node.
+static bbox3f get_child_bbox(const bvh_qnode4& node, int idx) {
+  auto scale = vec3f{bvh_exp2(node.exponent[0]), bvh_exp2(node.exponent[1]),
+      bvh_exp2(node.exponent[2])};
+  return {node.origin + vec3f{(float)node.min_x[idx], (float)node.min_y[idx],
+                                (float)node.min_z[idx]} *
+                            scale,
+      node.origin + vec3f{(float)node.max_x[idx], (float)node.max_y[idx],
+                        (float)node.max_z[idx]} *
+                        scale};
+}
+
+// Collapse the binary bvh into a compressed wide bvh, by quantizing the
+// nodes of the wide bvh. The wide nodes are not kept.
+static void build_compressed_bvh(bvh_tree& bvh) {
+  build_wide_bvh(bvh);
+  bvh.compressed_nodes.resize(bvh.wide_nodes.size());
+  for (auto idx = 0; idx < (int)bvh.wide_nodes.size(); idx++) {
+    bvh.compressed_nodes[idx] = quantize_node(bvh.wide_nodes[idx]);
   }
+  bvh.wide_nodes.clear();
+  bvh.wide_nodes.shrink_to_fit();
+}
 
-  // build nodes
-  build_bvh_serial(scene->bvh, bboxes, params);
+// Number of wide or compressed nodes
+static int get_num_wide(const bvh_tree& bvh) {
+  return (int)std::max(bvh.wide_nodes.size(), bvh.compressed_nodes.size());
 }
 
-void init_bvh(bvh_scene* scene, const bvh_params& params,
-    const progress_callback& progress_cb) {
-  // handle progress
-  auto progress = vec2i{0, 1 + (int)scene->shapes.size()};
+// Refit a wide or compressed node to the bounds of its children, given by
+// `child_bbox(start, num)`, quantizing them again for compressed nodes.
+// Returns the bounds of the node.
+template <typename ChildBBox>
+static bbox3f refit_wide_node(
+    bvh_tree& bvh, int node_id, ChildBBox&& child_bbox) {
+  auto compressed = !bvh.compressed_nodes.empty();
+  auto node       = compressed ? bvh_node4{} : bvh.wide_nodes[node_id];
+  if (compressed) {
+    auto& qnode = bvh.compressed_nodes[node_id];
+    for (auto idx = 0; idx < 4; idx++) {
+      node.start[idx] = qnode.start[idx];
+      node.num[idx]   = qnode.num[idx];
+    }
+  }
+  auto bbox = invalidb3f;
+  for (auto idx = 0; idx < 4; idx++) {
+    if (node.start[idx] < 0) continue;
+    auto cbbox = child_bbox(node.start[idx], (int)node.num[idx]);
+    set_child_bbox(node, idx, cbbox);
+    bbox = merge(bbox, cbbox);
+  }
+  if (compressed) {
+    bvh.compressed_nodes[node_id] = quantize_node(node);
+  } else {
+    bvh.wide_nodes[node_id] = node;
+  }
+  return bbox;
+}
 
-  // build shape bvh
-  for (auto shape : scene->shapes) {
-    if (progress_cb) progress_cb("build shape bvh", progress.x++, progress.y);
-    build_bvh(shape, params);
+// Refit all wide or compressed nodes bottom-up, given the bounds of leaves
+// as `leaf_bbox(start, num)`. Children are stored after their parents, so
+// nodes are refit from last to first. Returns the bounds of each node.
+template <typename LeafBBox>
+static vector<bbox3f> refit_wide_nodes(bvh_tree& bvh, LeafBBox&& leaf_bbox) {
+  auto bboxes = vector<bbox3f>(get_num_wide(bvh));
+  for (auto node_id = (int)bboxes.size() - 1; node_id >= 0; node_id--) {
+    bboxes[node_id] = refit_wide_node(bvh, node_id, [&](int start, int num) {
+      return num != 0 ? leaf_bbox(start, num) : bboxes[start];
+    });
   }
+  return bboxes;
+}
 
-  // build scene bvh
-  if (progress_cb) progress_cb("build scene bvh", progress.x++, progress.y);
-  build_bvh(scene, params);
+// Refit the bvh to the bounds of its primitives, stored as the elements.
+// Binary nodes are refit bottom-up, and so are wide and compressed nodes,
+// so that the tree structure is kept.
+static void update_bvh(bvh_tree& bvh, const vector<bbox3f>& bboxes) {
+  auto leaf_bbox = [&](int start, int num) {
+    auto bbox = invalidb3f;
+    for (auto idx = start; idx < start + num; idx++) {
+      bbox = merge(bbox, bboxes[bvh.ordered ? idx : bvh.primitives[idx]]);
+    }
+    return bbox;
+  };
 
-  // handle progress
-  if (progress_cb) progress_cb("build bvh", progress.x++, progress.y);
+  // compressed trees keep only the root of the binary tree
+  if (!bvh.compressed_nodes.empty()) {
+    auto wide_bboxes = refit_wide_nodes(bvh, leaf_bbox);
+    if (!bvh.nodes.empty()) bvh.nodes[0].bbox = wide_bboxes[0];
+    return;
+  }
+
+  // update binary nodes
+  for (auto nodeid = (int)bvh.nodes.size() - 1; nodeid >= 0; nodeid--) {
+    auto& node = bvh.nodes[nodeid];
+    if (node.internal) {
+      node.bbox = invalidb3f;
+      for (auto idx = 0; idx < 2; idx++) {
+        node.bbox = merge(node.bbox, bvh.nodes[node.start + idx].bbox);
+      }
+    } else {
+      node.bbox = leaf_bbox(node.start, node.num);
+    }
+  }
+
+  // update wide nodes
+  if (!bvh.wide_nodes.empty()) refit_wide_nodes(bvh, leaf_bbox);
 }
 
-static void update_bvh(bvh_shape* shape) {
-#ifdef YOCTO_EMBREE
-  if (shape->embree_bvh) {
-    throw std::runtime_error("embree shape refit not supported");
+// Reorder the elements of a shape so that they are stored in leaf order,
+// or restore their original order. Elements of shapes that are views are
+// copied first, so that only the elements are owned by the shape.
+template <typename T>
+static bool reorder_elements(vector<T>& data, bvh_span<T>& elements,
+    const vector<int>& primitives, bool restore) {
+  if (elements.empty()) return false;
+  if (elements.data() != data.data())
+    data.assign(elements.begin(), elements.end());
+  auto ordered = vector<T>(data.size());
+  for (auto idx = 0; idx < (int)primitives.size(); idx++) {
+    if (restore) {
+      ordered[primitives[idx]] = data[idx];
+    } else {
+      ordered[idx] = data[primitives[idx]];
+    }
+  }
+  data     = std::move(ordered);
+  elements = bvh_span<T>{data};
+  return true;
+}
+static void reorder_elements(bvh_shape* shape, bool restore) {
+  auto& primitives = shape->bvh.primitives;
+  auto  reordered  = false;
+  reordered |= reorder_elements(
+      shape->points_data, shape->points, primitives, restore);
+  reordered |= reorder_elements(
+      shape->lines_data, shape->lines, primitives, restore);
+  reordered |= reorder_elements(
+      shape->triangles_data, shape->triangles, primitives, restore);
+  reordered |= reorder_elements(
+      shape->quads_data, shape->quads, primitives, restore);
+  shape->bvh.ordered = reordered && !restore;
+}
+
+// Precompute triangles, quads and lines in leaf order. Precomputed elements
+// are intersected with SSE, so they are not built without it.
+static void precompute_elements(bvh_shape* shape) {
+  auto& precomputed = shape->precomputed;
+  precomputed       = {};
+#ifdef __SSE2__
+  auto& primitives = shape->bvh.primitives;
+  auto  components = !shape->triangles.empty() ? 9
+                     : !shape->quads.empty()   ? 18
+                     : !shape->lines.empty()   ? 9
+                                               : 0;
+  if (components == 0 || primitives.empty()) return;
+  auto stride        = (int)primitives.size() + 3;
+  precomputed.stride = stride;
+  precomputed.data   = vector<float>((size_t)components * stride, 0);
+  auto set_vec       = [&precomputed, stride](int component, int idx,
+                     const vec3f& value) {
+    precomputed.data[(size_t)(component + 0) * stride + idx] = value.x;
+    precomputed.data[(size_t)(component + 1) * stride + idx] = value.y;
+    precomputed.data[(size_t)(component + 2) * stride + idx] = value.z;
+  };
+  auto set_float = [&precomputed, stride](int component, int idx, float value) {
+    precomputed.data[(size_t)component * stride + idx] = value;
+  };
+  for (auto idx = 0; idx < (int)primitives.size(); idx++) {
+    auto element = shape->bvh.ordered ? idx : primitives[idx];
+    if (!shape->triangles.empty()) {
+      auto& t = shape->triangles[element];
+      auto& p0 = shape->positions[t.x], &p1 = shape->positions[t.y],
+            &p2 = shape->positions[t.z];
+      set_vec(0, idx, p0);
+      set_vec(3, idx, p1 - p0);
+      set_vec(6, idx, p2 - p0);
+    } else if (!shape->quads.empty()) {
+      auto& q = shape->quads[element];
+      auto& p0 = shape->positions[q.x], &p1 = shape->positions[q.y],
+            &p2 = shape->positions[q.z], &p3 = shape->positions[q.w];
+      set_vec(0, idx, p0);
+      set_vec(3, idx, p1 - p0);
+      set_vec(6, idx, p3 - p0);
+      set_vec(9, idx, p2);
+      set_vec(12, idx, p3 - p2);
+      set_vec(15, idx, p1 - p2);
+    } else if (!shape->lines.empty()) {
+      auto& l = shape->lines[element];
+      auto& p0 = shape->positions[l.x], &p1 = shape->positions[l.y];
+      set_vec(0, idx, p0);
+      set_vec(3, idx, p1 - p0);
+      set_float(6, idx, dot(p1 - p0, p1 - p0));
+      set_float(7, idx, shape->radius[l.x]);
+      set_float(8, idx, shape->radius[l.y]);
+    }
   }
 #endif
+}
 
+// Build the nodes of a shape bvh. Compressed trees keep only the root bounds
+// of the binary tree.
+static void build_bvh_nodes(bvh_shape* shape, const bvh_params& params) {
   // build primitives
   auto bboxes = vector<bbox3f>{};
   if (!shape->points.empty()) {
@@ -822,68 +1523,1393 @@ static void update_bvh(bvh_shape* shape) {
     }
   }
 
-  // update nodes
-  update_bvh(shape->bvh, bboxes);
+  // build nodes
+  if (params.bvh == bvh_build_type::spatial &&
+      (!shape->points.empty() || !shape->lines.empty())) {
+    build_bvh_spatial(shape->bvh, bboxes, params, split_reference);
+  } else if (params.bvh == bvh_build_type::spatial &&
+             !shape->triangles.empty()) {
+    build_bvh_spatial(shape->bvh, bboxes, params,
+        [shape](const bvh_reference& reference, int axis, float position) {
+          auto& t        = shape->triangles[reference.primitive];
+          auto  vertices = array<vec3f, 3>{shape->positions[t.x],
+              shape->positions[t.y], shape->positions[t.z]};
+          return split_polygon(reference, axis, position, vertices.data(), 3);
+        });
+  } else if (params.bvh == bvh_build_type::spatial &&
+             !shape->quads.empty()) {
+    build_bvh_spatial(shape->bvh, bboxes, params,
+        [shape](const bvh_reference& reference, int axis, float position) {
+          auto& q        = shape->quads[reference.primitive];
+          auto  vertices = array<vec3f, 4>{shape->positions[q.x],
+              shape->positions[q.y], shape->positions[q.z],
+              shape->positions[q.w]};
+          return split_polygon(reference, axis, position, vertices.data(),
+              q.z == q.w ? 3 : 4);
+        });
+  } else if (params.noparallel) {
+    build_bvh_serial(shape->bvh, bboxes, params);
+  } else {
+    build_bvh_parallel(shape->bvh, bboxes, params);
+  }
+  shape->bvh.wide_nodes.clear();
+  shape->bvh.compressed_nodes.clear();
+  if (params.bvh == bvh_build_type::wide) build_wide_bvh(shape->bvh);
+  if (params.bvh == bvh_build_type::compressed && !shape->bvh.nodes.empty()) {
+    build_compressed_bvh(shape->bvh);
+    shape->bvh.nodes = {bvh_node{shape->bvh.nodes[0].bbox}};
+  }
 }
 
-void update_bvh(bvh_scene* scene, const vector<int>& updated_instances) {
-#ifdef YOCTO_EMBREE
-  if (scene->embree_bvh) {
-    return update_embree_bvh(scene, updated_instances);
+// Number of shape elements
+static int get_num_elements(const bvh_shape* shape) {
+  return (int)(shape->points.size() + shape->lines.size() +
+               shape->triangles.size() + shape->quads.size());
+}
+
+// Hash a buffer 8 bytes at a time, mixing each word as in FNV-1a and
+// folding the high bits down, so that large buffers hash quickly.
+static uint64_t hash_buffer(uint64_t hash, const void* data, size_t size) {
+  auto bytes = (const unsigned char*)data;
+  auto mix   = [&hash](uint64_t word) {
+    hash = (hash ^ word) * 0x100000001b3ull;
+    hash ^= hash >> 32;
+  };
+  mix(size);
+  auto idx = (size_t)0;
+  for (; idx + 8 <= size; idx += 8) {
+    auto word = (uint64_t)0;
+    memcpy(&word, bytes + idx, 8);
+    mix(word);
+  }
+  auto tail = (uint64_t)0;
+  memcpy(&tail, bytes + idx, size - idx);
+  mix(tail);
+  return hash;
+}
+template <typename T>
+static uint64_t hash_buffer(uint64_t hash, const bvh_span<T>& data) {
+  return hash_buffer(hash, data.data(), data.size() * sizeof(T));
+}
+
+uint64_t hash_bvh_shape(const bvh_shape* shape) {
+  auto hash = 0xcbf29ce484222325ull;
+  hash      = hash_buffer(hash, shape->points);
+  hash      = hash_buffer(hash, shape->lines);
+  hash      = hash_buffer(hash, shape->triangles);
+  hash      = hash_buffer(hash, shape->quads);
+  hash      = hash_buffer(hash, shape->positions);
+  hash      = hash_buffer(hash, shape->radius);
+  return hash;
+}
+
+// Header of bvh files. Arrays are stored at the given offsets, aligned to
+// 64 bytes, in the order nodes, primitives, wide nodes and compressed nodes.
+struct bvh_file_header {
+  array<char, 8>     magic     = {'Y', 'B', 'V', 'H', 0, 0, 0, 0};
+  uint32_t           version   = 1;
+  int32_t            type      = 0;
+  uint64_t           hash      = 0;
+  array<uint64_t, 4> counts    = {0, 0, 0, 0};
+  array<uint64_t, 4> offsets   = {0, 0, 0, 0};
+  array<uint32_t, 4> sizes     = {(uint32_t)sizeof(bvh_node),
+      (uint32_t)sizeof(int), (uint32_t)sizeof(bvh_node4),
+      (uint32_t)sizeof(bvh_qnode4)};
+  uint64_t           elements  = 0;
+  uint64_t           file_size = 0;
+};
+
+// Alignment of the arrays in bvh files
+const size_t bvh_file_alignment = 64;
+
+bool save_bvh(const string& filename, const bvh_shape* shape, uint64_t hash,
+    bvh_build_type type, string& error) {
+  // layout
+  auto& bvh    = shape->bvh;
+  auto  header = bvh_file_header{};
+  header.type  = (int32_t)type;
+  header.hash  = hash;
+  header.counts = {bvh.nodes.size(), bvh.primitives.size(),
+      bvh.wide_nodes.size(), bvh.compressed_nodes.size()};
+  header.elements = get_num_elements(shape);
+  auto offset     = sizeof(header);
+  for (auto idx = 0; idx < 4; idx++) {
+    offset = (offset + bvh_file_alignment - 1) / bvh_file_alignment *
+             bvh_file_alignment;
+    header.offsets[idx] = offset;
+    offset += header.counts[idx] * header.sizes[idx];
+  }
+  header.file_size = offset;
+
+  // write to a temporary file, renamed when complete, so that concurrent
+  // readers never see partial files
+  auto tmpname = make_temporary_filename(filename);
+  auto fs      = open_file(tmpname, "wb");
+  if (!fs) {
+    error = filename + ": file not found";
+    return false;
+  }
+  auto padding = array<char, bvh_file_alignment>{};
+  auto written = sizeof(header);
+  auto write_array = [&](int idx, const void* data) {
+    auto pad = header.offsets[idx] - written;
+    if (!write_data(fs, padding.data(), pad)) return false;
+    auto size = header.counts[idx] * header.sizes[idx];
+    if (!write_data(fs, data, size)) return false;
+    written += pad + size;
+    return true;
+  };
+  if (!write_value(fs, header) || !write_array(0, bvh.nodes.data()) ||
+      !write_array(1, bvh.primitives.data()) ||
+      !write_array(2, bvh.wide_nodes.data()) ||
+      !write_array(3, bvh.compressed_nodes.data())) {
+    close_file(fs);
+    std::remove(tmpname.c_str());
+    error = filename + ": write error";
+    return false;
+  }
+  close_file(fs);
+  if (std::rename(tmpname.c_str(), filename.c_str()) != 0) {
+    std::remove(tmpname.c_str());
+    error = filename + ": write error";
+    return false;
+  }
+  return true;
+}
+
+bool load_bvh(const string& filename, bvh_shape* shape, uint64_t hash,
+    bvh_build_type type, string& error) {
+  // header
+  auto fs = open_file(filename, "rb");
+  if (!fs) {
+    error = filename + ": file not found";
+    return false;
+  }
+  auto header = bvh_file_header{};
+  auto check  = bvh_file_header{};
+  if (!read_value(fs, header)) {
+    error = filename + ": read error";
+    return false;
+  }
+  if (header.magic != check.magic || header.version != check.version ||
+      header.sizes != check.sizes) {
+    error = filename + ": unknown format";
+    return false;
+  }
+  if (header.hash != hash || header.type != (int32_t)type ||
+      header.elements != (uint64_t)get_num_elements(shape)) {
+    error = filename + ": mismatched shape";
+    return false;
+  }
+
+  // check that arrays fit in the file before allocating them
+  auto file_size = (uint64_t)0;
+  if (!get_file_size(fs, file_size)) {
+    error = filename + ": read error";
+    return false;
+  }
+  if (header.file_size != file_size) {
+    error = filename + ": truncated file";
+    return false;
+  }
+  for (auto idx = 0; idx < 4; idx++) {
+    if (header.offsets[idx] > file_size ||
+        header.counts[idx] > (file_size - header.offsets[idx]) /
+                                 header.sizes[idx] ||
+        header.counts[idx] > (uint64_t)int_max) {
+      error = filename + ": corrupted tree";
+      return false;
+    }
+  }
+
+  // arrays
+  auto bvh        = bvh_tree{};
+  auto read_array = [&](int idx, auto& data) {
+    data.resize(header.counts[idx]);
+    return seek_file(fs, header.offsets[idx]) &&
+           read_values(fs, data.data(), data.size());
+  };
+  if (!read_array(0, bvh.nodes) || !read_array(1, bvh.primitives) ||
+      !read_array(2, bvh.wide_nodes) || !read_array(3, bvh.compressed_nodes)) {
+    error = filename + ": read error";
+    return false;
+  }
+
+  // check that the tree refers to valid nodes and elements
+  auto num_primitives = (int)bvh.primitives.size();
+  for (auto primitive : bvh.primitives) {
+    if (primitive < 0 || (uint64_t)primitive >= header.elements) {
+      error = filename + ": corrupted tree";
+      return false;
+    }
+  }
+  // children follow their parents, so that traversal terminates; bounds are
+  // checked in 64 bits to avoid overflows
+  for (auto node_id = 0; node_id < (int)bvh.nodes.size(); node_id++) {
+    auto& node  = bvh.nodes[node_id];
+    auto  start = (int64_t)node.start;
+    auto  size  = node.internal ? (int64_t)bvh.nodes.size()
+                                : (int64_t)num_primitives;
+    auto  num   = node.internal ? (int64_t)2 : (int64_t)node.num;
+    if (start < 0 || num < 0 || start + num > size ||
+        (node.internal && start <= node_id) || node.axis < 0 ||
+        node.axis > 2) {
+      error = filename + ": corrupted tree";
+      return false;
+    }
+  }
+  auto check_wide = [&](const auto& nodes) {
+    for (auto node_id = 0; node_id < (int)nodes.size(); node_id++) {
+      auto& node = nodes[node_id];
+      for (auto idx = 0; idx < 4; idx++) {
+        if (node.start[idx] < 0) continue;
+        auto start = (int64_t)node.start[idx];
+        auto num   = (int64_t)node.num[idx];
+        if (num < 0) return false;
+        if (num == 0 && (start <= node_id || start >= (int64_t)nodes.size()))
+          return false;
+        if (num > 0 && start + num > (int64_t)num_primitives) return false;
+      }
+    }
+    return true;
+  };
+  if (!check_wide(bvh.wide_nodes) || !check_wide(bvh.compressed_nodes)) {
+    error = filename + ": corrupted tree";
+    return false;
+  }
+  bvh.wide_depth = !bvh.compressed_nodes.empty()
+                       ? get_wide_depth(bvh.compressed_nodes)
+                       : get_wide_depth(bvh.wide_nodes);
+
+  // set the tree, with elements in their original order
+  if (shape->bvh.ordered) reorder_elements(shape, true);
+  shape->bvh = std::move(bvh);
+  return true;
+}
+
+// Filename of a cached shape bvh
+static string get_cache_filename(const bvh_params& params, uint64_t hash) {
+  auto name = array<char, 32>{};
+  snprintf(name.data(), name.size(), "%016llx", (unsigned long long)hash);
+  return path_join(params.cachedir,
+      string{name.data()} + "-" + bvh_build_names[(int)params.bvh] + ".ybvh");
+}
+
+static void build_bvh(bvh_shape* shape, const bvh_params& params) {
+  // restore element order, if changed by a previous build
+  if (shape->bvh.ordered) reorder_elements(shape, true);
+
+#ifdef YOCTO_EMBREE
+  if (params.bvh == bvh_build_type::embree_default ||
+      params.bvh == bvh_build_type::embree_highquality ||
+      params.bvh == bvh_build_type::embree_compact) {
+    return init_embree_bvh(shape, params);
+  }
+#endif
+
+  // build nodes, unless cached for the same shape content; cache errors
+  // are not reported, since the cache only saves build time
+  if (!params.cachedir.empty()) {
+    auto hash     = hash_bvh_shape(shape);
+    auto filename = get_cache_filename(params, hash);
+    auto error    = string{};
+    if (!load_bvh(filename, shape, hash, params.bvh, error)) {
+      build_bvh_nodes(shape, params);
+      save_bvh(filename, shape, hash, params.bvh, error);
+    }
+  } else {
+    build_bvh_nodes(shape, params);
+  }
+
+  // compressed trees store elements in leaf order, copying views
+  if (params.bvh == bvh_build_type::compressed && !shape->bvh.nodes.empty()) {
+    reorder_elements(shape, false);
+  }
+
+  // precomputed elements
+  shape->precomputed = {};
+  if (params.precompute) precompute_elements(shape);
+}
+
+// Surface area of a bounding box, or zero if the box is empty
+static float bvh_area(const bbox3f& bbox) {
+  return bbox.min.x <= bbox.max.x ? bbox_area(bbox) : 0;
+}
+
+// Node weight in the SAH cost, with unit costs for node and primitive tests.
+static float bvh_weight(const bvh_node& node) {
+  return node.internal ? 1 : (float)node.num;
+}
+
+// SAH cost of the scene bvh computed from its weighted node areas.
+static float get_sah_cost(const bvh_scene* scene) {
+  if (scene->bvh.nodes.empty()) return 0;
+  auto root_area = bvh_area(scene->bvh.nodes[0].bbox);
+  if (root_area == 0) root_area = 1;
+  return (float)(scene->weighted_area / root_area);
+}
+
+// Bounds of the instances in a leaf of the scene bvh.
+static bbox3f get_leaf_bbox(const bvh_scene* scene, int start, int num) {
+  auto bbox = invalidb3f;
+  for (auto idx = start; idx < start + num; idx++) {
+    bbox = merge(bbox, scene->instance_bboxes[scene->bvh.primitives[idx]]);
+  }
+  return bbox;
+}
+
+// Init the data used to update the scene bvh incrementally.
+static void init_bvh_updates(bvh_scene* scene, vector<bbox3f>&& bboxes) {
+  auto& bvh              = scene->bvh;
+  scene->instance_bboxes = std::move(bboxes);
+  scene->instance_leaves = vector<int>(scene->num_instances, -1);
+  scene->node_parents    = vector<int>(bvh.nodes.size(), -1);
+  scene->weighted_area   = 0;
+  for (auto nodeid = 0; nodeid < (int)bvh.nodes.size(); nodeid++) {
+    auto& node = bvh.nodes[nodeid];
+    if (node.internal) {
+      for (auto idx = 0; idx < 2; idx++)
+        scene->node_parents[node.start + idx] = nodeid;
+    } else {
+      for (auto idx = 0; idx < node.num; idx++)
+        scene->instance_leaves[bvh.primitives[node.start + idx]] = nodeid;
+    }
+    scene->weighted_area += bvh_area(node.bbox) * bvh_weight(node);
+  }
+  scene->build_cost = get_sah_cost(scene);
+
+  // wide nodes holding each instance, parents and bounds of wide nodes
+  auto num_wide               = get_num_wide(bvh);
+  auto compressed             = !bvh.compressed_nodes.empty();
+  scene->instance_wide_leaves = vector<int>(
+      num_wide != 0 ? scene->num_instances : 0, -1);
+  scene->wide_parents = vector<int>(num_wide, -1);
+  for (auto node_id = 0; node_id < num_wide; node_id++) {
+    for (auto idx = 0; idx < 4; idx++) {
+      auto start = compressed ? bvh.compressed_nodes[node_id].start[idx]
+                              : bvh.wide_nodes[node_id].start[idx];
+      auto num   = compressed ? (int)bvh.compressed_nodes[node_id].num[idx]
+                              : (int)bvh.wide_nodes[node_id].num[idx];
+      if (start < 0) continue;
+      if (num == 0) scene->wide_parents[start] = node_id;
+      for (auto prim = start; prim < start + num; prim++)
+        scene->instance_wide_leaves[bvh.primitives[prim]] = node_id;
+    }
+  }
+  scene->wide_bboxes = refit_wide_nodes(bvh,
+      [scene](int start, int num) { return get_leaf_bbox(scene, start, num); });
+}
+
+// Bounds of an instance, over all its keyframes for moving instances.
+// Since keyframes are interpolated linearly, so are the corners of the
+// transformed shape bounds, which stay within the keyframe bounds.
+static bbox3f get_instance_bbox(
+    const bvh_scene* scene, const bvh_instance& instance) {
+  auto& sbvh = scene->shapes[instance.shape]->bvh;
+  if (sbvh.nodes.empty()) return invalidb3f;
+  if (instance.frames.size() < 2)
+    return transform_bbox(instance.frame, sbvh.nodes[0].bbox);
+  auto bbox = invalidb3f;
+  for (auto& frame : instance.frames)
+    bbox = merge(bbox, transform_bbox(frame, sbvh.nodes[0].bbox));
+  return bbox;
+}
+
+// Update the instance inverse frames and shapes used during traversal,
+// and the keyframes of moving instances
+static void update_inverse_instances(bvh_scene* scene) {
+  scene->inverse_instances.resize(scene->num_instances);
+  scene->shape_instances.assign(scene->shapes.size(), {});
+  scene->keyframes.clear();
+  scene->keyframe_bboxes.clear();
+  scene->num_cutouts = 0;
+  for (auto idx = 0; idx < scene->num_instances; idx++) {
+    auto instance = scene->instance_cb(idx);
+    scene->shape_instances[instance.shape].push_back(idx);
+    auto& inv_instance         = scene->inverse_instances[idx];
+    inv_instance.frame         = inverse(instance.frame, true);
+    inv_instance.shape         = instance.shape;
+    inv_instance.keyframes     = -1;
+    inv_instance.num_keyframes = 0;
+    inv_instance.opaque        = instance.opaque;
+    if (!instance.opaque) scene->num_cutouts += 1;
+    if (instance.frames.size() < 2) continue;
+    auto& sbvh                 = scene->shapes[instance.shape]->bvh;
+    inv_instance.keyframes     = (int)scene->keyframes.size();
+    inv_instance.num_keyframes = (int)instance.frames.size();
+    for (auto& frame : instance.frames) {
+      scene->keyframes.push_back(frame);
+      scene->keyframe_bboxes.push_back(
+          sbvh.nodes.empty() ? invalidb3f
+                             : transform_bbox(frame, sbvh.nodes[0].bbox));
+    }
+  }
+}
+
+void build_bvh(bvh_scene* scene, const bvh_params& params) {
+  // keep parameters for rebuilds
+  scene->params = params;
+
+  // instance inverses
+  update_inverse_instances(scene);
+
+  // embree
+#ifdef YOCTO_EMBREE
+  if (params.bvh == bvh_build_type::embree_default ||
+      params.bvh == bvh_build_type::embree_highquality ||
+      params.bvh == bvh_build_type::embree_compact) {
+    return init_embree_bvh(scene, params);
+  }
+#endif
+
+  // instance bboxes
+  auto bboxes = vector<bbox3f>(scene->num_instances);
+  for (auto idx = 0; idx < bboxes.size(); idx++) {
+    bboxes[idx] = get_instance_bbox(scene, scene->instance_cb(idx));
+  }
+
+  // build nodes
+  if (params.bvh == bvh_build_type::spatial) {
+    build_bvh_spatial(scene->bvh, bboxes, params, split_reference);
+  } else if (params.noparallel) {
+    build_bvh_serial(scene->bvh, bboxes, params);
+  } else {
+    build_bvh_parallel(scene->bvh, bboxes, params);
+  }
+  scene->bvh.wide_nodes.clear();
+  scene->bvh.compressed_nodes.clear();
+  if (params.bvh == bvh_build_type::wide) build_wide_bvh(scene->bvh);
+  if (params.bvh == bvh_build_type::compressed)
+    build_compressed_bvh(scene->bvh);
+
+  // incremental updates
+  init_bvh_updates(scene, std::move(bboxes));
+}
+
+// Minimum number of elements for building a shape bvh with parallelism
+// within the shape. Smaller shapes are built serially, many at a time.
+const int bvh_parallel_shape = 65536;
+
+void init_bvh(bvh_scene* scene, const bvh_params& params,
+    const progress_callback& progress_cb) {
+  // handle progress
+  auto progress = vec2i{0, 1 + (int)scene->shapes.size()};
+
+  // create the cache directory, building without cache if this fails
+  auto error = string{};
+  if (!params.cachedir.empty() && !make_directory(params.cachedir, error)) {
+    auto uncached_params     = params;
+    uncached_params.cachedir = "";
+    return init_bvh(scene, uncached_params, progress_cb);
+  }
+
+  // build shape bvh
+  if (params.noparallel) {
+    for (auto shape : scene->shapes) {
+      if (progress_cb) progress_cb("build shape bvh", progress.x++, progress.y);
+      build_bvh(shape, params);
+    }
+  } else {
+    // progress is reported under a lock since shapes finish concurrently
+    auto progress_mutex = std::mutex{};
+    auto shape_progress = [&]() {
+      if (!progress_cb) return;
+      std::lock_guard<std::mutex> lock(progress_mutex);
+      progress_cb("build shape bvh", progress.x++, progress.y);
+    };
+
+    // large shapes are built concurrently, each with a parallel build
+    auto large_shapes = vector<bvh_shape*>{};
+    auto small_shapes = vector<bvh_shape*>{};
+    for (auto shape : scene->shapes) {
+      if (get_num_elements(shape) >= bvh_parallel_shape) {
+        large_shapes.push_back(shape);
+      } else {
+        small_shapes.push_back(shape);
+      }
+    }
+    parallel_for(
+        (int)large_shapes.size(),
+        [&](int idx) {
+          shape_progress();
+          build_bvh(large_shapes[idx], params);
+        },
+        1);
+
+    // small shapes are built serially, in batches
+    auto serial_params       = params;
+    serial_params.noparallel = true;
+    parallel_for((int)small_shapes.size(), [&](int idx) {
+      shape_progress();
+      build_bvh(small_shapes[idx], serial_params);
+    });
+  }
+
+  // build scene bvh
+  if (progress_cb) progress_cb("build scene bvh", progress.x++, progress.y);
+  build_bvh(scene, params);
+
+  // handle progress
+  if (progress_cb) progress_cb("build bvh", progress.x++, progress.y);
+}
+
+static void update_bvh(bvh_shape* shape) {
+#ifdef YOCTO_EMBREE
+  if (shape->embree_bvh) {
+    throw std::runtime_error("embree shape refit not supported");
+  }
+#endif
+
+  // build primitives
+  auto bboxes = vector<bbox3f>{};
+  if (!shape->points.empty()) {
+    bboxes = vector<bbox3f>(shape->points.size());
+    for (auto idx = 0; idx < bboxes.size(); idx++) {
+      auto& p     = shape->points[idx];
+      bboxes[idx] = point_bounds(shape->positions[p], shape->radius[p]);
+    }
+  } else if (!shape->lines.empty()) {
+    bboxes = vector<bbox3f>(shape->lines.size());
+    for (auto idx = 0; idx < bboxes.size(); idx++) {
+      auto& l     = shape->lines[idx];
+      bboxes[idx] = line_bounds(shape->positions[l.x], shape->positions[l.y],
+          shape->radius[l.x], shape->radius[l.y]);
+    }
+  } else if (!shape->triangles.empty()) {
+    bboxes = vector<bbox3f>(shape->triangles.size());
+    for (auto idx = 0; idx < bboxes.size(); idx++) {
+      auto& t     = shape->triangles[idx];
+      bboxes[idx] = triangle_bounds(
+          shape->positions[t.x], shape->positions[t.y], shape->positions[t.z]);
+    }
+  } else if (!shape->quads.empty()) {
+    bboxes = vector<bbox3f>(shape->quads.size());
+    for (auto idx = 0; idx < bboxes.size(); idx++) {
+      auto& q     = shape->quads[idx];
+      bboxes[idx] = quad_bounds(shape->positions[q.x], shape->positions[q.y],
+          shape->positions[q.z], shape->positions[q.w]);
+    }
   }
+
+  // update nodes
+  update_bvh(shape->bvh, bboxes);
+
+  // compressed trees store elements in leaf order, and elements set again
+  // since the last build are in their original order
+  if (!shape->bvh.compressed_nodes.empty() && !shape->bvh.ordered) {
+    reorder_elements(shape, false);
+  }
+
+  // update precomputed elements
+  if (!shape->precomputed.data.empty()) precompute_elements(shape);
+}
+
+// Scene bvhs are rebuilt instead of refit when refitting raises their SAH
+// cost over the cost after the last build by this factor.
+const float bvh_rebuild_ratio = 1.5f;
+
+// Refit the nodes from a leaf to the root. Refitting stops at the first node
+// whose bounds do not change, since its ancestors do not change either.
+static void refit_bvh_path(bvh_scene* scene, int nodeid) {
+  auto& bvh = scene->bvh;
+  while (nodeid >= 0) {
+    auto& node = bvh.nodes[nodeid];
+    auto  bbox = invalidb3f;
+    if (node.internal) {
+      for (auto idx = 0; idx < 2; idx++) {
+        bbox = merge(bbox, bvh.nodes[node.start + idx].bbox);
+      }
+    } else {
+      for (auto idx = 0; idx < node.num; idx++) {
+        bbox = merge(
+            bbox, scene->instance_bboxes[bvh.primitives[node.start + idx]]);
+      }
+    }
+    if (bbox.min == node.bbox.min && bbox.max == node.bbox.max) break;
+    scene->weighted_area += ((double)bvh_area(bbox) - bvh_area(node.bbox)) *
+                            bvh_weight(node);
+    node.bbox = bbox;
+    nodeid    = scene->node_parents[nodeid];
+  }
+}
+
+// Refit the wide or compressed nodes from the wide node holding a leaf to
+// the root, stopping at the first node whose bounds do not change.
+static void refit_wide_path(bvh_scene* scene, int node_id) {
+  while (node_id >= 0) {
+    auto child_bbox = [scene](int start, int num) {
+      return num != 0 ? get_leaf_bbox(scene, start, num)
+                      : scene->wide_bboxes[start];
+    };
+    auto  bbox     = refit_wide_node(scene->bvh, node_id, child_bbox);
+    auto& old_bbox = scene->wide_bboxes[node_id];
+    if (bbox.min == old_bbox.min && bbox.max == old_bbox.max) break;
+    old_bbox = bbox;
+    node_id  = scene->wide_parents[node_id];
+  }
+}
+
+static void update_bvh(bvh_scene* scene, const vector<int>& updated_instances) {
+  // rebuild if the instances changed since the last build, if instances
+  // may be referenced by more than one leaf, or if the number of keyframes
+  // of an instance changes, since keyframes are stored contiguously
+  if ((int)scene->inverse_instances.size() != scene->num_instances ||
+      scene->params.bvh == bvh_build_type::spatial) {
+    return build_bvh(scene, scene->params);
+  }
+  for (auto instance_id : updated_instances) {
+    auto frames = scene->instance_cb(instance_id).frames.size();
+    if ((frames >= 2 ? (int)frames : 0) !=
+        scene->inverse_instances[instance_id].num_keyframes) {
+      return build_bvh(scene, scene->params);
+    }
+  }
+
+  // instance inverses, shapes and keyframes
+  for (auto instance_id : updated_instances) {
+    auto  instance     = scene->instance_cb(instance_id);
+    auto& inv_instance = scene->inverse_instances[instance_id];
+    if (inv_instance.shape != instance.shape) {
+      auto& instances = scene->shape_instances[inv_instance.shape];
+      instances.erase(
+          std::find(instances.begin(), instances.end(), instance_id));
+      scene->shape_instances[instance.shape].push_back(instance_id);
+    }
+    if (inv_instance.opaque != instance.opaque)
+      scene->num_cutouts += instance.opaque ? -1 : 1;
+    inv_instance.frame  = inverse(instance.frame, true);
+    inv_instance.shape  = instance.shape;
+    inv_instance.opaque = instance.opaque;
+    auto& sbvh          = scene->shapes[instance.shape]->bvh;
+    for (auto idx = 0; idx < inv_instance.num_keyframes; idx++) {
+      auto& frame = instance.frames[idx];
+      scene->keyframes[inv_instance.keyframes + idx]       = frame;
+      scene->keyframe_bboxes[inv_instance.keyframes + idx] =
+          sbvh.nodes.empty() ? invalidb3f
+                             : transform_bbox(frame, sbvh.nodes[0].bbox);
+    }
+  }
+
+#ifdef YOCTO_EMBREE
+  if (scene->embree_bvh) {
+    return update_embree_bvh(scene, updated_instances);
+  }
+#endif
+
+  // update bounds of updated instances, before refitting shared leaves
+  for (auto instance_id : updated_instances) {
+    scene->instance_bboxes[instance_id] = get_instance_bbox(
+        scene, scene->instance_cb(instance_id));
+  }
+
+  // refit only the nodes above updated instances
+  for (auto instance_id : updated_instances) {
+    refit_bvh_path(scene, scene->instance_leaves[instance_id]);
+  }
+
+  // rebuild if refitting degraded the tree too much
+  if (get_sah_cost(scene) > scene->build_cost * bvh_rebuild_ratio) {
+    return build_bvh(scene, scene->params);
+  }
+
+  // refit only the wide nodes above updated instances
+  if (get_num_wide(scene->bvh) != 0) {
+    for (auto instance_id : updated_instances) {
+      refit_wide_path(scene, scene->instance_wide_leaves[instance_id]);
+    }
+  }
+}
+
+void update_bvh(bvh_scene* scene, const vector<int>& updated_instances,
+    const vector<int>& updated_shapes, const progress_callback& progress_cb) {
+  // handle progress
+  auto progress = vec2i{0, 1 + (int)updated_shapes.size()};
+
+  // update shapes
+  for (auto shape : updated_shapes) {
+    if (progress_cb) progress_cb("update shape bvh", progress.x++, progress.y);
+    update_bvh(scene->shapes[shape]);
+  }
+
+  // instances of updated shapes are updated too
+  auto dirty_instances = updated_instances;
+  for (auto shape : updated_shapes) {
+    if (shape >= (int)scene->shape_instances.size()) continue;
+    for (auto instance_id : scene->shape_instances[shape])
+      dirty_instances.push_back(instance_id);
+  }
+
+  // handle instances
+  if (progress_cb) progress_cb("update scene bvh", progress.x++, progress.y);
+  update_bvh(scene, dirty_instances);
+
+  // handle progress
+  if (progress_cb) progress_cb("update bvh", progress.x++, progress.y);
+}
+
+// Compute compressed bvh statistics, with unit costs for wide node and
+// primitive tests. Children bounds are decoded as in traversal.
+static bvh_stats get_compressed_stats(const bvh_tree& bvh, float root_area) {
+  auto  stats  = bvh_stats{};
+  auto& nodes  = bvh.compressed_nodes;
+  auto  depths = vector<int>(nodes.size(), 1);
+  stats.sah_cost += 1;
+  for (auto nodeid = 0; nodeid < (int)nodes.size(); nodeid++) {
+    auto& node = nodes[nodeid];
+    stats.nodes += 1;
+    stats.depth = max(stats.depth, depths[nodeid]);
+    for (auto idx = 0; idx < 4; idx++) {
+      if (node.start[idx] < 0) continue;
+      auto ratio = bvh_area(get_child_bbox(node, idx)) / root_area;
+      if (node.num[idx] == 0) {
+        stats.sah_cost += ratio;
+        depths[node.start[idx]] = depths[nodeid] + 1;
+      } else {
+        stats.leaves += 1;
+        stats.sah_cost += ratio * node.num[idx];
+      }
+    }
+  }
+  return stats;
+}
+
+// Compute bvh statistics, with unit costs for node and primitive tests.
+static bvh_stats get_bvh_stats(const bvh_tree& bvh) {
+  auto stats = bvh_stats{};
+  if (bvh.nodes.empty()) return stats;
+  auto root_area = bvh_area(bvh.nodes[0].bbox);
+  if (root_area == 0) root_area = 1;
+  if (!bvh.compressed_nodes.empty())
+    return get_compressed_stats(bvh, root_area);
+  auto depths = vector<int>(bvh.nodes.size(), 1);
+  for (auto nodeid = 0; nodeid < (int)bvh.nodes.size(); nodeid++) {
+    auto& node  = bvh.nodes[nodeid];
+    auto  ratio = bvh_area(node.bbox) / root_area;
+    stats.nodes += 1;
+    stats.depth = max(stats.depth, depths[nodeid]);
+    if (node.internal) {
+      stats.sah_cost += ratio;
+      for (auto idx = 0; idx < 2; idx++)
+        depths[node.start + idx] = depths[nodeid] + 1;
+    } else {
+      stats.leaves += 1;
+      stats.sah_cost += ratio * node.num;
+    }
+  }
+  return stats;
+}
+
+// Memory used by the bvh tree
+static size_t get_bvh_memory(const bvh_tree& bvh) {
+  return bvh.nodes.size() * sizeof(bvh_node) +
+         bvh.primitives.size() * sizeof(int) +
+         bvh.wide_nodes.size() * sizeof(bvh_node4) +
+         bvh.compressed_nodes.size() * sizeof(bvh_qnode4);
+}
+
+size_t get_bvh_memory(const bvh_shape* shape) {
+  return get_bvh_memory(shape->bvh) +
+         shape->precomputed.data.size() * sizeof(float);
+}
+
+size_t get_bvh_memory(const bvh_scene* scene) {
+  auto memory = get_bvh_memory(scene->bvh) +
+                scene->inverse_instances.size() * sizeof(bvh_inverse_instance) +
+                scene->instance_bboxes.size() * sizeof(bbox3f) +
+                scene->instance_leaves.size() * sizeof(int) +
+                scene->node_parents.size() * sizeof(int) +
+                scene->instance_wide_leaves.size() * sizeof(int) +
+                scene->wide_parents.size() * sizeof(int) +
+                scene->wide_bboxes.size() * sizeof(bbox3f) +
+                scene->keyframes.size() * sizeof(frame3f) +
+                scene->keyframe_bboxes.size() * sizeof(bbox3f);
+  for (auto& instances : scene->shape_instances)
+    memory += instances.size() * sizeof(int);
+  for (auto shape : scene->shapes) memory += get_bvh_memory(shape);
+  return memory;
+}
+
+bvh_stats get_bvh_stats(const bvh_scene* scene) {
+  // scene statistics
+  auto stats = get_bvh_stats(scene->bvh);
+  if (scene->bvh.nodes.empty()) return stats;
+
+  // shape statistics
+  auto shape_costs = vector<float>(scene->shapes.size());
+  auto shape_depth = 0;
+  for (auto idx = 0; idx < (int)scene->shapes.size(); idx++) {
+    auto shape_stats = get_bvh_stats(scene->shapes[idx]->bvh);
+    shape_costs[idx] = shape_stats.sah_cost;
+    shape_depth      = max(shape_depth, shape_stats.depth);
+    stats.nodes += shape_stats.nodes;
+    stats.leaves += shape_stats.leaves;
+    stats.elements += get_num_elements(scene->shapes[idx]);
+  }
+  stats.depth += shape_depth;
+  stats.memory = get_bvh_memory(scene);
+
+  // rays that hit an instance bounds traverse its shape bvh
+  auto root_area = bvh_area(scene->bvh.nodes[0].bbox);
+  if (root_area == 0) root_area = 1;
+  for (auto idx = 0; idx < scene->num_instances; idx++) {
+    auto instance = scene->instance_cb(idx);
+    auto bbox     = get_instance_bbox(scene, instance);
+    stats.sah_cost += bvh_area(bbox) / root_area * shape_costs[instance.shape];
+  }
+  return stats;
+}
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION FOR BVH INTERSECTION
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+#ifdef __SSE2__
+// Intersect a ray with four precomputed triangles, computing the same values
+// as intersect_triangle. Returns the mask of the triangles that are hit.
+static int intersect_triangle4(const ray3f& ray, const float* data,
+    int stride, int component, __m128& u, __m128& v, __m128& t) {
+  auto load = [data, stride](int component) {
+    return _mm_loadu_ps(data + (size_t)component * stride);
+  };
+  auto p0x = load(component + 0), p0y = load(component + 1),
+       p0z = load(component + 2);
+  auto e1x = load(component + 3), e1y = load(component + 4),
+       e1z = load(component + 5);
+  auto e2x = load(component + 6), e2y = load(component + 7),
+       e2z = load(component + 8);
+  auto dx = _mm_set1_ps(ray.d.x), dy = _mm_set1_ps(ray.d.y),
+       dz = _mm_set1_ps(ray.d.z);
+
+  // compute determinant to solve a linear system
+  auto pvx = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+  auto pvy = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+  auto pvz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+  auto det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, pvx), _mm_mul_ps(e1y, pvy)),
+      _mm_mul_ps(e1z, pvz));
+  auto inv_det = _mm_div_ps(_mm_set1_ps(1), det);
+
+  // compute barycentric coordinates and ray parameter
+  auto tvx = _mm_sub_ps(_mm_set1_ps(ray.o.x), p0x);
+  auto tvy = _mm_sub_ps(_mm_set1_ps(ray.o.y), p0y);
+  auto tvz = _mm_sub_ps(_mm_set1_ps(ray.o.z), p0z);
+  u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tvx, pvx),
+                                _mm_mul_ps(tvy, pvy)),
+                     _mm_mul_ps(tvz, pvz)),
+      inv_det);
+  auto qvx = _mm_sub_ps(_mm_mul_ps(tvy, e1z), _mm_mul_ps(tvz, e1y));
+  auto qvy = _mm_sub_ps(_mm_mul_ps(tvz, e1x), _mm_mul_ps(tvx, e1z));
+  auto qvz = _mm_sub_ps(_mm_mul_ps(tvx, e1y), _mm_mul_ps(tvy, e1x));
+  v = _mm_mul_ps(
+      _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qvx), _mm_mul_ps(dy, qvy)),
+          _mm_mul_ps(dz, qvz)),
+      inv_det);
+  t = _mm_mul_ps(
+      _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qvx), _mm_mul_ps(e2y, qvy)),
+          _mm_mul_ps(e2z, qvz)),
+      inv_det);
+
+  // reject as in intersect_triangle, so that NaNs are handled the same
+  auto zero = _mm_setzero_ps(), one = _mm_set1_ps(1);
+  auto miss = _mm_or_ps(_mm_cmpeq_ps(det, zero),
+      _mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmpgt_ps(u, one)));
+  miss = _mm_or_ps(miss, _mm_or_ps(_mm_cmplt_ps(v, zero),
+                             _mm_cmpgt_ps(_mm_add_ps(u, v), one)));
+  miss = _mm_or_ps(miss, _mm_or_ps(_mm_cmplt_ps(t, _mm_set1_ps(ray.tmin)),
+                             _mm_cmpgt_ps(t, _mm_set1_ps(ray.tmax))));
+  return ~_mm_movemask_ps(miss) & 15;
+}
+
+// Intersect a ray with four precomputed lines, computing the same values
+// as intersect_line. Returns the mask of the lines that are hit.
+static int intersect_line4(const ray3f& ray, const float* data, int stride,
+    __m128& s, __m128& r, __m128& t, __m128& d2) {
+  auto load = [data, stride](int component) {
+    return _mm_loadu_ps(data + (size_t)component * stride);
+  };
+  auto p0x = load(0), p0y = load(1), p0z = load(2);
+  auto vx = load(3), vy = load(4), vz = load(5);
+  auto c = load(6), r0 = load(7), r1 = load(8);
+  auto dx = _mm_set1_ps(ray.d.x), dy = _mm_set1_ps(ray.d.y),
+       dz = _mm_set1_ps(ray.d.z);
+
+  // compute values to solve a linear system
+  auto wx = _mm_sub_ps(_mm_set1_ps(ray.o.x), p0x);
+  auto wy = _mm_sub_ps(_mm_set1_ps(ray.o.y), p0y);
+  auto wz = _mm_sub_ps(_mm_set1_ps(ray.o.z), p0z);
+  auto a  = _mm_set1_ps(dot(ray.d, ray.d));
+  auto b  = _mm_add_ps(
+      _mm_add_ps(_mm_mul_ps(dx, vx), _mm_mul_ps(dy, vy)), _mm_mul_ps(dz, vz));
+  auto d = _mm_add_ps(
+      _mm_add_ps(_mm_mul_ps(dx, wx), _mm_mul_ps(dy, wy)), _mm_mul_ps(dz, wz));
+  auto e = _mm_add_ps(
+      _mm_add_ps(_mm_mul_ps(vx, wx), _mm_mul_ps(vy, wy)), _mm_mul_ps(vz, wz));
+  auto det = _mm_sub_ps(_mm_mul_ps(a, c), _mm_mul_ps(b, b));
+
+  // compute parameters on both ray and segment
+  t = _mm_div_ps(_mm_sub_ps(_mm_mul_ps(b, e), _mm_mul_ps(c, d)), det);
+  s = _mm_div_ps(_mm_sub_ps(_mm_mul_ps(a, e), _mm_mul_ps(b, d)), det);
+  s = _mm_min_ps(_mm_max_ps(s, _mm_setzero_ps()), _mm_set1_ps(1));
+
+  // compute segment-segment distance on the closest points
+  auto prlx = _mm_sub_ps(_mm_add_ps(_mm_set1_ps(ray.o.x), _mm_mul_ps(dx, t)),
+      _mm_add_ps(p0x, _mm_mul_ps(vx, s)));
+  auto prly = _mm_sub_ps(_mm_add_ps(_mm_set1_ps(ray.o.y), _mm_mul_ps(dy, t)),
+      _mm_add_ps(p0y, _mm_mul_ps(vy, s)));
+  auto prlz = _mm_sub_ps(_mm_add_ps(_mm_set1_ps(ray.o.z), _mm_mul_ps(dz, t)),
+      _mm_add_ps(p0z, _mm_mul_ps(vz, s)));
+  d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(prlx, prlx), _mm_mul_ps(prly, prly)),
+      _mm_mul_ps(prlz, prlz));
+  r = _mm_add_ps(_mm_mul_ps(r0, _mm_sub_ps(_mm_set1_ps(1), s)),
+      _mm_mul_ps(r1, s));
+
+  // reject as in intersect_line
+  auto miss = _mm_or_ps(_mm_cmpeq_ps(det, _mm_setzero_ps()),
+      _mm_or_ps(_mm_cmplt_ps(t, _mm_set1_ps(ray.tmin)),
+          _mm_cmpgt_ps(t, _mm_set1_ps(ray.tmax))));
+  miss = _mm_or_ps(miss, _mm_cmpgt_ps(d2, _mm_mul_ps(r, r)));
+  return ~_mm_movemask_ps(miss) & 15;
+}
+
+// Intersect ray with the precomputed elements in a leaf, four at a time,
+// updating the ray distance. Hits are then accepted in element order, so
+// that results match intersect_elements.
+static bool intersect_precomputed(const bvh_shape* shape, int start, int num,
+    ray3f& ray, int& element, vec2f& uv, float& distance,
+    const bvh_opacity_callback* opacity_cb, int instance) {
+  auto& precomputed = shape->precomputed;
+  auto& primitives  = shape->bvh.primitives;
+  auto  hit         = false;
+  auto  opaque      = [&](int idx, const vec2f& uv, float distance) {
+    return !opacity_cb ||
+           (*opacity_cb)(instance, primitives[idx], uv, distance);
+  };
+  for (auto first = start; first < start + num; first += 4) {
+    auto data  = precomputed.data.data() + first;
+    auto count = min(start + num - first, 4);
+    auto lanes = (1 << count) - 1;
+    auto us = array<float, 4>{}, vs = array<float, 4>{},
+         ts = array<float, 4>{};
+    if (!shape->triangles.empty()) {
+      auto u = _mm_setzero_ps(), v = _mm_setzero_ps(), t = _mm_setzero_ps();
+      auto mask = intersect_triangle4(
+          ray, data, precomputed.stride, 0, u, v, t);
+      if ((mask & lanes) == 0) continue;
+      _mm_storeu_ps(us.data(), u);
+      _mm_storeu_ps(vs.data(), v);
+      _mm_storeu_ps(ts.data(), t);
+      for (auto idx = 0; idx < count; idx++) {
+        if (!(mask & (1 << idx)) || ts[idx] > ray.tmax) continue;
+        if (!opaque(first + idx, {us[idx], vs[idx]}, ts[idx])) continue;
+        hit      = true;
+        element  = primitives[first + idx];
+        uv       = {us[idx], vs[idx]};
+        distance = ts[idx];
+        ray.tmax = distance;
+      }
+    } else if (!shape->quads.empty()) {
+      auto u = _mm_setzero_ps(), v = _mm_setzero_ps(), t = _mm_setzero_ps();
+      auto u2 = _mm_setzero_ps(), v2 = _mm_setzero_ps(),
+           t2    = _mm_setzero_ps();
+      auto mask  = intersect_triangle4(
+          ray, data, precomputed.stride, 0, u, v, t);
+      auto mask2 = intersect_triangle4(
+          ray, data, precomputed.stride, 9, u2, v2, t2);
+      if (((mask | mask2) & lanes) == 0) continue;
+      auto us2 = array<float, 4>{}, vs2 = array<float, 4>{},
+           ts2 = array<float, 4>{};
+      _mm_storeu_ps(us.data(), u);
+      _mm_storeu_ps(vs.data(), v);
+      _mm_storeu_ps(ts.data(), t);
+      _mm_storeu_ps(us2.data(), u2);
+      _mm_storeu_ps(vs2.data(), v2);
+      _mm_storeu_ps(ts2.data(), t2);
+      for (auto idx = 0; idx < count; idx++) {
+        if ((mask & (1 << idx)) && ts[idx] <= ray.tmax &&
+            opaque(first + idx, {us[idx], vs[idx]}, ts[idx])) {
+          hit      = true;
+          element  = primitives[first + idx];
+          uv       = {us[idx], vs[idx]};
+          distance = ts[idx];
+          ray.tmax = distance;
+        }
+        if ((mask2 & (1 << idx)) && ts2[idx] <= ray.tmax &&
+            opaque(first + idx, {1 - us2[idx], 1 - vs2[idx]}, ts2[idx])) {
+          hit      = true;
+          element  = primitives[first + idx];
+          uv       = {1 - us2[idx], 1 - vs2[idx]};
+          distance = ts2[idx];
+          ray.tmax = distance;
+        }
+      }
+    } else if (!shape->lines.empty()) {
+      auto s = _mm_setzero_ps(), r = _mm_setzero_ps(), t = _mm_setzero_ps(),
+           d2   = _mm_setzero_ps();
+      auto mask = intersect_line4(ray, data, precomputed.stride, s, r, t, d2);
+      if ((mask & lanes) == 0) continue;
+      _mm_storeu_ps(us.data(), s);
+      _mm_storeu_ps(vs.data(), _mm_div_ps(_mm_sqrt_ps(d2), r));
+      _mm_storeu_ps(ts.data(), t);
+      for (auto idx = 0; idx < count; idx++) {
+        if (!(mask & (1 << idx)) || ts[idx] > ray.tmax) continue;
+        if (!opaque(first + idx, {us[idx], vs[idx]}, ts[idx])) continue;
+        hit      = true;
+        element  = primitives[first + idx];
+        uv       = {us[idx], vs[idx]};
+        distance = ts[idx];
+        ray.tmax = distance;
+      }
+    }
+  }
+  return hit;
+}
+#endif
+
+// Intersect ray with the elements in a leaf, updating the ray distance.
+// If `opacity_cb` is given, hits that are not opaque are skipped.
+static bool intersect_elements(const bvh_shape* shape, int start, int num,
+    ray3f& ray, int& element, vec2f& uv, float& distance,
+    const bvh_opacity_callback* opacity_cb = nullptr, int instance = -1) {
+#ifdef __SSE2__
+  // use precomputed elements if present
+  if (!shape->precomputed.data.empty()) {
+    return intersect_precomputed(shape, start, num, ray, element, uv,
+        distance, opacity_cb, instance);
+  }
+#endif
+
+  // accept opaque hits, updating the ray distance
+  auto hit_uv       = zero2f;
+  auto hit_distance = 0.0f;
+  auto accept_hit   = [&](int idx) {
+    auto hit_element = shape->bvh.primitives[idx];
+    if (opacity_cb &&
+        !(*opacity_cb)(instance, hit_element, hit_uv, hit_distance))
+      return false;
+    element  = hit_element;
+    uv       = hit_uv;
+    distance = hit_distance;
+    ray.tmax = hit_distance;
+    return true;
+  };
+
+  auto hit     = false;
+  auto ordered = shape->bvh.ordered;
+  if (!shape->points.empty()) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& p = shape->points[ordered ? idx : shape->bvh.primitives[idx]];
+      if (intersect_point(ray, shape->positions[p], shape->radius[p], hit_uv,
+              hit_distance) &&
+          accept_hit(idx))
+        hit = true;
+    }
+  } else if (!shape->lines.empty()) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& l = shape->lines[ordered ? idx : shape->bvh.primitives[idx]];
+      if (intersect_line(ray, shape->positions[l.x], shape->positions[l.y],
+              shape->radius[l.x], shape->radius[l.y], hit_uv, hit_distance) &&
+          accept_hit(idx))
+        hit = true;
+    }
+  } else if (!shape->triangles.empty()) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& t = shape->triangles[ordered ? idx : shape->bvh.primitives[idx]];
+      if (intersect_triangle(ray, shape->positions[t.x], shape->positions[t.y],
+              shape->positions[t.z], hit_uv, hit_distance) &&
+          accept_hit(idx))
+        hit = true;
+    }
+  } else if (!shape->quads.empty()) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& q = shape->quads[ordered ? idx : shape->bvh.primitives[idx]];
+      if (intersect_quad(ray, shape->positions[q.x], shape->positions[q.y],
+              shape->positions[q.z], shape->positions[q.w], hit_uv,
+              hit_distance) &&
+          accept_hit(idx))
+        hit = true;
+    }
+  }
+  return hit;
+}
+
+// Forward declaration
+static bool intersect_bvh(const bvh_shape* shape, const ray3f& ray_,
+    int& element, vec2f& uv, float& distance, bool find_any,
+    const bvh_opacity_callback* opacity_cb = nullptr, int instance = -1);
+
+// Get the inverse frame of an instance at the ray time. Moving instances
+// interpolate their keyframes, and return false if the ray misses their
+// bounds at the ray time, interpolated from the keyframe bounds.
+static bool get_inverse_frame(const bvh_scene* scene,
+    const bvh_inverse_instance& inv_instance, const ray3f& ray,
+    frame3f& inv_frame) {
+  if (inv_instance.num_keyframes == 0) {
+    inv_frame = inv_instance.frame;
+    return true;
+  }
+  auto time = clamp(ray.time, 0.0f, 1.0f) * (inv_instance.num_keyframes - 1);
+  auto idx  = min((int)time, inv_instance.num_keyframes - 2);
+  auto t    = time - idx;
+  auto key  = inv_instance.keyframes + idx;
+  auto &bbox0 = scene->keyframe_bboxes[key],
+       &bbox1 = scene->keyframe_bboxes[key + 1];
+  if (!intersect_bbox(ray, bbox3f{lerp(bbox0.min, bbox1.min, t),
+                               lerp(bbox0.max, bbox1.max, t)}))
+    return false;
+  auto &frame0 = scene->keyframes[key], &frame1 = scene->keyframes[key + 1];
+  inv_frame = inverse(frame3f{lerp(frame0.x, frame1.x, t),
+                          lerp(frame0.y, frame1.y, t),
+                          lerp(frame0.z, frame1.z, t),
+                          lerp(frame0.o, frame1.o, t)},
+      true);
+  return true;
+}
+
+// Intersect ray with the instances in a leaf, updating the ray distance.
+static bool intersect_instances(const bvh_scene* scene, int start, int num,
+    ray3f& ray, int& instance, int& element, vec2f& uv, float& distance,
+    bool find_any, const bvh_opacity_callback* opacity_cb) {
+  auto hit = false;
+  for (auto idx = start; idx < start + num; idx++) {
+    auto& inv_instance = scene->inverse_instances[scene->bvh.primitives[idx]];
+    auto  inv_frame    = frame3f{};
+    if (!get_inverse_frame(scene, inv_instance, ray, inv_frame)) continue;
+    auto inv_ray = transform_ray(inv_frame, ray);
+    if (intersect_bvh(scene->shapes[inv_instance.shape], inv_ray, element, uv,
+            distance, find_any, inv_instance.opaque ? nullptr : opacity_cb,
+            scene->bvh.primitives[idx])) {
+      hit      = true;
+      instance = scene->bvh.primitives[idx];
+      ray.tmax = distance;
+    }
+  }
+  return hit;
+}
+
+#ifdef __SSE2__
+// Intersect a ray with four bounds given as vectors of coordinates. Returns a
+// bit mask of the bounds that are hit and sets their entry distances.
+static int intersect_bbox4(__m128 min_x, __m128 min_y, __m128 min_z,
+    __m128 max_x, __m128 max_y, __m128 max_z, const ray3f& ray,
+    const vec3f& ray_dinv, array<float, 4>& distances) {
+  auto ox = _mm_set1_ps(ray.o.x), oy = _mm_set1_ps(ray.o.y),
+       oz = _mm_set1_ps(ray.o.z);
+  auto dx = _mm_set1_ps(ray_dinv.x), dy = _mm_set1_ps(ray_dinv.y),
+       dz = _mm_set1_ps(ray_dinv.z);
+  auto t0x  = _mm_mul_ps(_mm_sub_ps(min_x, ox), dx);
+  auto t1x  = _mm_mul_ps(_mm_sub_ps(max_x, ox), dx);
+  auto t0y  = _mm_mul_ps(_mm_sub_ps(min_y, oy), dy);
+  auto t1y  = _mm_mul_ps(_mm_sub_ps(max_y, oy), dy);
+  auto t0z  = _mm_mul_ps(_mm_sub_ps(min_z, oz), dz);
+  auto t1z  = _mm_mul_ps(_mm_sub_ps(max_z, oz), dz);
+  auto tmin = _mm_max_ps(
+      _mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)),
+      _mm_max_ps(_mm_min_ps(t0z, t1z), _mm_set1_ps(ray.tmin)));
+  auto tmax = _mm_min_ps(
+      _mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)),
+      _mm_min_ps(_mm_max_ps(t0z, t1z), _mm_set1_ps(ray.tmax)));
+  tmax = _mm_mul_ps(tmax, _mm_set1_ps(1.00000024f));
+  _mm_storeu_ps(distances.data(), tmin);
+  return _mm_movemask_ps(_mm_cmple_ps(tmin, tmax));
+}
+
+// Decode four quantized coordinates as origin + value * scale.
+static __m128 decode_bbox4(
+    const array<uint8_t, 4>& values, float origin, float scale) {
+  auto packed = 0;
+  memcpy(&packed, values.data(), sizeof(packed));
+  auto zero  = _mm_setzero_si128();
+  auto bytes = _mm_cvtsi32_si128(packed);
+  auto ints  = _mm_unpacklo_epi16(_mm_unpacklo_epi8(bytes, zero), zero);
+  return _mm_add_ps(_mm_set1_ps(origin),
+      _mm_mul_ps(_mm_cvtepi32_ps(ints), _mm_set1_ps(scale)));
+}
 #endif
 
-  // build primitives
-  auto bboxes = vector<bbox3f>(scene->num_instances);
-  for (auto idx = 0; idx < bboxes.size(); idx++) {
-    auto  instance = scene->instance_cb(idx);
-    auto& sbvh     = scene->shapes[instance.shape]->bvh;
-    bboxes[idx]    = transform_bbox(instance.frame, sbvh.nodes[0].bbox);
+// Intersect a ray with the four children bounds of a wide node. Returns a
+// bit mask of the children that are hit and sets their entry distances.
+static int intersect_bbox4(const bvh_node4& node, const ray3f& ray,
+    const vec3f& ray_dinv, array<float, 4>& distances) {
+#ifdef __SSE2__
+  return intersect_bbox4(_mm_load_ps(node.min_x.data()),
+      _mm_load_ps(node.min_y.data()), _mm_load_ps(node.min_z.data()),
+      _mm_load_ps(node.max_x.data()), _mm_load_ps(node.max_y.data()),
+      _mm_load_ps(node.max_z.data()), ray, ray_dinv, distances);
+#else
+  auto mask = 0;
+  for (auto idx = 0; idx < 4; idx++) {
+    auto bbox = bbox3f{{node.min_x[idx], node.min_y[idx], node.min_z[idx]},
+        {node.max_x[idx], node.max_y[idx], node.max_z[idx]}};
+    auto it_min    = (bbox.min - ray.o) * ray_dinv;
+    auto it_max    = (bbox.max - ray.o) * ray_dinv;
+    auto t0        = max(max(min(it_min, it_max)), ray.tmin);
+    auto t1        = min(min(max(it_min, it_max)), ray.tmax);
+    distances[idx] = t0;
+    if (t0 <= t1 * 1.00000024f) mask |= 1 << idx;
   }
-
-  // update nodes
-  update_bvh(scene->bvh, bboxes);
+  return mask;
+#endif
 }
 
-void update_bvh(bvh_scene* scene, const vector<int>& updated_instances,
-    const vector<int>& updated_shapes, const progress_callback& progress_cb) {
-  // handle progress
-  auto progress = vec2i{0, 1 + (int)updated_shapes.size()};
+// Intersect a ray with the four children bounds of a compressed node,
+// decoding the bounds first.
+static int intersect_bbox4(const bvh_qnode4& node, const ray3f& ray,
+    const vec3f& ray_dinv, array<float, 4>& distances) {
+  auto scale = vec3f{bvh_exp2(node.exponent[0]), bvh_exp2(node.exponent[1]),
+      bvh_exp2(node.exponent[2])};
+#ifdef __SSE2__
+  return intersect_bbox4(decode_bbox4(node.min_x, node.origin.x, scale.x),
+      decode_bbox4(node.min_y, node.origin.y, scale.y),
+      decode_bbox4(node.min_z, node.origin.z, scale.z),
+      decode_bbox4(node.max_x, node.origin.x, scale.x),
+      decode_bbox4(node.max_y, node.origin.y, scale.y),
+      decode_bbox4(node.max_z, node.origin.z, scale.z), ray, ray_dinv,
+      distances);
+#else
+  auto wide = bvh_node4{};
+  for (auto idx = 0; idx < 4; idx++) {
+    wide.min_x[idx] = node.origin.x + node.min_x[idx] * scale.x;
+    wide.min_y[idx] = node.origin.y + node.min_y[idx] * scale.y;
+    wide.min_z[idx] = node.origin.z + node.min_z[idx] * scale.z;
+    wide.max_x[idx] = node.origin.x + node.max_x[idx] * scale.x;
+    wide.max_y[idx] = node.origin.y + node.max_y[idx] * scale.y;
+    wide.max_z[idx] = node.origin.z + node.max_z[idx] * scale.z;
+  }
+  return intersect_bbox4(wide, ray, ray_dinv, distances);
+#endif
+}
 
-  // update shapes
-  for (auto shape : updated_shapes) {
-    if (progress_cb) progress_cb("update shape bvh", progress.x++, progress.y);
-    update_bvh(scene->shapes[shape]);
+// Intersect ray with a wide bvh, either plain or compressed, of the given
+// depth. Leaf children are tested as soon as their node is visited, front to
+// back, and only internal children are pushed, so that each level adds at
+// most three entries to the stack. Children are skipped if farther than the
+// closest hit found so far.
+template <typename Node, typename Intersect>
+static bool intersect_wide_bvh(const vector<Node>& nodes, int depth,
+    ray3f& ray, bool find_any, Intersect&& intersect_leaf) {
+  // check empty
+  if (nodes.empty()) return false;
+
+  // node stack, on the heap only for very deep trees
+  auto stack_size  = (size_t)3 * max(depth, 1) + 1;
+  auto local_nodes = array<int, 128>{};
+  auto local_dists = array<float, 128>{};
+  auto heap_nodes  = vector<int>{};
+  auto heap_dists  = vector<float>{};
+  auto node_stack  = local_nodes.data();
+  auto dist_stack  = local_dists.data();
+  if (stack_size > local_nodes.size()) {
+    heap_nodes.resize(stack_size);
+    heap_dists.resize(stack_size);
+    node_stack = heap_nodes.data();
+    dist_stack = heap_dists.data();
   }
+  auto node_cur          = 0;
+  node_stack[node_cur]   = 0;
+  dist_stack[node_cur++] = ray.tmin;
 
-  // handle instances
-  if (progress_cb) progress_cb("update scene bvh", progress.x++, progress.y);
-  update_bvh(scene, updated_instances);
+  // shared variables
+  auto hit = false;
 
-  // handle progress
-  if (progress_cb) progress_cb("update bvh", progress.x++, progress.y);
-}
+  // prepare ray for fast queries
+  auto ray_dinv = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
 
-}  // namespace yocto
+  // walking stack
+  while (node_cur != 0) {
+    // grab node
+    node_cur -= 1;
+    auto node_id = node_stack[node_cur];
+    if (dist_stack[node_cur] > ray.tmax) continue;
+
+    // intersect children bounds
+    auto& node      = nodes[node_id];
+    auto  distances = array<float, 4>{};
+    auto  mask      = intersect_bbox4(node, ray, ray_dinv, distances);
+    if (mask == 0) continue;
+
+    // sort hit children from farthest to closest
+    auto children  = array<int, 4>{};
+    auto nchildren = 0;
+    for (auto idx = 0; idx < 4; idx++) {
+      if ((mask & (1 << idx)) == 0 || node.start[idx] < 0) continue;
+      auto pos = nchildren++;
+      while (pos > 0 && distances[children[pos - 1]] < distances[idx]) {
+        children[pos] = children[pos - 1];
+        pos -= 1;
+      }
+      children[pos] = idx;
+    }
 
-// -----------------------------------------------------------------------------
-// IMPLEMENTATION FOR BVH INTERSECTION
-// -----------------------------------------------------------------------------
-namespace yocto {
+    // intersect leaves, from the closest
+    for (auto child = nchildren - 1; child >= 0; child--) {
+      auto idx = children[child];
+      if (node.num[idx] == 0 || distances[idx] > ray.tmax) continue;
+      if (intersect_leaf(node.start[idx], node.num[idx])) hit = true;
+      if (find_any && hit) return hit;
+    }
 
-// Intersect ray with a bvh.
+    // push internal children so that the closest is visited first
+    for (auto child = 0; child < nchildren; child++) {
+      auto idx = children[child];
+      if (node.num[idx] != 0 || distances[idx] > ray.tmax) continue;
+      node_stack[node_cur]   = node.start[idx];
+      dist_stack[node_cur++] = distances[idx];
+    }
+  }
+
+  return hit;
+}
+
+// Intersect ray with a bvh. If `opacity_cb` is given, hits that are not
+// opaque are skipped.
 static bool intersect_bvh(const bvh_shape* shape, const ray3f& ray_,
-    int& element, vec2f& uv, float& distance, bool find_any) {
+    int& element, vec2f& uv, float& distance, bool find_any,
+    const bvh_opacity_callback* opacity_cb, int instance) {
 #ifdef YOCTO_EMBREE
-  // call Embree if needed
+  // call Embree if needed, skipping hits that are not opaque by intersecting
+  // again past them
   if (shape->embree_bvh) {
-    return intersect_embree_bvh(shape, ray_, element, uv, distance, find_any);
+    if (!opacity_cb)
+      return intersect_embree_bvh(shape, ray_, element, uv, distance, find_any);
+    auto ray = ray_;
+    for (auto bounce = 0; bounce < 100; bounce++) {
+      if (!intersect_embree_bvh(shape, ray, element, uv, distance, false))
+        return false;
+      if ((*opacity_cb)(instance, element, uv, distance)) return true;
+      ray.tmin = std::nextafter(distance, flt_max);
+    }
+    return false;
   }
 #endif
 
   // check empty
   if (shape->bvh.nodes.empty()) return false;
 
+  // copy ray to modify it
+  auto ray = ray_;
+
+  // use compressed bvh if present
+  if (!shape->bvh.compressed_nodes.empty()) {
+    auto& bvh = shape->bvh;
+    return intersect_wide_bvh(bvh.compressed_nodes, bvh.wide_depth, ray,
+        find_any, [&](int start, int num) {
+          return intersect_elements(shape, start, num, ray, element, uv,
+              distance, opacity_cb, instance);
+        });
+  }
+
+  // use wide bvh if present
+  if (!shape->bvh.wide_nodes.empty()) {
+    auto& bvh = shape->bvh;
+    return intersect_wide_bvh(bvh.wide_nodes, bvh.wide_depth, ray,
+        find_any, [&](int start, int num) {
+          return intersect_elements(shape, start, num, ray, element, uv,
+              distance, opacity_cb, instance);
+        });
+  }
+
   // node stack
   auto node_stack        = array<int, 128>{};
   auto node_cur          = 0;
@@ -892,9 +2918,6 @@ static bool intersect_bvh(const bvh_shape* shape, const ray3f& ray_,
   // shared variables
   auto hit = false;
 
-  // copy ray to modify it
-  auto ray = ray_;
-
   // prepare ray for fast queries
   auto ray_dinv  = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
   auto ray_dsign = vec3i{(ray_dinv.x < 0) ? 1 : 0, (ray_dinv.y < 0) ? 1 : 0,
@@ -921,46 +2944,9 @@ static bool intersect_bvh(const bvh_shape* shape, const ray3f& ray_,
         node_stack[node_cur++] = node.start + 1;
         node_stack[node_cur++] = node.start + 0;
       }
-    } else if (!shape->points.empty()) {
-      for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& p = shape->points[shape->bvh.primitives[idx]];
-        if (intersect_point(
-                ray, shape->positions[p], shape->radius[p], uv, distance)) {
-          hit      = true;
-          element  = shape->bvh.primitives[idx];
-          ray.tmax = distance;
-        }
-      }
-    } else if (!shape->lines.empty()) {
-      for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& l = shape->lines[shape->bvh.primitives[idx]];
-        if (intersect_line(ray, shape->positions[l.x], shape->positions[l.y],
-                shape->radius[l.x], shape->radius[l.y], uv, distance)) {
-          hit      = true;
-          element  = shape->bvh.primitives[idx];
-          ray.tmax = distance;
-        }
-      }
-    } else if (!shape->triangles.empty()) {
-      for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& t = shape->triangles[shape->bvh.primitives[idx]];
-        if (intersect_triangle(ray, shape->positions[t.x],
-                shape->positions[t.y], shape->positions[t.z], uv, distance)) {
-          hit      = true;
-          element  = shape->bvh.primitives[idx];
-          ray.tmax = distance;
-        }
-      }
-    } else if (!shape->quads.empty()) {
-      for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& q = shape->quads[shape->bvh.primitives[idx]];
-        if (intersect_quad(ray, shape->positions[q.x], shape->positions[q.y],
-                shape->positions[q.z], shape->positions[q.w], uv, distance)) {
-          hit      = true;
-          element  = shape->bvh.primitives[idx];
-          ray.tmax = distance;
-        }
-      }
+    } else if (intersect_elements(shape, node.start, node.num, ray, element,
+                   uv, distance, opacity_cb, instance)) {
+      hit = true;
     }
 
     // check for early exit
@@ -970,21 +2956,58 @@ static bool intersect_bvh(const bvh_shape* shape, const ray3f& ray_,
   return hit;
 }
 
-// Intersect ray with a bvh.
+// Intersect ray with a bvh. If `opacity_cb` is given, hits that are not
+// opaque are skipped.
 static bool intersect_bvh(const bvh_scene* scene, const ray3f& ray_,
     int& instance, int& element, vec2f& uv, float& distance, bool find_any,
-    bool non_rigid_frames) {
+    const bvh_opacity_callback* opacity_cb = nullptr) {
 #ifdef YOCTO_EMBREE
-  // call Embree if needed
+  // call Embree if needed, skipping hits that are not opaque by intersecting
+  // again past them
   if (scene->embree_bvh) {
-    return intersect_embree_bvh(
-        scene, ray_, instance, element, uv, distance, find_any);
+    if (!opacity_cb || scene->num_cutouts == 0)
+      return intersect_embree_bvh(
+          scene, ray_, instance, element, uv, distance, find_any);
+    auto ray = ray_;
+    for (auto bounce = 0; bounce < 100; bounce++) {
+      if (!intersect_embree_bvh(
+              scene, ray, instance, element, uv, distance, false))
+        return false;
+      if (scene->inverse_instances[instance].opaque ||
+          (*opacity_cb)(instance, element, uv, distance))
+        return true;
+      ray.tmin = std::nextafter(distance, flt_max);
+    }
+    return false;
   }
 #endif
 
   // check empty
   if (scene->bvh.nodes.empty()) return false;
 
+  // copy ray to modify it
+  auto ray = ray_;
+
+  // use compressed bvh if present
+  if (!scene->bvh.compressed_nodes.empty()) {
+    auto& bvh = scene->bvh;
+    return intersect_wide_bvh(bvh.compressed_nodes, bvh.wide_depth, ray,
+        find_any, [&](int start, int num) {
+          return intersect_instances(scene, start, num, ray, instance,
+              element, uv, distance, find_any, opacity_cb);
+        });
+  }
+
+  // use wide bvh if present
+  if (!scene->bvh.wide_nodes.empty()) {
+    auto& bvh = scene->bvh;
+    return intersect_wide_bvh(bvh.wide_nodes, bvh.wide_depth, ray,
+        find_any, [&](int start, int num) {
+          return intersect_instances(scene, start, num, ray, instance,
+              element, uv, distance, find_any, opacity_cb);
+        });
+  }
+
   // node stack
   auto node_stack        = array<int, 128>{};
   auto node_cur          = 0;
@@ -993,9 +3016,6 @@ static bool intersect_bvh(const bvh_scene* scene, const ray3f& ray_,
   // shared variables
   auto hit = false;
 
-  // copy ray to modify it
-  auto ray = ray_;
-
   // prepare ray for fast queries
   auto ray_dinv  = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
   auto ray_dsign = vec3i{(ray_dinv.x < 0) ? 1 : 0, (ray_dinv.y < 0) ? 1 : 0,
@@ -1022,17 +3042,9 @@ static bool intersect_bvh(const bvh_scene* scene, const ray3f& ray_,
         node_stack[node_cur++] = node.start + 1;
         node_stack[node_cur++] = node.start + 0;
       }
-    } else {
-      for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto [frame, shape_id] = scene->instance_cb(scene->bvh.primitives[idx]);
-        auto& shape            = scene->shapes[shape_id];
-        auto  inv_ray = transform_ray(inverse(frame, non_rigid_frames), ray);
-        if (intersect_bvh(shape, inv_ray, element, uv, distance, find_any)) {
-          hit      = true;
-          instance = scene->bvh.primitives[idx];
-          ray.tmax = distance;
-        }
-      }
+    } else if (intersect_instances(scene, node.start, node.num, ray, instance,
+                   element, uv, distance, find_any, opacity_cb)) {
+      hit = true;
     }
 
     // check for early exit
@@ -1045,11 +3057,418 @@ static bool intersect_bvh(const bvh_scene* scene, const ray3f& ray_,
 // Intersect ray with a bvh.
 static bool intersect_bvh(const bvh_scene* scene, int instance,
     const ray3f& ray, int& element, vec2f& uv, float& distance, bool find_any,
-    bool non_rigid_frames) {
-  auto [frame, shape_id] = scene->instance_cb(instance);
-  auto& shape            = scene->shapes[shape_id];
-  auto  inv_ray          = transform_ray(inverse(frame, non_rigid_frames), ray);
-  return intersect_bvh(shape, inv_ray, element, uv, distance, find_any);
+    const bvh_opacity_callback* opacity_cb = nullptr) {
+  auto& inv_instance = scene->inverse_instances[instance];
+  auto  inv_frame    = frame3f{};
+  if (!get_inverse_frame(scene, inv_instance, ray, inv_frame)) return false;
+  auto inv_ray = transform_ray(inv_frame, ray);
+  return intersect_bvh(scene->shapes[inv_instance.shape], inv_ray, element, uv,
+      distance, find_any, opacity_cb, instance);
+}
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION FOR BVH PACKET INTERSECTION
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Rays of a packet stored as arrays of coordinates, so that node bounds are
+// tested against four rays at a time. If the inverse directions of the rays
+// are finite and have the same signs, the packet also keeps the intervals
+// of their origins, inverse directions and distances, used to skip nodes
+// that all rays miss with a single test.
+template <size_t N>
+struct bvh_packet {
+  alignas(16) array<float, N> ox = {}, oy = {}, oz = {};
+  alignas(16) array<float, N> dx = {}, dy = {}, dz = {};
+  alignas(16) array<float, N> tmin = {}, tmax = {};
+  bool  coherent = false;
+  vec3f omin = zero3f, omax = zero3f, dmin = zero3f, dmax = zero3f;
+  float tmin_min = 0, tmax_max = 0;
+};
+
+// Prepare a packet of rays for fast queries.
+template <size_t N>
+static bvh_packet<N> make_packet(const array<ray3f, N>& rays, uint32_t mask) {
+  auto packet = bvh_packet<N>{};
+  for (auto idx = 0; idx < (int)N; idx++) {
+    auto& ray        = rays[idx];
+    packet.ox[idx]   = ray.o.x;
+    packet.oy[idx]   = ray.o.y;
+    packet.oz[idx]   = ray.o.z;
+    packet.dx[idx]   = 1 / ray.d.x;
+    packet.dy[idx]   = 1 / ray.d.y;
+    packet.dz[idx]   = 1 / ray.d.z;
+    packet.tmin[idx] = ray.tmin;
+    packet.tmax[idx] = ray.tmax;
+  }
+
+  // intervals of the rays in the mask
+  packet.coherent = mask != 0;
+  auto first      = true;
+  for (auto idx = 0; idx < (int)N; idx++) {
+    if (!(mask & (1u << idx))) continue;
+    auto o    = vec3f{packet.ox[idx], packet.oy[idx], packet.oz[idx]};
+    auto dinv = vec3f{packet.dx[idx], packet.dy[idx], packet.dz[idx]};
+    if (!isfinite(dinv)) packet.coherent = false;
+    if (first) {
+      packet.omin = packet.omax = o;
+      packet.dmin = packet.dmax = dinv;
+      packet.tmin_min           = packet.tmin[idx];
+      packet.tmax_max           = packet.tmax[idx];
+      first                     = false;
+    } else {
+      packet.omin     = min(packet.omin, o);
+      packet.omax     = max(packet.omax, o);
+      packet.dmin     = min(packet.dmin, dinv);
+      packet.dmax     = max(packet.dmax, dinv);
+      packet.tmin_min = min(packet.tmin_min, packet.tmin[idx]);
+      packet.tmax_max = max(packet.tmax_max, packet.tmax[idx]);
+    }
+  }
+  for (auto axis = 0; axis < 3; axis++) {
+    if (packet.dmin[axis] < 0 && packet.dmax[axis] >= 0)
+      packet.coherent = false;
+  }
+  return packet;
+}
+
+// Check whether any ray of a coherent packet may hit a box, using interval
+// arithmetic over the packet origins and inverse directions. Since float
+// operations round monotonically, the entry and exit distances computed from
+// the interval corners bound those of every ray. Distances only shrink during
+// traversal, so the initial maximum distance stays a valid bound.
+template <size_t N>
+static bool intersect_interval(
+    const bvh_packet<N>& packet, const bbox3f& bbox) {
+  auto t0 = packet.tmin_min, t1 = packet.tmax_max;
+  for (auto axis = 0; axis < 3; axis++) {
+    auto negative = packet.dmax[axis] < 0;
+    auto entry    = negative ? bbox.max[axis] : bbox.min[axis];
+    auto exit     = negative ? bbox.min[axis] : bbox.max[axis];
+    auto dmin = packet.dmin[axis], dmax = packet.dmax[axis];
+    auto entry0 = entry - packet.omax[axis], entry1 = entry - packet.omin[axis];
+    auto exit0 = exit - packet.omax[axis], exit1 = exit - packet.omin[axis];
+    t0 = max(t0, min(min(entry0 * dmin, entry0 * dmax),
+                     min(entry1 * dmin, entry1 * dmax)));
+    t1 = min(t1, max(max(exit0 * dmin, exit0 * dmax),
+                     max(exit1 * dmin, exit1 * dmax)));
+  }
+  return t0 <= t1 * 1.00000024f;
+}
+
+// Intersect the rays of a packet in `mask` with a box, four rays at a time.
+// Returns the mask of the rays that hit. Rays are tested as in
+// intersect_bbox(), so that the results do not change.
+template <size_t N>
+static uint32_t intersect_bbox(
+    const bvh_packet<N>& packet, const bbox3f& bbox, uint32_t mask) {
+  auto hit = 0u;
+#ifdef __SSE2__
+  auto min_x = _mm_set1_ps(bbox.min.x), min_y = _mm_set1_ps(bbox.min.y),
+       min_z = _mm_set1_ps(bbox.min.z);
+  auto max_x = _mm_set1_ps(bbox.max.x), max_y = _mm_set1_ps(bbox.max.y),
+       max_z = _mm_set1_ps(bbox.max.z);
+  for (auto idx = 0; idx < (int)N; idx += 4) {
+    if (!((mask >> idx) & 0xf)) continue;
+    auto ox   = _mm_load_ps(packet.ox.data() + idx);
+    auto oy   = _mm_load_ps(packet.oy.data() + idx);
+    auto oz   = _mm_load_ps(packet.oz.data() + idx);
+    auto dx   = _mm_load_ps(packet.dx.data() + idx);
+    auto dy   = _mm_load_ps(packet.dy.data() + idx);
+    auto dz   = _mm_load_ps(packet.dz.data() + idx);
+    auto t0x  = _mm_mul_ps(_mm_sub_ps(min_x, ox), dx);
+    auto t1x  = _mm_mul_ps(_mm_sub_ps(max_x, ox), dx);
+    auto t0y  = _mm_mul_ps(_mm_sub_ps(min_y, oy), dy);
+    auto t1y  = _mm_mul_ps(_mm_sub_ps(max_y, oy), dy);
+    auto t0z  = _mm_mul_ps(_mm_sub_ps(min_z, oz), dz);
+    auto t1z  = _mm_mul_ps(_mm_sub_ps(max_z, oz), dz);
+    auto tmin = _mm_max_ps(
+        _mm_max_ps(_mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)),
+            _mm_min_ps(t0z, t1z)),
+        _mm_load_ps(packet.tmin.data() + idx));
+    auto tmax = _mm_min_ps(
+        _mm_min_ps(_mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)),
+            _mm_max_ps(t0z, t1z)),
+        _mm_load_ps(packet.tmax.data() + idx));
+    tmax = _mm_mul_ps(tmax, _mm_set1_ps(1.00000024f));
+    hit |= (uint32_t)_mm_movemask_ps(_mm_cmple_ps(tmin, tmax)) << idx;
+  }
+#else
+  for (auto idx = 0; idx < (int)N; idx++) {
+    auto o      = vec3f{packet.ox[idx], packet.oy[idx], packet.oz[idx]};
+    auto dinv   = vec3f{packet.dx[idx], packet.dy[idx], packet.dz[idx]};
+    auto it_min = (bbox.min - o) * dinv;
+    auto it_max = (bbox.max - o) * dinv;
+    auto t0     = max(max(min(it_min, it_max)), packet.tmin[idx]);
+    auto t1     = min(min(max(it_min, it_max)), packet.tmax[idx]);
+    if (t0 <= t1 * 1.00000024f) hit |= 1u << idx;
+  }
+#endif
+  return hit & mask;
+}
+
+// Intersect a packet of rays with a bvh tree, for the rays in `mask`. Nodes
+// are tested only against the rays that reached their parent, and are
+// skipped at once if the packet intervals miss them. Leaves are intersected
+// with `intersect_leaf(start, num, mask)` that returns the mask of the rays
+// that hit, updating their distance. Returns the mask of the rays that hit.
+template <size_t N, typename Intersect>
+static uint32_t intersect_packet(const bvh_tree& bvh,
+    const array<ray3f, N>& rays, uint32_t mask, bool find_any,
+    Intersect&& intersect_leaf) {
+  // prepare rays for fast queries
+  auto packet = make_packet(rays, mask);
+
+  // node stack, with the rays that reached each node
+  auto node_stack        = array<int, 128>{};
+  auto mask_stack        = array<uint32_t, 128>{};
+  auto node_cur          = 0;
+  node_stack[node_cur]   = 0;
+  mask_stack[node_cur++] = mask;
+
+  // shared variables
+  auto hit = 0u;
+
+  // walking stack
+  while (node_cur != 0) {
+    // grab node
+    node_cur -= 1;
+    auto& node      = bvh.nodes[node_stack[node_cur]];
+    auto  node_mask = mask_stack[node_cur] & (find_any ? ~hit : ~0u);
+    if (!node_mask) continue;
+
+    // skip nodes missed by the whole packet, then intersect bbox with the
+    // rays that are still active
+    if (packet.coherent && !intersect_interval(packet, node.bbox)) continue;
+    auto active = intersect_bbox(packet, node.bbox, node_mask);
+    if (!active) continue;
+
+    // intersect node, switching based on node type
+    if (node.internal) {
+      // for internal nodes, attempts to proceed along the split axis from
+      // smallest to largest nodes, using the first active ray
+      auto first = 0;
+      while (!(active & (1u << first))) first += 1;
+      auto& dinv = node.axis == 0   ? packet.dx
+                   : node.axis == 1 ? packet.dy
+                                    : packet.dz;
+      auto reverse           = dinv[first] < 0;
+      node_stack[node_cur]   = node.start + (reverse ? 0 : 1);
+      mask_stack[node_cur++] = active;
+      node_stack[node_cur]   = node.start + (reverse ? 1 : 0);
+      mask_stack[node_cur++] = active;
+    } else {
+      hit |= intersect_leaf(node.start, node.num, active);
+      for (auto idx = 0; idx < (int)N; idx++) {
+        if (active & (1u << idx)) packet.tmax[idx] = rays[idx].tmax;
+      }
+    }
+
+    // check for early exit
+    if (find_any && (hit & mask) == mask) return hit;
+  }
+
+  return hit;
+}
+
+// Intersect a packet of rays with a shape bvh, for the rays in `mask`.
+// Hits that are not opaque for the callback of their ray, if any, are
+// skipped.
+template <size_t N>
+static uint32_t intersect_bvh_packet(const bvh_shape* shape,
+    array<ray3f, N>& rays, uint32_t mask,
+    array<bvh_intersection, N>& intersections, bool find_any,
+    const array<const bvh_opacity_callback*, N>& opacity_cbs, int instance) {
+#ifdef YOCTO_EMBREE
+  // call Embree if needed, one ray at a time
+  if (shape->embree_bvh) {
+    auto hit = 0u;
+    for (auto idx = 0; idx < N; idx++) {
+      if (!(mask & (1u << idx))) continue;
+      auto& intersection = intersections[idx];
+      if (intersect_bvh(shape, rays[idx], intersection.element,
+              intersection.uv, intersection.distance, find_any,
+              opacity_cbs[idx], instance))
+        hit |= 1u << idx;
+    }
+    return hit;
+  }
+#endif
+
+  // check empty
+  if (shape->bvh.nodes.empty()) return 0;
+
+  // compressed trees do not keep the binary tree, so rays are intersected
+  // one at a time
+  if (!shape->bvh.compressed_nodes.empty()) {
+    auto hit = 0u;
+    for (auto idx = 0; idx < (int)N; idx++) {
+      if (!(mask & (1u << idx))) continue;
+      auto& intersection = intersections[idx];
+      if (intersect_bvh(shape, rays[idx], intersection.element,
+              intersection.uv, intersection.distance, find_any,
+              opacity_cbs[idx], instance))
+        hit |= 1u << idx;
+    }
+    return hit;
+  }
+
+  return intersect_packet(
+      shape->bvh, rays, mask, find_any, [&](int start, int num, uint32_t mask) {
+        auto hit = 0u;
+        for (auto idx = 0; idx < (int)N; idx++) {
+          if (!(mask & (1u << idx))) continue;
+          auto& intersection = intersections[idx];
+          if (intersect_elements(shape, start, num, rays[idx],
+                  intersection.element, intersection.uv, intersection.distance,
+                  opacity_cbs[idx], instance))
+            hit |= 1u << idx;
+        }
+        return hit;
+      });
+}
+
+// Intersect a packet of rays with a scene bvh. Rays are transformed once
+// for each instance they reach. Hits that are not opaque for the callback of
+// their ray, if any, are skipped.
+template <size_t N>
+static array<bvh_intersection, N> intersect_bvh_packet(const bvh_scene* scene,
+    const array<ray3f, N>& rays_, bool find_any,
+    const array<const bvh_opacity_callback*, N>& opacity_cbs) {
+  // prepare intersections
+  auto intersections = array<bvh_intersection, N>{};
+
+#ifdef YOCTO_EMBREE
+  // call Embree if needed, one ray at a time
+  if (scene->embree_bvh) {
+    for (auto idx = 0; idx < N; idx++) {
+      auto& intersection = intersections[idx];
+      intersection.hit   = intersect_bvh(scene, rays_[idx],
+          intersection.instance, intersection.element, intersection.uv,
+          intersection.distance, find_any, opacity_cbs[idx]);
+    }
+    return intersections;
+  }
+#endif
+
+  // check empty
+  if (scene->bvh.nodes.empty()) return intersections;
+
+  // copy rays to modify them
+  auto rays = rays_;
+  auto mask = (uint32_t)((1ull << N) - 1);
+
+  // opaque instances are intersected without callbacks
+  auto no_cbs = array<const bvh_opacity_callback*, N>{};
+
+  // intersect
+  auto hit = intersect_packet(
+      scene->bvh, rays, mask, find_any, [&](int start, int num, uint32_t mask) {
+        auto hit = 0u;
+        for (auto prim = start; prim < start + num && mask; prim++) {
+          auto  instance     = scene->bvh.primitives[prim];
+          auto& inv_instance = scene->inverse_instances[instance];
+          auto  inv_rays     = array<ray3f, N>{};
+          auto  inv_mask     = mask;
+          for (auto idx = 0; idx < (int)N; idx++) {
+            if (!(mask & (1u << idx))) continue;
+            auto inv_frame = frame3f{};
+            if (get_inverse_frame(scene, inv_instance, rays[idx], inv_frame)) {
+              inv_rays[idx] = transform_ray(inv_frame, rays[idx]);
+            } else {
+              inv_mask &= ~(1u << idx);
+            }
+          }
+          if (!inv_mask) continue;
+          auto shape_hit = intersect_bvh_packet(
+              scene->shapes[inv_instance.shape], inv_rays, inv_mask,
+              intersections, find_any,
+              inv_instance.opaque ? no_cbs : opacity_cbs, instance);
+          for (auto idx = 0; idx < (int)N; idx++) {
+            if (!(shape_hit & (1u << idx))) continue;
+            intersections[idx].instance = instance;
+            rays[idx].tmax              = intersections[idx].distance;
+          }
+          hit |= shape_hit;
+          if (find_any) mask &= ~shape_hit;
+        }
+        return hit;
+      });
+
+  // set hits
+  for (auto idx = 0; idx < (int)N; idx++)
+    intersections[idx].hit = (hit & (1u << idx)) != 0;
+  return intersections;
+}
+
+// Intersect a packet of rays with a scene bvh.
+template <size_t N>
+array<bvh_intersection, N> intersect_bvh_packet(const bvh_scene* scene,
+    const array<ray3f, N>& rays, bool find_any) {
+  return intersect_bvh_packet(
+      scene, rays, find_any, array<const bvh_opacity_callback*, N>{});
+}
+
+// Explicit instantiations for the supported packet sizes
+template array<bvh_intersection, 4> intersect_bvh_packet(
+    const bvh_scene*, const array<ray3f, 4>&, bool);
+template array<bvh_intersection, 8> intersect_bvh_packet(
+    const bvh_scene*, const array<ray3f, 8>&, bool);
+template array<bvh_intersection, 16> intersect_bvh_packet(
+    const bvh_scene*, const array<ray3f, 16>&, bool);
+
+// Intersect a stream of rays with a bvh. Rays are stably sorted by the
+// octant of their direction, so that rays in a packet traverse children in
+// the same order, and then intersected in packets of 16. Hits that are not
+// opaque for the callback of their ray, given by `opacity_cb`, are skipped.
+template <typename Callback>
+static vector<bvh_intersection> intersect_bvh_stream(const bvh_scene* scene,
+    const vector<ray3f>& rays, bool find_any, Callback&& opacity_cb) {
+  // sort rays by direction octant
+  auto octant = [](const ray3f& ray) {
+    return (ray.d.x < 0 ? 1 : 0) + (ray.d.y < 0 ? 2 : 0) +
+           (ray.d.z < 0 ? 4 : 0);
+  };
+  auto offsets = array<int, 9>{};
+  for (auto& ray : rays) offsets[octant(ray) + 1] += 1;
+  for (auto idx = 1; idx < 9; idx++) offsets[idx] += offsets[idx - 1];
+  auto order = vector<int>(rays.size());
+  for (auto idx = 0; idx < (int)rays.size(); idx++)
+    order[offsets[octant(rays[idx])]++] = idx;
+
+  // intersect packets, padding the last one with copies of its last ray
+  auto intersections = vector<bvh_intersection>(rays.size());
+  for (auto start = 0; start < (int)rays.size(); start += 16) {
+    auto num         = min((int)rays.size() - start, 16);
+    auto packet      = array<ray3f, 16>{};
+    auto opacity_cbs = array<const bvh_opacity_callback*, 16>{};
+    for (auto idx = 0; idx < 16; idx++) {
+      auto ray         = order[start + min(idx, num - 1)];
+      packet[idx]      = rays[ray];
+      opacity_cbs[idx] = opacity_cb(ray);
+    }
+    auto packet_intersections = intersect_bvh_packet(
+        scene, packet, find_any, opacity_cbs);
+    for (auto idx = 0; idx < num; idx++)
+      intersections[order[start + idx]] = packet_intersections[idx];
+  }
+  return intersections;
+}
+
+// Intersect a stream of rays with a bvh.
+vector<bvh_intersection> intersect_bvh_stream(const bvh_scene* scene,
+    const vector<ray3f>& rays, bool find_any) {
+  return intersect_bvh_stream(scene, rays, find_any,
+      [](int) { return (const bvh_opacity_callback*)nullptr; });
+}
+vector<bvh_intersection> intersect_bvh_stream(const bvh_scene* scene,
+    const vector<ray3f>&                rays,
+    const vector<bvh_opacity_callback>& opacity_cbs) {
+  return intersect_bvh_stream(scene, rays, false, [&opacity_cbs](int ray) {
+    return opacity_cbs[ray] ? &opacity_cbs[ray] : nullptr;
+  });
 }
 
 }  // namespace yocto
@@ -1059,6 +3478,97 @@ static bool intersect_bvh(const bvh_scene* scene, int instance,
 // -----------------------------------------------------------------------------
 namespace yocto {
 
+// Overlap a point with the shape elements in a leaf, updating the maximum
+// distance.
+static bool overlap_elements(const bvh_shape* shape, int start, int num,
+    const vec3f& pos, float& max_distance, int& element, vec2f& uv,
+    float& distance) {
+  auto hit     = false;
+  auto ordered = shape->bvh.ordered;
+  if (!shape->points.empty()) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& p = shape->points[ordered ? idx : shape->bvh.primitives[idx]];
+      if (overlap_point(pos, max_distance, shape->positions[p],
+              shape->radius[p], uv, distance)) {
+        hit          = true;
+        element      = shape->bvh.primitives[idx];
+        max_distance = distance;
+      }
+    }
+  } else if (!shape->lines.empty()) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& l = shape->lines[ordered ? idx : shape->bvh.primitives[idx]];
+      if (overlap_line(pos, max_distance, shape->positions[l.x],
+              shape->positions[l.y], shape->radius[l.x], shape->radius[l.y],
+              uv, distance)) {
+        hit          = true;
+        element      = shape->bvh.primitives[idx];
+        max_distance = distance;
+      }
+    }
+  } else if (!shape->triangles.empty()) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& t = shape->triangles[ordered ? idx : shape->bvh.primitives[idx]];
+      if (overlap_triangle(pos, max_distance, shape->positions[t.x],
+              shape->positions[t.y], shape->positions[t.z], shape->radius[t.x],
+              shape->radius[t.y], shape->radius[t.z], uv, distance)) {
+        hit          = true;
+        element      = shape->bvh.primitives[idx];
+        max_distance = distance;
+      }
+    }
+  } else if (!shape->quads.empty()) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& q = shape->quads[ordered ? idx : shape->bvh.primitives[idx]];
+      if (overlap_quad(pos, max_distance, shape->positions[q.x],
+              shape->positions[q.y], shape->positions[q.z],
+              shape->positions[q.w], shape->radius[q.x], shape->radius[q.y],
+              shape->radius[q.z], shape->radius[q.w], uv, distance)) {
+        hit          = true;
+        element      = shape->bvh.primitives[idx];
+        max_distance = distance;
+      }
+    }
+  }
+  return hit;
+}
+
+// Overlap a point with a compressed bvh, decoding children bounds.
+static bool overlap_compressed_bvh(const bvh_shape* shape, const vec3f& pos,
+    float max_distance, int& element, vec2f& uv, float& distance,
+    bool find_any) {
+  // node stack
+  auto& nodes            = shape->bvh.compressed_nodes;
+  auto  node_stack       = array<int, 128>{};
+  auto  node_cur         = 0;
+  node_stack[node_cur++] = 0;
+
+  // hit
+  auto hit = false;
+
+  // walking stack
+  while (node_cur != 0) {
+    // grab node
+    auto& node = nodes[node_stack[--node_cur]];
+
+    // overlap children bounds
+    for (auto idx = 0; idx < 4; idx++) {
+      if (node.start[idx] < 0) continue;
+      if (!overlap_bbox(pos, max_distance, get_child_bbox(node, idx)))
+        continue;
+      if (node.num[idx] == 0) {
+        node_stack[node_cur++] = node.start[idx];
+      } else if (overlap_elements(shape, node.start[idx], node.num[idx], pos,
+                     max_distance, element, uv, distance)) {
+        hit = true;
+        if (find_any) return hit;
+      }
+    }
+  }
+
+  return hit;
+}
+
 // Intersect ray with a bvh.
 static bool overlap_bvh(const bvh_shape* shape, const vec3f& pos,
     float max_distance, int& element, vec2f& uv, float& distance,
@@ -1066,6 +3576,12 @@ static bool overlap_bvh(const bvh_shape* shape, const vec3f& pos,
   // check if empty
   if (shape->bvh.nodes.empty()) return false;
 
+  // use compressed bvh if present
+  if (!shape->bvh.compressed_nodes.empty()) {
+    return overlap_compressed_bvh(
+        shape, pos, max_distance, element, uv, distance, find_any);
+  }
+
   // node stack
   auto node_stack        = array<int, 64>{};
   auto node_cur          = 0;
@@ -1088,55 +3604,9 @@ static bool overlap_bvh(const bvh_shape* shape, const vec3f& pos,
       // internal node
       node_stack[node_cur++] = node.start + 0;
       node_stack[node_cur++] = node.start + 1;
-    } else if (!shape->points.empty()) {
-      for (auto idx = 0; idx < node.num; idx++) {
-        auto  primitive = shape->bvh.primitives[node.start + idx];
-        auto& p         = shape->points[primitive];
-        if (overlap_point(pos, max_distance, shape->positions[p],
-                shape->radius[p], uv, distance)) {
-          hit          = true;
-          element      = primitive;
-          max_distance = distance;
-        }
-      }
-    } else if (!shape->lines.empty()) {
-      for (auto idx = 0; idx < node.num; idx++) {
-        auto  primitive = shape->bvh.primitives[node.start + idx];
-        auto& l         = shape->lines[primitive];
-        if (overlap_line(pos, max_distance, shape->positions[l.x],
-                shape->positions[l.y], shape->radius[l.x], shape->radius[l.y],
-                uv, distance)) {
-          hit          = true;
-          element      = primitive;
-          max_distance = distance;
-        }
-      }
-    } else if (!shape->triangles.empty()) {
-      for (auto idx = 0; idx < node.num; idx++) {
-        auto  primitive = shape->bvh.primitives[node.start + idx];
-        auto& t         = shape->triangles[primitive];
-        if (overlap_triangle(pos, max_distance, shape->positions[t.x],
-                shape->positions[t.y], shape->positions[t.z],
-                shape->radius[t.x], shape->radius[t.y], shape->radius[t.z], uv,
-                distance)) {
-          hit          = true;
-          element      = primitive;
-          max_distance = distance;
-        }
-      }
-    } else if (!shape->quads.empty()) {
-      for (auto idx = 0; idx < node.num; idx++) {
-        auto  primitive = shape->bvh.primitives[node.start + idx];
-        auto& q         = shape->quads[primitive];
-        if (overlap_quad(pos, max_distance, shape->positions[q.x],
-                shape->positions[q.y], shape->positions[q.z],
-                shape->positions[q.w], shape->radius[q.x], shape->radius[q.y],
-                shape->radius[q.z], shape->radius[q.w], uv, distance)) {
-          hit          = true;
-          element      = primitive;
-          max_distance = distance;
-        }
-      }
+    } else if (overlap_elements(shape, node.start, node.num, pos,
+                   max_distance, element, uv, distance)) {
+      hit = true;
     }
 
     // check for early exit
@@ -1149,7 +3619,7 @@ static bool overlap_bvh(const bvh_shape* shape, const vec3f& pos,
 // Intersect ray with a bvh.
 static bool overlap_bvh(const bvh_scene* scene, const vec3f& pos,
     float max_distance, int& instance, int& element, vec2f& uv, float& distance,
-    bool find_any, bool non_rigid_frames) {
+    bool find_any) {
   // check if empty
   if (scene->bvh.nodes.empty()) return false;
 
@@ -1177,12 +3647,11 @@ static bool overlap_bvh(const bvh_scene* scene, const vec3f& pos,
       node_stack[node_cur++] = node.start + 1;
     } else {
       for (auto idx = 0; idx < node.num; idx++) {
-        auto primitive         = scene->bvh.primitives[node.start + idx];
-        auto [frame, shape_id] = scene->instance_cb(primitive);
-        auto shape             = scene->shapes[shape_id];
-        auto inv_pos = transform_point(inverse(frame, non_rigid_frames), pos);
-        if (overlap_bvh(shape, inv_pos, max_distance, element, uv, distance,
-                find_any)) {
+        auto  primitive    = scene->bvh.primitives[node.start + idx];
+        auto& inv_instance = scene->inverse_instances[primitive];
+        auto  inv_pos      = transform_point(inv_instance.frame, pos);
+        if (overlap_bvh(scene->shapes[inv_instance.shape], inv_pos,
+                max_distance, element, uv, distance, find_any)) {
           hit          = true;
           instance     = primitive;
           max_distance = distance;
@@ -1259,28 +3728,65 @@ void overlap_bvh_elems(const bvh_data& bvh1, const bvh_data& bvh2,
 #endif
 
 bvh_intersection intersect_bvh(const bvh_scene* scene, const ray3f& ray,
-    bool find_any, bool non_rigid_frames) {
+    bool find_any, [[maybe_unused]] bool non_rigid_frames) {
   auto intersection = bvh_intersection{};
   intersection.hit  = intersect_bvh(scene, ray, intersection.instance,
-      intersection.element, intersection.uv, intersection.distance, find_any,
-      non_rigid_frames);
+      intersection.element, intersection.uv, intersection.distance, find_any);
   return intersection;
 }
 bvh_intersection intersect_bvh(const bvh_scene* scene, int instance,
-    const ray3f& ray, bool find_any, bool non_rigid_frames) {
+    const ray3f& ray, bool find_any, [[maybe_unused]] bool non_rigid_frames) {
   auto intersection = bvh_intersection{};
   intersection.hit  = intersect_bvh(scene, instance, ray, intersection.element,
-      intersection.uv, intersection.distance, find_any, non_rigid_frames);
+      intersection.uv, intersection.distance, find_any);
   intersection.instance = instance;
   return intersection;
 }
 
+bvh_intersection intersect_bvh(const bvh_scene* scene, const ray3f& ray,
+    const bvh_opacity_callback& opacity_cb) {
+  auto intersection = bvh_intersection{};
+  intersection.hit  = intersect_bvh(scene, ray, intersection.instance,
+      intersection.element, intersection.uv, intersection.distance, false,
+      opacity_cb ? &opacity_cb : nullptr);
+  return intersection;
+}
+bvh_intersection intersect_bvh(const bvh_scene* scene, int instance,
+    const ray3f& ray, const bvh_opacity_callback& opacity_cb) {
+  auto intersection = bvh_intersection{};
+  intersection.hit  = intersect_bvh(scene, instance, ray, intersection.element,
+      intersection.uv, intersection.distance, false,
+      opacity_cb ? &opacity_cb : nullptr);
+  intersection.instance = instance;
+  return intersection;
+}
+
+bool occlude_bvh(const bvh_scene* scene, const ray3f& ray,
+    const bvh_opacity_callback& opacity_cb) {
+  auto instance = -1, element = -1;
+  auto uv       = zero2f;
+  auto distance = 0.0f;
+  return intersect_bvh(scene, ray, instance, element, uv, distance, true,
+      opacity_cb ? &opacity_cb : nullptr);
+}
+
+vector<bool> occlude_bvh_stream(const bvh_scene* scene,
+    const vector<ray3f>& rays, const bvh_opacity_callback& opacity_cb) {
+  auto callback      = opacity_cb ? &opacity_cb : nullptr;
+  auto intersections = intersect_bvh_stream(
+      scene, rays, true, [callback](int) { return callback; });
+  auto occluded = vector<bool>(rays.size(), false);
+  for (auto idx = 0; idx < (int)rays.size(); idx++)
+    occluded[idx] = intersections[idx].hit;
+  return occluded;
+}
+
 bvh_intersection overlap_bvh(const bvh_scene* scene, const vec3f& pos,
-    float max_distance, bool find_any, bool non_rigid_frames) {
+    float max_distance, bool find_any, [[maybe_unused]] bool non_rigid_frames) {
   auto intersection = bvh_intersection{};
   intersection.hit  = overlap_bvh(scene, pos, max_distance,
       intersection.instance, intersection.element, intersection.uv,
-      intersection.distance, find_any, non_rigid_frames);
+      intersection.distance, find_any);
   return intersection;
 }
 
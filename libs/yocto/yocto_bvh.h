@@ -81,13 +81,68 @@ struct bvh_node {
   bool    internal = false;
 };
 
+// Wide BVH node with up to four children, collapsed from the binary tree.
+// Children bounds are stored as separate arrays so that all children can be
+// tested at once. Internal children have `num` zero and `start` set to the
+// index of the child wide node. Leaf children have `num` primitives starting
+// at `start`. Unused children have `start` set to -1.
+struct alignas(16) bvh_node4 {
+  array<float, 4>   min_x = {0, 0, 0, 0};
+  array<float, 4>   min_y = {0, 0, 0, 0};
+  array<float, 4>   min_z = {0, 0, 0, 0};
+  array<float, 4>   max_x = {0, 0, 0, 0};
+  array<float, 4>   max_y = {0, 0, 0, 0};
+  array<float, 4>   max_z = {0, 0, 0, 0};
+  array<int32_t, 4> start = {-1, -1, -1, -1};
+  array<int16_t, 4> num   = {0, 0, 0, 0};
+};
+
+// Compressed wide BVH node with up to four children, laid out as bvh_node4.
+// Children bounds are quantized to 8 bits on a grid over the node bounds,
+// with the grid origin at `origin` and cell sizes of 2^`exponent`. Bounds
+// are rounded outwards, so that decoded children contain the original ones.
+struct alignas(64) bvh_qnode4 {
+  vec3f             origin   = {0, 0, 0};
+  array<int8_t, 3>  exponent = {0, 0, 0};
+  array<uint8_t, 4> min_x    = {0, 0, 0, 0};
+  array<uint8_t, 4> min_y    = {0, 0, 0, 0};
+  array<uint8_t, 4> min_z    = {0, 0, 0, 0};
+  array<uint8_t, 4> max_x    = {0, 0, 0, 0};
+  array<uint8_t, 4> max_y    = {0, 0, 0, 0};
+  array<uint8_t, 4> max_z    = {0, 0, 0, 0};
+  array<int32_t, 4> start    = {-1, -1, -1, -1};
+  array<uint8_t, 4> num      = {0, 0, 0, 0};
+};
+
 // BVH tree stored as a node array with the tree structure is encoded using
 // array indices. BVH nodes indices refer to either the node array,
 // for internal nodes, or the primitive arrays, for leaf nodes.
-// Application data is not stored explicitly.
+// Application data is not stored explicitly. Optionally, the tree is also
+// stored as a wide BVH or a compressed wide BVH, used for ray intersection
+// if present. Compressed shape trees keep only the root in `nodes`, for its
+// bounds. If `ordered` is set, shape elements are stored in leaf order and
+// primitives only map them back to their original indices. The depth of the
+// wide tree sizes the traversal stacks.
 struct bvh_tree {
-  vector<bvh_node> nodes      = {};
-  vector<int>      primitives = {};
+  vector<bvh_node>   nodes            = {};
+  vector<int>        primitives       = {};
+  vector<bvh_node4>  wide_nodes       = {};
+  vector<bvh_qnode4> compressed_nodes = {};
+  int                wide_depth       = 0;
+  bool               ordered          = false;
+};
+
+// Shape elements precomputed for intersection, stored in leaf order with
+// one array per component, so that the elements of a leaf are tested together
+// with unit-stride loads. Component `c` of the element at leaf position `idx`
+// is `data[c * stride + idx]`. Triangles store the first vertex and two
+// edges, quads store the triangles (p0, p1, p3) and (p2, p3, p1) as for
+// triangles, and lines store the first vertex, the segment, its squared
+// length and the two radii. Arrays are padded to load four elements from
+// any leaf.
+struct bvh_precomputed {
+  vector<float> data   = {};
+  int           stride = 0;
 };
 
 // BVH span to give a view over an array
@@ -135,18 +190,75 @@ struct bvh_shape {
 #ifdef YOCTO_EMBREE
   RTCScene embree_bvh = nullptr;
 #endif
+
+  // optional precomputed elements, used for leaf intersection if present
+  bvh_precomputed precomputed = {};
+
   ~bvh_shape();
 };
 
-// instance
+// instance. Moving instances have two or more keyframes, evenly spaced over
+// the time interval [0, 1], that are linearly interpolated at the ray time.
+// Queries that do not support time use `frame` for all instances.
+// Opacity callbacks are only called for hits on instances that are not
+// `opaque`, so instances need updating when their opacity changes.
 struct bvh_instance {
-  frame3f frame = identity3x4f;
-  int     shape = -1;
+  frame3f         frame  = identity3x4f;
+  int             shape  = -1;
+  vector<frame3f> frames = {};
+  bool            opaque = true;
 };
 
 // Callback to get instance properties
 using bvh_instance_callback = function<bvh_instance(int)>;
 
+// Instance data used during traversal, with the world to object frame and
+// the shape id, aligned to a cache line. Moving instances also refer to
+// `num_keyframes` keyframes in the scene, starting at `keyframes`.
+struct alignas(64) bvh_inverse_instance {
+  frame3f frame         = identity3x4f;
+  int     shape         = -1;
+  int     keyframes     = -1;
+  int     num_keyframes = 0;
+  bool    opaque        = true;
+};
+
+// Strategy used to build the bvh
+enum struct bvh_build_type {
+  default_,
+  highquality,
+  middle,
+  balanced,
+  wide,
+  compressed,
+  spatial,
+#ifdef YOCTO_EMBREE
+  embree_default,
+  embree_highquality,
+  embree_compact  // only for copy interface
+#endif
+};
+
+const auto bvh_build_names = vector<string>{
+    "default", "highquality", "middle", "balanced", "wide", "compressed",
+    "spatial",
+#ifdef YOCTO_EMBREE
+    "embree-default", "embree-highquality", "embree-compact"
+#endif
+};
+
+// Bvh parameters. If `precompute` is set, triangles, quads and lines are
+// also stored in leaf order for faster intersection, at the cost of memory.
+// If `cachedir` is set, shape bvhs are loaded from that directory when
+// cached for the same shape content and build type, and saved there
+// otherwise.
+struct bvh_params {
+  bvh_build_type bvh        = bvh_build_type::default_;
+  bool           noparallel = false;
+  bool           precompute = false;
+  string         cachedir   = "";
+};
+
 // BVH data for whole shapes. This interface makes copies of all the data.
 struct bvh_scene {
   // instances and shapes
@@ -155,15 +267,44 @@ struct bvh_scene {
   vector<bvh_instance>  instances_data = {};
   vector<bvh_shape*>    shapes         = {};
 
+  // instance inverses, the instances of each shape and the number of
+  // instances that are not opaque, computed in init_bvh and update_bvh
+  vector<bvh_inverse_instance> inverse_instances = {};
+  vector<vector<int>>          shape_instances   = {};
+  int                          num_cutouts       = 0;
+
+  // keyframes of moving instances and the instance bounds at each keyframe,
+  // used to bound instances at the ray time; tree nodes bound instances
+  // over the whole time interval
+  vector<frame3f> keyframes       = {};
+  vector<bbox3f>  keyframe_bboxes = {};
+
   // nodes
   bvh_tree bvh = {};
 #ifdef YOCTO_EMBREE
   RTCScene embree_bvh = nullptr;
 #endif
+
+  // data for incremental updates, computed when building the scene bvh:
+  // instance bounds, leaf of each instance, parent of each node, and the
+  // sum of node areas weighted by their cost, used to track the SAH cost;
+  // for wide trees, also the wide node holding each instance, the parent
+  // and the unquantized bounds of each wide node
+  bvh_params     params               = {};
+  vector<bbox3f> instance_bboxes      = {};
+  vector<int>    instance_leaves      = {};
+  vector<int>    node_parents         = {};
+  double         weighted_area        = 0;
+  float          build_cost           = 0;
+  vector<int>    instance_wide_leaves = {};
+  vector<int>    wide_parents         = {};
+  vector<bbox3f> wide_bboxes          = {};
+
   ~bvh_scene();
 };
 
-// Set shapes
+// Set shapes. With `as_view`, shape data is referenced instead of copied,
+// except for the elements of compressed trees, which are copied in leaf order.
 int  add_shape(bvh_scene* bvh, const vector<int>& points,
      const vector<vec2i>& lines, const vector<vec3i>& triangles,
      const vector<vec4i>& quads, const vector<vec3f>& positions,
@@ -177,32 +318,6 @@ void set_shape(bvh_scene* bvh, int shape_id, const vector<int>& points,
 void set_instances(bvh_scene* bvh, int num_instances,
     bvh_instance_callback instance_cb, bool as_view = false);
 
-// Strategy used to build the bvh
-enum struct bvh_build_type {
-  default_,
-  highquality,
-  middle,
-  balanced,
-#ifdef YOCTO_EMBREE
-  embree_default,
-  embree_highquality,
-  embree_compact  // only for copy interface
-#endif
-};
-
-const auto bvh_build_names = vector<string>{
-    "default", "highquality", "middle", "balanced",
-#ifdef YOCTO_EMBREE
-    "embree-default", "embree-highquality", "embree-compact"
-#endif
-};
-
-// Bvh parameters
-struct bvh_params {
-  bvh_build_type bvh        = bvh_build_type::default_;
-  bool           noparallel = false;  // only serial momentarily
-};
-
 // Progress report callback
 using progress_callback =
     function<void(const string& message, int current, int total)>;
@@ -211,11 +326,52 @@ using progress_callback =
 void init_bvh(bvh_scene* bvh, const bvh_params& params,
     const progress_callback& progress_cb = {});
 
-// Refit bvh data
+// Refit bvh data, keeping the tree structure, including wide and compressed
+// trees. Shape bvhs are refit entirely, while the scene bvh is refit only
+// along the paths from the updated instances to the root, including the
+// instances of updated shapes. The scene bvh is rebuilt if refitting raises
+// its SAH cost too much, if the number of instances changed, or if the
+// number of keyframes of an updated instance changed.
 void update_bvh(bvh_scene* bvh, const vector<int>& updated_instances,
     const vector<int>&       updated_shapes,
     const progress_callback& progress_cb = {});
 
+// Hash of the shape elements and vertices, used to key cached shape bvhs.
+// Elements are hashed in their stored order, so that shapes with elements
+// reordered by a compressed build hash differently.
+uint64_t hash_bvh_shape(const bvh_shape* bvh);
+
+// Save and load the tree of a shape bvh in a binary format. Arrays are stored
+// raw, at 64-byte aligned offsets after a fixed header, so that files can be
+// mapped in memory. Loading fails if the stored hash or build type differ
+// from the given ones, or if the tree does not match the shape elements.
+bool save_bvh(const string& filename, const bvh_shape* bvh, uint64_t hash,
+    bvh_build_type type, string& error);
+bool load_bvh(const string& filename, bvh_shape* bvh, uint64_t hash,
+    bvh_build_type type, string& error);
+
+// Bvh statistics, used to compare build strategies. The SAH cost is the
+// expected number of node visits and primitive tests for a random ray that
+// hits the scene bounds, including the traversal of the shape bvhs.
+// Compressed trees count visits to their wide nodes. Memory is in bytes and
+// elements are the number of shape elements, counted once per shape.
+struct bvh_stats {
+  int    nodes    = 0;
+  int    leaves   = 0;
+  int    depth    = 0;
+  float  sah_cost = 0;
+  size_t memory   = 0;
+  size_t elements = 0;
+};
+
+// Compute bvh statistics for the scene and shape bvhs.
+bvh_stats get_bvh_stats(const bvh_scene* bvh);
+
+// Memory used by the bvh data, in bytes, excluding shape elements and
+// vertices. The scene memory includes the memory of its shapes.
+size_t get_bvh_memory(const bvh_shape* bvh);
+size_t get_bvh_memory(const bvh_scene* bvh);
+
 // Results of intersect_xxx and overlap_xxx functions that include hit flag,
 // instance id, shape element id, shape element uv and intersection distance.
 // The values are all set for scene intersection. Shape intersection does not
@@ -232,11 +388,68 @@ struct bvh_intersection {
 // Intersect ray with a bvh returning either the first or any intersection
 // depending on `find_any`. Returns the ray distance , the instance id,
 // the shape element index and the element barycentric coordinates.
+// Instance frames are inverted when building the bvh, supporting non-rigid
+// frames, so `non_rigid_frames` is kept only for compatibility. Moving
+// instances are intersected at the ray time, except with Embree bvhs.
 bvh_intersection intersect_bvh(const bvh_scene* bvh, const ray3f& ray,
     bool find_any = false, bool non_rigid_frames = true);
 bvh_intersection intersect_bvh(const bvh_scene* bvh, int instance,
     const ray3f& ray, bool find_any = false, bool non_rigid_frames = true);
 
+// Opacity callback, returning whether the hit of an element of an instance
+// at the given uv and ray distance is opaque. The distance lets callers size
+// texture footprints. Hits that are not opaque are skipped, and traversal
+// continues past them. With spatial split bvhs, the same element may be
+// reported more than once for a ray.
+using bvh_opacity_callback = function<bool(
+    int instance, int element, const vec2f& uv, float distance)>;
+
+// Intersect ray with a bvh returning the first opaque intersection, as
+// determined by `opacity_cb`. This skips cutouts, like foliage, in a single
+// traversal instead of intersecting again from each transparent hit.
+// Scene queries call `opacity_cb` only for instances that are not opaque,
+// while queries on a single instance call it for all hits.
+bvh_intersection intersect_bvh(const bvh_scene* bvh, const ray3f& ray,
+    const bvh_opacity_callback& opacity_cb);
+bvh_intersection intersect_bvh(const bvh_scene* bvh, int instance,
+    const ray3f& ray, const bvh_opacity_callback& opacity_cb);
+
+// Check whether segments, given as rays from `tmin` to `tmax`, are occluded
+// by an opaque element. Traversal visits nodes front to back and stops at the
+// first opaque hit. If `opacity_cb` is not given, all hits are opaque.
+bool occlude_bvh(const bvh_scene* bvh, const ray3f& ray,
+    const bvh_opacity_callback& opacity_cb = {});
+
+// Check occlusion for a batch of segments, returning a flag for each.
+// Segments are tested in packets, as for `intersect_bvh_stream`.
+vector<bool> occlude_bvh_stream(const bvh_scene* bvh,
+    const vector<ray3f>& rays, const bvh_opacity_callback& opacity_cb = {});
+
+// Intersect a packet of rays with a bvh returning either the first or any
+// intersection for each ray, depending on `find_any`. The rays of a packet
+// traverse the bvh together, and each node is tested only against the rays
+// that can still hit it. This is faster than intersecting rays one at a time
+// for coherent rays, like camera rays. Packets of 4, 8 or 16 rays are
+// supported.
+template <size_t N>
+array<bvh_intersection, N> intersect_bvh_packet(const bvh_scene* bvh,
+    const array<ray3f, N>& rays, bool find_any = false);
+
+// Intersect a stream of rays with a bvh returning either the first or any
+// intersection for each ray, depending on `find_any`. Rays are grouped by
+// direction and intersected in packets, so streams should be ordered
+// to keep nearby rays close, as for camera rays in image order.
+vector<bvh_intersection> intersect_bvh_stream(const bvh_scene* bvh,
+    const vector<ray3f>& rays, bool find_any = false);
+
+// Intersect a stream of rays with a bvh returning the first opaque
+// intersection for each ray, as determined by the callback of the ray in
+// `opacity_cbs`, with rays intersected in packets. Empty callbacks make all
+// hits opaque.
+vector<bvh_intersection> intersect_bvh_stream(const bvh_scene* bvh,
+    const vector<ray3f>&                rays,
+    const vector<bvh_opacity_callback>& opacity_cbs);
+
 // Find a shape element that overlaps a point within a given distance
 // max distance, returning either the closest or any overlap depending on
 // `find_any`. Returns the point distance, the instance id, the shape element
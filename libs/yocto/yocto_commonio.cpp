@@ -30,6 +30,7 @@
 #include "yocto_commonio.h"
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <cstdio>
 #include <filesystem>
@@ -39,8 +40,26 @@
 #include <string>
 #include <type_traits>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 // -----------------------------------------------------------------------------
 // USING DIRECTIVES
 // -----------------------------------------------------------------------------
@@ -93,6 +112,25 @@ string format_num(uint64_t num) {
   return std::to_string(rem);
 }
 
+// Get the peak resident memory of the process in bytes
+size_t get_peak_memory() {
+#ifdef _WIN32
+  auto counters = PROCESS_MEMORY_COUNTERS{};
+  if (!K32GetProcessMemoryInfo(
+          GetCurrentProcess(), &counters, sizeof(counters)))
+    return 0;
+  return (size_t)counters.PeakWorkingSetSize;
+#else
+  auto usage = rusage{};
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+  return (size_t)usage.ru_maxrss;
+#else
+  return (size_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
 // Print traces for timing and program debugging
 print_timer print_timed(const string& msg) {
   printf("%s", msg.c_str());
@@ -162,11 +200,13 @@ file_stream open_file(const string& filename, const string& mode) {
 }
 
 // Close a file
-void close_file(file_stream& fs) {
-  if (fs.owned && fs.fs) fclose(fs.fs);
+bool close_file(file_stream& fs) {
+  auto ok = true;
+  if (fs.owned && fs.fs) ok = fclose(fs.fs) == 0;
   fs.filename = "";
   fs.fs       = nullptr;
   fs.owned    = false;
+  return ok;
 }
 
 // Read a line of text
@@ -189,6 +229,118 @@ bool write_data(file_stream& fs, const void* buffer, size_t count) {
   return fwrite(buffer, 1, count, fs.fs) == count;
 }
 
+// Seek to an absolute position in a file, with 64 bit offsets
+bool seek_file(file_stream& fs, uint64_t offset) {
+#ifdef _WIN32
+  return _fseeki64(fs.fs, (int64_t)offset, SEEK_SET) == 0;
+#else
+  return fseeko(fs.fs, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+// Size of a file in bytes, keeping the current position
+bool get_file_size(file_stream& fs, uint64_t& size) {
+#ifdef _WIN32
+  auto position = _ftelli64(fs.fs);
+  if (position < 0 || _fseeki64(fs.fs, 0, SEEK_END) != 0) return false;
+  auto end = _ftelli64(fs.fs);
+  if (end < 0 || _fseeki64(fs.fs, position, SEEK_SET) != 0) return false;
+#else
+  auto position = ftello(fs.fs);
+  if (position < 0 || fseeko(fs.fs, 0, SEEK_END) != 0) return false;
+  auto end = ftello(fs.fs);
+  if (end < 0 || fseeko(fs.fs, position, SEEK_SET) != 0) return false;
+#endif
+  size = (uint64_t)end;
+  return true;
+}
+
+// Name for a temporary file next to `filename`, from the process id and a
+// per-process counter
+string make_temporary_filename(const string& filename) {
+  static auto counter = std::atomic<uint64_t>{0};
+#ifdef _WIN32
+  auto pid = (uint64_t)GetCurrentProcessId();
+#else
+  auto pid = (uint64_t)getpid();
+#endif
+  return filename + ".tmp" + std::to_string(pid) + "-" +
+         std::to_string(counter++);
+}
+
+// Construction from a mapping, that is then owned
+mapped_file::mapped_file(const string& filename, const byte* data, size_t size)
+    : filename{filename}, data{data}, size{size} {}
+
+// Moves transfer the mapping, leaving the source empty
+mapped_file::mapped_file(mapped_file&& other)
+    : filename{std::move(other.filename)}, data{other.data}, size{other.size} {
+  other.data = nullptr;
+  other.size = 0;
+}
+mapped_file& mapped_file::operator=(mapped_file&& other) {
+  if (this == &other) return *this;
+  unmap_file(*this);
+  filename   = std::move(other.filename);
+  data       = other.data;
+  size       = other.size;
+  other.data = nullptr;
+  other.size = 0;
+  return *this;
+}
+
+// Cleanup
+mapped_file::~mapped_file() { unmap_file(*this); }
+
+// Map a file in memory. The file handles are closed right away, since the
+// mapping keeps the file open.
+mapped_file map_file(const string& filename) {
+#ifdef _WIN32
+  auto path8 = std::filesystem::u8path(filename);
+  auto file  = CreateFileW(path8.c_str(), GENERIC_READ, FILE_SHARE_READ,
+      nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE) return {filename, nullptr, 0};
+  auto fsize = LARGE_INTEGER{};
+  if (!GetFileSizeEx(file, &fsize) || fsize.QuadPart == 0) {
+    CloseHandle(file);
+    return {filename, nullptr, 0};
+  }
+  auto mapping = CreateFileMappingW(
+      file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  CloseHandle(file);
+  if (!mapping) return {filename, nullptr, 0};
+  auto data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(mapping);
+  if (!data) return {filename, nullptr, 0};
+  return {filename, (const byte*)data, (size_t)fsize.QuadPart};
+#else
+  auto fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) return {filename, nullptr, 0};
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size == 0) {
+    close(fd);
+    return {filename, nullptr, 0};
+  }
+  auto size = (size_t)info.st_size;
+  auto data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return {filename, nullptr, 0};
+  return {filename, (const byte*)data, size};
+#endif
+}
+
+// Unmap a file
+void unmap_file(mapped_file& mf) {
+#ifdef _WIN32
+  if (mf.data) UnmapViewOfFile(mf.data);
+#else
+  if (mf.data) munmap((void*)mf.data, mf.size);
+#endif
+  mf.filename = "";
+  mf.data     = nullptr;
+  mf.size     = 0;
+}
+
 // Opens a file with a utf8 file name
 FILE* fopen_utf8(const char* filename, const char* mode) {
 #ifdef _WIN32
@@ -416,13 +568,16 @@ string get_usage(const cli_state& cli) {
     auto str = string{};
     str += "<";
     if (option.nargs < 0) str += "[";
-    if (!option.choices.empty()) str += "string";
-    switch (option.type) {
-      case cli_type::integer: str += "integer"; break;
-      case cli_type::uinteger: str += "uinteger"; break;
-      case cli_type::number: str += "number"; break;
-      case cli_type::string: str += "string"; break;
-      case cli_type::boolean: str += "boolean"; break;
+    if (!option.choices.empty()) {
+      str += "string";
+    } else {
+      switch (option.type) {
+        case cli_type::integer: str += "integer"; break;
+        case cli_type::uinteger: str += "uinteger"; break;
+        case cli_type::number: str += "number"; break;
+        case cli_type::string: str += "string"; break;
+        case cli_type::boolean: str += "boolean"; break;
+      }
     }
     if (option.nargs < 0) str += "]";
     str += ">";
@@ -90,6 +90,9 @@ string format_duration(int64_t duration);
 // Format a large integer number in human readable form
 string format_num(uint64_t num);
 
+// Get the peak resident memory of the process in bytes, or 0 if unknown
+size_t get_peak_memory();
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -240,8 +243,8 @@ struct file_stream {
 // Open a file
 file_stream open_file(const string& filename, const string& mode);
 
-// Close a file
-void close_file(file_stream& fs);
+// Close a file, returning whether buffered data was written successfully
+bool close_file(file_stream& fs);
 
 // Read a line of text
 bool read_line(file_stream& fs, char* buffer, size_t size);
@@ -261,6 +264,17 @@ bool read_data(file_stream& fs, void* buffer, size_t count);
 // Write data from a file
 bool write_data(file_stream& fs, const void* buffer, size_t count);
 
+// Seek to an absolute position in a file, with 64 bit offsets
+bool seek_file(file_stream& fs, uint64_t offset);
+
+// Size of a file in bytes, keeping the current position. Returns false on
+// error.
+bool get_file_size(file_stream& fs, uint64_t& size);
+
+// Name for a temporary file next to `filename`, unique across processes and
+// calls, used to write files that are renamed once complete
+string make_temporary_filename(const string& filename);
+
 // Read data from a file
 template <typename T>
 inline bool read_value(file_stream& fs, T& buffer) {
@@ -315,6 +329,33 @@ inline bool write_value(file_stream& fs, const T& value_, bool big_endian) {
 // Opens a file with a utf8 file name
 FILE* fopen_utf8(const char* filename, const char* mode);
 
+// Read-only memory mapping of a file. Pages are loaded on access and are
+// shared with the os file cache, so large files are not copied on load.
+struct mapped_file {
+  // file parameters
+  string      filename = "";
+  const byte* data     = nullptr;
+  size_t      size     = 0;
+
+  // move-only type, where moves leave the source empty
+  mapped_file() = default;
+  mapped_file(const string& filename, const byte* data, size_t size);
+  mapped_file(const mapped_file&) = delete;
+  mapped_file& operator=(const mapped_file&) = delete;
+  mapped_file(mapped_file&& other);
+  mapped_file& operator=(mapped_file&& other);
+  ~mapped_file();
+
+  // operator bool to check for error
+  explicit operator bool() const { return data != nullptr; }
+};
+
+// Map a file in memory. Empty files cannot be mapped.
+mapped_file map_file(const string& filename);
+
+// Unmap a file
+void unmap_file(mapped_file& mf);
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -450,6 +491,9 @@ inline cli_type get_cli_type() {
   if constexpr (std::is_floating_point_v<T>) {
     return cli_type::number;
   }
+  if constexpr (std::is_enum_v<T>) {
+    return cli_type::integer;
+  }
   return cli_type::string;
 }
 
@@ -470,6 +514,8 @@ inline void set_value(cli_value& cvalue, const T& value) {
     cvalue.uinteger = value;
   } else if constexpr (std::is_floating_point_v<T>) {
     cvalue.number = value;
+  } else if constexpr (std::is_enum_v<T>) {
+    cvalue.integer = (int)value;
   } else {
     // pass
   }
@@ -501,6 +547,10 @@ inline bool get_value(const cli_value& cvalue, T& value) {
     if (cvalue.type != cli_type::number) return false;
     value = (T)cvalue.number;
     return true;
+  } else if constexpr (std::is_enum_v<T>) {
+    if (cvalue.type != cli_type::integer) return false;
+    value = (T)cvalue.integer;
+    return true;
   } else {
     return false;
   }
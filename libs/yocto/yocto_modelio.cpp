@@ -28,8 +28,11 @@
 
 #include "yocto_modelio.h"
 
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
 #include <filesystem>
+#include <limits>
 #include <memory>
 #include <stdexcept>
 #include <string_view>
@@ -39,6 +42,7 @@
 
 #include "yocto_color.h"
 #include "yocto_commonio.h"
+#include "yocto_parallel.h"
 
 // -----------------------------------------------------------------------------
 // USING DIRECTIVES
@@ -163,10 +167,28 @@ inline bool parse_value(string_view& str, int16_t& value) {
   return true;
 }
 inline bool parse_value(string_view& str, int32_t& value) {
-  char* end = nullptr;
-  value     = (int32_t)strtol(str.data(), &end, 10);
-  if (str.data() == end) return false;
-  str.remove_prefix(end - str.data());
+  // decimal integers are parsed directly, without reading past the view
+  auto ptr = str.data(), end = str.data() + str.size();
+  while (ptr != end && is_space(*ptr)) ptr++;
+  auto negative = ptr != end && *ptr == '-';
+  if (ptr != end && (*ptr == '-' || *ptr == '+')) ptr++;
+  auto number = (int64_t)0;
+  auto digits = 0;
+  for (; ptr != end && *ptr >= '0' && *ptr <= '9' && digits < 18; ptr++) {
+    number = number * 10 + (*ptr - '0');
+    digits++;
+  }
+  if (digits > 0 && digits < 18) {
+    value = (int32_t)(negative ? -number : number);
+    str.remove_prefix(ptr - str.data());
+    return true;
+  }
+  // other cases use a null-terminated copy
+  auto copy  = string{str};
+  char* cend = nullptr;
+  value      = (int32_t)strtol(copy.c_str(), &cend, 10);
+  if (copy.c_str() == cend) return false;
+  str.remove_prefix(cend - copy.c_str());
   return true;
 }
 inline bool parse_value(string_view& str, int64_t& value) {
@@ -204,11 +226,72 @@ inline bool parse_value(string_view& str, uint64_t& value) {
   str.remove_prefix(end - str.data());
   return true;
 }
+// Floats are parsed without locale and without reading past the view. Decimal
+// numbers with up to 19 significant digits and small exponents are computed
+// with a single rounded double operation, and then rounded to float. This
+// matches strtof, except when the double lands exactly halfway between two
+// floats. That case, and all other syntaxes, use strtof on a copy.
 inline bool parse_value(string_view& str, float& value) {
-  char* end = nullptr;
-  value     = strtof(str.data(), &end);
-  if (str.data() == end) return false;
-  str.remove_prefix(end - str.data());
+  static const double powers[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+      1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19,
+      1e20, 1e21, 1e22};
+  auto ptr = str.data(), end = str.data() + str.size();
+  while (ptr != end && is_space(*ptr)) ptr++;
+  auto negative = ptr != end && *ptr == '-';
+  if (ptr != end && (*ptr == '-' || *ptr == '+')) ptr++;
+  auto mantissa = (uint64_t)0;
+  auto digits = 0, exponent = 0, significant = 0;
+  for (; ptr != end && *ptr >= '0' && *ptr <= '9'; ptr++, digits++) {
+    mantissa = mantissa * 10 + (*ptr - '0');
+    if (mantissa != 0) significant++;
+  }
+  if (ptr != end && *ptr == '.') {
+    for (ptr++; ptr != end && *ptr >= '0' && *ptr <= '9'; ptr++, digits++) {
+      mantissa = mantissa * 10 + (*ptr - '0');
+      if (mantissa != 0) significant++;
+      exponent--;
+    }
+  }
+  if (ptr != end && (*ptr == 'e' || *ptr == 'E')) {
+    auto eptr      = ptr + 1;
+    auto enegative = eptr != end && *eptr == '-';
+    if (eptr != end && (*eptr == '-' || *eptr == '+')) eptr++;
+    auto evalue = 0, edigits = 0;
+    for (; eptr != end && *eptr >= '0' && *eptr <= '9'; eptr++, edigits++) {
+      if (evalue < 10000) evalue = evalue * 10 + (*eptr - '0');
+    }
+    if (edigits > 0) {
+      exponent += enegative ? -evalue : evalue;
+      ptr = eptr;
+    }
+  }
+  auto fast = digits > 0 && significant <= 19 &&
+              (ptr == end || (*ptr != 'x' && *ptr != 'X'));
+  if (fast && mantissa == 0) {
+    value = negative ? -0.0f : 0.0f;
+    str.remove_prefix(ptr - str.data());
+    return true;
+  }
+  if (fast && mantissa < ((uint64_t)1 << 53) && exponent >= -22 &&
+      exponent <= 22) {
+    auto result = exponent < 0 ? (double)mantissa / powers[-exponent]
+                               : (double)mantissa * powers[exponent];
+    auto bits   = (uint64_t)0;
+    memcpy(&bits, &result, sizeof(bits));
+    auto halfway = (bits & 0x1fffffff) == 0x10000000;
+    if (!halfway && result >= (double)std::numeric_limits<float>::min() &&
+        result <= (double)std::numeric_limits<float>::max()) {
+      value = (float)(negative ? -result : result);
+      str.remove_prefix(ptr - str.data());
+      return true;
+    }
+  }
+  // other cases use a null-terminated copy
+  auto copy  = string{str};
+  char* cend = nullptr;
+  value      = strtof(copy.c_str(), &cend);
+  if (copy.c_str() == cend) return false;
+  str.remove_prefix(cend - copy.c_str());
   return true;
 }
 inline bool parse_value(string_view& str, double& value) {
@@ -274,8 +357,216 @@ ply_model::~ply_model() {
   for (auto element : elements) delete element;
 }
 
-// Load ply
-bool load_ply(const string& filename, ply_model* ply, string& error) {
+// Size of ply types in bytes
+static size_t get_ply_type_size(ply_type type) {
+  switch (type) {
+    case ply_type::i8: return 1;
+    case ply_type::i16: return 2;
+    case ply_type::i32: return 4;
+    case ply_type::i64: return 8;
+    case ply_type::u8: return 1;
+    case ply_type::u16: return 2;
+    case ply_type::u32: return 4;
+    case ply_type::u64: return 8;
+    case ply_type::f32: return 4;
+    case ply_type::f64: return 8;
+    default: return 0;
+  }
+}
+
+// Grow the data of a ply property by `count` values, returning their bytes
+static byte* append_ply_values(ply_property* prop, size_t count) {
+  auto append = [count](auto& data) {
+    data.resize(data.size() + count);
+    return (byte*)(data.data() + data.size() - count);
+  };
+  switch (prop->type) {
+    case ply_type::i8: return append(prop->data_i8);
+    case ply_type::i16: return append(prop->data_i16);
+    case ply_type::i32: return append(prop->data_i32);
+    case ply_type::i64: return append(prop->data_i64);
+    case ply_type::u8: return append(prop->data_u8);
+    case ply_type::u16: return append(prop->data_u16);
+    case ply_type::u32: return append(prop->data_u32);
+    case ply_type::u64: return append(prop->data_u64);
+    case ply_type::f32: return append(prop->data_f32);
+    case ply_type::f64: return append(prop->data_f64);
+    default: return nullptr;
+  }
+}
+
+// Copy `count` values of `size` bytes, spaced by `stride` bytes in `data`,
+// swapping their bytes for big endian files
+template <size_t size>
+static void copy_ply_values(byte* values, const byte* data, size_t count,
+    size_t stride, bool big_endian) {
+  for (auto idx = (size_t)0; idx < count; idx++) {
+    auto value = values + idx * size;
+    memcpy(value, data + idx * stride, size);
+    if (big_endian) std::reverse(value, value + size);
+  }
+}
+static void copy_ply_values(byte* values, const byte* data, size_t size,
+    size_t count, size_t stride, bool big_endian) {
+  if (!big_endian && size == stride) {
+    memcpy(values, data, size * count);
+    return;
+  }
+  switch (size) {
+    case 1: copy_ply_values<1>(values, data, count, stride, big_endian); break;
+    case 2: copy_ply_values<2>(values, data, count, stride, big_endian); break;
+    case 4: copy_ply_values<4>(values, data, count, stride, big_endian); break;
+    case 8: copy_ply_values<8>(values, data, count, stride, big_endian); break;
+  }
+}
+
+// Buffer for the body of binary ply files, read in large blocks
+struct ply_buffer {
+  vector<byte> data = vector<byte>(1 << 24);
+  size_t       pos  = 0;
+  size_t       size = 0;
+};
+
+// Buffer at least `count` bytes, if the file has them, and returns the
+// number of bytes buffered
+static size_t fill_ply_buffer(
+    file_stream& fs, ply_buffer& buffer, size_t count) {
+  if (buffer.size - buffer.pos >= count) return buffer.size - buffer.pos;
+  memmove(buffer.data.data(), buffer.data.data() + buffer.pos,
+      buffer.size - buffer.pos);
+  buffer.size -= buffer.pos;
+  buffer.pos = 0;
+  if (count > buffer.data.size()) buffer.data.resize(count);
+  buffer.size += fread(buffer.data.data() + buffer.size, 1,
+      buffer.data.size() - buffer.size, fs.fs);
+  return buffer.size;
+}
+
+// Read the body of binary ply files, of `remaining` bytes. Elements without
+// lists are decoded one property at a time over all the elements buffered,
+// after checking that the file holds them, so that corrupted counts are not
+// allocated. Elements with lists are scanned first, to size the property
+// data, and then decoded.
+static bool read_ply_body(file_stream& fs, ply_model* ply, size_t remaining) {
+  auto big_endian = ply->format == ply_format::binary_big_endian;
+  auto buffer     = ply_buffer{};
+  auto values     = vector<byte*>{};
+  auto lengths    = vector<uint8_t*>{};
+  auto counts     = vector<size_t>{};
+  for (auto elem : ply->elements) {
+    auto& props = elem->properties;
+    auto  sizes = vector<size_t>{};
+    for (auto prop : props) sizes.push_back(get_ply_type_size(prop->type));
+    auto has_lists = std::any_of(
+        props.begin(), props.end(), [](auto prop) { return prop->is_list; });
+
+    if (!has_lists) {
+      // fixed layout
+      auto stride = (size_t)0;
+      for (auto size : sizes) stride += size;
+      if (stride == 0) continue;
+      if (elem->count > remaining / stride) return false;
+      remaining -= elem->count * stride;
+      values.clear();
+      for (auto prop : props)
+        values.push_back(append_ply_values(prop, elem->count));
+      for (auto start = (size_t)0; start < elem->count;) {
+        auto available = fill_ply_buffer(fs, buffer, stride);
+        if (available < stride) return false;
+        auto count  = std::min(elem->count - start, available / stride);
+        auto data   = buffer.data.data() + buffer.pos;
+        auto offset = (size_t)0;
+        for (auto idx = (size_t)0; idx < props.size(); idx++) {
+          copy_ply_values(values[idx] + start * sizes[idx], data + offset,
+              sizes[idx], count, stride, big_endian);
+          offset += sizes[idx];
+        }
+        buffer.pos += count * stride;
+        start += count;
+      }
+    } else {
+      // buffer at least one element of maximum size
+      auto max_size = (size_t)0;
+      for (auto idx = (size_t)0; idx < props.size(); idx++)
+        max_size += props[idx]->is_list ? 1 + 255 * sizes[idx] : sizes[idx];
+      for (auto start = (size_t)0; start < elem->count;) {
+        auto available = fill_ply_buffer(fs, buffer, max_size);
+        auto data      = buffer.data.data() + buffer.pos;
+        // count the elements and list values in the buffer
+        auto count = (size_t)0, used = (size_t)0;
+        counts.assign(props.size(), 0);
+        while (start + count < elem->count) {
+          auto size = (size_t)0;
+          for (auto idx = (size_t)0; idx < props.size(); idx++) {
+            if (!props[idx]->is_list) {
+              size += sizes[idx];
+            } else if (used + size < available) {
+              size += 1 + data[used + size] * sizes[idx];
+            } else {
+              size = available + 1;
+              break;
+            }
+          }
+          if (used + size > available) break;
+          for (auto idx = (size_t)0, pos = used; idx < props.size(); idx++) {
+            if (props[idx]->is_list) {
+              counts[idx] += data[pos];
+              pos += 1 + data[pos] * sizes[idx];
+            } else {
+              pos += sizes[idx];
+            }
+          }
+          used += size;
+          count += 1;
+        }
+        if (count == 0) return false;
+        // decode the elements
+        values.clear();
+        lengths.clear();
+        for (auto idx = (size_t)0; idx < props.size(); idx++) {
+          auto prop = props[idx];
+          values.push_back(append_ply_values(
+              prop, prop->is_list ? counts[idx] : count));
+          if (prop->is_list) {
+            auto& ldata = prop->ldata_u8;
+            ldata.resize(ldata.size() + count);
+            lengths.push_back(ldata.data() + ldata.size() - count);
+          } else {
+            lengths.push_back(nullptr);
+          }
+        }
+        auto ptr = data;
+        for (auto element = (size_t)0; element < count; element++) {
+          for (auto idx = (size_t)0; idx < props.size(); idx++) {
+            auto prop = props[idx];
+            if (prop->is_list) {
+              auto length     = (size_t)*ptr++;
+              *lengths[idx]++ = (uint8_t)length;
+              copy_ply_values(
+                  values[idx], ptr, sizes[idx], length, sizes[idx], big_endian);
+              values[idx] += length * sizes[idx];
+              ptr += length * sizes[idx];
+            } else {
+              copy_ply_values(
+                  values[idx], ptr, sizes[idx], 1, sizes[idx], big_endian);
+              values[idx] += sizes[idx];
+              ptr += sizes[idx];
+            }
+          }
+        }
+        buffer.pos += used;
+        remaining -= std::min(used, remaining);
+        start += count;
+      }
+    }
+  }
+  return true;
+}
+
+// Parse a ply header, reading lines with `read_line(string_view&)` until
+// `end_header`. Used by both the streamed and the mapped loaders.
+template <typename ReadLine>
+static bool read_ply_header(ply_model* ply, ReadLine&& read_line) {
   // ply type names
   static auto type_map = unordered_map<string, ply_type>{{"char", ply_type::i8},
       {"short", ply_type::i16}, {"int", ply_type::i32}, {"long", ply_type::i64},
@@ -288,59 +579,35 @@ bool load_ply(const string& filename, ply_model* ply, string& error) {
       {"uint32", ply_type::u32}, {"uint64", ply_type::u64},
       {"float32", ply_type::f32}, {"float64", ply_type::f64}};
 
-  // initialize data
-  ply->comments.clear();
-  ply->elements.clear();
-
-  // error helpers
-  auto open_error = [filename, &error]() {
-    error = filename + ": file not found";
-    return false;
-  };
-  auto parse_error = [filename, &error]() {
-    error = filename + ": parse error";
-    return false;
-  };
-  auto read_error = [filename, &error]() {
-    error = filename + ": read error";
-    return false;
-  };
-
-  // open file
-  auto fs = open_file(filename, "rb");
-  if (!fs) return open_error();
-
   // parsing checks
   auto first_line = true;
-  auto end_header = false;
 
   // read header ---------------------------------------------
-  auto buffer = array<char, 4096>{};
-  while (read_line(fs, buffer)) {
+  auto str = string_view{};
+  while (read_line(str)) {
     // str
-    auto str = string_view{buffer.data()};
     remove_comment(str);
     skip_whitespace(str);
     if (str.empty()) continue;
 
     // get command
     auto cmd = ""s;
-    if (!parse_value(str, cmd)) return parse_error();
+    if (!parse_value(str, cmd)) return false;
     if (cmd.empty()) continue;
 
     // check magic number
     if (first_line) {
-      if (cmd != "ply") return parse_error();
+      if (cmd != "ply") return false;
       first_line = false;
       continue;
     }
 
     // possible token values
     if (cmd == "ply") {
-      if (!first_line) return parse_error();
+      if (!first_line) return false;
     } else if (cmd == "format") {
       auto fmt = ""s;
-      if (!parse_value(str, fmt)) return parse_error();
+      if (!parse_value(str, fmt)) return false;
       if (fmt == "ascii") {
         ply->format = ply_format::ascii;
       } else if (fmt == "binary_little_endian") {
@@ -348,7 +615,7 @@ bool load_ply(const string& filename, ply_model* ply, string& error) {
       } else if (fmt == "binary_big_endian") {
         ply->format = ply_format::binary_big_endian;
       } else {
-        return parse_error();
+        return false;
       }
     } else if (cmd == "comment") {
       skip_whitespace(str);
@@ -358,43 +625,86 @@ bool load_ply(const string& filename, ply_model* ply, string& error) {
       // comment is the rest of the str
     } else if (cmd == "element") {
       auto elem = ply->elements.emplace_back(new ply_element{});
-      if (!parse_value(str, elem->name)) return parse_error();
-      if (!parse_value(str, elem->count)) return parse_error();
+      if (!parse_value(str, elem->name)) return false;
+      if (!parse_value(str, elem->count)) return false;
     } else if (cmd == "property") {
-      if (ply->elements.empty()) return parse_error();
+      if (ply->elements.empty()) return false;
       auto prop = ply->elements.back()->properties.emplace_back(
           new ply_property{});
       auto tname = ""s;
-      if (!parse_value(str, tname)) return parse_error();
+      if (!parse_value(str, tname)) return false;
       if (tname == "list") {
         prop->is_list = true;
-        if (!parse_value(str, tname)) return parse_error();
+        if (!parse_value(str, tname)) return false;
         auto itype = type_map.at(tname);
-        if (itype != ply_type::u8) return parse_error();
-        if (!parse_value(str, tname)) return parse_error();
-        if (type_map.find(tname) == type_map.end()) return parse_error();
+        if (itype != ply_type::u8) return false;
+        if (!parse_value(str, tname)) return false;
+        if (type_map.find(tname) == type_map.end()) return false;
         prop->type = type_map.at(tname);
       } else {
         prop->is_list = false;
-        if (type_map.find(tname) == type_map.end()) return parse_error();
+        if (type_map.find(tname) == type_map.end()) return false;
         prop->type = type_map.at(tname);
       }
-      if (!parse_value(str, prop->name)) return parse_error();
+      if (!parse_value(str, prop->name)) return false;
     } else if (cmd == "end_header") {
-      end_header = true;
-      break;
+      return true;
     } else {
-      return parse_error();
+      return false;
     }
   }
 
-  // check exit
-  if (!end_header) return parse_error();
+  // missing end_header
+  return false;
+}
+
+// Load ply
+bool load_ply(const string& filename, ply_model* ply, string& error) {
+  // initialize data
+  ply->comments.clear();
+  ply->elements.clear();
+
+  // error helpers
+  auto open_error = [filename, &error]() {
+    error = filename + ": file not found";
+    return false;
+  };
+  auto parse_error = [filename, &error]() {
+    error = filename + ": parse error";
+    return false;
+  };
+  auto read_error = [filename, &error]() {
+    error = filename + ": read error";
+    return false;
+  };
+
+  // open file
+  auto fs = open_file(filename, "rb");
+  if (!fs) return open_error();
+
+  // read header
+  auto buffer      = array<char, 4096>{};
+  auto header_size = (size_t)0;
+  auto read_header = [&fs, &buffer, &header_size](string_view& str) {
+    if (!read_line(fs, buffer)) return false;
+    str = string_view{buffer.data()};
+    header_size += str.size();
+    return true;
+  };
+  if (!read_ply_header(ply, read_header)) return parse_error();
+
+  // bytes left for the body, used to bound allocations since each value
+  // takes at least one byte
+  auto file_size = (uint64_t)0;
+  if (!get_file_size(fs, file_size)) return read_error();
+  auto remaining = file_size > header_size ? (size_t)(file_size - header_size)
+                                           : (size_t)0;
 
   // allocate data ---------------------------------
   for (auto element : ply->elements) {
     for (auto property : element->properties) {
-      auto count = property->is_list ? element->count * 3 : element->count;
+      auto count = std::min(
+          property->is_list ? element->count * 3 : element->count, remaining);
       switch (property->type) {
         case ply_type::i8: property->data_i8.reserve(count); break;
         case ply_type::i16: property->data_i16.reserve(count); break;
@@ -407,7 +717,8 @@ bool load_ply(const string& filename, ply_model* ply, string& error) {
         case ply_type::f32: property->data_f32.reserve(count); break;
         case ply_type::f64: property->data_f64.reserve(count); break;
       }
-      if (property->is_list) property->ldata_u8.reserve(element->count);
+      if (property->is_list)
+        property->ldata_u8.reserve(std::min(element->count, remaining));
     }
   }
 
@@ -472,62 +783,7 @@ bool load_ply(const string& filename, ply_model* ply, string& error) {
       }
     }
   } else {
-    auto big_endian = ply->format == ply_format::binary_big_endian;
-    for (auto elem : ply->elements) {
-      for (auto idx = 0; idx < elem->count; idx++) {
-        for (auto prop : elem->properties) {
-          if (prop->is_list) {
-            if (!read_value(fs, prop->ldata_u8.emplace_back(), big_endian))
-              return read_error();
-          }
-          auto vcount = prop->is_list ? prop->ldata_u8.back() : 1;
-          for (auto i = 0; i < vcount; i++) {
-            switch (prop->type) {
-              case ply_type::i8:
-                if (!read_value(fs, prop->data_i8.emplace_back(), big_endian))
-                  return read_error();
-                break;
-              case ply_type::i16:
-                if (!read_value(fs, prop->data_i16.emplace_back(), big_endian))
-                  return read_error();
-                break;
-              case ply_type::i32:
-                if (!read_value(fs, prop->data_i32.emplace_back(), big_endian))
-                  return read_error();
-                break;
-              case ply_type::i64:
-                if (!read_value(fs, prop->data_i64.emplace_back(), big_endian))
-                  return read_error();
-                break;
-              case ply_type::u8:
-                if (!read_value(fs, prop->data_u8.emplace_back(), big_endian))
-                  return read_error();
-                break;
-              case ply_type::u16:
-                if (!read_value(fs, prop->data_u16.emplace_back(), big_endian))
-                  return read_error();
-                break;
-              case ply_type::u32:
-                if (!read_value(fs, prop->data_u32.emplace_back(), big_endian))
-                  return read_error();
-                break;
-              case ply_type::u64:
-                if (!read_value(fs, prop->data_u64.emplace_back(), big_endian))
-                  return read_error();
-                break;
-              case ply_type::f32:
-                if (!read_value(fs, prop->data_f32.emplace_back(), big_endian))
-                  return read_error();
-                break;
-              case ply_type::f64:
-                if (!read_value(fs, prop->data_f64.emplace_back(), big_endian))
-                  return read_error();
-                break;
-            }
-          }
-        }
-      }
-    }
+    if (!read_ply_body(fs, ply, remaining)) return read_error();
   }
   return true;
 }
@@ -959,6 +1215,334 @@ bool has_quads(ply_model* ply) {
   return false;
 }
 
+// Data of an element in a mapped binary ply. Elements without lists have a
+// fixed stride and property offsets. Elements with lists keep a histogram of
+// the list lengths of each property, used to size the output buffers.
+struct ply_mapped_element {
+  const byte*                data    = nullptr;
+  size_t                     stride  = 0;
+  vector<size_t>             offsets = {};
+  vector<array<size_t, 256>> lengths = {};
+};
+
+// Locate the elements of a mapped binary ply, checking that the file has
+// enough data for all of them
+static bool map_ply_elements(ply_model* ply, const byte* data, size_t size,
+    vector<ply_mapped_element>& mapped) {
+  mapped.clear();
+  auto pos = (size_t)0;
+  for (auto elem : ply->elements) {
+    auto& props = elem->properties;
+    auto& melem = mapped.emplace_back();
+    melem.data  = data + pos;
+    auto sizes  = vector<size_t>{};
+    for (auto prop : props) sizes.push_back(get_ply_type_size(prop->type));
+    auto has_lists = std::any_of(
+        props.begin(), props.end(), [](auto prop) { return prop->is_list; });
+    if (!has_lists) {
+      for (auto idx = (size_t)0; idx < props.size(); idx++) {
+        melem.offsets.push_back(melem.stride);
+        melem.stride += sizes[idx];
+      }
+      if (melem.stride == 0) continue;
+      if (elem->count > (size - pos) / melem.stride) return false;
+      pos += elem->count * melem.stride;
+    } else {
+      melem.lengths.assign(props.size(), {});
+      for (auto element = (size_t)0; element < elem->count; element++) {
+        for (auto idx = (size_t)0; idx < props.size(); idx++) {
+          if (props[idx]->is_list) {
+            if (pos >= size) return false;
+            auto length = (size_t)data[pos];
+            melem.lengths[idx][length] += 1;
+            pos += 1 + length * sizes[idx];
+          } else {
+            pos += sizes[idx];
+          }
+        }
+        if (pos > size) return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Find a property by element and property name, as in `get_property()`
+static bool find_ply_property(ply_model* ply, const string& element,
+    const string& property, size_t& element_id, size_t& property_id) {
+  for (auto eidx = (size_t)0; eidx < ply->elements.size(); eidx++) {
+    auto elem = ply->elements[eidx];
+    if (elem->name != element) continue;
+    for (auto pidx = (size_t)0; pidx < elem->properties.size(); pidx++) {
+      if (elem->properties[pidx]->name != property) continue;
+      element_id  = eidx;
+      property_id = pidx;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Decode `count` values of a ply type, spaced by `stride` bytes in `data`,
+// into `values`, spaced by `components` values
+template <typename T>
+static void decode_ply_values(T* values, size_t components, const byte* data,
+    ply_type type, size_t count, size_t stride) {
+  auto decode = [&](auto value) {
+    for (auto idx = (size_t)0; idx < count; idx++) {
+      memcpy(&value, data + idx * stride, sizeof(value));
+      values[idx * components] = (T)value;
+    }
+  };
+  switch (type) {
+    case ply_type::i8: decode(int8_t{}); break;
+    case ply_type::i16: decode(int16_t{}); break;
+    case ply_type::i32: decode(int32_t{}); break;
+    case ply_type::i64: decode(int64_t{}); break;
+    case ply_type::u8: decode(uint8_t{}); break;
+    case ply_type::u16: decode(uint16_t{}); break;
+    case ply_type::u32: decode(uint32_t{}); break;
+    case ply_type::u64: decode(uint64_t{}); break;
+    case ply_type::f32: decode(float{}); break;
+    case ply_type::f64: decode(double{}); break;
+  }
+}
+
+// Decode properties of an element without lists into vectors of N floats.
+// Consecutive float properties that span the whole element are copied at once.
+template <typename T, size_t N>
+static bool get_mapped_values(ply_model* ply,
+    const vector<ply_mapped_element>& mapped, const string& element,
+    const array<string, N>& properties, vector<T>& values) {
+  static_assert(sizeof(T) == sizeof(float) * N, "bad value type");
+  values.clear();
+  auto eidx = array<size_t, N>{}, pidx = array<size_t, N>{};
+  for (auto c = (size_t)0; c < N; c++) {
+    if (!find_ply_property(ply, element, properties[c], eidx[c], pidx[c]))
+      return false;
+    if (eidx[c] != eidx[0]) return false;
+  }
+  auto  elem    = ply->elements[eidx[0]];
+  auto& melem   = mapped[eidx[0]];
+  auto  aligned = melem.stride == sizeof(T);
+  for (auto c = (size_t)0; c < N; c++) {
+    auto prop = elem->properties[pidx[c]];
+    if (prop->is_list) return false;
+    aligned = aligned && prop->type == ply_type::f32 &&
+              melem.offsets[pidx[c]] == sizeof(float) * c;
+  }
+  values.resize(elem->count);
+  if (aligned) {
+    memcpy(values.data(), melem.data, elem->count * sizeof(T));
+  } else {
+    for (auto c = (size_t)0; c < N; c++) {
+      decode_ply_values((float*)values.data() + c, N,
+          melem.data + melem.offsets[pidx[c]],
+          elem->properties[pidx[c]]->type, elem->count, melem.stride);
+    }
+  }
+  return true;
+}
+
+// Get the histogram of the list lengths of a property
+static const array<size_t, 256>* get_mapped_lengths(ply_model* ply,
+    const vector<ply_mapped_element>& mapped, const string& element,
+    const string& property) {
+  auto eidx = (size_t)0, pidx = (size_t)0;
+  if (!find_ply_property(ply, element, property, eidx, pidx)) return nullptr;
+  if (!ply->elements[eidx]->properties[pidx]->is_list) return nullptr;
+  return &mapped[eidx].lengths[pidx];
+}
+
+// Decode the lists of a property, calling `func(indices, length)` for each
+static void visit_mapped_lists(ply_model* ply,
+    const vector<ply_mapped_element>& mapped, const string& element,
+    const string& property, const function<void(const int*, size_t)>& func) {
+  auto eidx = (size_t)0, pidx = (size_t)0;
+  if (!find_ply_property(ply, element, property, eidx, pidx)) return;
+  auto  elem    = ply->elements[eidx];
+  auto& props   = elem->properties;
+  auto  ptr     = mapped[eidx].data;
+  auto  indices = array<int, 255>{};
+  for (auto item = (size_t)0; item < elem->count; item++) {
+    for (auto idx = (size_t)0; idx < props.size(); idx++) {
+      auto size   = get_ply_type_size(props[idx]->type);
+      auto length = props[idx]->is_list ? (size_t)*ptr++ : 1;
+      if (idx == pidx) {
+        decode_ply_values(
+            indices.data(), 1, ptr, props[idx]->type, length, size);
+        func(indices.data(), length);
+      }
+      ptr += length * size;
+    }
+  }
+}
+
+// Load the mesh of a ply file directly into shape buffers
+bool load_ply_shape(const string& filename, vector<int>& points,
+    vector<vec2i>& lines, vector<vec3i>& triangles, vector<vec4i>& quads,
+    vector<vec3f>& positions, vector<vec3f>& normals, vector<vec2f>& texcoords,
+    vector<vec4f>& colors, vector<float>& radius, string& error,
+    bool flip_texcoord) {
+  auto read_error = [filename, &error]() {
+    error = filename + ": read error";
+    return false;
+  };
+
+  points    = {};
+  lines     = {};
+  triangles = {};
+  quads     = {};
+  positions = {};
+  normals   = {};
+  texcoords = {};
+  colors    = {};
+  radius    = {};
+
+  // map binary little endian files on little endian machines, since their
+  // values can be read in place; errors are reported by the fallback
+  auto ply_guard = std::make_unique<ply_model>();
+  auto ply       = ply_guard.get();
+  auto mf        = map_file(filename);
+  auto header    = (size_t)0;
+  auto endian    = (uint16_t)1;
+  auto mapped    = (bool)mf && *(const byte*)&endian == 1;
+  if (mapped) {
+    auto read_header = [&mf, &header](string_view& str) {
+      if (header >= mf.size) return false;
+      auto begin  = (const char*)mf.data + header;
+      auto end    = (const char*)memchr(begin, '\n', mf.size - header);
+      auto length = end ? (size_t)(end - begin) : mf.size - header;
+      str         = string_view{begin, length};
+      header += end ? length + 1 : length;
+      return true;
+    };
+    mapped = read_ply_header(ply, read_header) &&
+             ply->format == ply_format::binary_little_endian;
+    for (auto elem : ply->elements) {
+      if (elem->name != "vertex") continue;
+      for (auto prop : elem->properties) mapped = mapped && !prop->is_list;
+    }
+  }
+
+  // fallback to the ply model
+  if (!mapped) {
+    unmap_file(mf);
+    ply_guard = std::make_unique<ply_model>();
+    ply       = ply_guard.get();
+    if (!load_ply(filename, ply, error)) return false;
+    get_positions(ply, positions);
+    get_normals(ply, normals);
+    get_texcoords(ply, texcoords, flip_texcoord);
+    get_colors(ply, colors);
+    get_radius(ply, radius);
+    if (has_quads(ply)) {
+      get_quads(ply, quads);
+    } else {
+      get_triangles(ply, triangles);
+    }
+    get_lines(ply, lines);
+    get_points(ply, points);
+    return true;
+  }
+
+  // locate elements
+  auto melements = vector<ply_mapped_element>{};
+  if (!map_ply_elements(
+          ply, mf.data + header, mf.size - header, melements))
+    return read_error();
+
+  // vertex properties
+  get_mapped_values(ply, melements, "vertex", array<string, 3>{"x", "y", "z"},
+      positions);
+  get_mapped_values(ply, melements, "vertex",
+      array<string, 3>{"nx", "ny", "nz"}, normals);
+  if (has_property(ply, "vertex", "u")) {
+    get_mapped_values(
+        ply, melements, "vertex", array<string, 2>{"u", "v"}, texcoords);
+  } else {
+    get_mapped_values(
+        ply, melements, "vertex", array<string, 2>{"s", "t"}, texcoords);
+  }
+  if (flip_texcoord) {
+    for (auto& uv : texcoords) uv.y = 1 - uv.y;
+  }
+  if (has_property(ply, "vertex", "alpha")) {
+    get_mapped_values(ply, melements, "vertex",
+        array<string, 4>{"red", "green", "blue", "alpha"}, colors);
+  } else {
+    auto colors3 = vector<vec3f>{};
+    get_mapped_values(ply, melements, "vertex",
+        array<string, 3>{"red", "green", "blue"}, colors3);
+    colors.resize(colors3.size());
+    for (auto idx = (size_t)0; idx < colors.size(); idx++)
+      colors[idx] = {colors3[idx].x, colors3[idx].y, colors3[idx].z, 1};
+  }
+  get_mapped_values(
+      ply, melements, "vertex", array<string, 1>{"radius"}, radius);
+
+  // faces, sized from the list lengths
+  if (auto lengths = get_mapped_lengths(
+          ply, melements, "face", "vertex_indices")) {
+    auto& hist = *lengths;
+    if (hist[4] != 0) {
+      auto count = (size_t)0;
+      for (auto size = 3; size < 256; size++)
+        count += hist[size] * (size == 4 ? 1 : size - 2);
+      quads.reserve(count);
+      visit_mapped_lists(ply, melements, "face", "vertex_indices",
+          [&quads](const int* indices, size_t size) {
+            if (size == 4) {
+              quads.push_back(
+                  {indices[0], indices[1], indices[2], indices[3]});
+            } else {
+              for (auto c = (size_t)2; c < size; c++) {
+                quads.push_back({indices[0], indices[c - 1], indices[c],
+                    indices[c]});
+              }
+            }
+          });
+    } else {
+      auto count = (size_t)0;
+      for (auto size = 3; size < 256; size++) count += hist[size] * (size - 2);
+      triangles.reserve(count);
+      visit_mapped_lists(ply, melements, "face", "vertex_indices",
+          [&triangles](const int* indices, size_t size) {
+            for (auto c = (size_t)2; c < size; c++) {
+              triangles.push_back({indices[0], indices[c - 1], indices[c]});
+            }
+          });
+    }
+  }
+
+  // lines and points
+  if (auto lengths = get_mapped_lengths(
+          ply, melements, "line", "vertex_indices")) {
+    auto count = (size_t)0;
+    for (auto size = 2; size < 256; size++)
+      count += (*lengths)[size] * (size - 1);
+    lines.reserve(count);
+    visit_mapped_lists(ply, melements, "line", "vertex_indices",
+        [&lines](const int* indices, size_t size) {
+          for (auto c = (size_t)1; c < size; c++) {
+            lines.push_back({indices[c - 1], indices[c]});
+          }
+        });
+  }
+  if (auto lengths = get_mapped_lengths(
+          ply, melements, "point", "vertex_indices")) {
+    auto count = (size_t)0;
+    for (auto size = 1; size < 256; size++) count += (*lengths)[size] * size;
+    points.reserve(count);
+    visit_mapped_lists(ply, melements, "point", "vertex_indices",
+        [&points](const int* indices, size_t size) {
+          points.insert(points.end(), indices, indices + size);
+        });
+  }
+
+  return true;
+}
+
 // Add ply properties
 inline ply_element* add_element(
     ply_model* ply, const string& element_name, size_t count) {
@@ -1546,7 +2130,91 @@ obj_shape* add_shape(obj_scene* obj) {
   return obj->shapes.emplace_back(new obj_shape{});
 }
 
-// Read obj
+// Commands of an obj chunk, other than vertex data, kept in file order so
+// that they can be replayed when merging chunks. Elements store the range of
+// their vertices and the vertex data parsed before them in the chunk, used to
+// resolve relative indices. Grouping commands store the index of their name.
+struct obj_command {
+  char       type   = 0;  // f, l, p, o, g, u for usemtl, m for mtllib
+  int        size   = 0;
+  size_t     start  = 0;
+  obj_vertex counts = {};
+};
+
+// Content of a range of lines of an obj file
+struct obj_chunk {
+  vector<vec3f>       positions = {};
+  vector<vec3f>       normals   = {};
+  vector<vec2f>       texcoords = {};
+  vector<obj_vertex>  vertices  = {};
+  vector<obj_command> commands  = {};
+  vector<string>      names     = {};
+  bool                relative  = false;
+  bool                error     = false;
+};
+
+// Parse the lines of an obj chunk. Lines have no length limit.
+static bool parse_obj_chunk(
+    string_view data, obj_chunk& chunk, bool geom_only) {
+  while (!data.empty()) {
+    // str
+    auto length = data.find('\n');
+    auto str    = data.substr(0, length);
+    data.remove_prefix(length == data.npos ? data.size() : length + 1);
+    remove_comment(str);
+    skip_whitespace(str);
+    if (str.empty()) continue;
+
+    // get command
+    auto cmd = string_view{};
+    if (!parse_value(str, cmd)) return false;
+    if (cmd.empty()) continue;
+
+    // possible token values
+    if (cmd == "v") {
+      if (!parse_value(str, chunk.positions.emplace_back())) return false;
+    } else if (cmd == "vn") {
+      if (!parse_value(str, chunk.normals.emplace_back())) return false;
+    } else if (cmd == "vt") {
+      if (!parse_value(str, chunk.texcoords.emplace_back())) return false;
+    } else if (cmd == "f" || cmd == "l" || cmd == "p") {
+      auto& command  = chunk.commands.emplace_back();
+      command.type   = cmd.front();
+      command.start  = chunk.vertices.size();
+      command.counts = {(int)chunk.positions.size(),
+          (int)chunk.texcoords.size(), (int)chunk.normals.size()};
+      skip_whitespace(str);
+      while (!str.empty()) {
+        auto vert = obj_vertex{};
+        if (!parse_value(str, vert)) return false;
+        if (vert.position == 0) break;
+        if (vert.position < 0 || vert.texcoord < 0 || vert.normal < 0)
+          chunk.relative = true;
+        chunk.vertices.push_back(vert);
+        command.size += 1;
+        skip_whitespace(str);
+      }
+    } else if (cmd == "o" || cmd == "g") {
+      if (geom_only) continue;
+      skip_whitespace(str);
+      auto& name = chunk.names.emplace_back();
+      if (!str.empty() && !parse_value(str, name)) return false;
+      chunk.commands.push_back({cmd.front(), 0, chunk.names.size() - 1});
+    } else if (cmd == "usemtl" || cmd == "mtllib") {
+      if (geom_only) continue;
+      if (!parse_value(str, chunk.names.emplace_back())) return false;
+      chunk.commands.push_back(
+          {cmd == "usemtl" ? 'u' : 'm', 0, chunk.names.size() - 1});
+    } else {
+      // unused
+    }
+  }
+  return true;
+}
+
+// Read obj. The file is split in chunks at line boundaries, that are parsed
+// in parallel. Chunks are then merged in order, resolving relative indices
+// and grouping elements into shapes.
 bool load_obj(const string& filename, obj_scene* obj, string& error,
     bool geom_only, bool split_elements, bool split_materials) {
   // error helpers
@@ -1558,24 +2226,77 @@ bool load_obj(const string& filename, obj_scene* obj, string& error,
     error = filename + ": parse error";
     return false;
   };
-  auto read_error = [filename, &error]() {
-    error = filename + ": read error";
-    return false;
-  };
   auto dependent_error = [filename, &error]() {
     error = filename + ": error in " + error;
     return false;
   };
 
-  // open file
-  auto fs = open_file(filename, "rt");
-  if (!fs) return open_error();
+  // map file, reading it instead for empty or unmappable files
+  auto mf   = map_file(filename);
+  auto text = ""s;
+  if (!mf && !load_text(filename, text, error)) return open_error();
+  auto data = mf ? string_view{(const char*)mf.data, mf.size}
+                 : string_view{text};
+
+  // split at line boundaries
+  auto chunk_size = (size_t)1 << 22;
+  auto bounds     = vector<size_t>{0};
+  while (data.size() - bounds.back() > chunk_size) {
+    auto next = data.find('\n', bounds.back() + chunk_size);
+    if (next == data.npos) break;
+    bounds.push_back(next + 1);
+  }
+  bounds.push_back(data.size());
+
+  // parse chunks
+  auto chunks = vector<obj_chunk>(bounds.size() - 1);
+  parallel_for(
+      chunks.size(),
+      [&](size_t idx) {
+        auto range = data.substr(bounds[idx], bounds[idx + 1] - bounds[idx]);
+        chunks[idx].error = !parse_obj_chunk(range, chunks[idx], geom_only);
+      },
+      1);
+
+  // resolve relative indices with the vertex data of the previous chunks
+  auto offsets = vector<obj_vertex>(chunks.size());
+  for (auto idx = (size_t)1; idx < chunks.size(); idx++) {
+    auto& prev   = chunks[idx - 1];
+    offsets[idx] = {offsets[idx - 1].position + (int)prev.positions.size(),
+        offsets[idx - 1].texcoord + (int)prev.texcoords.size(),
+        offsets[idx - 1].normal + (int)prev.normals.size()};
+  }
+  parallel_for(
+      chunks.size(),
+      [&](size_t idx) {
+        auto& chunk = chunks[idx];
+        if (!chunk.relative) return;
+        for (auto& command : chunk.commands) {
+          if (command.type != 'f' && command.type != 'l' &&
+              command.type != 'p')
+            continue;
+          auto vert_size = obj_vertex{
+              offsets[idx].position + command.counts.position,
+              offsets[idx].texcoord + command.counts.texcoord,
+              offsets[idx].normal + command.counts.normal};
+          for (auto vid = command.start; vid < command.start + command.size;
+               vid++) {
+            auto& vert = chunk.vertices[vid];
+            if (vert.position < 0)
+              vert.position = vert_size.position + vert.position + 1;
+            if (vert.texcoord < 0)
+              vert.texcoord = vert_size.texcoord + vert.texcoord + 1;
+            if (vert.normal < 0)
+              vert.normal = vert_size.normal + vert.normal + 1;
+          }
+        }
+      },
+      1);
 
   // parsing state
   auto opositions   = vector<vec3f>{};
   auto onormals     = vector<vec3f>{};
   auto otexcoords   = vector<vec2f>{};
-  auto vert_size    = obj_vertex{};
   auto oname        = ""s;
   auto gname        = ""s;
   auto mname        = ""s;
@@ -1593,128 +2314,103 @@ bool load_obj(const string& filename, obj_scene* obj, string& error,
   obj->shapes.emplace_back(new obj_shape{});
   auto empty_material = (obj_material*)nullptr;
 
-  // read the file str by str
-  auto buffer = array<char, 4096>{};
-  while (read_line(fs, buffer)) {
-    // str
-    auto str = string_view{buffer.data()};
-    remove_comment(str);
-    skip_whitespace(str);
-    if (str.empty()) continue;
-
-    // get command
-    auto cmd = ""s;
-    if (!parse_value(str, cmd)) return parse_error();
-    if (cmd.empty()) continue;
-
-    // possible token values
-    if (cmd == "v") {
-      if (!parse_value(str, opositions.emplace_back())) return parse_error();
-      vert_size.position += 1;
-    } else if (cmd == "vn") {
-      if (!parse_value(str, onormals.emplace_back())) return parse_error();
-      vert_size.normal += 1;
-    } else if (cmd == "vt") {
-      if (!parse_value(str, otexcoords.emplace_back())) return parse_error();
-      vert_size.texcoord += 1;
-    } else if (cmd == "f" || cmd == "l" || cmd == "p") {
-      // split if split_elements and different primitives
-      if (auto shape = obj->shapes.back();
-          split_elements && !shape->vertices.empty()) {
-        if ((cmd == "f" && (!shape->lines.empty() || !shape->points.empty())) ||
-            (cmd == "l" && (!shape->faces.empty() || !shape->points.empty())) ||
-            (cmd == "p" && (!shape->faces.empty() || !shape->lines.empty()))) {
-          add_shape(obj);
-          obj->shapes.back()->name = oname + gname;
-        }
-      }
-      // split if splt_material and different materials
-      if (auto shape = obj->shapes.back();
-          !geom_only && split_materials && !shape->materials.empty()) {
-        if (shape->materials.size() > 1)
-          throw std::runtime_error("should not have happened");
-        if (shape->materials.back() != mname) {
-          add_shape(obj);
-          obj->shapes.back()->name = oname + gname;
+  // merge chunks in file order
+  for (auto& chunk : chunks) {
+    for (auto& command : chunk.commands) {
+      auto cmd = command.type;
+      if (cmd == 'f' || cmd == 'l' || cmd == 'p') {
+        // split if split_elements and different primitives
+        if (auto shape = obj->shapes.back();
+            split_elements && !shape->vertices.empty()) {
+          if ((cmd == 'f' &&
+                  (!shape->lines.empty() || !shape->points.empty())) ||
+              (cmd == 'l' &&
+                  (!shape->faces.empty() || !shape->points.empty())) ||
+              (cmd == 'p' &&
+                  (!shape->faces.empty() || !shape->lines.empty()))) {
+            add_shape(obj);
+            obj->shapes.back()->name = oname + gname;
+          }
         }
-      }
-      // grab shape and add element
-      auto  shape   = obj->shapes.back();
-      auto& element = (cmd == "f")
-                          ? shape->faces.emplace_back()
-                          : (cmd == "l") ? shape->lines.emplace_back()
-                                         : shape->points.emplace_back();
-      // get element material or add if needed
-      if (!geom_only) {
-        if (mname.empty() && empty_material == nullptr) {
-          empty_material   = obj->materials.emplace_back(new obj_material{});
-          material_map[""] = empty_material;
+        // split if splt_material and different materials
+        if (auto shape = obj->shapes.back();
+            !geom_only && split_materials && !shape->materials.empty()) {
+          if (shape->materials.size() > 1)
+            throw std::runtime_error("should not have happened");
+          if (shape->materials.back() != mname) {
+            add_shape(obj);
+            obj->shapes.back()->name = oname + gname;
+          }
         }
-        auto mat_idx = -1;
-        for (auto midx = 0; midx < shape->materials.size(); midx++)
-          if (shape->materials[midx] == mname) mat_idx = midx;
-        if (mat_idx < 0) {
-          shape->materials.push_back(mname);
-          mat_idx = (int)shape->materials.size() - 1;
+        // grab shape and add element
+        auto  shape   = obj->shapes.back();
+        auto& element = (cmd == 'f')
+                            ? shape->faces.emplace_back()
+                            : (cmd == 'l') ? shape->lines.emplace_back()
+                                           : shape->points.emplace_back();
+        // get element material or add if needed
+        if (!geom_only) {
+          if (mname.empty() && empty_material == nullptr) {
+            empty_material   = obj->materials.emplace_back(new obj_material{});
+            material_map[""] = empty_material;
+          }
+          auto mat_idx = -1;
+          for (auto midx = 0; midx < shape->materials.size(); midx++)
+            if (shape->materials[midx] == mname) mat_idx = midx;
+          if (mat_idx < 0) {
+            shape->materials.push_back(mname);
+            mat_idx = (int)shape->materials.size() - 1;
+          }
+          element.material = (uint8_t)mat_idx;
         }
-        element.material = (uint8_t)mat_idx;
-      }
-      // parse vertices
-      skip_whitespace(str);
-      while (!str.empty()) {
-        auto vert = obj_vertex{};
-        if (!parse_value(str, vert)) return parse_error();
-        if (vert.position == 0) break;
-        if (vert.position < 0)
-          vert.position = vert_size.position + vert.position + 1;
-        if (vert.texcoord < 0)
-          vert.texcoord = vert_size.texcoord + vert.texcoord + 1;
-        if (vert.normal < 0) vert.normal = vert_size.normal + vert.normal + 1;
-        shape->vertices.push_back(vert);
-        element.size += 1;
-        skip_whitespace(str);
-      }
-    } else if (cmd == "o" || cmd == "g") {
-      if (geom_only) continue;
-      skip_whitespace(str);
-      if (cmd == "o") {
-        if (str.empty()) {
-          oname = "";
+        // add vertices
+        auto vertices = chunk.vertices.begin() + command.start;
+        shape->vertices.insert(
+            shape->vertices.end(), vertices, vertices + command.size);
+        element.size = (uint8_t)command.size;
+      } else if (cmd == 'o' || cmd == 'g') {
+        if (cmd == 'o') {
+          oname = chunk.names[command.start];
         } else {
-          if (!parse_value(str, oname)) return parse_error();
+          gname = chunk.names[command.start];
         }
-      } else {
-        if (str.empty()) {
-          gname = "";
+        if (!obj->shapes.back()->vertices.empty()) {
+          obj->shapes.emplace_back(new obj_shape{});
+          obj->shapes.back()->name = oname + gname;
         } else {
-          if (!parse_value(str, gname)) return parse_error();
+          obj->shapes.back()->name = oname + gname;
+        }
+      } else if (cmd == 'u') {
+        mname = chunk.names[command.start];
+      } else if (cmd == 'm') {
+        auto& mtllib = chunk.names[command.start];
+        if (std::find(mtllibs.begin(), mtllibs.end(), mtllib) ==
+            mtllibs.end()) {
+          mtllibs.push_back(mtllib);
+          if (!load_mtl(
+                  path_join(path_dirname(filename), mtllib), obj, error))
+            return dependent_error();
+          for (auto material : obj->materials)
+            material_map[material->name] = material;
         }
       }
-      if (!obj->shapes.back()->vertices.empty()) {
-        obj->shapes.emplace_back(new obj_shape{});
-        obj->shapes.back()->name = oname + gname;
-      } else {
-        obj->shapes.back()->name = oname + gname;
-      }
-    } else if (cmd == "usemtl") {
-      if (geom_only) continue;
-      if (!parse_value(str, mname)) return parse_error();
-    } else if (cmd == "s") {
-      if (geom_only) continue;
-    } else if (cmd == "mtllib") {
-      if (geom_only) continue;
-      auto mtllib = ""s;
-      if (!parse_value(str, mtllib)) return parse_error();
-      if (std::find(mtllibs.begin(), mtllibs.end(), mtllib) == mtllibs.end()) {
-        mtllibs.push_back(mtllib);
-        if (!load_mtl(path_join(path_dirname(filename), mtllib), obj, error))
-          return dependent_error();
-        for (auto material : obj->materials)
-          material_map[material->name] = material;
-      }
-    } else {
-      // unused
     }
+    // errors are reported after the commands before them
+    if (chunk.error) return parse_error();
+  }
+
+  // join vertex data
+  auto& last = offsets.back();
+  opositions.reserve(last.position + chunks.back().positions.size());
+  onormals.reserve(last.normal + chunks.back().normals.size());
+  otexcoords.reserve(last.texcoord + chunks.back().texcoords.size());
+  for (auto& chunk : chunks) {
+    opositions.insert(
+        opositions.end(), chunk.positions.begin(), chunk.positions.end());
+    onormals.insert(onormals.end(), chunk.normals.begin(), chunk.normals.end());
+    otexcoords.insert(
+        otexcoords.end(), chunk.texcoords.begin(), chunk.texcoords.end());
+    chunk = {};
   }
 
   // fix empty material
@@ -1724,31 +2420,43 @@ bool load_obj(const string& filename, obj_scene* obj, string& error,
     empty_material->pbr_base = {0.8, 0.8, 0.8};
   }
 
-  // convert vertex data
-  auto ipositions = vector<int>{};
-  auto inormals   = vector<int>{};
-  auto itexcoords = vector<int>{};
+  // convert vertex data. Index maps are shared by all shapes, and entries
+  // are valid only if larger than the vertex data of the previous shapes,
+  // so that the maps need not be cleared for every shape.
+  auto ipositions = vector<int>(opositions.size() + 1, 0);
+  auto inormals   = vector<int>(onormals.size() + 1, 0);
+  auto itexcoords = vector<int>(otexcoords.size() + 1, 0);
+  auto vert_base  = obj_vertex{0, 0, 0};
   for (auto shape : obj->shapes) {
-    ipositions.assign(opositions.size() + 1, 0);
-    inormals.assign(onormals.size() + 1, 0);
-    itexcoords.assign(otexcoords.size() + 1, 0);
     for (auto& vertex : shape->vertices) {
-      if (vertex.position != 0 && ipositions[vertex.position] == 0) {
-        shape->positions.push_back(opositions[vertex.position - 1]);
-        ipositions[vertex.position] = (int)shape->positions.size();
+      if (vertex.position != 0) {
+        if (ipositions[vertex.position] <= vert_base.position) {
+          shape->positions.push_back(opositions[vertex.position - 1]);
+          ipositions[vertex.position] = vert_base.position +
+                                        (int)shape->positions.size();
+        }
+        vertex.position = ipositions[vertex.position] - vert_base.position;
       }
-      if (vertex.normal != 0 && inormals[vertex.normal] == 0) {
-        shape->normals.push_back(onormals[vertex.normal - 1]);
-        inormals[vertex.normal] = (int)shape->normals.size();
+      if (vertex.normal != 0) {
+        if (inormals[vertex.normal] <= vert_base.normal) {
+          shape->normals.push_back(onormals[vertex.normal - 1]);
+          inormals[vertex.normal] = vert_base.normal +
+                                    (int)shape->normals.size();
+        }
+        vertex.normal = inormals[vertex.normal] - vert_base.normal;
       }
-      if (vertex.texcoord != 0 && itexcoords[vertex.texcoord] == 0) {
-        shape->texcoords.push_back(otexcoords[vertex.texcoord - 1]);
-        itexcoords[vertex.texcoord] = (int)shape->texcoords.size();
+      if (vertex.texcoord != 0) {
+        if (itexcoords[vertex.texcoord] <= vert_base.texcoord) {
+          shape->texcoords.push_back(otexcoords[vertex.texcoord - 1]);
+          itexcoords[vertex.texcoord] = vert_base.texcoord +
+                                        (int)shape->texcoords.size();
+        }
+        vertex.texcoord = itexcoords[vertex.texcoord] - vert_base.texcoord;
       }
-      vertex.position = ipositions[vertex.position];
-      vertex.normal   = inormals[vertex.normal];
-      vertex.texcoord = itexcoords[vertex.texcoord];
     }
+    vert_base.position += (int)shape->positions.size();
+    vert_base.normal += (int)shape->normals.size();
+    vert_base.texcoord += (int)shape->texcoords.size();
   }
 
   // exit if done
@@ -153,6 +153,16 @@ bool get_triangles(ply_model* ply, vector<vec3i>& values);
 bool get_quads(ply_model* ply, vector<vec4i>& values);
 bool has_quads(ply_model* ply);
 
+// Load the mesh of a ply file directly into shape buffers, with the same
+// results as `load_ply()` followed by the getters above. Binary little endian
+// files are memory mapped and decoded from the mapping, without building an
+// intermediate ply model. Other files are loaded with `load_ply()`.
+bool load_ply_shape(const string& filename, vector<int>& points,
+    vector<vec2i>& lines, vector<vec3i>& triangles, vector<vec4i>& quads,
+    vector<vec3f>& positions, vector<vec3f>& normals, vector<vec2f>& texcoords,
+    vector<vec4f>& colors, vector<float>& radius, string& error,
+    bool flip_texcoord = false);
+
 // Add ply properties
 bool add_value(ply_model* ply, const string& element, const string& property,
     const vector<float>& values);
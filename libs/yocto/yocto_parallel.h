@@ -37,11 +37,18 @@
 // INCLUDES
 // -----------------------------------------------------------------------------
 
+#include <algorithm>
 #include <atomic>
+#include <condition_variable>
 #include <deque>
+#include <exception>
+#include <functional>
 #include <future>
+#include <memory>
 #include <mutex>
 #include <thread>
+#include <tuple>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
@@ -53,6 +60,7 @@ namespace yocto {
 // using directives
 using std::atomic;
 using std::deque;
+using std::function;
 using std::future;
 using std::vector;
 
@@ -80,7 +88,62 @@ struct concurrent_queue {
   deque<T>   queue;
 };
 
-// Run a task asynchronously
+// Process-wide thread pool used by all parallel utilities. Each worker owns
+// a task deque: workers push and pop tasks at the back of their own deque,
+// and steal from the front of the others when idle. Threads waiting for
+// parallel work to complete execute pending loop tasks, so parallel loops
+// can be nested inside tasks without oversubscribing the machine. Async
+// tasks may run for long, so they are kept in separate deques and run only
+// by idle workers, in submission order.
+struct parallel_pool {
+  explicit parallel_pool(int num_threads = 0);
+  ~parallel_pool();
+  parallel_pool(const parallel_pool& other) = delete;
+  parallel_pool& operator=(const parallel_pool& other) = delete;
+
+  // number of worker threads
+  int size() const;
+  // index of the calling worker or -1 if not called from a worker
+  int worker_id() const;
+  // submit a loop task, or an async task if `async` is set
+  void push(function<void()>&& task, bool async = false);
+  // run a single pending task, if any, returning whether one was run;
+  // async tasks are run only if `async` is set
+  bool run_one(bool async = false);
+
+ private:
+  struct worker_queue {
+    std::mutex               mutex;
+    deque<function<void()>> tasks;
+    deque<function<void()>> async_tasks;
+  };
+  vector<std::thread>                   threads       = {};
+  vector<std::unique_ptr<worker_queue>> queues        = {};
+  atomic<int>                           pending       = 0;
+  atomic<int>                           pending_async = 0;
+  atomic<bool>                          stop          = false;
+  atomic<unsigned>                      next          = 0;
+  std::mutex                            sleep_mutex;
+  std::condition_variable               sleep_cv;
+
+  static inline thread_local parallel_pool* current_pool = nullptr;
+  static inline thread_local int            current_id   = -1;
+
+  bool pop(int queue_id, function<void()>& task, bool steal);
+  bool pop_async(int queue_id, function<void()>& task);
+  void work(int worker_id);
+};
+
+// Get the process-wide thread pool, creating it on first use.
+inline parallel_pool& get_parallel_pool();
+
+// Number of threads that run parallel work, including the calling one.
+inline int parallel_concurrency();
+
+// Run a task asynchronously on the thread pool. The returned future can be
+// waited on from any thread, but tasks should not block on other futures.
+// Async tasks are run only by idle workers, never by threads waiting for
+// parallel loops.
 template <typename Func, typename... Args>
 inline auto run_async(Func&& func, Args&&... args);
 
@@ -90,20 +153,23 @@ inline bool is_running(const future<void>& result);
 inline bool is_ready(const future<void>& result);
 
 // Simple parallel for used since our target platforms do not yet support
-// parallel algorithms. `Func` takes the integer index.
+// parallel algorithms. `Func` takes the integer index. Indices are
+// processed in chunks of `grain` elements, chosen automatically if zero.
 template <typename T, typename Func>
-inline void parallel_for(T num, Func&& func);
+inline void parallel_for(T num, Func&& func, int grain = 0);
 // Simple parallel for used since our target platforms do not yet support
-// parallel algorithms. `Func` takes the two integer indices.
+// parallel algorithms. `Func` takes the two integer indices. Rows are
+// processed in chunks of `grain` rows.
 template <typename T, typename Func>
-inline void parallel_for(T num1, T num2, Func&& func);
+inline void parallel_for(T num1, T num2, Func&& func, int grain = 1);
 
 // Simple parallel for used since our target platforms do not yet support
 // parallel algorithms. `Func` takes a reference to a `T`.
 template <typename T, typename Func>
-inline void parallel_foreach(vector<T>& values, Func&& func);
+inline void parallel_foreach(vector<T>& values, Func&& func, int grain = 0);
 template <typename T, typename Func>
-inline void parallel_foreach(const vector<T>& values, Func&& func);
+inline void parallel_foreach(
+    const vector<T>& values, Func&& func, int grain = 0);
 
 }  // namespace yocto
 
@@ -145,11 +211,132 @@ bool concurrent_queue<T>::try_pop(T& value) {
   return true;
 }
 
+// Process-wide thread pool
+inline parallel_pool::parallel_pool(int num_threads) {
+  if (num_threads <= 0)
+    num_threads = std::max(1, (int)std::thread::hardware_concurrency() - 1);
+  for (auto idx = 0; idx < num_threads; idx++)
+    queues.emplace_back(std::make_unique<worker_queue>());
+  for (auto idx = 0; idx < num_threads; idx++)
+    threads.emplace_back([this, idx]() { work(idx); });
+}
+inline parallel_pool::~parallel_pool() {
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex);
+    stop = true;
+  }
+  sleep_cv.notify_all();
+  for (auto& thread : threads) thread.join();
+}
+inline int parallel_pool::size() const { return (int)threads.size(); }
+inline int parallel_pool::worker_id() const {
+  return current_pool == this ? current_id : -1;
+}
+inline void parallel_pool::push(function<void()>&& task, bool async) {
+  auto queue_id = worker_id();
+  if (queue_id < 0) queue_id = (int)(next++ % (unsigned)queues.size());
+  {
+    auto&                       queue = *queues[queue_id];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (async) {
+      queue.async_tasks.push_back(std::move(task));
+    } else {
+      queue.tasks.push_back(std::move(task));
+    }
+  }
+  if (async) {
+    pending_async += 1;
+  } else {
+    pending += 1;
+  }
+  { std::lock_guard<std::mutex> lock(sleep_mutex); }
+  sleep_cv.notify_one();
+}
+inline bool parallel_pool::pop(
+    int queue_id, function<void()>& task, bool steal) {
+  auto&                       queue = *queues[queue_id];
+  std::lock_guard<std::mutex> lock(queue.mutex);
+  if (queue.tasks.empty()) return false;
+  if (steal) {
+    task = std::move(queue.tasks.front());
+    queue.tasks.pop_front();
+  } else {
+    task = std::move(queue.tasks.back());
+    queue.tasks.pop_back();
+  }
+  pending -= 1;
+  return true;
+}
+inline bool parallel_pool::pop_async(int queue_id, function<void()>& task) {
+  auto&                       queue = *queues[queue_id];
+  std::lock_guard<std::mutex> lock(queue.mutex);
+  if (queue.async_tasks.empty()) return false;
+  task = std::move(queue.async_tasks.front());
+  queue.async_tasks.pop_front();
+  pending_async -= 1;
+  return true;
+}
+inline bool parallel_pool::run_one(bool async) {
+  auto task  = function<void()>{};
+  auto num   = (int)queues.size();
+  auto owner = worker_id();
+  auto first = owner >= 0 ? owner + 1 : (int)(next % (unsigned)num);
+  auto found = false;
+  // loop tasks first, from the own deque and then stealing from the others
+  if (pending > 0) {
+    found = owner >= 0 && pop(owner, task, false);
+    for (auto idx = 0; idx < num && !found; idx++) {
+      auto queue_id = (first + idx) % num;
+      if (queue_id != owner) found = pop(queue_id, task, true);
+    }
+  }
+  // async tasks only when asked for, since they may run for long
+  if (async && pending_async > 0) {
+    for (auto idx = 0; idx < num && !found; idx++)
+      found = pop_async((first + idx) % num, task);
+  }
+  if (!found) return false;
+  task();
+  return true;
+}
+inline void parallel_pool::work(int worker_id) {
+  current_pool = this;
+  current_id   = worker_id;
+  while (true) {
+    if (run_one(true)) continue;
+    std::unique_lock<std::mutex> lock(sleep_mutex);
+    sleep_cv.wait(lock, [this]() {
+      return stop || pending > 0 || pending_async > 0;
+    });
+    if (stop) return;
+  }
+}
+
+// Get the process-wide thread pool, creating it on first use.
+inline parallel_pool& get_parallel_pool() {
+  static auto pool = parallel_pool{};
+  return pool;
+}
+
+// Number of threads that run parallel work, including the calling one.
+inline int parallel_concurrency() {
+  auto& pool = get_parallel_pool();
+  return pool.worker_id() >= 0 ? pool.size() : pool.size() + 1;
+}
+
 // Run a task asynchronously
 template <typename Func, typename... Args>
 inline auto run_async(Func&& func, Args&&... args) {
-  return std::async(std::launch::async, std::forward<Func>(func),
-      std::forward<Args>(args)...);
+  using result_type = std::invoke_result_t<std::decay_t<Func>&,
+      std::decay_t<Args>&...>;
+  auto task = std::make_shared<std::packaged_task<result_type()>>(
+      [func = std::forward<Func>(func),
+          args = std::make_tuple(std::forward<Args>(args)...)]() mutable {
+        return std::apply(func, args);
+      });
+  auto result = task->get_future();
+  get_parallel_pool().push([task]() { (*task)(); }, true);
+  return result;
 }
 // Check if an async task is ready
 inline bool is_valid(const future<void>& result) { return result.valid(); }
@@ -165,54 +352,84 @@ inline bool is_ready(const future<void>& result) {
 // Simple parallel for used since our target platforms do not yet support
 // parallel algorithms. `Func` takes the integer index.
 template <typename T, typename Func>
-inline void parallel_for(T num, Func&& func) {
-  auto      futures  = vector<future<void>>{};
-  auto      nthreads = std::thread::hardware_concurrency();
-  atomic<T> next_idx(0);
-  for (auto thread_id = 0; thread_id < nthreads; thread_id++) {
-    futures.emplace_back(
-        std::async(std::launch::async, [&func, &next_idx, num]() {
-          while (true) {
-            auto idx = next_idx.fetch_add(1);
-            if (idx >= num) break;
-            func(idx);
-          }
-        }));
+inline void parallel_for(T num, Func&& func, int grain) {
+  if (num <= 0) return;
+  auto& pool     = get_parallel_pool();
+  auto  nthreads = (T)pool.size() + 1;
+  // by default, split the work in a few chunks per thread for load balancing
+  auto chunk   = grain > 0 ? (T)grain : std::max((T)1, num / (nthreads * 8));
+  auto nchunks = (num + chunk - 1) / chunk;
+  if (nchunks == 1) {
+    for (auto idx = (T)0; idx < num; idx++) func(idx);
+    return;
+  }
+
+  // chunks are grabbed dynamically by the calling thread and by helper tasks,
+  // so the loop completes even if no worker is free to help; helpers that
+  // start late find no chunks left and exit without touching `func`
+  struct loop_state {
+    atomic<T>          next   = 0;
+    atomic<int>        active = 0;
+    std::mutex         error_mutex;
+    std::exception_ptr error = nullptr;
+  };
+  auto state      = std::make_shared<loop_state>();
+  auto run_chunks = [chunk, nchunks, num, func = &func](loop_state* state) {
+    state->active += 1;
+    while (true) {
+      auto chunk_id = state->next.fetch_add(1);
+      if (chunk_id >= nchunks) break;
+      try {
+        auto start = chunk_id * chunk, end = std::min(start + chunk, num);
+        for (auto idx = start; idx < end; idx++) (*func)(idx);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(state->error_mutex);
+        if (!state->error) state->error = std::current_exception();
+        state->next = nchunks;
+      }
+    }
+    state->active -= 1;
+  };
+  auto nhelpers = std::min(nchunks - 1, nthreads - 1);
+  for (auto helper = (T)0; helper < nhelpers; helper++) {
+    pool.push([state, run_chunks]() { run_chunks(state.get()); });
+  }
+  run_chunks(state.get());
+
+  // wait for helpers, running other tasks if called from a worker
+  auto is_worker = pool.worker_id() >= 0;
+  while (state->active > 0) {
+    if (!is_worker || !pool.run_one()) std::this_thread::yield();
   }
-  for (auto& f : futures) f.get();
+  if (state->error) std::rethrow_exception(state->error);
 }
 
 // Simple parallel for used since our target platforms do not yet support
 // parallel algorithms. `Func` takes the two integer indices.
 template <typename T, typename Func>
-inline void parallel_for(T num1, T num2, Func&& func) {
-  auto      futures  = vector<future<void>>{};
-  auto      nthreads = std::thread::hardware_concurrency();
-  atomic<T> next_idx(0);
-  for (auto thread_id = 0; thread_id < nthreads; thread_id++) {
-    futures.emplace_back(
-        std::async(std::launch::async, [&func, &next_idx, num1, num2]() {
-          while (true) {
-            auto j = next_idx.fetch_add(1);
-            if (j >= num2) break;
-            for (auto i = (T)0; i < num1; i++) func(i, j);
-          }
-        }));
-  }
-  for (auto& f : futures) f.get();
+inline void parallel_for(T num1, T num2, Func&& func, int grain) {
+  parallel_for(
+      num2,
+      [&func, num1](T j) {
+        for (auto i = (T)0; i < num1; i++) func(i, j);
+      },
+      grain);
 }
 
 // Simple parallel for used since our target platforms do not yet support
 // parallel algorithms. `Func` takes a reference to a `T`.
 template <typename T, typename Func>
-inline void parallel_foreach(vector<T>& values, Func&& func) {
+inline void parallel_foreach(vector<T>& values, Func&& func, int grain) {
   parallel_for(
-      0, (int)values.size(), [&func, &values](int idx) { func(values[idx]); });
+      (int)values.size(), [&func, &values](int idx) { func(values[idx]); },
+      grain);
 }
 template <typename T, typename Func>
-inline void parallel_foreach(const vector<T>& values, Func&& func) {
+inline void parallel_foreach(
+    const vector<T>& values, Func&& func, int grain) {
   parallel_for(
-      0, (int)values.size(), [&func, &values](int idx) { func(values[idx]); });
+      (int)values.size(), [&func, &values](int idx) { func(values[idx]); },
+      grain);
 }
 
 }  // namespace yocto
@@ -174,6 +174,15 @@ template <size_t N>
 inline float sample_discrete_weights_pdf(
     const array<float, N>& weights, int idx);
 
+// Make an alias table for a discrete distribution represented by its weights.
+// Sampling picks an element uniformly, then keeps it with probability
+// `probs[idx]` or takes `aliases[idx]` otherwise, in constant time.
+inline void make_discrete_alias(
+    vector<float>& probs, vector<int>& aliases, const vector<float>& weights);
+// Sample a discrete distribution represented by its alias table.
+inline int sample_discrete_alias(
+    const vector<float>& probs, const vector<int>& aliases, float r);
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -442,6 +451,52 @@ inline float sample_discrete_weights_pdf(
   return weights[idx];
 }
 
+// Make an alias table for a discrete distribution represented by its weights.
+inline void make_discrete_alias(
+    vector<float>& probs, vector<int>& aliases, const vector<float>& weights) {
+  auto size = (int)weights.size();
+  probs.assign(size, 1);
+  aliases.resize(size);
+  for (auto idx = 0; idx < size; idx++) aliases[idx] = idx;
+  auto sum = 0.0;
+  for (auto weight : weights) sum += weight;
+  if (sum <= 0) return;
+  // split elements in under and over full, then fill the under full ones
+  auto scaled = vector<double>(size);
+  auto small  = vector<int>{};
+  auto large  = vector<int>{};
+  for (auto idx = 0; idx < size; idx++) {
+    scaled[idx] = weights[idx] * size / sum;
+    if (scaled[idx] < 1) {
+      small.push_back(idx);
+    } else {
+      large.push_back(idx);
+    }
+  }
+  while (!small.empty() && !large.empty()) {
+    auto under = small.back();
+    auto over  = large.back();
+    small.pop_back();
+    probs[under]   = (float)scaled[under];
+    aliases[under] = over;
+    scaled[over]   = (scaled[over] + scaled[under]) - 1;
+    if (scaled[over] < 1) {
+      large.pop_back();
+      small.push_back(over);
+    }
+  }
+}
+// Sample a discrete distribution represented by its alias table. The index
+// and fraction are computed in double, since in float `r * size` loses
+// precision for tables larger than 2^24 elements.
+inline int sample_discrete_alias(
+    const vector<float>& probs, const vector<int>& aliases, float r) {
+  auto size   = (int)probs.size();
+  auto scaled = (double)r * size;
+  auto idx    = clamp((int)scaled, 0, size - 1);
+  return (scaled - idx < probs[idx]) ? idx : aliases[idx];
+}
+
 }  // namespace yocto
 
 #endif
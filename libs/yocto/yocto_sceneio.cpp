@@ -29,12 +29,15 @@
 #include "yocto_sceneio.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
+#include <cstddef>
 #include <climits>
 #include <cstdlib>
 #include <cstring>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <unordered_map>
 
@@ -1032,6 +1035,12 @@ static bool load_ply_scene(const string& filename, sceneio_scene* scene,
 static bool save_ply_scene(const string& filename, const sceneio_scene* scene,
     string& error, const progress_callback& progress_cb, bool noparallel);
 
+// Load/save a scene from/to the binary format.
+static bool load_ybin_scene(const string& filename, sceneio_scene* scene,
+    string& error, const progress_callback& progress_cb, bool noparallel);
+static bool save_ybin_scene(const string& filename, const sceneio_scene* scene,
+    string& error, const progress_callback& progress_cb, bool noparallel);
+
 // Load/save a scene from/to glTF.
 static bool load_gltf_scene(const string& filename, sceneio_scene* scene,
     string& error, const progress_callback& progress_cb, bool noparallel);
@@ -1063,6 +1072,8 @@ bool load_scene(const string& filename, sceneio_scene* scene, string& error,
     return load_pbrt_scene(filename, scene, error, progress_cb, noparallel);
   } else if (ext == ".ply" || ext == ".PLY") {
     return load_ply_scene(filename, scene, error, progress_cb, noparallel);
+  } else if (ext == ".ybin" || ext == ".YBIN") {
+    return load_ybin_scene(filename, scene, error, progress_cb, noparallel);
   } else {
     return format_error();
   }
@@ -1085,6 +1096,8 @@ bool save_scene(const string& filename, const sceneio_scene* scene,
     return save_pbrt_scene(filename, scene, error, progress_cb, noparallel);
   } else if (ext == ".ply" || ext == ".PLY") {
     return save_ply_scene(filename, scene, error, progress_cb, noparallel);
+  } else if (ext == ".ybin" || ext == ".YBIN") {
+    return save_ybin_scene(filename, scene, error, progress_cb, noparallel);
   } else {
     return format_error();
   }
@@ -1197,6 +1210,48 @@ static bool save_json(const string& filename, const json& js, string& error) {
   return save_text(filename, js.dump(2), error);
 }
 
+// Load the assets in a map by name order, calling `load(name, asset, error)`.
+// Assets are loaded concurrently one per task, so that at most one asset per
+// thread is decoded at a time. On failure, assets after the failed one are
+// skipped and the error of the first failed asset by name is reported.
+template <typename T, typename Func>
+static bool load_assets(const unordered_map<string, T*>& asset_map,
+    const string& message, vec2i& progress, string& error,
+    const progress_callback& progress_cb, bool noparallel, Func&& load) {
+  auto assets = vector<pair<string, T*>>{asset_map.begin(), asset_map.end()};
+  std::sort(assets.begin(), assets.end(),
+      [](auto& a, auto& b) { return a.first < b.first; });
+  if (noparallel) {
+    for (auto& [name, asset] : assets) {
+      if (progress_cb) progress_cb(message, progress.x++, progress.y);
+      if (!load(name, asset, error)) return false;
+    }
+    return true;
+  }
+
+  auto mutex  = std::mutex{};
+  auto failed = std::atomic<int>{(int)assets.size()};
+  auto errors = vector<string>(assets.size());
+  parallel_for(
+      (int)assets.size(),
+      [&](int idx) {
+        if (idx > failed) return;
+        if (progress_cb) {
+          auto lock = std::lock_guard{mutex};
+          progress_cb(message, progress.x++, progress.y);
+        }
+        auto& [name, asset] = assets[idx];
+        if (load(name, asset, errors[idx])) return;
+        auto current = failed.load();
+        while (idx < current && !failed.compare_exchange_weak(current, idx)) {
+        }
+      },
+      1);
+  if (failed == (int)assets.size()) return true;
+  error = errors[failed];
+  return false;
+}
+
 // Save a scene in the builtin JSON format.
 static bool load_json_scene(const string& filename, sceneio_scene* scene,
     string& error, const progress_callback& progress_cb, bool noparallel) {
@@ -1360,6 +1415,7 @@ static bool load_json_scene(const string& filename, sceneio_scene* scene,
       if (!get_value(ejs, "film", camera->film)) return false;
       if (!get_value(ejs, "focus", camera->focus)) return false;
       if (!get_value(ejs, "aperture", camera->aperture)) return false;
+      if (!get_value(ejs, "shutter", camera->shutter)) return false;
       if (ejs.contains("lookat")) {
         auto lookat = identity3x3f;
         if (!get_value(ejs, "lookat", lookat)) return false;
@@ -1434,6 +1490,10 @@ static bool load_json_scene(const string& filename, sceneio_scene* scene,
         if (!get_value(ejs, "lookat", lookat)) return false;
         instance->frame = lookat_frame(lookat.x, lookat.y, lookat.z, true);
       }
+      if (!get_value(ejs, "frames", instance->frames)) return false;
+      if (!ejs.contains("frame") && !ejs.contains("lookat") &&
+          !instance->frames.empty())
+        instance->frame = instance->frames.front();
       if (!get_ref(ejs, "material", instance->material, material_map))
         return false;
       if (!get_shape(ejs, "shape", instance->shape)) return false;
@@ -1462,6 +1522,10 @@ static bool load_json_scene(const string& filename, sceneio_scene* scene,
         if (!get_value(ejs, "lookat", lookat)) return false;
         instance->frame = lookat_frame(lookat.x, lookat.y, lookat.z, true);
       }
+      if (!get_value(ejs, "frames", instance->frames)) return false;
+      if (!ejs.contains("frame") && !ejs.contains("lookat") &&
+          !instance->frames.empty())
+        instance->frame = instance->frames.front();
       if (!get_ref(ejs, "material", instance->material, material_map))
         return false;
       if (!get_shape(ejs, "shape", instance->shape)) return false;
@@ -1498,43 +1562,45 @@ static bool load_json_scene(const string& filename, sceneio_scene* scene,
   };
 
   // load shapes
-  shape_map.erase("");
-  for (auto [name, shape] : shape_map) {
-    if (progress_cb) progress_cb("load shape", progress.x++, progress.y);
+  auto load_shape_ = [&make_filename](const string& name, sceneio_shape* shape,
+                         string& error) {
     auto path = make_filename(name, "shapes", {".ply", ".obj"});
-    if (!load_shape(path, shape->points, shape->lines, shape->triangles,
-            shape->quads, shape->quadspos, shape->quadsnorm,
-            shape->quadstexcoord, shape->positions, shape->normals,
-            shape->texcoords, shape->colors, shape->radius, error,
-            shape->catmullclark && shape->subdivisions > 0))
-      return dependent_error();
-  }
+    return load_shape(path, shape->points, shape->lines, shape->triangles,
+        shape->quads, shape->quadspos, shape->quadsnorm, shape->quadstexcoord,
+        shape->positions, shape->normals, shape->texcoords, shape->colors,
+        shape->radius, error, shape->catmullclark && shape->subdivisions > 0);
+  };
+  shape_map.erase("");
+  if (!load_assets(shape_map, "load shape", progress, error, progress_cb,
+          noparallel, load_shape_))
+    return dependent_error();
+
   // load textures
-  ctexture_map.erase("");
-  for (auto [name, texture] : ctexture_map) {
-    if (progress_cb) progress_cb("load texture", progress.x++, progress.y);
+  auto load_texture_ = [&make_filename](const string& name,
+                           sceneio_texture* texture, string& error) {
     auto path = make_filename(
         name, "textures", {".hdr", ".exr", ".png", ".jpg"});
-    if (!load_image(path, texture->hdr, texture->ldr, error))
-      return dependent_error();
-  }
-  // load textures
+    return load_image(path, texture->hdr, texture->ldr, error);
+  };
+  ctexture_map.erase("");
+  if (!load_assets(ctexture_map, "load texture", progress, error, progress_cb,
+          noparallel, load_texture_))
+    return dependent_error();
   stexture_map.erase("");
-  for (auto [name, texture] : stexture_map) {
-    if (progress_cb) progress_cb("load texture", progress.x++, progress.y);
-    auto path = make_filename(
-        name, "textures", {".hdr", ".exr", ".png", ".jpg"});
-    if (!load_image(path, texture->hdr, texture->ldr, error))
-      return dependent_error();
-  }
+  if (!load_assets(stexture_map, "load texture", progress, error, progress_cb,
+          noparallel, load_texture_))
+    return dependent_error();
 
   // load instances
-  ply_instance_map.erase("");
-  for (auto [name, instance] : ply_instance_map) {
-    if (progress_cb) progress_cb("load instance", progress.x++, progress.y);
+  auto load_instance_ = [&make_filename](const string& name,
+                            ply_instance* instance, string& error) {
     auto path = make_filename(name, "instances", {".ply"});
-    if (!load_instance(path, instance->frames, error)) return dependent_error();
-  }
+    return load_instance(path, instance->frames, error);
+  };
+  ply_instance_map.erase("");
+  if (!load_assets(ply_instance_map, "load instance", progress, error,
+          progress_cb, noparallel, load_instance_))
+    return dependent_error();
 
   // apply instances
   if (!ply_instances.empty()) {
@@ -1547,6 +1613,7 @@ static bool load_json_scene(const string& filename, sceneio_scene* scene,
       if (it == instance_ply.end()) {
         auto ninstance      = add_instance(scene, instance->name);
         ninstance->frame    = instance->frame;
+        ninstance->frames   = instance->frames;
         ninstance->shape    = instance->shape;
         ninstance->material = instance->material;
       } else {
@@ -1623,6 +1690,7 @@ static bool save_json_scene(const string& filename, const sceneio_scene* scene,
     add_opt(ejs, "film", camera->film, def_cam.film);
     add_opt(ejs, "focus", camera->focus, def_cam.focus);
     add_opt(ejs, "aperture", camera->aperture, def_cam.aperture);
+    add_opt(ejs, "shutter", camera->shutter, def_cam.shutter);
   }
 
   auto def_env = sceneio_environment{};
@@ -1674,6 +1742,7 @@ static bool save_json_scene(const string& filename, const sceneio_scene* scene,
   for (auto instance : scene->instances) {
     auto& ejs = js["instances"][instance->name];
     add_opt(ejs, "frame", instance->frame, def_object.frame);
+    add_opt(ejs, "frames", instance->frames, def_object.frames);
     add_ref(ejs, "shape", instance->shape);
     add_ref(ejs, "material", instance->material);
     if (instance->shape != nullptr) {
@@ -2122,6 +2191,601 @@ static bool save_ply_scene(const string& filename, const sceneio_scene* scene,
 
 }  // namespace yocto
 
+// -----------------------------------------------------------------------------
+// BINARY SCENE IO
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// A ybin file stores a whole scene in a single file that can be memory mapped
+// on load. The file starts with a header that holds the table of contents,
+// that is one array of records for each kind of scene object. Records are
+// plain structs whose names and buffers are raw arrays stored elsewhere in
+// the file, and whose references to other objects are indices, with -1 for
+// none. Arrays are aligned to 64 bytes and are written in the host layout,
+// whose byte order and record sizes are stored in the header and checked on
+// load. Texture pixels are stored decoded.
+static const auto ybin_magic     = array<char, 8>{'y', 'o', 'c', 't', 'o',
+    'b', 'i', 'n'};
+static const auto ybin_version   = (uint32_t)2;
+static const auto ybin_byteorder = (uint32_t)0x01020304;
+static const auto ybin_alignment = (uint64_t)64;
+
+// Array of values in a ybin file, as a byte offset and a count
+struct ybin_array {
+  uint64_t offset;
+  uint64_t count;
+};
+
+// Ybin file header
+struct ybin_header {
+  array<char, 8>     magic;
+  uint32_t           version;
+  uint32_t           byteorder;
+  array<uint32_t, 8> sizes;
+  ybin_array         name;
+  ybin_array         copyright;
+  ybin_array         cameras;
+  ybin_array         textures;
+  ybin_array         materials;
+  ybin_array         shapes;
+  ybin_array         instances;
+  ybin_array         environments;
+};
+
+// Ybin records. Records have no default member initializers, so that values
+// in vectors are zero-initialized, padding included.
+struct ybin_camera {
+  ybin_array name;
+  frame3f    frame;
+  uint32_t   orthographic;
+  float      lens;
+  float      film;
+  float      aspect;
+  float      focus;
+  float      aperture;
+  float      shutter;
+};
+struct ybin_texture {
+  ybin_array name;
+  vec2i      hdr_size;
+  ybin_array hdr;
+  vec2i      ldr_size;
+  ybin_array ldr;
+};
+struct ybin_material {
+  ybin_array name;
+  vec3f      emission;
+  vec3f      color;
+  float      specular;
+  float      roughness;
+  float      metallic;
+  float      ior;
+  vec3f      spectint;
+  float      coat;
+  float      transmission;
+  float      translucency;
+  vec3f      scattering;
+  float      scanisotropy;
+  float      trdepth;
+  float      opacity;
+  uint32_t   thin;
+  int32_t    emission_tex;
+  int32_t    color_tex;
+  int32_t    specular_tex;
+  int32_t    metallic_tex;
+  int32_t    roughness_tex;
+  int32_t    transmission_tex;
+  int32_t    translucency_tex;
+  int32_t    spectint_tex;
+  int32_t    scattering_tex;
+  int32_t    coat_tex;
+  int32_t    opacity_tex;
+  int32_t    normal_tex;
+};
+struct ybin_shape {
+  ybin_array name;
+  ybin_array points;
+  ybin_array lines;
+  ybin_array triangles;
+  ybin_array quads;
+  ybin_array quadspos;
+  ybin_array quadsnorm;
+  ybin_array quadstexcoord;
+  ybin_array positions;
+  ybin_array normals;
+  ybin_array texcoords;
+  ybin_array colors;
+  ybin_array radius;
+  ybin_array tangents;
+  int32_t    subdivisions;
+  uint32_t   catmullclark;
+  uint32_t   smooth;
+  float      displacement;
+  int32_t    displacement_tex;
+};
+struct ybin_instance {
+  ybin_array name;
+  frame3f    frame;
+  ybin_array frames;
+  int32_t    shape;
+  int32_t    material;
+};
+struct ybin_environment {
+  ybin_array name;
+  frame3f    frame;
+  vec3f      emission;
+  int32_t    emission_tex;
+};
+
+// Sizes of the header and records in the host layout, that differ for
+// example between 32 and 64 bit builds
+static const auto ybin_sizes = array<uint32_t, 8>{
+    (uint32_t)sizeof(ybin_header), (uint32_t)sizeof(ybin_array),
+    (uint32_t)sizeof(ybin_camera), (uint32_t)sizeof(ybin_texture),
+    (uint32_t)sizeof(ybin_material), (uint32_t)sizeof(ybin_shape),
+    (uint32_t)sizeof(ybin_instance), (uint32_t)sizeof(ybin_environment)};
+
+// Layout of a ybin file, as the list of blocks to write in file order
+struct ybin_block {
+  uint64_t    offset = 0;
+  const void* data   = nullptr;
+  size_t      size   = 0;
+};
+struct ybin_layout {
+  uint64_t           size   = 0;
+  vector<ybin_block> blocks = {};
+};
+
+// Adds an array to the file layout
+template <typename T>
+static ybin_array add_ybin_array(
+    ybin_layout& layout, const T* values, size_t count) {
+  if (count == 0) return {0, 0};
+  auto offset = (layout.size + ybin_alignment - 1) / ybin_alignment *
+                ybin_alignment;
+  layout.blocks.push_back({offset, values, count * sizeof(T)});
+  layout.size = offset + count * sizeof(T);
+  return {offset, count};
+}
+template <typename T>
+static ybin_array add_ybin_array(ybin_layout& layout, const vector<T>& values) {
+  return add_ybin_array(layout, values.data(), values.size());
+}
+static ybin_array add_ybin_array(ybin_layout& layout, const string& value) {
+  return add_ybin_array(layout, value.data(), value.size());
+}
+
+// Gets an array from a mapped file, checking its bounds
+template <typename T>
+static bool get_ybin_array(
+    const mapped_file& mf, const ybin_array& array, T* values) {
+  if (array.count > mf.size / sizeof(T)) return false;
+  if (array.offset > mf.size - array.count * sizeof(T)) return false;
+  if (array.count == 0) return true;
+  memcpy(values, mf.data + array.offset, array.count * sizeof(T));
+  return true;
+}
+template <typename T>
+static bool get_ybin_array(
+    const mapped_file& mf, const ybin_array& array, vector<T>& values) {
+  if (array.count > mf.size / sizeof(T)) return false;
+  values.resize(array.count);
+  return get_ybin_array(mf, array, values.data());
+}
+static bool get_ybin_array(
+    const mapped_file& mf, const ybin_array& array, string& value) {
+  if (array.count > mf.size) return false;
+  value.resize(array.count);
+  return get_ybin_array(mf, array, value.data());
+}
+template <typename T>
+static bool get_ybin_array(const mapped_file& mf, const vec2i& size,
+    const ybin_array& array, image<T>& img) {
+  if (size == zero2i) return array.count == 0;
+  if (size.x <= 0 || size.y <= 0) return false;
+  if (array.count != (uint64_t)size.x * (uint64_t)size.y) return false;
+  if (array.count > mf.size / sizeof(T)) return false;
+  img = image<T>{size};
+  return get_ybin_array(mf, array, img.data());
+}
+
+// Gets an object from its index, with -1 for none
+template <typename T>
+static bool get_ybin_object(const vector<T*>& objects, int index, T*& object) {
+  if (index < -1 || index >= (int)objects.size()) return false;
+  object = index < 0 ? nullptr : objects[index];
+  return true;
+}
+
+// Load a scene in the binary format.
+static bool load_ybin_scene(const string& filename, sceneio_scene* scene,
+    string& error, const progress_callback& progress_cb, bool noparallel) {
+  auto open_error = [filename, &error]() {
+    error = filename + ": file not found";
+    return false;
+  };
+  auto format_error = [filename, &error]() {
+    error = filename + ": corrupted binary scene";
+    return false;
+  };
+  auto version_error = [filename, &error]() {
+    error = filename + ": unsupported binary scene version";
+    return false;
+  };
+  auto byteorder_error = [filename, &error]() {
+    error = filename + ": binary scene written with a different byte order";
+    return false;
+  };
+  auto layout_error = [filename, &error]() {
+    error = filename + ": binary scene written with a different record layout";
+    return false;
+  };
+
+  // handle progress
+  auto progress = vec2i{0, 2};
+  if (progress_cb) progress_cb("load scene", progress.x++, progress.y);
+
+  // map file
+  auto mf = map_file(filename);
+  if (!mf) return open_error();
+
+  // header, checking the fields that precede the sizes first, since they
+  // have the same layout on all platforms
+  auto header = ybin_header{};
+  auto prefix = (uint64_t)(offsetof(ybin_header, sizes) + sizeof(header.sizes));
+  if (!get_ybin_array(mf, {0, prefix}, (byte*)&header)) return format_error();
+  if (header.magic != ybin_magic) return format_error();
+  if (header.byteorder == swap_endian(ybin_byteorder)) return byteorder_error();
+  if (header.byteorder != ybin_byteorder) return format_error();
+  if (header.version != ybin_version) return version_error();
+  if (header.sizes != ybin_sizes) return layout_error();
+  if (!get_ybin_array(mf, {0, 1}, &header)) return format_error();
+
+  // records
+  auto cameras      = vector<ybin_camera>{};
+  auto textures     = vector<ybin_texture>{};
+  auto materials    = vector<ybin_material>{};
+  auto shapes       = vector<ybin_shape>{};
+  auto instances    = vector<ybin_instance>{};
+  auto environments = vector<ybin_environment>{};
+  if (!get_ybin_array(mf, header.name, scene->name)) return format_error();
+  if (!get_ybin_array(mf, header.copyright, scene->copyright))
+    return format_error();
+  if (!get_ybin_array(mf, header.cameras, cameras)) return format_error();
+  if (!get_ybin_array(mf, header.textures, textures)) return format_error();
+  if (!get_ybin_array(mf, header.materials, materials)) return format_error();
+  if (!get_ybin_array(mf, header.shapes, shapes)) return format_error();
+  if (!get_ybin_array(mf, header.instances, instances)) return format_error();
+  if (!get_ybin_array(mf, header.environments, environments))
+    return format_error();
+
+  // create objects first, so that references can be resolved
+  for (auto& record : textures) {
+    auto texture = add_texture(scene);
+    if (!get_ybin_array(mf, record.name, texture->name)) return format_error();
+  }
+  for (auto& record : shapes) {
+    auto shape = add_shape(scene);
+    if (!get_ybin_array(mf, record.name, shape->name)) return format_error();
+  }
+
+  // cameras
+  for (auto& record : cameras) {
+    auto camera = add_camera(scene);
+    if (!get_ybin_array(mf, record.name, camera->name)) return format_error();
+    camera->frame        = record.frame;
+    camera->orthographic = record.orthographic != 0;
+    camera->lens         = record.lens;
+    camera->film         = record.film;
+    camera->aspect       = record.aspect;
+    camera->focus        = record.focus;
+    camera->aperture     = record.aperture;
+    camera->shutter      = record.shutter;
+  }
+
+  // materials
+  for (auto& record : materials) {
+    auto material = add_material(scene);
+    if (!get_ybin_array(mf, record.name, material->name))
+      return format_error();
+    material->emission     = record.emission;
+    material->color        = record.color;
+    material->specular     = record.specular;
+    material->roughness    = record.roughness;
+    material->metallic     = record.metallic;
+    material->ior          = record.ior;
+    material->spectint     = record.spectint;
+    material->coat         = record.coat;
+    material->transmission = record.transmission;
+    material->translucency = record.translucency;
+    material->scattering   = record.scattering;
+    material->scanisotropy = record.scanisotropy;
+    material->trdepth      = record.trdepth;
+    material->opacity      = record.opacity;
+    material->thin         = record.thin != 0;
+    auto get_texture       = [&](int index, sceneio_texture*& texture) {
+      return get_ybin_object(scene->textures, index, texture);
+    };
+    if (!get_texture(record.emission_tex, material->emission_tex) ||
+        !get_texture(record.color_tex, material->color_tex) ||
+        !get_texture(record.specular_tex, material->specular_tex) ||
+        !get_texture(record.metallic_tex, material->metallic_tex) ||
+        !get_texture(record.roughness_tex, material->roughness_tex) ||
+        !get_texture(record.transmission_tex, material->transmission_tex) ||
+        !get_texture(record.translucency_tex, material->translucency_tex) ||
+        !get_texture(record.spectint_tex, material->spectint_tex) ||
+        !get_texture(record.scattering_tex, material->scattering_tex) ||
+        !get_texture(record.coat_tex, material->coat_tex) ||
+        !get_texture(record.opacity_tex, material->opacity_tex) ||
+        !get_texture(record.normal_tex, material->normal_tex))
+      return format_error();
+  }
+
+  // shape properties
+  for (auto idx = (size_t)0; idx < shapes.size(); idx++) {
+    auto& record        = shapes[idx];
+    auto  shape         = scene->shapes[idx];
+    shape->subdivisions = record.subdivisions;
+    shape->catmullclark = record.catmullclark != 0;
+    shape->smooth       = record.smooth != 0;
+    shape->displacement = record.displacement;
+    if (!get_ybin_object(scene->textures, record.displacement_tex,
+            shape->displacement_tex))
+      return format_error();
+  }
+
+  // instances
+  for (auto& record : instances) {
+    auto instance = add_instance(scene);
+    if (!get_ybin_array(mf, record.name, instance->name))
+      return format_error();
+    instance->frame = record.frame;
+    if (!get_ybin_array(mf, record.frames, instance->frames))
+      return format_error();
+    if (!get_ybin_object(scene->shapes, record.shape, instance->shape))
+      return format_error();
+    if (!get_ybin_object(scene->materials, record.material, instance->material))
+      return format_error();
+  }
+
+  // environments
+  for (auto& record : environments) {
+    auto environment = add_environment(scene);
+    if (!get_ybin_array(mf, record.name, environment->name))
+      return format_error();
+    environment->frame    = record.frame;
+    environment->emission = record.emission;
+    if (!get_ybin_object(scene->textures, record.emission_tex,
+            environment->emission_tex))
+      return format_error();
+  }
+
+  // copy texture pixels and shape buffers, one object per task, since most
+  // of the time is spent faulting in the pages of the mapping
+  auto copy_buffers = [&](int idx) {
+    if (idx < (int)textures.size()) {
+      auto& record  = textures[idx];
+      auto  texture = scene->textures[idx];
+      return get_ybin_array(mf, record.hdr_size, record.hdr, texture->hdr) &&
+             get_ybin_array(mf, record.ldr_size, record.ldr, texture->ldr);
+    } else {
+      auto& record = shapes[idx - textures.size()];
+      auto  shape  = scene->shapes[idx - textures.size()];
+      return get_ybin_array(mf, record.points, shape->points) &&
+             get_ybin_array(mf, record.lines, shape->lines) &&
+             get_ybin_array(mf, record.triangles, shape->triangles) &&
+             get_ybin_array(mf, record.quads, shape->quads) &&
+             get_ybin_array(mf, record.quadspos, shape->quadspos) &&
+             get_ybin_array(mf, record.quadsnorm, shape->quadsnorm) &&
+             get_ybin_array(mf, record.quadstexcoord, shape->quadstexcoord) &&
+             get_ybin_array(mf, record.positions, shape->positions) &&
+             get_ybin_array(mf, record.normals, shape->normals) &&
+             get_ybin_array(mf, record.texcoords, shape->texcoords) &&
+             get_ybin_array(mf, record.colors, shape->colors) &&
+             get_ybin_array(mf, record.radius, shape->radius) &&
+             get_ybin_array(mf, record.tangents, shape->tangents);
+    }
+  };
+  auto num_buffers = (int)(textures.size() + shapes.size());
+  if (noparallel) {
+    for (auto idx = 0; idx < num_buffers; idx++) {
+      if (!copy_buffers(idx)) return format_error();
+    }
+  } else {
+    auto failed = std::atomic<bool>{false};
+    parallel_for(
+        num_buffers,
+        [&](int idx) {
+          if (failed) return;
+          if (!copy_buffers(idx)) failed = true;
+        },
+        1);
+    if (failed) return format_error();
+  }
+
+  // done
+  if (progress_cb) progress_cb("load done", progress.x++, progress.y);
+  return true;
+}
+
+// Save a scene in the binary format.
+static bool save_ybin_scene(const string& filename, const sceneio_scene* scene,
+    string& error, const progress_callback& progress_cb, bool noparallel) {
+  auto open_error = [filename, &error]() {
+    error = filename + ": file not found";
+    return false;
+  };
+  auto write_error = [filename, &error]() {
+    error = filename + ": write error";
+    return false;
+  };
+
+  // handle progress
+  auto progress = vec2i{0, 2};
+  if (progress_cb) progress_cb("save scene", progress.x++, progress.y);
+
+  // object indices
+  auto texture_map  = unordered_map<const sceneio_texture*, int>{{nullptr, -1}};
+  auto shape_map    = unordered_map<const sceneio_shape*, int>{{nullptr, -1}};
+  auto material_map = unordered_map<const sceneio_material*, int>{
+      {nullptr, -1}};
+  for (auto idx = (size_t)0; idx < scene->textures.size(); idx++)
+    texture_map[scene->textures[idx]] = (int)idx;
+  for (auto idx = (size_t)0; idx < scene->shapes.size(); idx++)
+    shape_map[scene->shapes[idx]] = (int)idx;
+  for (auto idx = (size_t)0; idx < scene->materials.size(); idx++)
+    material_map[scene->materials[idx]] = (int)idx;
+
+  // header and records, laid out before the arrays they reference
+  auto header       = vector<ybin_header>(1);
+  auto cameras      = vector<ybin_camera>(scene->cameras.size());
+  auto textures     = vector<ybin_texture>(scene->textures.size());
+  auto materials    = vector<ybin_material>(scene->materials.size());
+  auto shapes       = vector<ybin_shape>(scene->shapes.size());
+  auto instances    = vector<ybin_instance>(scene->instances.size());
+  auto environments = vector<ybin_environment>(scene->environments.size());
+  auto layout       = ybin_layout{};
+  add_ybin_array(layout, header);
+  header[0].magic        = ybin_magic;
+  header[0].version      = ybin_version;
+  header[0].byteorder    = ybin_byteorder;
+  header[0].sizes        = ybin_sizes;
+  header[0].cameras      = add_ybin_array(layout, cameras);
+  header[0].textures     = add_ybin_array(layout, textures);
+  header[0].materials    = add_ybin_array(layout, materials);
+  header[0].shapes       = add_ybin_array(layout, shapes);
+  header[0].instances    = add_ybin_array(layout, instances);
+  header[0].environments = add_ybin_array(layout, environments);
+  header[0].name         = add_ybin_array(layout, scene->name);
+  header[0].copyright    = add_ybin_array(layout, scene->copyright);
+
+  // cameras
+  for (auto idx = (size_t)0; idx < cameras.size(); idx++) {
+    auto  camera        = scene->cameras[idx];
+    auto& record        = cameras[idx];
+    record.name         = add_ybin_array(layout, camera->name);
+    record.frame        = camera->frame;
+    record.orthographic = camera->orthographic ? 1 : 0;
+    record.lens         = camera->lens;
+    record.film         = camera->film;
+    record.aspect       = camera->aspect;
+    record.focus        = camera->focus;
+    record.aperture     = camera->aperture;
+    record.shutter      = camera->shutter;
+  }
+
+  // materials
+  for (auto idx = (size_t)0; idx < materials.size(); idx++) {
+    auto  material          = scene->materials[idx];
+    auto& record            = materials[idx];
+    record.name             = add_ybin_array(layout, material->name);
+    record.emission         = material->emission;
+    record.color            = material->color;
+    record.specular         = material->specular;
+    record.roughness        = material->roughness;
+    record.metallic         = material->metallic;
+    record.ior              = material->ior;
+    record.spectint         = material->spectint;
+    record.coat             = material->coat;
+    record.transmission     = material->transmission;
+    record.translucency     = material->translucency;
+    record.scattering       = material->scattering;
+    record.scanisotropy     = material->scanisotropy;
+    record.trdepth          = material->trdepth;
+    record.opacity          = material->opacity;
+    record.thin             = material->thin ? 1 : 0;
+    record.emission_tex     = texture_map.at(material->emission_tex);
+    record.color_tex        = texture_map.at(material->color_tex);
+    record.specular_tex     = texture_map.at(material->specular_tex);
+    record.metallic_tex     = texture_map.at(material->metallic_tex);
+    record.roughness_tex    = texture_map.at(material->roughness_tex);
+    record.transmission_tex = texture_map.at(material->transmission_tex);
+    record.translucency_tex = texture_map.at(material->translucency_tex);
+    record.spectint_tex     = texture_map.at(material->spectint_tex);
+    record.scattering_tex   = texture_map.at(material->scattering_tex);
+    record.coat_tex         = texture_map.at(material->coat_tex);
+    record.opacity_tex      = texture_map.at(material->opacity_tex);
+    record.normal_tex       = texture_map.at(material->normal_tex);
+  }
+
+  // instances
+  for (auto idx = (size_t)0; idx < instances.size(); idx++) {
+    auto  instance  = scene->instances[idx];
+    auto& record    = instances[idx];
+    record.name     = add_ybin_array(layout, instance->name);
+    record.frame    = instance->frame;
+    record.frames   = add_ybin_array(layout, instance->frames);
+    record.shape    = shape_map.at(instance->shape);
+    record.material = material_map.at(instance->material);
+  }
+
+  // environments
+  for (auto idx = (size_t)0; idx < environments.size(); idx++) {
+    auto  environment   = scene->environments[idx];
+    auto& record        = environments[idx];
+    record.name         = add_ybin_array(layout, environment->name);
+    record.frame        = environment->frame;
+    record.emission     = environment->emission;
+    record.emission_tex = texture_map.at(environment->emission_tex);
+  }
+
+  // textures
+  for (auto idx = (size_t)0; idx < textures.size(); idx++) {
+    auto  texture   = scene->textures[idx];
+    auto& record    = textures[idx];
+    record.name     = add_ybin_array(layout, texture->name);
+    record.hdr_size = texture->hdr.imsize();
+    record.hdr      = add_ybin_array(
+        layout, texture->hdr.data(), texture->hdr.count());
+    record.ldr_size = texture->ldr.imsize();
+    record.ldr      = add_ybin_array(
+        layout, texture->ldr.data(), texture->ldr.count());
+  }
+
+  // shapes
+  for (auto idx = (size_t)0; idx < shapes.size(); idx++) {
+    auto  shape             = scene->shapes[idx];
+    auto& record            = shapes[idx];
+    record.name             = add_ybin_array(layout, shape->name);
+    record.points           = add_ybin_array(layout, shape->points);
+    record.lines            = add_ybin_array(layout, shape->lines);
+    record.triangles        = add_ybin_array(layout, shape->triangles);
+    record.quads            = add_ybin_array(layout, shape->quads);
+    record.quadspos         = add_ybin_array(layout, shape->quadspos);
+    record.quadsnorm        = add_ybin_array(layout, shape->quadsnorm);
+    record.quadstexcoord    = add_ybin_array(layout, shape->quadstexcoord);
+    record.positions        = add_ybin_array(layout, shape->positions);
+    record.normals          = add_ybin_array(layout, shape->normals);
+    record.texcoords        = add_ybin_array(layout, shape->texcoords);
+    record.colors           = add_ybin_array(layout, shape->colors);
+    record.radius           = add_ybin_array(layout, shape->radius);
+    record.tangents         = add_ybin_array(layout, shape->tangents);
+    record.subdivisions     = shape->subdivisions;
+    record.catmullclark     = shape->catmullclark ? 1 : 0;
+    record.smooth           = shape->smooth ? 1 : 0;
+    record.displacement     = shape->displacement;
+    record.displacement_tex = texture_map.at(shape->displacement_tex);
+  }
+
+  // write blocks in file order, padding to their offsets
+  auto fs = open_file(filename, "wb");
+  if (!fs) return open_error();
+  auto padding = array<byte, ybin_alignment>{};
+  auto written = (uint64_t)0;
+  for (auto& [offset, data, size] : layout.blocks) {
+    if (!write_data(fs, padding.data(), offset - written)) return write_error();
+    if (!write_data(fs, data, size)) return write_error();
+    written = offset + size;
+  }
+  if (!close_file(fs)) return write_error();
+
+  // done
+  if (progress_cb) progress_cb("save done", progress.x++, progress.y);
+  return true;
+}
+
+}  // namespace yocto
+
 // -----------------------------------------------------------------------------
 // GLTF CONVESION
 // -----------------------------------------------------------------------------
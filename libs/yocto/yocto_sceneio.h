@@ -4,7 +4,7 @@
 // Yocto/Scene defines a simple scene representation, and related utilities,
 // mostly geared towards scene creation and serialization.
 // Yocto/SceneIO supports loading and saving scenes from Ply, Obj, Pbrt, glTF
-// and a custom Json format.
+// and custom Json and binary formats.
 // Yocto/SceneIO is implemented in `yocto_sceneio.h` and `yocto_sceneio.cpp`,
 // and depends on `cgltf.h`.
 //
@@ -90,6 +90,7 @@ struct sceneio_camera {
   float   aspect       = 1.500;
   float   focus        = 10000;
   float   aperture     = 0;
+  float   shutter      = 0;
 };
 
 // Texture containing either an LDR or HDR image. HdR images are encoded
@@ -185,6 +186,7 @@ struct sceneio_instance {
   // instance data
   string            name     = "";
   frame3f           frame    = identity3x4f;
+  vector<frame3f>   frames   = {};
   sceneio_shape*    shape    = nullptr;
   sceneio_material* material = nullptr;
 };
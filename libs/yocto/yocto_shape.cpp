@@ -3532,36 +3532,26 @@ bool load_shape(const string& filename, vector<int>& points,
   radius        = {};
 
   auto ext = path_extension(filename);
-  if (ext == ".ply" || ext == ".PLY") {
+  if ((ext == ".ply" || ext == ".PLY") && !facevarying) {
+    // load buffers directly, without an intermediate ply model
+    if (!load_ply_shape(filename, points, lines, triangles, quads, positions,
+            normals, texcoords, colors, radius, error, flip_texcoord))
+      return false;
+    if (positions.empty()) return shape_error();
+    return true;
+  } else if (ext == ".ply" || ext == ".PLY") {
     // open ply
     auto ply_guard = std::make_unique<ply_model>();
     auto ply       = ply_guard.get();
     if (!load_ply(filename, ply, error)) return false;
 
-    if (!facevarying) {
-      // gets vertex
-      get_positions(ply, positions);
-      get_normals(ply, normals);
-      get_texcoords(ply, texcoords, flip_texcoord);
-      get_colors(ply, colors);
-      get_radius(ply, radius);
-
-      // get faces
-      if (has_quads(ply)) {
-        get_quads(ply, quads);
-      } else {
-        get_triangles(ply, triangles);
-      }
-      get_lines(ply, lines);
-      get_points(ply, points);
-    } else {
-      get_positions(ply, positions);
-      get_normals(ply, normals);
-      get_texcoords(ply, texcoords, flip_texcoord);
-      get_quads(ply, quadspos);
-      if (!normals.empty()) quadsnorm = quadspos;
-      if (!texcoords.empty()) quadstexcoord = quadspos;
-    }
+    // get facevarying shape
+    get_positions(ply, positions);
+    get_normals(ply, normals);
+    get_texcoords(ply, texcoords, flip_texcoord);
+    get_quads(ply, quadspos);
+    if (!normals.empty()) quadsnorm = quadspos;
+    if (!texcoords.empty()) quadstexcoord = quadspos;
 
     if (positions.empty()) return shape_error();
     return true;
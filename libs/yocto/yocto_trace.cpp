@@ -29,6 +29,7 @@
 #include "yocto_trace.h"
 
 #include <algorithm>
+#include <chrono>
 #include <cstring>
 #include <deque>
 #include <memory>
@@ -328,6 +329,148 @@ vec4f eval_texture(const trace_texture* texture, const vec2f& uv,
          lookup_texture(texture, {ii, jj}, ldr_as_linear) * u * v;
 }
 
+// Halve an image with a box filter, averaging texels decoded to linear
+// values. For odd sizes, the last row and column average three texels, so
+// that no texel is dropped.
+template <typename T, typename Decode, typename Encode>
+static image<T> make_mipmap(
+    const image<T>& img, Decode&& decode, Encode&& encode) {
+  auto mip = image<T>{
+      {max(img.width() / 2, 1), max(img.height() / 2, 1)}};
+  for (auto j = 0; j < mip.height(); j++) {
+    for (auto i = 0; i < mip.width(); i++) {
+      auto ii = (i == mip.width() - 1) ? img.width() - 1 : 2 * i + 1;
+      auto jj = (j == mip.height() - 1) ? img.height() - 1 : 2 * j + 1;
+      auto sum = zero4f;
+      for (auto sj = 2 * j; sj <= jj; sj++) {
+        for (auto si = 2 * i; si <= ii; si++) sum += decode(img[{si, sj}]);
+      }
+      mip[{i, j}] = encode(sum / (float)((ii - 2 * i + 1) * (jj - 2 * j + 1)));
+    }
+  }
+  return mip;
+}
+
+// Build the mip levels of a texture, if not already built. LDR levels are
+// averaged in linear space, so they are built separately for lookups that
+// decode them from sRGB and for lookups that use them as linear. Concurrent
+// lookups of the same texture wait for the first one to finish, while
+// different textures are built in parallel by the threads that need them.
+static void init_mipmaps(const trace_texture* texture, bool ldr_as_linear) {
+  auto  linear    = ldr_as_linear && texture->hdr.empty();
+  auto& mipmapped = linear ? texture->linear_mipmapped : texture->mipmapped;
+  if (mipmapped) return;
+  auto lock = std::lock_guard{texture->mips_mutex};
+  if (mipmapped) return;
+  if (!texture->hdr.empty()) {
+    auto identity = [](const vec4f& texel) { return texel; };
+    texture->hdr_mips.clear();
+    auto level = &texture->hdr;
+    while (level->width() > 1 || level->height() > 1) {
+      texture->hdr_mips.push_back(make_mipmap(*level, identity, identity));
+      level = &texture->hdr_mips.back();
+    }
+  } else if (!texture->ldr.empty()) {
+    auto decode = [linear](const vec4b& texel) {
+      return linear ? byte_to_float(texel) : srgb_to_rgb(byte_to_float(texel));
+    };
+    auto encode = [linear](const vec4f& texel) {
+      return linear ? float_to_byte(texel) : float_to_byte(rgb_to_srgb(texel));
+    };
+    auto& mips = linear ? texture->ldr_linear_mips : texture->ldr_mips;
+    mips.clear();
+    auto level = &texture->ldr;
+    while (level->width() > 1 || level->height() > 1) {
+      mips.push_back(make_mipmap(*level, decode, encode));
+      level = &mips.back();
+    }
+  }
+  mipmapped = true;
+}
+
+// Clear mip levels
+void clear_mipmaps(trace_texture* texture) {
+  auto lock = std::lock_guard{texture->mips_mutex};
+  texture->hdr_mips.clear();
+  texture->ldr_mips.clear();
+  texture->ldr_linear_mips.clear();
+  texture->mipmapped        = false;
+  texture->linear_mipmapped = false;
+}
+
+// Evaluate a mip level with bilinear interpolation and tiling
+static vec4f eval_mipmap(const trace_texture* texture, int level,
+    const vec2f& uv, bool ldr_as_linear) {
+  if (level == 0) return eval_texture(texture, uv, ldr_as_linear);
+  auto& ldr_mips = ldr_as_linear ? texture->ldr_linear_mips
+                                 : texture->ldr_mips;
+  auto  lookup   = [&](const vec2i& ij) -> vec4f {
+    if (!texture->hdr_mips.empty()) {
+      return texture->hdr_mips[level - 1][ij];
+    } else {
+      auto& ldr = ldr_mips[level - 1];
+      return ldr_as_linear ? byte_to_float(ldr[ij])
+                           : srgb_to_rgb(byte_to_float(ldr[ij]));
+    }
+  };
+  auto size = !texture->hdr_mips.empty() ? texture->hdr_mips[level - 1].imsize()
+                                         : ldr_mips[level - 1].imsize();
+  auto s    = fmod(uv.x, 1.0f) * size.x;
+  if (s < 0) s += size.x;
+  auto t = fmod(uv.y, 1.0f) * size.y;
+  if (t < 0) t += size.y;
+  auto i = clamp((int)s, 0, size.x - 1), j = clamp((int)t, 0, size.y - 1);
+  auto ii = (i + 1) % size.x, jj = (j + 1) % size.y;
+  auto u = s - i, v = t - j;
+  return lookup({i, j}) * (1 - u) * (1 - v) + lookup({i, jj}) * (1 - u) * v +
+         lookup({ii, j}) * u * (1 - v) + lookup({ii, jj}) * u * v;
+}
+
+// Evaluate a texture over a footprint
+vec4f eval_texture(const trace_texture* texture, const vec2f& uv,
+    const trace_footprint& footprint, bool ldr_as_linear) {
+  // get texture
+  if (texture == nullptr) return {1, 1, 1, 1};
+
+  // footprint axes in texels, with the major axis first
+  auto size  = texture_size(texture);
+  auto scale = vec2f{(float)size.x, (float)size.y};
+  auto major = footprint.duvdx, minor = footprint.duvdy;
+  if (length(major * scale) < length(minor * scale)) std::swap(major, minor);
+  auto major_length = length(major * scale);
+  auto minor_length = length(minor * scale);
+
+  // footprints smaller than a texel use the base level
+  if (!isfinite(major_length) || major_length <= 1)
+    return eval_texture(texture, uv, ldr_as_linear);
+  init_mipmaps(texture, ldr_as_linear);
+
+  // approximate elongated footprints with lookups along the major axis
+  const auto max_anisotropy = 8;
+  auto       nlookups       = clamp(
+      (int)ceil(major_length / max(minor_length, 1.0f)), 1, max_anisotropy);
+  auto nlevels = 1 + (int)(!texture->hdr_mips.empty() ? texture->hdr_mips.size()
+                           : ldr_as_linear ? texture->ldr_linear_mips.size()
+                                           : texture->ldr_mips.size());
+  auto lod   = clamp(log2(max(minor_length, major_length / nlookups)), 0.0f,
+      (float)(nlevels - 1));
+  auto level = min((int)lod, nlevels - 2);
+  auto t     = lod - level;
+
+  // trilinear lookups
+  auto color = zero4f;
+  for (auto lookup = 0; lookup < nlookups; lookup++) {
+    auto luv = uv + major * ((lookup + 0.5f) / nlookups - 0.5f);
+    if (nlevels == 1) {
+      color += eval_mipmap(texture, 0, luv, ldr_as_linear);
+    } else {
+      color += eval_mipmap(texture, level, luv, ldr_as_linear) * (1 - t) +
+               eval_mipmap(texture, level + 1, luv, ldr_as_linear) * t;
+    }
+  }
+  return color / (float)nlookups;
+}
+
 // Generates a ray from a camera for yimg::image plane coordinate uv and
 // the lens coordinates luv.
 ray3f eval_camera(
@@ -367,6 +510,31 @@ ray3f eval_camera(
   }
 }
 
+// Eval frame, interpolating the keyframes of moving instances
+frame3f eval_frame(const trace_instance* instance, float time) {
+  auto& frames = instance->frames;
+  if (frames.size() < 2) return instance->frame;
+  auto ftime = clamp(time, 0.0f, 1.0f) * (frames.size() - 1);
+  auto idx   = min((int)ftime, (int)frames.size() - 2);
+  auto t     = ftime - idx;
+  auto &frame0 = frames[idx], &frame1 = frames[idx + 1];
+  return {lerp(frame0.x, frame1.x, t), lerp(frame0.y, frame1.y, t),
+      lerp(frame0.z, frame1.z, t), lerp(frame0.o, frame1.o, t)};
+}
+
+// Get an instance at a time. Moving instances are copied to `moved`, with
+// their frame at that time, so that their properties are evaluated as for
+// static instances.
+static const trace_instance* eval_instance(
+    const trace_instance* instance, float time, trace_instance& moved) {
+  if (instance->frames.size() < 2) return instance;
+  moved.frame       = eval_frame(instance, time);
+  moved.shape       = instance->shape;
+  moved.material    = instance->material;
+  moved.instance_id = instance->instance_id;
+  return &moved;
+}
+
 // Eval position
 vec3f eval_position(
     const trace_instance* instance, int element, const vec2f& uv) {
@@ -524,8 +692,8 @@ pair<vec3f, vec3f> eval_element_tangents(
   }
 }
 
-vec3f eval_normalmap(
-    const trace_instance* instance, int element, const vec2f& uv) {
+vec3f eval_normalmap(const trace_instance* instance, int element,
+    const vec2f& uv, const trace_footprint& footprint) {
   auto shape      = instance->shape;
   auto normal_tex = instance->material->normal_tex;
   // apply normal mapping
@@ -533,7 +701,8 @@ vec3f eval_normalmap(
   auto texcoord = eval_texcoord(instance, element, uv);
   if (normal_tex != nullptr &&
       (!shape->triangles.empty() || !shape->quads.empty())) {
-    auto normalmap = -1 + 2 * xyz(eval_texture(normal_tex, texcoord, true));
+    auto normalmap = -1 + 2 * xyz(eval_texture(
+                                  normal_tex, texcoord, footprint, true));
     auto [tu, tv]  = eval_element_tangents(instance, element);
     auto frame     = frame3f{tu, tv, normal, zero3f};
     frame.x        = orthonormalize(frame.x, frame.z);
@@ -547,13 +716,13 @@ vec3f eval_normalmap(
 
 // Eval shading normal
 vec3f eval_shading_normal(const trace_instance* instance, int element,
-    const vec2f& uv, const vec3f& outgoing) {
+    const vec2f& uv, const vec3f& outgoing, const trace_footprint& footprint) {
   auto shape    = instance->shape;
   auto material = instance->material;
   if (!shape->triangles.empty() || !shape->quads.empty()) {
     auto normal = eval_normal(instance, element, uv);
     if (material->normal_tex != nullptr) {
-      normal = eval_normalmap(instance, element, uv);
+      normal = eval_normalmap(instance, element, uv, footprint);
     }
     if (!material->thin) return normal;
     return dot(normal, outgoing) >= 0 ? normal : -normal;
@@ -589,6 +758,46 @@ vec4f eval_color(const trace_instance* instance, int element, const vec2f& uv) {
   }
 }
 
+// Eval texture footprint. The cone covers an ellipse on the element plane,
+// elongated along the projected ray direction, that is mapped to texture
+// space with the linear map given by the element texcoords.
+trace_footprint eval_footprint(const trace_instance* instance, int element,
+    const vec3f& direction, float width) {
+  auto shape = instance->shape;
+  if (width <= 0 || shape->texcoords.empty()) return {};
+  auto idx = vec3i{};
+  if (!shape->triangles.empty()) {
+    idx = shape->triangles[element];
+  } else if (!shape->quads.empty()) {
+    auto q = shape->quads[element];
+    idx    = {q.x, q.y, q.z};
+  } else {
+    return {};
+  }
+  auto p0 = transform_point(instance->frame, shape->positions[idx.x]);
+  auto e1 = transform_point(instance->frame, shape->positions[idx.y]) - p0;
+  auto e2 = transform_point(instance->frame, shape->positions[idx.z]) - p0;
+  auto t0 = shape->texcoords[idx.x];
+  auto t1 = shape->texcoords[idx.y] - t0, t2 = shape->texcoords[idx.z] - t0;
+  auto e11 = dot(e1, e1), e12 = dot(e1, e2), e22 = dot(e2, e2);
+  auto det = e11 * e22 - e12 * e12;
+  if (det <= 0) return {};
+  // ellipse axes on the element plane
+  auto normal    = normalize(cross(e1, e2));
+  auto cosine    = abs(dot(direction, normal));
+  auto projected = direction - normal * dot(direction, normal);
+  auto major     = length(projected) > 1e-3f ? normalize(projected)
+                                             : normalize(e1);
+  auto minor     = cross(normal, major);
+  // map a vector on the element plane to texture space
+  auto to_uv = [&](const vec3f& w) {
+    auto w1 = dot(w, e1), w2 = dot(w, e2);
+    return t1 * ((e22 * w1 - e12 * w2) / det) +
+           t2 * ((e11 * w2 - e12 * w1) / det);
+  };
+  return {to_uv(major * (width / max(cosine, 0.01f))), to_uv(minor * width)};
+}
+
 // Evaluate environment color.
 vec3f eval_environment(
     const trace_environment* environment, const vec3f& direction) {
@@ -610,36 +819,46 @@ vec3f eval_environment(const trace_scene* scene, const vec3f& direction) {
 }
 
 // Evaluate point
-trace_material_sample eval_material(
-    const trace_material* material, const vec2f& texcoord) {
+trace_material_sample eval_material(const trace_material* material,
+    const vec2f& texcoord, const trace_footprint& footprint) {
   auto mat     = trace_material_sample{};
   mat.emission = material->emission *
-                 xyz(eval_texture(material->emission_tex, texcoord, false));
+                 xyz(eval_texture(
+                     material->emission_tex, texcoord, footprint, false));
   mat.color = material->color *
-              xyz(eval_texture(material->color_tex, texcoord, false));
+              xyz(eval_texture(
+                  material->color_tex, texcoord, footprint, false));
   mat.specular = material->specular *
-                 eval_texture(material->specular_tex, texcoord, true).x;
+                 eval_texture(
+                     material->specular_tex, texcoord, footprint, true).x;
   mat.metallic = material->metallic *
-                 eval_texture(material->metallic_tex, texcoord, true).x;
+                 eval_texture(
+                     material->metallic_tex, texcoord, footprint, true).x;
   mat.roughness = material->roughness *
-                  eval_texture(material->roughness_tex, texcoord, true).x;
+                  eval_texture(
+                      material->roughness_tex, texcoord, footprint, true).x;
   mat.ior  = material->ior;
   mat.coat = material->coat *
-             eval_texture(material->coat_tex, texcoord, true).x;
+             eval_texture(material->coat_tex, texcoord, footprint, true).x;
   mat.transmission = material->transmission *
-                     eval_texture(material->emission_tex, texcoord, true).x;
-  mat.translucency = material->translucency *
-                     eval_texture(material->translucency_tex, texcoord, true).x;
+                     eval_texture(
+                         material->emission_tex, texcoord, footprint, true).x;
+  mat.translucency =
+      material->translucency *
+      eval_texture(material->translucency_tex, texcoord, footprint, true).x;
   mat.opacity = material->opacity *
-                eval_texture(material->opacity_tex, texcoord, true).x;
+                eval_texture(
+                    material->opacity_tex, texcoord, footprint, true).x;
   mat.thin       = material->thin || material->transmission == 0;
   mat.scattering = material->scattering *
-                   xyz(eval_texture(material->scattering_tex, texcoord, false));
+                   xyz(eval_texture(
+                       material->scattering_tex, texcoord, footprint, false));
   mat.scanisotropy = material->scanisotropy;
   mat.trdepth      = material->trdepth;
   mat.normalmap =
       material->normal_tex != nullptr
-          ? -1 + 2 * xyz(eval_texture(material->normal_tex, texcoord, true))
+          ? -1 + 2 * xyz(eval_texture(
+                         material->normal_tex, texcoord, footprint, true))
           : vec3f{0, 0, 1};
   return mat;
 }
@@ -650,45 +869,54 @@ static const auto coat_roughness = 0.03f * 0.03f;
 
 // Eval material to obtain emission, brdf and opacity.
 vec3f eval_emission(const trace_instance* instance, int element,
-    const vec2f& uv, const vec3f& normal, const vec3f& outgoing) {
+    const vec2f& uv, const vec3f& normal, const vec3f& outgoing,
+    const trace_footprint& footprint) {
   auto material = instance->material;
   auto texcoord = eval_texcoord(instance, element, uv);
   return material->emission *
-         xyz(eval_texture(material->emission_tex, texcoord));
+         xyz(eval_texture(material->emission_tex, texcoord, footprint));
 }
 
 // Eval material to obtain emission, brdf and opacity.
 float eval_opacity(const trace_instance* instance, int element, const vec2f& uv,
-    const vec3f& normal, const vec3f& outgoing) {
+    const vec3f& normal, const vec3f& outgoing,
+    const trace_footprint& footprint) {
   auto material = instance->material;
   auto texcoord = eval_texcoord(instance, element, uv);
   auto opacity  = material->opacity *
-                 eval_texture(material->opacity_tex, texcoord, true).x;
+                 eval_texture(
+                     material->opacity_tex, texcoord, footprint, true).x;
   if (opacity > 0.999f) opacity = 1;
   return opacity;
 }
 
 // Evaluate bsdf
 trace_bsdf eval_bsdf(const trace_instance* instance, int element,
-    const vec2f& uv, const vec3f& normal, const vec3f& outgoing) {
+    const vec2f& uv, const vec3f& normal, const vec3f& outgoing,
+    const trace_footprint& footprint) {
   auto material = instance->material;
   auto texcoord = eval_texcoord(instance, element, uv);
   auto color    = material->color * xyz(eval_color(instance, element, uv)) *
-               xyz(eval_texture(material->color_tex, texcoord, false));
+               xyz(eval_texture(
+                   material->color_tex, texcoord, footprint, false));
   auto specular = material->specular *
-                  eval_texture(material->specular_tex, texcoord, true).x;
+                  eval_texture(
+                      material->specular_tex, texcoord, footprint, true).x;
   auto metallic = material->metallic *
-                  eval_texture(material->metallic_tex, texcoord, true).x;
+                  eval_texture(
+                      material->metallic_tex, texcoord, footprint, true).x;
   auto roughness = material->roughness *
-                   eval_texture(material->roughness_tex, texcoord, true).x;
+                   eval_texture(
+                       material->roughness_tex, texcoord, footprint, true).x;
   auto ior  = material->ior;
   auto coat = material->coat *
-              eval_texture(material->coat_tex, texcoord, true).x;
+              eval_texture(material->coat_tex, texcoord, footprint, true).x;
   auto transmission = material->transmission *
-                      eval_texture(material->emission_tex, texcoord, true).x;
+                      eval_texture(
+                          material->emission_tex, texcoord, footprint, true).x;
   auto translucency =
       material->translucency *
-      eval_texture(material->translucency_tex, texcoord, true).x;
+      eval_texture(material->translucency_tex, texcoord, footprint, true).x;
   auto thin = material->thin || material->transmission == 0;
 
   // factors
@@ -753,23 +981,25 @@ trace_bsdf eval_bsdf(const trace_instance* instance, int element,
 bool is_delta(const trace_bsdf& bsdf) { return bsdf.roughness == 0; }
 
 // evaluate volume
-trace_vsdf eval_vsdf(
-    const trace_instance* instance, int element, const vec2f& uv) {
+trace_vsdf eval_vsdf(const trace_instance* instance, int element,
+    const vec2f& uv, const trace_footprint& footprint) {
   auto material = instance->material;
   // initialize factors
   auto texcoord = eval_texcoord(instance, element, uv);
   auto color    = material->color * xyz(eval_color(instance, element, uv)) *
-               xyz(eval_texture(material->color_tex, texcoord, false));
+               xyz(eval_texture(
+                   material->color_tex, texcoord, footprint, false));
   auto transmission = material->transmission *
-                      eval_texture(material->emission_tex, texcoord, true).x;
+                      eval_texture(
+                          material->emission_tex, texcoord, footprint, true).x;
   auto translucency =
       material->translucency *
-      eval_texture(material->translucency_tex, texcoord, true).x;
+      eval_texture(material->translucency_tex, texcoord, footprint, true).x;
   auto thin = material->thin ||
               (material->transmission == 0 && material->translucency == 0);
   auto scattering =
       material->scattering *
-      xyz(eval_texture(material->scattering_tex, texcoord, false));
+      xyz(eval_texture(material->scattering_tex, texcoord, footprint, false));
   auto scanisotropy = material->scanisotropy;
   auto trdepth      = material->trdepth;
 
@@ -789,13 +1019,16 @@ bool has_volume(const trace_instance* instance) {
   return !instance->material->thin && instance->material->transmission != 0;
 }
 
-// Sample camera
+// Sample camera, with the ray time in [0, shutter] given by `tuv`
 static ray3f sample_camera(const trace_camera* camera, const vec2i& ij,
-    const vec2i& image_size, const vec2f& puv, const vec2f& luv, bool tent) {
+    const vec2i& image_size, const vec2f& puv, const vec2f& luv, float tuv,
+    bool tent) {
   if (!tent) {
     auto uv = vec2f{
         (ij.x + puv.x) / image_size.x, (ij.y + puv.y) / image_size.y};
-    return eval_camera(camera, uv, sample_disk(luv));
+    auto ray = eval_camera(camera, uv, sample_disk(luv));
+    ray.time = tuv * camera->shutter;
+    return ray;
   } else {
     const auto width  = 2.0f;
     const auto offset = 0.5f;
@@ -808,10 +1041,48 @@ static ray3f sample_camera(const trace_camera* camera, const vec2i& ij,
         offset;
     auto uv = vec2f{
         (ij.x + fuv.x) / image_size.x, (ij.y + fuv.y) / image_size.y};
-    return eval_camera(camera, uv, sample_disk(luv));
+    auto ray = eval_camera(camera, uv, sample_disk(luv));
+    ray.time = tuv * camera->shutter;
+    return ray;
   }
 }
 
+// Sample the time of camera rays, drawing random numbers only if the camera
+// shutter is open, so that renders without motion blur do not change.
+static float sample_shutter(const trace_camera* camera, rng_state& rng) {
+  return camera->shutter > 0 ? rand1f(rng) : 0;
+}
+
+// Ray cone, used as a cheap form of ray differentials to track the texture
+// footprint of camera rays. The cone width grows with its spread angle.
+struct trace_cone {
+  float width  = 0;
+  float spread = 0;
+};
+
+// Cone of camera rays, covering a pixel and ignoring depth of field. Empty
+// cones are returned if texture filtering is disabled.
+static trace_cone eval_camera_cone(const trace_camera* camera,
+    const vec2i& image_size, const trace_params& params) {
+  if (!params.mipmaps) return {};
+  auto film = camera->aspect >= 1 ? camera->film
+                                  : camera->film * camera->aspect;
+  auto pixel = film / (camera->lens * image_size.x);
+  if (!camera->orthographic) {
+    return {0, pixel};
+  } else {
+    return {pixel, 0};
+  }
+}
+
+// Propagate a ray cone over a distance and through a bounce, widening it by
+// the bounce roughness, that is zero for specular bounces.
+static trace_cone propagate_cone(
+    const trace_cone& cone, float distance, float roughness) {
+  if (cone.width == 0 && cone.spread == 0) return cone;
+  return {cone.width + cone.spread * distance, cone.spread + roughness};
+}
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -831,31 +1102,32 @@ void init_bvh(trace_bvh* bvh, const trace_scene* scene,
       bvh, (int)scene->instances.size(),
       [scene](int idx) {
         auto instance = scene->instances[idx];
-        return bvh_instance{instance->frame, instance->shape->shape_id};
+        auto material = instance->material;
+        return bvh_instance{instance->frame, instance->shape->shape_id,
+            instance->frames,
+            material->opacity == 1 && material->opacity_tex == nullptr};
       },
       true);
 
   // build
-  init_bvh(bvh, bvh_params{(bvh_build_type)params.bvh, params.noparallel},
+  init_bvh(bvh,
+      bvh_params{(bvh_build_type)params.bvh, params.noparallel,
+          params.precompute, params.bvhcache},
       progress_cb);
 }
 
 // Refit bvh data
-void update_bvh(trace_bvh* bvh, const trace_scene* scene,
+void update_bvh(trace_bvh* bvh, [[maybe_unused]] const trace_scene* scene,
     const vector<trace_instance*>& updated_instances,
     const vector<trace_shape*>& updated_shapes, const trace_params& params) {
+  // ids are stored on the objects, so the lookup is constant time
   auto updated_instances_ids = vector<int>{};
   auto updated_shapes_ids    = vector<int>{};
   for (auto shape : updated_shapes) {
-    updated_shapes_ids.push_back(
-        (int)(std::find(scene->shapes.begin(), scene->shapes.end(), shape) -
-              scene->shapes.begin()));
+    updated_shapes_ids.push_back(shape->shape_id);
   }
   for (auto instance : updated_instances) {
-    updated_instances_ids.push_back(
-        (int)(std::find(
-                  scene->instances.begin(), scene->instances.end(), instance) -
-              scene->instances.begin()));
+    updated_instances_ids.push_back(instance->instance_id);
   }
   update_bvh(bvh, updated_instances_ids, updated_shapes_ids);
 }
@@ -1139,26 +1411,49 @@ static float sample_scattering_pdf(
   return sample_phasefunction_pdf(vsdf.anisotropy, outgoing, incoming);
 }
 
-// Sample lights wrt solid angle
-static vec3f sample_lights(const trace_scene* scene, const trace_lights* lights,
-    const vec3f& position, float rl, float rel, const vec2f& ruv) {
-  auto light_id = sample_uniform((int)lights->lights.size(), rl);
-  auto light    = lights->lights[light_id];
+// Estimate the contribution of the lights in a node at a position, from
+// their power, their distance and the angle between their normals and the
+// direction to the position. The estimate is conservative, so it is zero
+// only if the lights cannot illuminate the position.
+static float eval_light_importance(
+    const trace_light_node& node, const vec3f& position) {
+  if (node.power == 0) return 0;
+  auto lcenter   = center(node.bbox);
+  auto radius2   = distance_squared(node.bbox.max, lcenter);
+  auto distance2 = distance_squared(position, lcenter);
+  if (distance2 <= radius2) return node.power / radius2;
+  auto cos_w   = abs(dot(node.axis, position - lcenter)) / sqrt(distance2);
+  auto theta_w = acos(clamp(cos_w, 0.0f, 1.0f));
+  auto theta_b = asin(clamp(sqrt(radius2 / distance2), 0.0f, 1.0f));
+  auto theta   = max(theta_w - node.angle - theta_b, 0.0f);
+  return node.power * max(cos(theta), 0.0f) / distance2;
+}
+
+// Sample a light wrt solid angle. Moving lights are sampled at time 0.
+static vec3f sample_light(const trace_light* light, const vec3f& position,
+    float rel, const vec2f& ruv) {
   if (light->instance != nullptr) {
-    auto instance = light->instance;
-    auto element  = sample_discrete_cdf(light->elements_cdf, rel);
+    auto moved    = trace_instance{};
+    auto instance = eval_instance(light->instance, 0, moved);
+    auto element  = sample_discrete_alias(
+        light->elements_probs, light->elements_aliases, rel);
     auto uv       = (!instance->shape->triangles.empty()) ? sample_triangle(ruv)
                                                     : ruv;
-    auto lposition = eval_position(light->instance, element, uv);
+    auto lposition = eval_position(instance, element, uv);
     return normalize(lposition - position);
   } else if (light->environment != nullptr) {
     auto environment = light->environment;
     if (environment->emission_tex != nullptr) {
       auto emission_tex = environment->emission_tex;
-      auto idx          = sample_discrete_cdf(light->elements_cdf, rel);
       auto size         = texture_size(emission_tex);
-      auto uv           = vec2f{
-          ((idx % size.x) + 0.5f) / size.x, ((idx / size.x) + 0.5f) / size.y};
+      auto j            = sample_discrete_alias(
+          light->rows_probs, light->rows_aliases, rel);
+      auto r      = ruv.x * size.x;
+      auto i      = clamp((int)r, 0, size.x - 1);
+      auto offset = j * size.x;
+      if (r - i >= light->elements_probs[offset + i])
+        i = light->elements_aliases[offset + i];
+      auto uv = vec2f{(i + 0.5f) / size.x, (j + 0.5f) / size.y};
       return transform_direction(environment->frame,
           {cos(uv.x * 2 * pif) * sin(uv.y * pif), cos(uv.y * pif),
               sin(uv.x * 2 * pif) * sin(uv.y * pif)});
@@ -1170,213 +1465,449 @@ static vec3f sample_lights(const trace_scene* scene, const trace_lights* lights,
   }
 }
 
-// Sample lights pdf
+// Sample a light pdf. Moving lights are sampled at time 0.
+static float sample_light_pdf(const trace_bvh* bvh, const trace_light* light,
+    const vec3f& position, const vec3f& direction) {
+  if (light->instance != nullptr) {
+    // check all intersections in one traversal, treating hits as transparent
+    // and skipping elements reported more than once
+    auto moved     = trace_instance{};
+    auto linstance = eval_instance(light->instance, 0, moved);
+    auto pdf       = 0.0f;
+    auto elements  = array<int, 100>{};
+    auto num       = 0;
+    intersect_bvh(bvh, linstance->instance_id, {position, direction},
+        [&](int, int element, const vec2f& uv, float) {
+          if (num == (int)elements.size()) return false;
+          for (auto idx = 0; idx < num; idx++)
+            if (elements[idx] == element) return false;
+          elements[num++] = element;
+          // accumulate pdf
+          auto lposition = eval_position(linstance, element, uv);
+          auto lnormal   = eval_element_normal(linstance, element);
+          // prob triangle * area triangle = area triangle mesh
+          auto area = light->elements_total;
+          pdf += distance_squared(lposition, position) /
+                 (abs(dot(lnormal, direction)) * area);
+          return false;
+        });
+    return pdf;
+  } else if (light->environment != nullptr) {
+    auto environment = light->environment;
+    if (environment->emission_tex != nullptr) {
+      auto emission_tex = environment->emission_tex;
+      auto size         = texture_size(emission_tex);
+      auto wl = transform_direction(inverse(environment->frame), direction);
+      auto texcoord = vec2f{atan2(wl.z, wl.x) / (2 * pif),
+          acos(clamp(wl.y, -1.0f, 1.0f)) / pif};
+      if (texcoord.x < 0) texcoord.x += 1;
+      auto i     = clamp((int)(texcoord.x * size.x), 0, size.x - 1);
+      auto j     = clamp((int)(texcoord.y * size.y), 0, size.y - 1);
+      auto prob  = light->elements_weights[j * size.x + i] /
+                  light->elements_total;
+      auto angle = (2 * pif / size.x) * (pif / size.y) *
+                   sin(pif * (j + 0.5f) / size.y);
+      return prob / angle;
+    } else {
+      return 1 / (4 * pif);
+    }
+  } else {
+    return 0;
+  }
+}
+
+// Sample lights wrt solid angle. Environments and the light hierarchy are
+// picked uniformly. In the hierarchy, lights are picked by descending the
+// tree, choosing children proportionally to their importance at the position.
+static vec3f sample_lights(const trace_scene* scene, const trace_lights* lights,
+    const vec3f& position, float rl, float rel, const vec2f& ruv) {
+  auto num_groups = (int)lights->environments.size() +
+                    (lights->nodes.empty() ? 0 : 1);
+  if (num_groups == 0) return zero3f;
+  auto group = sample_uniform(num_groups, rl);
+  if (group < lights->environments.size()) {
+    return sample_light(lights->environments[group], position, rel, ruv);
+  }
+  rl          = clamp(rl * num_groups - group, 0.0f, 1 - flt_eps);
+  auto nodeid = 0;
+  while (lights->nodes[nodeid].internal) {
+    auto& node  = lights->nodes[nodeid];
+    auto  left  = eval_light_importance(lights->nodes[node.start], position);
+    auto  right = eval_light_importance(
+        lights->nodes[node.start + 1], position);
+    if (left + right == 0) return zero3f;
+    auto prob = left / (left + right);
+    if (rl < prob) {
+      nodeid = node.start;
+      rl     = min(rl / prob, 1 - flt_eps);
+    } else {
+      nodeid = node.start + 1;
+      rl     = min((rl - prob) / (1 - prob), 1 - flt_eps);
+    }
+  }
+  return sample_light(
+      lights->lights[lights->nodes[nodeid].start], position, rel, ruv);
+}
+
+// Sample lights pdf. Only the hierarchy nodes whose bounds are intersected
+// by the direction are visited, while accumulating the probability of
+// picking them.
 static float sample_lights_pdf(const trace_scene* scene, const trace_bvh* bvh,
     const trace_lights* lights, const vec3f& position, const vec3f& direction) {
+  auto num_groups = (int)lights->environments.size() +
+                    (lights->nodes.empty() ? 0 : 1);
+  if (num_groups == 0 || direction == zero3f) return 0;
   auto pdf = 0.0f;
-  for (auto light : lights->lights) {
-    if (light->instance != nullptr) {
-      // check all intersection
-      auto lpdf          = 0.0f;
-      auto next_position = position;
-      for (auto bounce = 0; bounce < 100; bounce++) {
-        auto intersection = intersect_bvh(
-            bvh, light->instance->instance_id, {next_position, direction});
-        if (!intersection.hit) break;
-        // accumulate pdf
-        auto lposition = eval_position(
-            light->instance, intersection.element, intersection.uv);
-        auto lnormal = eval_element_normal(
-            light->instance, intersection.element);
-        // prob triangle * area triangle = area triangle mesh
-        auto area = light->elements_cdf.back();
-        lpdf += distance_squared(lposition, position) /
-                (abs(dot(lnormal, direction)) * area);
-        // continue
-        next_position = lposition + direction * 1e-3f;
-      }
-      pdf += lpdf;
-    } else if (light->environment != nullptr) {
-      auto environment = light->environment;
-      if (environment->emission_tex != nullptr) {
-        auto emission_tex = environment->emission_tex;
-        auto size         = texture_size(emission_tex);
-        auto wl = transform_direction(inverse(environment->frame), direction);
-        auto texcoord = vec2f{atan2(wl.z, wl.x) / (2 * pif),
-            acos(clamp(wl.y, -1.0f, 1.0f)) / pif};
-        if (texcoord.x < 0) texcoord.x += 1;
-        auto i    = clamp((int)(texcoord.x * size.x), 0, size.x - 1);
-        auto j    = clamp((int)(texcoord.y * size.y), 0, size.y - 1);
-        auto prob = sample_discrete_cdf_pdf(
-                        light->elements_cdf, j * size.x + i) /
-                    light->elements_cdf.back();
-        auto angle = (2 * pif / size.x) * (pif / size.y) *
-                     sin(pif * (j + 0.5f) / size.y);
-        pdf += prob / angle;
+  for (auto environment : lights->environments) {
+    pdf += sample_light_pdf(bvh, environment, position, direction);
+  }
+  if (!lights->nodes.empty()) {
+    // ray to intersect node bounds
+    auto ray = ray3f{position, direction};
+
+    // node stack, with the probability of picking each node
+    auto node_stack        = array<int, 128>{};
+    auto prob_stack        = array<float, 128>{};
+    auto node_cur          = 0;
+    node_stack[node_cur]   = 0;
+    prob_stack[node_cur++] = 1;
+
+    // walking stack
+    while (node_cur != 0) {
+      // grab node
+      node_cur -= 1;
+      auto& node = lights->nodes[node_stack[node_cur]];
+      auto  prob = prob_stack[node_cur];
+
+      // intersect bbox
+      if (!intersect_bbox(ray, node.bbox)) continue;
+
+      // intersect node, switching based on node type
+      if (node.internal) {
+        auto left  = eval_light_importance(lights->nodes[node.start], position);
+        auto right = eval_light_importance(
+            lights->nodes[node.start + 1], position);
+        if (left + right == 0) continue;
+        if (left != 0) {
+          node_stack[node_cur]   = node.start;
+          prob_stack[node_cur++] = prob * left / (left + right);
+        }
+        if (right != 0) {
+          node_stack[node_cur]   = node.start + 1;
+          prob_stack[node_cur++] = prob * right / (left + right);
+        }
       } else {
-        pdf += 1 / (4 * pif);
+        pdf += prob * sample_light_pdf(bvh, lights->lights[node.start],
+                          position, direction);
       }
     }
   }
-  pdf *= sample_uniform_pdf((int)lights->lights.size());
+  pdf *= sample_uniform_pdf(num_groups);
   return pdf;
 }
 
-// Recursive path tracing.
-static vec4f trace_path(const trace_scene* scene, const trace_bvh* bvh,
-    const trace_lights* lights, const ray3f& ray_, rng_state& rng,
-    const trace_params& params) {
-  // initialize
-  auto radiance      = zero3f;
-  auto weight        = vec3f{1, 1, 1};
-  auto ray           = ray_;
-  auto volume_stack  = vector<trace_vsdf>{};
-  auto max_roughness = 0.0f;
-  auto hit           = !params.envhidden && !scene->environments.empty();
-
-  // trace  path
-  for (auto bounce = 0; bounce < params.bounces; bounce++) {
-    // intersect next point
-    auto intersection = intersect_bvh(bvh, ray);
-    if (!intersection.hit) {
-      if (bounce > 0 || !params.envhidden)
-        radiance += weight * eval_environment(scene, ray.d);
-      break;
-    }
+// Opacity of hits along a ray for cutouts, where hits are opaque with
+// probability equal to the material opacity. Opacity is filtered with the
+// footprint of the ray cone at the hit distance, as for shading. The choice
+// is made from a seed drawn from `rng` and the hit element and uv, so that
+// it agrees for elements reported more than once. Rays in scenes without
+// cutouts have no scene, and draw no random numbers. Callbacks refer to
+// this state, so they are not allocated for each ray.
+struct trace_opacity {
+  const trace_scene* scene = nullptr;
+  ray3f              ray   = {};
+  trace_cone         cone  = {};
+  uint64_t           seed  = 0;
+
+  bool operator()(
+      int instance_id, int element, const vec2f& uv, float distance) const {
+    auto moved     = trace_instance{};
+    auto instance  = eval_instance(
+        scene->instances[instance_id], ray.time, moved);
+    auto footprint = eval_footprint(
+        instance, element, ray.d, cone.width + cone.spread * distance);
+    auto opacity = eval_opacity(
+        instance, element, uv, zero3f, zero3f, footprint);
+    if (opacity == 1) return true;
+    // hash seed, element and uv to a uniform number, with splitmix64 steps
+    auto mix = [](uint64_t hash) {
+      hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ull;
+      hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebull;
+      return hash ^ (hash >> 31);
+    };
+    auto uv_bits = array<uint32_t, 2>{};
+    memcpy(uv_bits.data(), &uv, sizeof(uv_bits));
+    auto hash = mix(seed ^ (((uint64_t)instance_id << 32) + element));
+    hash      = mix(hash ^ (((uint64_t)uv_bits[0] << 32) + uv_bits[1]));
+    return (hash >> 40) / (float)(1 << 24) < opacity;
+  }
+};
+
+// Opacity for a ray, drawing its seed only if the bvh has cutouts
+static trace_opacity make_opacity(const trace_scene* scene,
+    const trace_bvh* bvh, const ray3f& ray, const trace_cone& cone,
+    rng_state& rng) {
+  if (bvh->num_cutouts == 0) return {};
+  return {scene, ray, cone, (uint64_t)rand1i(rng, 1 << 30)};
+}
 
-    // handle transmission if inside a volume
-    auto in_volume = false;
-    if (!volume_stack.empty()) {
-      auto& vsdf     = volume_stack.back();
-      auto  distance = sample_transmittance(
-          vsdf.density, intersection.distance, rand1f(rng), rand1f(rng));
-      weight *= eval_transmittance(vsdf.density, distance) /
-                sample_transmittance_pdf(
-                    vsdf.density, distance, intersection.distance);
-      in_volume             = distance < intersection.distance;
-      intersection.distance = distance;
-    }
+// Opacity callback referring to `opacity`, which must outlive it
+static bvh_opacity_callback make_opacity_callback(
+    const trace_opacity& opacity) {
+  if (!opacity.scene) return {};
+  return std::cref(opacity);
+}
 
-    // switch between surface and volume
-    if (!in_volume) {
-      // prepare shading point
-      auto outgoing = -ray.d;
-      auto instance = scene->instances[intersection.instance];
-      auto element  = intersection.element;
-      auto uv       = intersection.uv;
-      auto position = eval_position(instance, element, uv);
-      auto normal   = eval_shading_normal(instance, element, uv, outgoing);
-      auto emission = eval_emission(instance, element, uv, normal, outgoing);
-      auto opacity  = eval_opacity(instance, element, uv, normal, outgoing);
-      auto bsdf     = eval_bsdf(instance, element, uv, normal, outgoing);
-
-      // correct roughness
-      if (params.nocaustics) {
-        max_roughness  = max(bsdf.roughness, max_roughness);
-        bsdf.roughness = max_roughness;
-      }
+// Intersect a ray with the scene, skipping cutouts
+static bvh_intersection intersect_cutouts(const trace_scene* scene,
+    const trace_bvh* bvh, const ray3f& ray, const trace_cone& cone,
+    rng_state& rng) {
+  auto opacity = make_opacity(scene, bvh, ray, cone, rng);
+  return intersect_bvh(bvh, ray, make_opacity_callback(opacity));
+}
 
-      // handle opacity
-      if (opacity < 1 && rand1f(rng) >= opacity) {
-        ray = {position + ray.d * 1e-2f, ray.d};
-        bounce -= 1;
-        continue;
-      }
-      hit = true;
-
-      // accumulate emission
-      radiance += weight * eval_emission(emission, normal, outgoing);
-
-      // next direction
-      auto incoming = zero3f;
-      if (!is_delta(bsdf)) {
-        if (rand1f(rng) < 0.5f) {
-          incoming = sample_bsdfcos(
-              bsdf, normal, outgoing, rand1f(rng), rand2f(rng));
-        } else {
-          incoming = sample_lights(
-              scene, lights, position, rand1f(rng), rand1f(rng), rand2f(rng));
-        }
-        weight *= eval_bsdfcos(bsdf, normal, outgoing, incoming) /
-                  (0.5f * sample_bsdfcos_pdf(bsdf, normal, outgoing, incoming) +
-                      0.5f * sample_lights_pdf(
-                                 scene, bvh, lights, position, incoming));
-      } else {
-        incoming = sample_delta(bsdf, normal, outgoing, rand1f(rng));
-        weight *= eval_delta(bsdf, normal, outgoing, incoming) /
-                  sample_delta_pdf(bsdf, normal, outgoing, incoming);
-      }
+// Check whether a sampler skips cutouts. False color renders show the first
+// hit, whatever its opacity.
+static bool skips_cutouts(const trace_params& params) {
+  return params.sampler != trace_sampler_type::falsecolor;
+}
 
-      // update volume stack
-      if (has_volume(instance) &&
-          dot(normal, outgoing) * dot(normal, incoming) < 0) {
-        if (volume_stack.empty()) {
-          auto vsdf = eval_vsdf(instance, element, uv);
-          volume_stack.push_back(vsdf);
-        } else {
-          volume_stack.pop_back();
-        }
-      }
+// Path state, advanced one bounce at a time by path tracing and by
+// wavefront path tracing
+struct trace_path_state {
+  ray3f              ray           = {};
+  trace_cone         cone          = {};
+  vec3f              radiance      = {0, 0, 0};
+  vec3f              weight        = {1, 1, 1};
+  vector<trace_vsdf> volume_stack  = {};
+  float              max_roughness = 0;
+  bool               hit           = false;
+  int                bounce        = 0;
+  bool               done          = false;
+};
+
+// Next vertex of a path, on a surface or inside a volume. The shading point
+// of surface vertices is computed by eval_path_vertex.
+struct trace_path_vertex {
+  bvh_intersection intersection = {};
+  float            distance     = 0;
+  bool             in_volume    = false;
+  trace_footprint  footprint    = {};
+  vec3f            position     = {0, 0, 0};
+  vec3f            normal       = {0, 0, 0};
+  vec3f            emission     = {0, 0, 0};
+  trace_bsdf       bsdf         = {};
+};
+
+// Get the next vertex of a path from its intersection, sampling the distance
+// travelled before scattering if inside a volume. Paths that miss the scene
+// accumulate the environment and are done.
+static trace_path_vertex sample_path_vertex(const trace_scene* scene,
+    trace_path_state& path, const bvh_intersection& intersection,
+    rng_state& rng, const trace_params& params) {
+  auto vertex = trace_path_vertex{};
+  if (!intersection.hit) {
+    if (path.bounce > 0 || !params.envhidden)
+      path.radiance += path.weight * eval_environment(scene, path.ray.d);
+    path.done = true;
+    return vertex;
+  }
+  vertex.intersection = intersection;
+  vertex.distance     = intersection.distance;
+  if (!path.volume_stack.empty()) {
+    auto& vsdf     = path.volume_stack.back();
+    auto  distance = sample_transmittance(
+        vsdf.density, intersection.distance, rand1f(rng), rand1f(rng));
+    path.weight *= eval_transmittance(vsdf.density, distance) /
+                   sample_transmittance_pdf(
+                       vsdf.density, distance, intersection.distance);
+    vertex.in_volume = distance < intersection.distance;
+    vertex.distance  = distance;
+  }
+  return vertex;
+}
 
-      // setup next iteration
-      ray = {position, incoming};
-    } else {
-      // prepare shading point
-      auto  outgoing = -ray.d;
-      auto  position = ray.o + ray.d * intersection.distance;
-      auto& vsdf     = volume_stack.back();
+// Evaluate the shading point of a surface vertex
+static void eval_path_vertex(const trace_scene* scene,
+    const trace_path_state& path, trace_path_vertex& vertex) {
+  auto outgoing = -path.ray.d;
+  auto moved    = trace_instance{};
+  auto instance = eval_instance(
+      scene->instances[vertex.intersection.instance], path.ray.time, moved);
+  auto element     = vertex.intersection.element;
+  auto uv          = vertex.intersection.uv;
+  vertex.footprint = eval_footprint(instance, element, path.ray.d,
+      path.cone.width + path.cone.spread * vertex.intersection.distance);
+  vertex.position = eval_position(instance, element, uv);
+  vertex.normal   = eval_shading_normal(
+      instance, element, uv, outgoing, vertex.footprint);
+  vertex.emission = eval_emission(
+      instance, element, uv, vertex.normal, outgoing, vertex.footprint);
+  vertex.bsdf = eval_bsdf(
+      instance, element, uv, vertex.normal, outgoing, vertex.footprint);
+}
 
-      // handle opacity
-      hit = true;
+// Shade a path vertex, accumulating emission and sampling the next
+// direction with next event estimation. Paths are done when their weight
+// vanishes, when russian roulette terminates them, or after the maximum
+// number of bounces.
+static void shade_path_vertex(const trace_scene* scene, const trace_bvh* bvh,
+    const trace_lights* lights, trace_path_state& path,
+    trace_path_vertex& vertex, rng_state& rng, const trace_params& params) {
+  // switch between surface and volume
+  if (!vertex.in_volume) {
+    // prepare shading point
+    auto  outgoing = -path.ray.d;
+    auto  instance = scene->instances[vertex.intersection.instance];
+    auto  element  = vertex.intersection.element;
+    auto  uv       = vertex.intersection.uv;
+    auto& position = vertex.position;
+    auto& normal   = vertex.normal;
+    auto& bsdf     = vertex.bsdf;
+
+    // correct roughness
+    if (params.nocaustics) {
+      path.max_roughness = max(bsdf.roughness, path.max_roughness);
+      bsdf.roughness     = path.max_roughness;
+    }
+    path.hit = true;
 
-      // accumulate emission
-      // radiance += weight * eval_volemission(emission, outgoing);
+    // accumulate emission
+    path.radiance += path.weight *
+                     eval_emission(vertex.emission, normal, outgoing);
 
-      // next direction
-      auto incoming = zero3f;
+    // next direction
+    auto incoming = zero3f;
+    if (!is_delta(bsdf)) {
       if (rand1f(rng) < 0.5f) {
-        incoming = sample_scattering(vsdf, outgoing, rand1f(rng), rand2f(rng));
+        incoming = sample_bsdfcos(
+            bsdf, normal, outgoing, rand1f(rng), rand2f(rng));
       } else {
         incoming = sample_lights(
             scene, lights, position, rand1f(rng), rand1f(rng), rand2f(rng));
       }
-      weight *=
-          eval_scattering(vsdf, outgoing, incoming) /
-          (0.5f * sample_scattering_pdf(vsdf, outgoing, incoming) +
-              0.5f * sample_lights_pdf(scene, bvh, lights, position, incoming));
+      path.weight *=
+          eval_bsdfcos(bsdf, normal, outgoing, incoming) /
+          (0.5f * sample_bsdfcos_pdf(bsdf, normal, outgoing, incoming) +
+              0.5f *
+                  sample_lights_pdf(scene, bvh, lights, position, incoming));
+    } else {
+      incoming = sample_delta(bsdf, normal, outgoing, rand1f(rng));
+      path.weight *= eval_delta(bsdf, normal, outgoing, incoming) /
+                     sample_delta_pdf(bsdf, normal, outgoing, incoming);
+    }
 
-      // setup next iteration
-      ray = {position, incoming};
+    // update volume stack
+    if (has_volume(instance) &&
+        dot(normal, outgoing) * dot(normal, incoming) < 0) {
+      if (path.volume_stack.empty()) {
+        auto vsdf = eval_vsdf(instance, element, uv, vertex.footprint);
+        path.volume_stack.push_back(vsdf);
+      } else {
+        path.volume_stack.pop_back();
+      }
     }
 
-    // check weight
-    if (weight == zero3f || !isfinite(weight)) break;
+    // setup next iteration
+    path.cone = propagate_cone(
+        path.cone, vertex.intersection.distance, bsdf.roughness);
+    path.ray = {position, incoming, ray_eps, flt_max, path.ray.time};
+  } else {
+    // prepare shading point
+    auto  outgoing = -path.ray.d;
+    auto  position = path.ray.o + path.ray.d * vertex.distance;
+    auto& vsdf     = path.volume_stack.back();
 
-    // russian roulette
-    if (bounce > 3) {
-      auto rr_prob = min((float)0.99, max(weight));
-      if (rand1f(rng) >= rr_prob) break;
-      weight *= 1 / rr_prob;
+    // handle opacity
+    path.hit = true;
+
+    // accumulate emission
+    // radiance += weight * eval_volemission(emission, outgoing);
+
+    // next direction
+    auto incoming = zero3f;
+    if (rand1f(rng) < 0.5f) {
+      incoming = sample_scattering(vsdf, outgoing, rand1f(rng), rand2f(rng));
+    } else {
+      incoming = sample_lights(
+          scene, lights, position, rand1f(rng), rand1f(rng), rand2f(rng));
     }
+    path.weight *=
+        eval_scattering(vsdf, outgoing, incoming) /
+        (0.5f * sample_scattering_pdf(vsdf, outgoing, incoming) +
+            0.5f * sample_lights_pdf(scene, bvh, lights, position, incoming));
+
+    // setup next iteration, widening the cone over the scatter distance
+    path.cone = propagate_cone(path.cone, vertex.distance, 1);
+    path.ray  = {position, incoming, ray_eps, flt_max, path.ray.time};
   }
 
-  return {radiance.x, radiance.y, radiance.z, hit ? 1.0f : 0.0f};
+  // check weight
+  if (path.weight == zero3f || !isfinite(path.weight)) {
+    path.done = true;
+    return;
+  }
+
+  // russian roulette
+  if (path.bounce > 3) {
+    auto rr_prob = min((float)0.99, max(path.weight));
+    if (rand1f(rng) >= rr_prob) {
+      path.done = true;
+      return;
+    }
+    path.weight *= 1 / rr_prob;
+  }
+
+  // next bounce
+  path.bounce += 1;
+  if (path.bounce >= params.bounces) path.done = true;
+}
+
+// Recursive path tracing.
+static vec4f trace_path(const trace_scene* scene, const trace_bvh* bvh,
+    const trace_lights* lights, const ray3f& ray, const trace_cone& cone,
+    rng_state& rng, const trace_params& params) {
+  // initialize
+  auto path = trace_path_state{};
+  path.ray  = ray;
+  path.cone = cone;
+  path.hit  = !params.envhidden && !scene->environments.empty();
+  path.done = params.bounces <= 0;
+
+  // trace  path
+  while (!path.done) {
+    // intersect next point, skipping cutouts
+    auto intersection = intersect_cutouts(
+        scene, bvh, path.ray, path.cone, rng);
+
+    // handle misses and transmission if inside a volume
+    auto vertex = sample_path_vertex(scene, path, intersection, rng, params);
+    if (path.done) break;
+
+    // shade the next vertex
+    if (!vertex.in_volume) eval_path_vertex(scene, path, vertex);
+    shade_path_vertex(scene, bvh, lights, path, vertex, rng, params);
+  }
+
+  return {path.radiance.x, path.radiance.y, path.radiance.z,
+      path.hit ? 1.0f : 0.0f};
 }
 
 // Recursive path tracing.
 static vec4f trace_naive(const trace_scene* scene, const trace_bvh* bvh,
-    const trace_lights* lights, const ray3f& ray_, rng_state& rng,
-    const trace_params& params) {
+    [[maybe_unused]] const trace_lights* lights, const ray3f& ray_,
+    const trace_cone& cone_, rng_state& rng, const trace_params& params) {
   // initialize
   auto radiance = zero3f;
   auto weight   = vec3f{1, 1, 1};
   auto ray      = ray_;
+  auto cone     = cone_;
   auto hit      = !params.envhidden && !scene->environments.empty();
 
   // trace  path
   for (auto bounce = 0; bounce < params.bounces; bounce++) {
-    // intersect next point
-    auto intersection = intersect_bvh(bvh, ray);
+    // intersect next point, skipping cutouts
+    auto intersection = intersect_cutouts(scene, bvh, ray, cone, rng);
     if (!intersection.hit) {
       if (bounce > 0 || !params.envhidden)
         radiance += weight * eval_environment(scene, ray.d);
@@ -1385,22 +1916,20 @@ static vec4f trace_naive(const trace_scene* scene, const trace_bvh* bvh,
 
     // prepare shading point
     auto outgoing = -ray.d;
-    auto instance = scene->instances[intersection.instance];
-    auto element  = intersection.element;
-    auto uv       = intersection.uv;
+    auto moved    = trace_instance{};
+    auto instance = eval_instance(
+        scene->instances[intersection.instance], ray.time, moved);
+    auto element   = intersection.element;
+    auto uv        = intersection.uv;
+    auto footprint = eval_footprint(instance, element, ray.d,
+        cone.width + cone.spread * intersection.distance);
     auto position = eval_position(instance, element, uv);
-    auto normal   = eval_shading_normal(instance, element, uv, outgoing);
-    auto emission = eval_emission(instance, element, uv, normal, outgoing);
-    auto opacity  = eval_opacity(instance, element, uv, normal, outgoing);
-    auto bsdf     = eval_bsdf(instance, element, uv, normal, outgoing);
-
-    // handle opacity
-    if (opacity < 1 && rand1f(rng) >= opacity) {
-      ray = {position + ray.d * 1e-2f, ray.d};
-      bounce -= 1;
-      continue;
-    }
-    hit = true;
+    auto normal   = eval_shading_normal(
+        instance, element, uv, outgoing, footprint);
+    auto emission = eval_emission(
+        instance, element, uv, normal, outgoing, footprint);
+    auto bsdf = eval_bsdf(instance, element, uv, normal, outgoing, footprint);
+    hit       = true;
 
     // accumulate emission
     radiance += weight * eval_emission(emission, normal, outgoing);
@@ -1429,7 +1958,8 @@ static vec4f trace_naive(const trace_scene* scene, const trace_bvh* bvh,
     }
 
     // setup next iteration
-    ray = {position, incoming};
+    cone = propagate_cone(cone, intersection.distance, bsdf.roughness);
+    ray  = {position, incoming, ray_eps, flt_max, ray.time};
   }
 
   return {radiance.x, radiance.y, radiance.z, hit ? 1.0f : 0.0f};
@@ -1437,18 +1967,24 @@ static vec4f trace_naive(const trace_scene* scene, const trace_bvh* bvh,
 
 // Eyelight for quick previewing.
 static vec4f trace_eyelight(const trace_scene* scene, const trace_bvh* bvh,
-    const trace_lights* lights, const ray3f& ray_, rng_state& rng,
-    const trace_params& params) {
+    [[maybe_unused]] const trace_lights* lights, const ray3f& ray_,
+    const trace_cone& cone_, const bvh_intersection& intersection_,
+    rng_state& rng, const trace_params& params) {
   // initialize
   auto radiance = zero3f;
   auto weight   = vec3f{1, 1, 1};
   auto ray      = ray_;
+  auto cone     = cone_;
   auto hit      = !params.envhidden && !scene->environments.empty();
+  auto first    = true;
 
   // trace  path
   for (auto bounce = 0; bounce < max(params.bounces, 4); bounce++) {
-    // intersect next point
-    auto intersection = intersect_bvh(bvh, ray);
+    // intersect next point, using the given intersection for the first ray
+    auto intersection = first ? intersection_
+                              : intersect_cutouts(
+                                    scene, bvh, ray, cone, rng);
+    first = false;
     if (!intersection.hit) {
       if (bounce > 0 || !params.envhidden)
         radiance += weight * eval_environment(scene, ray.d);
@@ -1457,22 +1993,20 @@ static vec4f trace_eyelight(const trace_scene* scene, const trace_bvh* bvh,
 
     // prepare shading point
     auto outgoing = -ray.d;
-    auto instance = scene->instances[intersection.instance];
-    auto element  = intersection.element;
-    auto uv       = intersection.uv;
+    auto moved    = trace_instance{};
+    auto instance = eval_instance(
+        scene->instances[intersection.instance], ray.time, moved);
+    auto element   = intersection.element;
+    auto uv        = intersection.uv;
+    auto footprint = eval_footprint(instance, element, ray.d,
+        cone.width + cone.spread * intersection.distance);
     auto position = eval_position(instance, element, uv);
-    auto normal   = eval_shading_normal(instance, element, uv, outgoing);
-    auto emission = eval_emission(instance, element, uv, normal, outgoing);
-    auto opacity  = eval_opacity(instance, element, uv, normal, outgoing);
-    auto bsdf     = eval_bsdf(instance, element, uv, normal, outgoing);
-
-    // handle opacity
-    if (opacity < 1 && rand1f(rng) >= opacity) {
-      ray = {position + ray.d * 1e-2f, ray.d};
-      bounce -= 1;
-      continue;
-    }
-    hit = true;
+    auto normal   = eval_shading_normal(
+        instance, element, uv, outgoing, footprint);
+    auto emission = eval_emission(
+        instance, element, uv, normal, outgoing, footprint);
+    auto bsdf = eval_bsdf(instance, element, uv, normal, outgoing, footprint);
+    hit       = true;
 
     // accumulate emission
     auto incoming = outgoing;
@@ -1489,25 +2023,37 @@ static vec4f trace_eyelight(const trace_scene* scene, const trace_bvh* bvh,
     if (weight == zero3f || !isfinite(weight)) break;
 
     // setup next iteration
-    ray = {position, incoming};
+    cone = propagate_cone(cone, intersection.distance, 0);
+    ray  = {position, incoming, ray_eps, flt_max, ray.time};
   }
 
   return {radiance.x, radiance.y, radiance.z, hit ? 1.0f : 0.0f};
 }
 
+static vec4f trace_eyelight(const trace_scene* scene, const trace_bvh* bvh,
+    const trace_lights* lights, const ray3f& ray, const trace_cone& cone,
+    rng_state& rng, const trace_params& params) {
+  auto intersection = intersect_cutouts(scene, bvh, ray, cone, rng);
+  return trace_eyelight(
+      scene, bvh, lights, ray, cone, intersection, rng, params);
+}
+
 // False color rendering
-static vec4f trace_falsecolor(const trace_scene* scene, const trace_bvh* bvh,
-    const trace_lights* lights, const ray3f& ray, rng_state& rng,
+static vec4f trace_falsecolor(const trace_scene* scene,
+    [[maybe_unused]] const trace_bvh* bvh, const trace_lights* lights,
+    const ray3f& ray, [[maybe_unused]] const trace_cone& cone,
+    const bvh_intersection& intersection, rng_state& rng,
     const trace_params& params) {
-  // intersect next point
-  auto intersection = intersect_bvh(bvh, ray);
+  // check intersection
   if (!intersection.hit) {
     return {0, 0, 0, 0};
   }
 
   // prepare shading point
   auto outgoing = -ray.d;
-  auto instance = scene->instances[intersection.instance];
+  auto moved    = trace_instance{};
+  auto instance = eval_instance(
+      scene->instances[intersection.instance], ray.time, moved);
   auto element  = intersection.element;
   auto uv       = intersection.uv;
   auto position = eval_position(instance, element, uv);
@@ -1572,10 +2118,22 @@ static vec4f trace_falsecolor(const trace_scene* scene, const trace_bvh* bvh,
   }
 }
 
+static vec4f trace_falsecolor(const trace_scene* scene, const trace_bvh* bvh,
+    const trace_lights* lights, const ray3f& ray, const trace_cone& cone,
+    rng_state& rng, const trace_params& params) {
+  return trace_falsecolor(
+      scene, bvh, lights, ray, cone, intersect_bvh(bvh, ray), rng, params);
+}
+
+// Forward declaration
 static vec4f trace_albedo(const trace_scene* scene, const trace_bvh* bvh,
     const trace_lights* lights, const ray3f& ray, rng_state& rng,
+    const trace_params& params, int bounce);
+
+static vec4f trace_albedo(const trace_scene* scene, const trace_bvh* bvh,
+    const trace_lights* lights, const ray3f& ray,
+    const bvh_intersection& intersection, rng_state& rng,
     const trace_params& params, int bounce) {
-  auto intersection = intersect_bvh(bvh, ray);
   if (!intersection.hit) {
     auto radiance = eval_environment(scene, ray.d);
     return {radiance.x, radiance.y, radiance.z, 1};
@@ -1583,7 +2141,9 @@ static vec4f trace_albedo(const trace_scene* scene, const trace_bvh* bvh,
 
   // prepare shading point
   auto outgoing = -ray.d;
-  auto instance = scene->instances[intersection.instance];
+  auto moved    = trace_instance{};
+  auto instance = eval_instance(
+      scene->instances[intersection.instance], ray.time, moved);
   auto element  = intersection.element;
   auto uv       = intersection.uv;
   auto material = scene->instances[intersection.instance]->material;
@@ -1592,7 +2152,6 @@ static vec4f trace_albedo(const trace_scene* scene, const trace_bvh* bvh,
   auto texcoord = eval_texcoord(instance, element, uv);
   auto color    = eval_color(instance, element, uv);
   auto emission = eval_emission(instance, element, uv, normal, outgoing);
-  auto opacity  = eval_opacity(instance, element, uv, normal, outgoing);
   auto bsdf     = eval_bsdf(instance, element, uv, normal, outgoing);
 
   if (emission != zero3f) {
@@ -1602,22 +2161,17 @@ static vec4f trace_albedo(const trace_scene* scene, const trace_bvh* bvh,
   auto albedo = material->color * xyz(color) *
                 xyz(eval_texture(material->color_tex, texcoord, false));
 
-  // handle opacity
-  if (opacity < 1.0f) {
-    auto blend_albedo = trace_albedo(scene, bvh, lights,
-        ray3f{position + ray.d * 1e-2f, ray.d}, rng, params, bounce);
-    return lerp(blend_albedo, vec4f{albedo.x, albedo.y, albedo.z, 1}, opacity);
-  }
-
   if (bsdf.roughness < 0.05 && bounce < 5) {
     if (bsdf.transmission != zero3f && material->thin) {
       auto incoming     = -outgoing;
       auto trans_albedo = trace_albedo(scene, bvh, lights,
-          ray3f{position, incoming}, rng, params, bounce + 1);
+          ray3f{position, incoming, ray_eps, flt_max, ray.time}, rng, params,
+          bounce + 1);
 
       incoming         = reflect(outgoing, normal);
       auto spec_albedo = trace_albedo(scene, bvh, lights,
-          ray3f{position, incoming}, rng, params, bounce + 1);
+          ray3f{position, incoming, ray_eps, flt_max, ray.time}, rng, params,
+          bounce + 1);
 
       auto fresnel = fresnel_dielectric(material->ior, outgoing, normal);
       auto dielectric_albedo = lerp(trans_albedo, spec_albedo, fresnel);
@@ -1625,7 +2179,8 @@ static vec4f trace_albedo(const trace_scene* scene, const trace_bvh* bvh,
     } else if (bsdf.metal != zero3f) {
       auto incoming    = reflect(outgoing, normal);
       auto refl_albedo = trace_albedo(scene, bvh, lights,
-          ray3f{position, incoming}, rng, params, bounce + 1);
+          ray3f{position, incoming, ray_eps, flt_max, ray.time}, rng, params,
+          bounce + 1);
       return refl_albedo * vec4f{albedo.x, albedo.y, albedo.z, 1};
     }
   }
@@ -1635,53 +2190,74 @@ static vec4f trace_albedo(const trace_scene* scene, const trace_bvh* bvh,
 
 static vec4f trace_albedo(const trace_scene* scene, const trace_bvh* bvh,
     const trace_lights* lights, const ray3f& ray, rng_state& rng,
+    const trace_params& params, int bounce) {
+  auto intersection = intersect_cutouts(scene, bvh, ray, {}, rng);
+  return trace_albedo(
+      scene, bvh, lights, ray, intersection, rng, params, bounce);
+}
+
+static vec4f trace_albedo(const trace_scene* scene, const trace_bvh* bvh,
+    const trace_lights* lights, const ray3f& ray,
+    [[maybe_unused]] const trace_cone& cone,
+    const bvh_intersection& intersection, rng_state& rng,
     const trace_params& params) {
-  auto albedo = trace_albedo(scene, bvh, lights, ray, rng, params, 0);
+  auto albedo = trace_albedo(
+      scene, bvh, lights, ray, intersection, rng, params, 0);
   return clamp(albedo, 0.0, 1.0);
 }
 
+static vec4f trace_albedo(const trace_scene* scene, const trace_bvh* bvh,
+    const trace_lights* lights, const ray3f& ray, const trace_cone& cone,
+    rng_state& rng, const trace_params& params) {
+  auto intersection = intersect_cutouts(scene, bvh, ray, cone, rng);
+  return trace_albedo(
+      scene, bvh, lights, ray, cone, intersection, rng, params);
+}
+
+// Forward declaration
 static vec4f trace_normal(const trace_scene* scene, const trace_bvh* bvh,
     const trace_lights* lights, const ray3f& ray, rng_state& rng,
+    const trace_params& params, int bounce);
+
+static vec4f trace_normal(const trace_scene* scene, const trace_bvh* bvh,
+    const trace_lights* lights, const ray3f& ray,
+    const bvh_intersection& intersection, rng_state& rng,
     const trace_params& params, int bounce) {
-  auto intersection = intersect_bvh(bvh, ray);
   if (!intersection.hit) {
     return {0, 0, 0, 1};
   }
 
   // prepare shading point
   auto outgoing = -ray.d;
-  auto instance = scene->instances[intersection.instance];
+  auto moved    = trace_instance{};
+  auto instance = eval_instance(
+      scene->instances[intersection.instance], ray.time, moved);
   auto element  = intersection.element;
   auto uv       = intersection.uv;
   auto material = scene->instances[intersection.instance]->material;
   auto position = eval_position(instance, element, uv);
   auto normal   = eval_shading_normal(instance, element, uv, outgoing);
-  auto opacity  = eval_opacity(instance, element, uv, normal, outgoing);
   auto bsdf     = eval_bsdf(instance, element, uv, normal, outgoing);
 
-  // handle opacity
-  if (opacity < 1.0f) {
-    auto normal = trace_normal(scene, bvh, lights,
-        ray3f{position + ray.d * 1e-2f, ray.d}, rng, params, bounce);
-    return lerp(normal, normal, opacity);
-  }
-
   if (bsdf.roughness < 0.05f && bounce < 5) {
     if (bsdf.transmission != zero3f && material->thin) {
       auto incoming   = -outgoing;
       auto trans_norm = trace_normal(scene, bvh, lights,
-          ray3f{position, incoming}, rng, params, bounce + 1);
+          ray3f{position, incoming, ray_eps, flt_max, ray.time}, rng, params,
+          bounce + 1);
 
       incoming       = reflect(outgoing, normal);
       auto spec_norm = trace_normal(scene, bvh, lights,
-          ray3f{position, incoming}, rng, params, bounce + 1);
+          ray3f{position, incoming, ray_eps, flt_max, ray.time}, rng, params,
+          bounce + 1);
 
       auto fresnel = fresnel_dielectric(material->ior, outgoing, normal);
       return lerp(trans_norm, spec_norm, fresnel);
     } else if (bsdf.metal != zero3f) {
       auto incoming = reflect(outgoing, normal);
-      return trace_normal(scene, bvh, lights, ray3f{position, incoming}, rng,
-          params, bounce + 1);
+      return trace_normal(scene, bvh, lights,
+          ray3f{position, incoming, ray_eps, flt_max, ray.time}, rng, params,
+          bounce + 1);
     }
   }
 
@@ -1690,18 +2266,37 @@ static vec4f trace_normal(const trace_scene* scene, const trace_bvh* bvh,
 
 static vec4f trace_normal(const trace_scene* scene, const trace_bvh* bvh,
     const trace_lights* lights, const ray3f& ray, rng_state& rng,
+    const trace_params& params, int bounce) {
+  auto intersection = intersect_cutouts(scene, bvh, ray, {}, rng);
+  return trace_normal(
+      scene, bvh, lights, ray, intersection, rng, params, bounce);
+}
+
+static vec4f trace_normal(const trace_scene* scene, const trace_bvh* bvh,
+    const trace_lights* lights, const ray3f& ray,
+    [[maybe_unused]] const trace_cone& cone,
+    const bvh_intersection& intersection, rng_state& rng,
     const trace_params& params) {
-  return trace_normal(scene, bvh, lights, ray, rng, params, 0);
+  return trace_normal(scene, bvh, lights, ray, intersection, rng, params, 0);
+}
+
+static vec4f trace_normal(const trace_scene* scene, const trace_bvh* bvh,
+    const trace_lights* lights, const ray3f& ray, const trace_cone& cone,
+    rng_state& rng, const trace_params& params) {
+  auto intersection = intersect_cutouts(scene, bvh, ray, cone, rng);
+  return trace_normal(
+      scene, bvh, lights, ray, cone, intersection, rng, params);
 }
 
 // Trace a single ray from the camera using the given algorithm.
 using sampler_func = vec4f (*)(const trace_scene* scene, const trace_bvh* bvh,
-    const trace_lights* lights, const ray3f& ray, rng_state& rng,
-    const trace_params& params);
+    const trace_lights* lights, const ray3f& ray, const trace_cone& cone,
+    rng_state& rng, const trace_params& params);
 static sampler_func get_trace_sampler_func(const trace_params& params) {
   switch (params.sampler) {
     case trace_sampler_type::path: return trace_path;
     case trace_sampler_type::naive: return trace_naive;
+    case trace_sampler_type::wavefront: return trace_path;
     case trace_sampler_type::eyelight: return trace_eyelight;
     case trace_sampler_type::falsecolor: return trace_falsecolor;
     case trace_sampler_type::albedo: return trace_albedo;
@@ -1713,11 +2308,28 @@ static sampler_func get_trace_sampler_func(const trace_params& params) {
   }
 }
 
+// Trace a single ray from the camera, given its first intersection. Used
+// to intersect camera rays together for the samplers that support it.
+using hit_sampler_func = vec4f (*)(const trace_scene* scene,
+    const trace_bvh* bvh, const trace_lights* lights, const ray3f& ray,
+    const trace_cone& cone, const bvh_intersection& intersection,
+    rng_state& rng, const trace_params& params);
+static hit_sampler_func get_trace_hit_sampler_func(const trace_params& params) {
+  switch (params.sampler) {
+    case trace_sampler_type::eyelight: return trace_eyelight;
+    case trace_sampler_type::falsecolor: return trace_falsecolor;
+    case trace_sampler_type::albedo: return trace_albedo;
+    case trace_sampler_type::normal: return trace_normal;
+    default: return nullptr;
+  }
+}
+
 // Check is a sampler requires lights
 bool is_sampler_lit(const trace_params& params) {
   switch (params.sampler) {
     case trace_sampler_type::path: return true;
     case trace_sampler_type::naive: return true;
+    case trace_sampler_type::wavefront: return true;
     case trace_sampler_type::eyelight: return false;
     case trace_sampler_type::falsecolor: return false;
     case trace_sampler_type::albedo: return false;
@@ -1729,18 +2341,15 @@ bool is_sampler_lit(const trace_params& params) {
   }
 }
 
-// Trace a block of samples
-void trace_sample(trace_state* state, const trace_scene* scene,
-    const trace_camera* camera, const trace_bvh* bvh,
-    const trace_lights* lights, const vec2i& ij, const trace_params& params) {
-  auto sampler = get_trace_sampler_func(params);
-  auto ray     = sample_camera(camera, ij, state->render.imsize(),
-      rand2f(state->rngs[ij]), rand2f(state->rngs[ij]), params.tentfilter);
-  auto sample  = sampler(scene, bvh, lights, ray, state->rngs[ij], params);
+// Accumulate a sample in a pixel
+static void accumulate_sample(trace_state* state, const vec2i& ij,
+    const vec4f& sample_, const trace_params& params) {
+  auto sample = sample_;
   if (!isfinite(xyz(sample))) sample = {0, 0, 0, sample.w};
   if (max(sample) > params.clamp)
     sample = sample * (params.clamp / max(sample));
   state->accumulation[ij] += sample;
+  state->moments[ij] += luminance(xyz(sample)) * luminance(xyz(sample));
   state->samples[ij] += 1;
   auto radiance = state->accumulation[ij].w != 0
                       ? xyz(state->accumulation[ij]) / state->accumulation[ij].w
@@ -1749,6 +2358,218 @@ void trace_sample(trace_state* state, const trace_scene* scene,
   state->render[ij] = {radiance.x, radiance.y, radiance.z, coverage};
 }
 
+// Trace a block of samples
+void trace_sample(trace_state* state, const trace_scene* scene,
+    const trace_camera* camera, const trace_bvh* bvh,
+    const trace_lights* lights, const vec2i& ij, const trace_params& params) {
+  auto sampler = get_trace_sampler_func(params);
+  auto ray     = sample_camera(camera, ij, state->render.imsize(),
+      rand2f(state->rngs[ij]), rand2f(state->rngs[ij]),
+      sample_shutter(camera, state->rngs[ij]), params.tentfilter);
+  auto cone    = eval_camera_cone(camera, state->render.imsize(), params);
+  auto sample  = sampler(
+      scene, bvh, lights, ray, cone, state->rngs[ij], params);
+  accumulate_sample(state, ij, sample, params);
+}
+
+// Trace a sample for a set of pixels, intersecting all camera rays as a
+// stream before shading them.
+static void trace_samples(trace_state* state, const trace_scene* scene,
+    const trace_camera* camera, const trace_bvh* bvh,
+    const trace_lights* lights, const vector<vec2i>& pixels,
+    const trace_params& params) {
+  auto sampler = get_trace_hit_sampler_func(params);
+  auto rays    = vector<ray3f>(pixels.size());
+  for (auto idx = 0; idx < pixels.size(); idx++) {
+    auto& ij  = pixels[idx];
+    rays[idx] = sample_camera(camera, ij, state->render.imsize(),
+        rand2f(state->rngs[ij]), rand2f(state->rngs[ij]),
+        sample_shutter(camera, state->rngs[ij]), params.tentfilter);
+  }
+  auto cone        = eval_camera_cone(camera, state->render.imsize(), params);
+  auto opacities   = vector<trace_opacity>(pixels.size());
+  auto opacity_cbs = vector<bvh_opacity_callback>(pixels.size());
+  if (skips_cutouts(params)) {
+    for (auto idx = 0; idx < pixels.size(); idx++) {
+      opacities[idx]   = make_opacity(
+          scene, bvh, rays[idx], cone, state->rngs[pixels[idx]]);
+      opacity_cbs[idx] = make_opacity_callback(opacities[idx]);
+    }
+  }
+  auto intersections = intersect_bvh_stream(bvh, rays, opacity_cbs);
+  for (auto idx = 0; idx < pixels.size(); idx++) {
+    auto& ij     = pixels[idx];
+    auto  sample = sampler(scene, bvh, lights, rays[idx], cone,
+        intersections[idx], state->rngs[ij], params);
+    accumulate_sample(state, ij, sample, params);
+  }
+}
+
+// Wavefront path tracing. Paths for all pixels are advanced together one
+// bounce at a time: rays are intersected as a stream, surface hits are
+// sorted by material and shape before evaluating their bsdfs, and paths are
+// compacted between bounces. Paths are shaded as in trace_path, using the
+// random numbers of their pixel in the same order, so results are the same.
+static void trace_wavefront(trace_state* state, const trace_scene* scene,
+    const trace_camera* camera, const trace_bvh* bvh,
+    const trace_lights* lights, const vector<vec2i>& pixels,
+    const trace_params& params) {
+  // generate camera rays
+  auto cone  = eval_camera_cone(camera, state->render.imsize(), params);
+  auto paths = vector<trace_path_state>(pixels.size());
+  for (auto idx = 0; idx < pixels.size(); idx++) {
+    auto& ij   = pixels[idx];
+    auto& path = paths[idx];
+    path.ray   = sample_camera(camera, ij, state->render.imsize(),
+        rand2f(state->rngs[ij]), rand2f(state->rngs[ij]),
+        sample_shutter(camera, state->rngs[ij]), params.tentfilter);
+    path.cone  = cone;
+    path.hit   = !params.envhidden && !scene->environments.empty();
+    path.done  = params.bounces <= 0;
+  }
+
+  // active paths
+  auto active = vector<int>{};
+  for (auto idx = 0; idx < paths.size(); idx++)
+    if (!paths[idx].done) active.push_back(idx);
+
+  // trace paths
+  auto rays        = vector<ray3f>{};
+  auto opacities   = vector<trace_opacity>{};
+  auto opacity_cbs = vector<bvh_opacity_callback>{};
+  auto vertices    = vector<trace_path_vertex>{};
+  auto order       = vector<int>{};
+  while (!active.empty()) {
+    // intersect next points, skipping cutouts
+    rays.resize(active.size());
+    opacities.resize(active.size());
+    opacity_cbs.resize(active.size());
+    for (auto idx = 0; idx < active.size(); idx++) {
+      auto& path       = paths[active[idx]];
+      rays[idx]        = path.ray;
+      opacities[idx]   = make_opacity(scene, bvh, path.ray, path.cone,
+          state->rngs[pixels[active[idx]]]);
+      opacity_cbs[idx] = make_opacity_callback(opacities[idx]);
+    }
+    auto intersections = intersect_bvh_stream(bvh, rays, opacity_cbs);
+
+    // handle misses and transmission if inside a volume
+    vertices.resize(active.size());
+    for (auto idx = 0; idx < active.size(); idx++) {
+      vertices[idx] = sample_path_vertex(scene, paths[active[idx]],
+          intersections[idx], state->rngs[pixels[active[idx]]], params);
+    }
+
+    // sort surface points by material and shape
+    order.clear();
+    for (auto idx = 0; idx < active.size(); idx++) {
+      if (paths[active[idx]].done || vertices[idx].in_volume) continue;
+      order.push_back(idx);
+    }
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+      auto instance_a = scene->instances[vertices[a].intersection.instance];
+      auto instance_b = scene->instances[vertices[b].intersection.instance];
+      if (instance_a->material != instance_b->material)
+        return std::less<>{}(instance_a->material, instance_b->material);
+      return instance_a->shape->shape_id < instance_b->shape->shape_id;
+    });
+
+    // evaluate surface points, in material order
+    for (auto idx : order) {
+      eval_path_vertex(scene, paths[active[idx]], vertices[idx]);
+    }
+
+    // continue paths
+    for (auto idx = 0; idx < active.size(); idx++) {
+      auto& path = paths[active[idx]];
+      if (path.done) continue;
+      shade_path_vertex(scene, bvh, lights, path, vertices[idx],
+          state->rngs[pixels[active[idx]]], params);
+    }
+
+    // compact paths
+    active.erase(std::remove_if(active.begin(), active.end(),
+                     [&paths](int idx) { return paths[idx].done; }),
+        active.end());
+  }
+
+  // accumulate samples
+  for (auto idx = 0; idx < paths.size(); idx++) {
+    auto& path = paths[idx];
+    accumulate_sample(state, pixels[idx],
+        {path.radiance.x, path.radiance.y, path.radiance.z,
+            path.hit ? 1.0f : 0.0f},
+        params);
+  }
+}
+
+// Interleave the bits of the tile coordinates to get its Z-order index.
+static uint64_t morton_index(const vec2i& ij) {
+  auto spread = [](uint64_t x) {
+    x = (x | (x << 16)) & 0x0000ffff0000ffffull;
+    x = (x | (x << 8)) & 0x00ff00ff00ff00ffull;
+    x = (x | (x << 4)) & 0x0f0f0f0f0f0f0f0full;
+    x = (x | (x << 2)) & 0x3333333333333333ull;
+    x = (x | (x << 1)) & 0x5555555555555555ull;
+    return x;
+  };
+  return spread((uint32_t)ij.x) | (spread((uint32_t)ij.y) << 1);
+}
+
+// Distance of the tile along a Hilbert curve covering a grid of size n,
+// with n a power of two.
+static uint64_t hilbert_index(const vec2i& ij, int n) {
+  auto x = ij.x, y = ij.y;
+  auto d = (uint64_t)0;
+  for (auto s = n / 2; s > 0; s /= 2) {
+    auto rx = (x & s) > 0 ? 1 : 0, ry = (y & s) > 0 ? 1 : 0;
+    d += (uint64_t)s * (uint64_t)s * (uint64_t)((3 * rx) ^ ry);
+    if (ry == 0) {
+      if (rx == 1) {
+        x = s - 1 - x;
+        y = s - 1 - y;
+      }
+      std::swap(x, y);
+    }
+  }
+  return d;
+}
+
+// Split the image in tiles, sorted in rendering order.
+static vector<vec4i> make_tiles(
+    const vec2i& size, int tilesize, trace_tileorder_type order) {
+  tilesize       = max(tilesize, 1);
+  auto num_tiles = (size + tilesize - 1) / tilesize;
+  auto tiles     = vector<pair<uint64_t, vec4i>>{};
+  tiles.reserve((size_t)num_tiles.x * (size_t)num_tiles.y);
+  auto grid_size = 1;
+  while (grid_size < max(num_tiles)) grid_size *= 2;
+  for (auto tj = 0; tj < num_tiles.y; tj++) {
+    for (auto ti = 0; ti < num_tiles.x; ti++) {
+      auto index = (uint64_t)0;
+      switch (order) {
+        case trace_tileorder_type::scanline:
+          index = (uint64_t)tj * num_tiles.x + ti;
+          break;
+        case trace_tileorder_type::morton:
+          index = morton_index({ti, tj});
+          break;
+        case trace_tileorder_type::hilbert:
+          index = hilbert_index({ti, tj}, grid_size);
+          break;
+      }
+      auto tile = vec4i{ti * tilesize, tj * tilesize,
+          min((ti + 1) * tilesize, size.x), min((tj + 1) * tilesize, size.y)};
+      tiles.push_back({index, tile});
+    }
+  }
+  std::sort(tiles.begin(), tiles.end(),
+      [](auto& a, auto& b) { return a.first < b.first; });
+  auto sorted = vector<vec4i>(tiles.size());
+  for (auto idx = 0; idx < tiles.size(); idx++) sorted[idx] = tiles[idx].second;
+  return sorted;
+}
+
 // Init a sequence of random number generators.
 void init_state(trace_state* state, const trace_scene* scene,
     const trace_camera* camera, const trace_params& params) {
@@ -1759,12 +2580,149 @@ void init_state(trace_state* state, const trace_scene* scene,
                               params.resolution};
   state->render.assign(image_size, zero4f);
   state->accumulation.assign(image_size, zero4f);
+  state->moments.assign(image_size, 0);
   state->samples.assign(image_size, 0);
   state->rngs.assign(image_size, {});
   auto rng_ = make_rng(1301081);
   for (auto& rng : state->rngs) {
     rng = make_rng(params.seed, rand1i(rng_, 1 << 31) / 2 + 1);
   }
+  state->tiles = make_tiles(image_size, params.tilesize, params.tileorder);
+  state->active.assign(state->tiles.size(), {});
+  for (auto tile_id = 0; tile_id < state->tiles.size(); tile_id++) {
+    auto  tile   = state->tiles[tile_id];
+    auto& active = state->active[tile_id];
+    active.reserve((size_t)(tile.z - tile.x) * (size_t)(tile.w - tile.y));
+    for (auto j = tile.y; j < tile.w; j++) {
+      for (auto i = tile.x; i < tile.z; i++) active.push_back({i, j});
+    }
+  }
+}
+
+// Estimated relative error of a pixel, computed as the standard error of
+// the mean luminance over the mean luminance.
+float eval_error(const trace_state* state, const vec2i& ij) {
+  auto num = (float)state->samples[ij];
+  if (num < 2) return flt_max;
+  auto mean     = luminance(xyz(state->accumulation[ij])) / num;
+  auto variance = max(state->moments[ij] / num - mean * mean, 0.0f) * num /
+                  (num - 1);
+  return sqrt(variance / num) / max(mean, 0.01f);
+}
+
+// Check whether a pixel can stop sampling
+static bool is_converged(
+    const trace_state* state, const vec2i& ij, const trace_params& params) {
+  if (!params.adaptive) return false;
+  if (state->samples[ij] < max(params.minsamples, 2)) return false;
+  return eval_error(state, ij) < params.targeterror;
+}
+
+// Maximum number of samples per pixel. With adaptive sampling, pixels that
+// do not converge are capped at a multiple of the average samples.
+static int get_max_samples(const trace_params& params) {
+  return params.adaptive ? params.samples * max(params.maxratio, 1)
+                         : params.samples;
+}
+
+// Check whether a pixel is done sampling
+static bool is_done(
+    const trace_state* state, const vec2i& ij, const trace_params& params) {
+  return state->samples[ij] >= get_max_samples(params) ||
+         is_converged(state, ij, params);
+}
+
+// Number of samples per pixel in the next batch. Samples are spent from a
+// budget of samples per pixel times the number of pixels, so with adaptive
+// sampling the budget left by converged pixels goes to the active ones.
+// Batches grow as pixels converge, to keep the work per batch about even.
+static int get_batch_samples(const trace_params& params, int64_t remaining,
+    int64_t active, int64_t npixels) {
+  auto batch = (int64_t)max(params.tilesamples, 1) *
+               std::max(npixels / std::max(active, (int64_t)1), (int64_t)1);
+  return (int)std::min((remaining + active - 1) / active, batch);
+}
+
+// Trace a batch of samples for the active pixels in a tile, removing the
+// pixels that are done. Returns the number of samples taken.
+static int64_t trace_tile(trace_state* state, const trace_scene* scene,
+    const trace_camera* camera, const trace_bvh* bvh,
+    const trace_lights* lights, int tile_id, int nsamples, int current,
+    const trace_params& params, const async_callback& async_cb) {
+  auto& pixels  = state->active[tile_id];
+  auto  sampled = (int64_t)0;
+  auto  stream  = get_trace_hit_sampler_func(params) != nullptr ||
+                params.sampler == trace_sampler_type::wavefront;
+  for (auto sample = 0; sample < nsamples; sample++) {
+    if (pixels.empty() || state->stop) break;
+    if (params.sampler == trace_sampler_type::wavefront) {
+      trace_wavefront(state, scene, camera, bvh, lights, pixels, params);
+    } else if (stream) {
+      trace_samples(state, scene, camera, bvh, lights, pixels, params);
+    }
+    for (auto& ij : pixels) {
+      if (!stream)
+        trace_sample(state, scene, camera, bvh, lights, ij, params);
+      if (async_cb)
+        async_cb(state->render, current + sample, params.samples, ij);
+    }
+    sampled += (int64_t)pixels.size();
+    auto done = [&](const vec2i& ij) { return is_done(state, ij, params); };
+    pixels.erase(
+        std::remove_if(pixels.begin(), pixels.end(), done), pixels.end());
+  }
+  return sampled;
+}
+
+// Progressively render the active tiles in batches, until the sample budget
+// is spent, all pixels are done, the time limit is reached or the rendering
+// is stopped. Returns the average number of samples per pixel.
+static int trace_batches(trace_state* state, const trace_scene* scene,
+    const trace_camera* camera, const trace_bvh* bvh,
+    const trace_lights* lights, const trace_params& params,
+    const progress_callback& progress_cb, const image_callback& image_cb,
+    const async_callback& async_cb) {
+  auto start   = std::chrono::steady_clock::now();
+  auto npixels = (int64_t)state->render.count();
+  auto budget  = (int64_t)params.samples * npixels;
+  auto spent   = (int64_t)0;
+  auto active  = npixels;
+  auto tiles   = vector<int>(state->tiles.size());
+  for (auto tile_id = 0; tile_id < tiles.size(); tile_id++)
+    tiles[tile_id] = tile_id;
+  while (spent < budget && active > 0 && !state->stop) {
+    auto current = (int)(spent / npixels);
+    if (progress_cb) progress_cb("trace image", current, params.samples);
+    auto nsamples = get_batch_samples(params, budget - spent, active, npixels);
+    auto sampled  = atomic<int64_t>{0};
+    if (params.noparallel) {
+      for (auto tile_id : tiles) {
+        sampled += trace_tile(state, scene, camera, bvh, lights, tile_id,
+            nsamples, current, params, async_cb);
+      }
+    } else {
+      parallel_for(
+          (int)tiles.size(),
+          [&](int idx) {
+            sampled += trace_tile(state, scene, camera, bvh, lights,
+                tiles[idx], nsamples, current, params, async_cb);
+          },
+          1);
+    }
+    spent += sampled;
+    if (image_cb)
+      image_cb(state->render, (int)(spent / npixels), params.samples);
+    auto done = [&](int tile_id) { return state->active[tile_id].empty(); };
+    tiles.erase(std::remove_if(tiles.begin(), tiles.end(), done), tiles.end());
+    active = 0;
+    for (auto tile_id : tiles) active += (int64_t)state->active[tile_id].size();
+    auto elapsed = std::chrono::duration<float>(
+        std::chrono::steady_clock::now() - start);
+    if (params.timelimit > 0 && elapsed.count() >= params.timelimit) break;
+  }
+
+  // report the average number of samples actually taken
+  return npixels != 0 ? (int)(spent / npixels) : 0;
 }
 
 // Forward declaration
@@ -1772,6 +2730,186 @@ static trace_light* add_light(trace_lights* lights) {
   return lights->lights.emplace_back(new trace_light{});
 }
 
+// Bounds of an instance light, in world space, at time 0
+static trace_light_node make_light_node(const trace_light* light) {
+  auto instance = light->instance;
+  auto shape    = instance->shape;
+  auto frame    = eval_frame(instance, 0);
+  auto node     = trace_light_node{};
+  auto normals  = vector<vec3f>{};
+  auto area     = 0.0f;
+  normals.reserve(shape->triangles.size() + shape->quads.size());
+  for (auto& t : shape->triangles) {
+    auto p0 = transform_point(frame, shape->positions[t.x]);
+    auto p1 = transform_point(frame, shape->positions[t.y]);
+    auto p2 = transform_point(frame, shape->positions[t.z]);
+    node.bbox = merge(merge(merge(node.bbox, p0), p1), p2);
+    auto element_area = triangle_area(p0, p1, p2);
+    if (element_area == 0) continue;
+    area += element_area;
+    normals.push_back(triangle_normal(p0, p1, p2));
+  }
+  for (auto& q : shape->quads) {
+    auto p0 = transform_point(frame, shape->positions[q.x]);
+    auto p1 = transform_point(frame, shape->positions[q.y]);
+    auto p2 = transform_point(frame, shape->positions[q.z]);
+    auto p3 = transform_point(frame, shape->positions[q.w]);
+    node.bbox = merge(merge(merge(merge(node.bbox, p0), p1), p2), p3);
+    auto element_area = quad_area(p0, p1, p2, p3);
+    if (element_area == 0) continue;
+    area += element_area;
+    normals.push_back(quad_normal(p0, p1, p2, p3));
+  }
+  // enlarge bounds to be robust to intersection precision
+  node.bbox.min -= ray_eps;
+  node.bbox.max += ray_eps;
+  node.power = max(instance->material->emission) * area;
+  // bound normals and their opposites with a cone
+  auto axis = zero3f;
+  for (auto& normal : normals) {
+    axis += dot(axis, normal) < 0 ? -normal : normal;
+  }
+  if (axis == zero3f) {
+    node.angle = pif / 2;
+    return node;
+  }
+  auto cos_angle = 1.0f;
+  node.axis      = normalize(axis);
+  for (auto& normal : normals) {
+    cos_angle = min(cos_angle, abs(dot(node.axis, normal)));
+  }
+  node.angle = acos(clamp(cos_angle, 0.0f, 1.0f));
+  return node;
+}
+
+// Merge the bounds of two light nodes. Cones are merged as in pbrt-v4, after
+// flipping one axis since opposite normals are bound together.
+static trace_light_node merge_light_nodes(
+    const trace_light_node& a, const trace_light_node& b) {
+  auto node  = trace_light_node{};
+  node.bbox  = merge(a.bbox, b.bbox);
+  node.power = a.power + b.power;
+  auto baxis = dot(a.axis, b.axis) < 0 ? -b.axis : b.axis;
+  auto theta = acos(clamp(dot(a.axis, baxis), -1.0f, 1.0f));
+  if (theta + b.angle <= a.angle) {
+    node.axis  = a.axis;
+    node.angle = a.angle;
+  } else if (theta + a.angle <= b.angle) {
+    node.axis  = baxis;
+    node.angle = b.angle;
+  } else {
+    auto angle = (a.angle + theta + b.angle) / 2;
+    auto ortho = baxis - a.axis * dot(a.axis, baxis);
+    if (angle >= pif / 2 || ortho == zero3f) {
+      node.axis  = a.axis;
+      node.angle = pif / 2;
+    } else {
+      auto rotation = angle - a.angle;
+      node.axis     = normalize(
+          a.axis * cos(rotation) + normalize(ortho) * sin(rotation));
+      node.angle = angle;
+    }
+  }
+  return node;
+}
+
+// Build the light hierarchy recursively, splitting lights at the median of
+// the largest axis of their centers.
+static void build_light_node(vector<trace_light_node>& nodes, int nodeid,
+    vector<trace_light_node>& leaves, int start, int end) {
+  if (end - start == 1) {
+    nodes[nodeid] = leaves[start];
+    return;
+  }
+  auto cbbox = invalidb3f;
+  for (auto idx = start; idx < end; idx++)
+    cbbox = merge(cbbox, center(leaves[idx].bbox));
+  auto csize = size(cbbox);
+  auto axis  = 0;
+  if (csize.y >= csize.x && csize.y >= csize.z) axis = 1;
+  if (csize.z >= csize.x && csize.z >= csize.y) axis = 2;
+  auto mid = (start + end) / 2;
+  std::nth_element(leaves.data() + start, leaves.data() + mid,
+      leaves.data() + end, [axis](auto& a, auto& b) {
+        return center(a.bbox)[axis] < center(b.bbox)[axis];
+      });
+  auto children = (int)nodes.size();
+  nodes.emplace_back();
+  nodes.emplace_back();
+  build_light_node(nodes, children, leaves, start, mid);
+  build_light_node(nodes, children + 1, leaves, mid, end);
+  nodes[nodeid] = merge_light_nodes(nodes[children], nodes[children + 1]);
+  nodes[nodeid].start    = children;
+  nodes[nodeid].internal = true;
+}
+
+// Init the alias tables used to sample light elements. Environment rows are
+// built in parallel, since environment maps can be large.
+static void init_light_elements(trace_light* light, bool parallel) {
+  if (light->instance != nullptr) {
+    auto shape = light->instance->shape;
+    if (!shape->triangles.empty()) {
+      light->elements_weights = vector<float>(shape->triangles.size());
+      for (auto idx = 0; idx < light->elements_weights.size(); idx++) {
+        auto& t                      = shape->triangles[idx];
+        light->elements_weights[idx] = triangle_area(shape->positions[t.x],
+            shape->positions[t.y], shape->positions[t.z]);
+      }
+    }
+    if (!shape->quads.empty()) {
+      light->elements_weights = vector<float>(shape->quads.size());
+      for (auto idx = 0; idx < light->elements_weights.size(); idx++) {
+        auto& q                      = shape->quads[idx];
+        light->elements_weights[idx] = quad_area(shape->positions[q.x],
+            shape->positions[q.y], shape->positions[q.z],
+            shape->positions[q.w]);
+      }
+    }
+    make_discrete_alias(light->elements_probs, light->elements_aliases,
+        light->elements_weights);
+  } else if (light->environment != nullptr &&
+             light->environment->emission_tex != nullptr) {
+    auto texture = light->environment->emission_tex;
+    auto size    = texture_size(texture);
+    if (size == zero2i) return;
+    light->elements_weights = vector<float>(size.x * size.y);
+    light->elements_probs   = vector<float>(size.x * size.y);
+    light->elements_aliases = vector<int>(size.x * size.y);
+    auto rows_weights       = vector<float>(size.y);
+
+    // rows are built independently
+    auto init_row = [light, texture, size, &rows_weights](int j) {
+      auto th      = (j + 0.5f) * pif / size.y;
+      auto weights = vector<float>(size.x);
+      auto sum     = 0.0;
+      for (auto i = 0; i < size.x; i++) {
+        weights[i] = max(lookup_texture(texture, {i, j})) * sin(th);
+        sum += weights[i];
+      }
+      auto probs   = vector<float>{};
+      auto aliases = vector<int>{};
+      make_discrete_alias(probs, aliases, weights);
+      auto offset = (size_t)j * size.x;
+      std::copy(weights.begin(), weights.end(),
+          light->elements_weights.begin() + offset);
+      std::copy(
+          probs.begin(), probs.end(), light->elements_probs.begin() + offset);
+      std::copy(aliases.begin(), aliases.end(),
+          light->elements_aliases.begin() + offset);
+      rows_weights[j] = (float)sum;
+    };
+    if (parallel) {
+      parallel_for(size.y, init_row);
+    } else {
+      for (auto j = 0; j < size.y; j++) init_row(j);
+    }
+    make_discrete_alias(light->rows_probs, light->rows_aliases, rows_weights);
+  }
+  auto total = 0.0;
+  for (auto weight : light->elements_weights) total += weight;
+  light->elements_total = (float)total;
+}
+
 // Init trace lights
 void init_lights(trace_lights* lights, const trace_scene* scene,
     const trace_params& params, const progress_callback& progress_cb) {
@@ -1781,6 +2919,8 @@ void init_lights(trace_lights* lights, const trace_scene* scene,
 
   for (auto light : lights->lights) delete light;
   lights->lights.clear();
+  lights->nodes.clear();
+  lights->environments.clear();
 
   for (auto instance : scene->instances) {
     if (instance->material->emission == zero3f) continue;
@@ -1790,25 +2930,6 @@ void init_lights(trace_lights* lights, const trace_scene* scene,
     auto light         = add_light(lights);
     light->instance    = instance;
     light->environment = nullptr;
-    if (!shape->triangles.empty()) {
-      light->elements_cdf = vector<float>(shape->triangles.size());
-      for (auto idx = 0; idx < light->elements_cdf.size(); idx++) {
-        auto& t                  = shape->triangles[idx];
-        light->elements_cdf[idx] = triangle_area(shape->positions[t.x],
-            shape->positions[t.y], shape->positions[t.z]);
-        if (idx != 0) light->elements_cdf[idx] += light->elements_cdf[idx - 1];
-      }
-    }
-    if (!shape->quads.empty()) {
-      light->elements_cdf = vector<float>(shape->quads.size());
-      for (auto idx = 0; idx < light->elements_cdf.size(); idx++) {
-        auto& t                  = shape->quads[idx];
-        light->elements_cdf[idx] = quad_area(shape->positions[t.x],
-            shape->positions[t.y], shape->positions[t.z],
-            shape->positions[t.w]);
-        if (idx != 0) light->elements_cdf[idx] += light->elements_cdf[idx - 1];
-      }
-    }
   }
   for (auto environment : scene->environments) {
     if (environment->emission == zero3f) continue;
@@ -1816,20 +2937,29 @@ void init_lights(trace_lights* lights, const trace_scene* scene,
     auto light         = add_light(lights);
     light->instance    = nullptr;
     light->environment = environment;
-    if (environment->emission_tex != nullptr) {
-      auto texture        = environment->emission_tex;
-      auto size           = texture_size(texture);
-      light->elements_cdf = vector<float>(size.x * size.y);
-      if (size != zero2i) {
-        for (auto i = 0; i < light->elements_cdf.size(); i++) {
-          auto ij                = vec2i{i % size.x, i / size.x};
-          auto th                = (ij.y + 0.5f) * pif / size.y;
-          auto value             = lookup_texture(texture, ij);
-          light->elements_cdf[i] = max(value) * sin(th);
-          if (i != 0) light->elements_cdf[i] += light->elements_cdf[i - 1];
-        }
-      }
-    }
+    lights->environments.push_back(light);
+  }
+
+  // build element distributions
+  if (params.noparallel) {
+    for (auto light : lights->lights) init_light_elements(light, false);
+  } else {
+    parallel_for(
+        (int)lights->lights.size(),
+        [lights](int idx) { init_light_elements(lights->lights[idx], true); },
+        1);
+  }
+
+  // build light hierarchy
+  auto leaves = vector<trace_light_node>{};
+  for (auto idx = 0; idx < lights->lights.size(); idx++) {
+    if (lights->lights[idx]->instance == nullptr) continue;
+    auto& leaf = leaves.emplace_back(make_light_node(lights->lights[idx]));
+    leaf.start = idx;
+  }
+  if (!leaves.empty()) {
+    lights->nodes.emplace_back();
+    build_light_node(lights->nodes, 0, leaves, 0, (int)leaves.size());
   }
 
   // handle progress
@@ -1860,24 +2990,11 @@ image<vec4f> trace_image(const trace_scene* scene, const trace_camera* camera,
   auto state       = state_guard.get();
   init_state(state, scene, camera, params);
 
-  for (auto sample = 0; sample < params.samples; sample++) {
-    if (progress_cb) progress_cb("trace image", sample, params.samples);
-    if (params.noparallel) {
-      for (auto j = 0; j < state->render.height(); j++) {
-        for (auto i = 0; i < state->render.width(); i++) {
-          trace_sample(state, scene, camera, bvh, lights, {i, j}, params);
-        }
-      }
-    } else {
-      parallel_for(state->render.width(), state->render.height(),
-          [state, scene, camera, bvh, lights, &params](int i, int j) {
-            trace_sample(state, scene, camera, bvh, lights, {i, j}, params);
-          });
-    }
-    if (image_cb) image_cb(state->render, sample + 1, params.samples);
-  }
-
-  if (progress_cb) progress_cb("trace image", params.samples, params.samples);
+  // with adaptive sampling, samples not taken by converged pixels are spent
+  // on the others, until all pixels are done or on timeout
+  auto samples = trace_batches(
+      state, scene, camera, bvh, lights, params, progress_cb, image_cb, {});
+  if (progress_cb) progress_cb("trace image", samples, samples);
   return state->render;
 }
 
@@ -1907,21 +3024,12 @@ void trace_start(trace_state* state, const trace_scene* scene,
   if (image_cb) image_cb(state->render, 0, params.samples);
 
   // start renderer
-  state->worker = std::async(std::launch::async, [=]() {
-    for (auto sample = 0; sample < params.samples; sample++) {
-      if (state->stop) return;
-      if (progress_cb) progress_cb("trace image", sample, params.samples);
-      parallel_for(
-          state->render.width(), state->render.height(), [&](int i, int j) {
-            if (state->stop) return;
-            trace_sample(state, scene, camera, bvh, lights, {i, j}, params);
-            if (async_cb)
-              async_cb(state->render, sample, params.samples, {i, j});
-          });
-      if (image_cb) image_cb(state->render, sample + 1, params.samples);
-    }
-    if (progress_cb) progress_cb("trace image", params.samples, params.samples);
-    if (image_cb) image_cb(state->render, params.samples, params.samples);
+  state->worker = run_async([=]() {
+    auto samples = trace_batches(state, scene, camera, bvh, lights, params,
+        progress_cb, image_cb, async_cb);
+    if (state->stop) return;
+    if (progress_cb) progress_cb("trace image", samples, samples);
+    if (image_cb) image_cb(state->render, samples, params.samples);
   });
 }
 void trace_stop(trace_state* state) {
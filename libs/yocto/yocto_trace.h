@@ -40,6 +40,7 @@
 #include <atomic>
 #include <future>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <utility>
 #include <vector>
@@ -81,7 +82,8 @@ namespace yocto {
 // 2.39:1 on 35 mm:  0.036 x 0.01506 or 0.05736 x 0.024
 // 2.4:1  on 35 mm:  0.036 x 0.015   or 0.05760 x 0.024 (approx. 2.39 : 1)
 // To compute good apertures, one can use the F-stop number from photography
-// and set the aperture to focal length over f-stop.
+// and set the aperture to focal length over f-stop. For motion blur, the
+// shutter is open for the time interval [0, shutter].
 struct trace_camera {
   frame3f frame        = identity3x4f;
   bool    orthographic = false;
@@ -90,13 +92,24 @@ struct trace_camera {
   float   aspect       = 1.500;
   float   focus        = 10000;
   float   aperture     = 0;
+  float   shutter      = 0;
 };
 
 // Texture containing either an LDR or HDR image. HdR images are encoded
 // in linear color space, while LDRs are encoded as sRGB.
+// Mip levels after the base image are built on the first filtered lookup.
+// LDR levels are built separately for sRGB and linear lookups.
 struct trace_texture {
   image<vec4f> hdr = {};
   image<vec4b> ldr = {};
+
+  // mip levels, built lazily
+  mutable vector<image<vec4f>> hdr_mips         = {};
+  mutable vector<image<vec4b>> ldr_mips         = {};
+  mutable vector<image<vec4b>> ldr_linear_mips  = {};
+  mutable atomic<bool>         mipmapped        = {};
+  mutable atomic<bool>         linear_mipmapped = {};
+  mutable std::mutex           mips_mutex;
 };
 
 // Material for surfaces, lines and triangles.
@@ -173,9 +186,11 @@ struct trace_shape {
   int shape_id = -1;
 };
 
-// Object.
+// Object. Moving objects have two or more keyframes, evenly spaced over the
+// time interval [0, 1], that override the frame.
 struct trace_instance {
   frame3f         frame    = identity3x4f;
+  vector<frame3f> frames   = {};
   trace_shape*    shape    = nullptr;
   trace_material* material = nullptr;
 
@@ -245,8 +260,27 @@ vec4f eval_texture(const trace_texture* texture, const vec2f& uv,
     bool ldr_as_linear = false, bool no_interpolation = false,
     bool clamp_to_edge = false);
 
-// Evaluate instance properties
-vec3f eval_position(
+// Footprint of a ray in texture space, as the two axes of the ellipse it
+// covers in texture coordinates. Empty footprints use the base level.
+struct trace_footprint {
+  vec2f duvdx = {0, 0};
+  vec2f duvdy = {0, 0};
+};
+
+// Evaluates a texture over a footprint, with trilinear lookups in the mip
+// levels, taking several lookups along the major axis of elongated
+// footprints. Mip levels are built on the first call.
+vec4f eval_texture(const trace_texture* texture, const vec2f& uv,
+    const trace_footprint& footprint, bool ldr_as_linear = false);
+// Clears the mip levels of a texture, needed after changing its images.
+// Renders using the texture must be stopped first, since lookups read the
+// mip levels without locking.
+void clear_mipmaps(trace_texture* texture);
+
+// Evaluate instance properties. Properties are evaluated with the instance
+// frame, while eval_frame gives the frame of moving instances at a time.
+frame3f eval_frame(const trace_instance* instance, float time);
+vec3f   eval_position(
     const trace_instance* instance, int element, const vec2f& uv);
 vec3f eval_element_normal(const trace_instance* instance, int element);
 vec3f eval_normal(const trace_instance* instance, int element, const vec2f& uv);
@@ -254,12 +288,18 @@ vec2f eval_texcoord(
     const trace_instance* instance, int element, const vec2f& uv);
 pair<vec3f, vec3f> eval_element_tangents(
     const trace_instance* instance, int element);
-vec3f eval_normalmap(
-    const trace_instance* instance, int element, const vec2f& uv);
+vec3f eval_normalmap(const trace_instance* instance, int element,
+    const vec2f& uv, const trace_footprint& footprint = {});
 vec3f eval_shading_normal(const trace_instance* instance, int element,
-    const vec2f& uv, const vec3f& outgoing);
+    const vec2f& uv, const vec3f& outgoing,
+    const trace_footprint& footprint = {});
 vec4f eval_color(const trace_instance* instance, int element, const vec2f& uv);
 
+// Evaluates the texture footprint of a ray cone of the given `width` hitting
+// an element from `direction`.
+trace_footprint eval_footprint(const trace_instance* instance, int element,
+    const vec3f& direction, float width);
+
 // Environment
 vec3f eval_environment(
     const trace_environment* environment, const vec3f& direction);
@@ -286,8 +326,8 @@ struct trace_material_sample {
 };
 
 // Evaluates material and textures
-trace_material_sample eval_material(
-    const trace_material* material, const vec2f& texcoord);
+trace_material_sample eval_material(const trace_material* material,
+    const vec2f& texcoord, const trace_footprint& footprint = {});
 
 // Material Bsdf parameters
 struct trace_bsdf {
@@ -315,12 +355,15 @@ struct trace_bsdf {
 
 // Eval material to obtain emission, brdf and opacity.
 vec3f eval_emission(const trace_instance* instance, int element,
-    const vec2f& uv, const vec3f& normal, const vec3f& outgoing);
+    const vec2f& uv, const vec3f& normal, const vec3f& outgoing,
+    const trace_footprint& footprint = {});
 // Eval material to obatain emission, brdf and opacity.
 trace_bsdf eval_bsdf(const trace_instance* instance, int element,
-    const vec2f& uv, const vec3f& normal, const vec3f& outgoing);
+    const vec2f& uv, const vec3f& normal, const vec3f& outgoing,
+    const trace_footprint& footprint = {});
 float eval_opacity(const trace_instance* instance, int element, const vec2f& uv,
-    const vec3f& normal, const vec3f& outgoing);
+    const vec3f& normal, const vec3f& outgoing,
+    const trace_footprint& footprint = {});
 // check if a brdf is a delta
 bool is_delta(const trace_bsdf& bsdf);
 
@@ -334,8 +377,8 @@ struct trace_vsdf {
 // check if we have a volume
 bool has_volume(const trace_instance* instance);
 // evaluate volume
-trace_vsdf eval_vsdf(
-    const trace_instance* instance, int element, const vec2f& uv);
+trace_vsdf eval_vsdf(const trace_instance* instance, int element,
+    const vec2f& uv, const trace_footprint& footprint = {});
 
 }  // namespace yocto
 
@@ -350,6 +393,9 @@ enum struct trace_bvh_type {
   highquality,
   middle,
   balanced,
+  wide,
+  compressed,
+  spatial,
 #ifdef YOCTO_EMBREE
   embree_default,
   embree_highquality,
@@ -365,6 +411,7 @@ enum struct trace_sampler_type {
   falsecolor,  // false color rendering
   albedo,      // renders the (approximate) albedo of objects for denoising
   normal,      // renders the normals of objects for denoising
+  wavefront,   // path tracing that advances many paths together
 };
 // Type of false color visualization
 enum struct trace_falsecolor_type {
@@ -375,37 +422,59 @@ enum struct trace_falsecolor_type {
   // clang-format on
 };
 
+// Order in which image tiles are rendered
+enum struct trace_tileorder_type {
+  scanline,  // row by row
+  morton,    // Z-order curve
+  hilbert,   // Hilbert curve
+};
+
 // Default trace seed
 const auto trace_default_seed = 961748941ull;
 
 // Options for trace functions
 struct trace_params {
-  int                   resolution = 1280;
-  trace_sampler_type    sampler    = trace_sampler_type::path;
-  trace_falsecolor_type falsecolor = trace_falsecolor_type::diffuse;
-  int                   samples    = 512;
-  int                   bounces    = 8;
-  float                 clamp      = 100;
-  bool                  nocaustics = false;
-  bool                  envhidden  = false;
-  bool                  tentfilter = false;
-  uint64_t              seed       = trace_default_seed;
-  trace_bvh_type        bvh        = trace_bvh_type::default_;
-  bool                  noparallel = false;
-  int                   pratio     = 8;
-  float                 exposure   = 0;
+  int                   resolution  = 1280;
+  trace_sampler_type    sampler     = trace_sampler_type::path;
+  trace_falsecolor_type falsecolor  = trace_falsecolor_type::diffuse;
+  int                   samples     = 512;
+  int                   bounces     = 8;
+  float                 clamp       = 100;
+  bool                  nocaustics  = false;
+  bool                  envhidden   = false;
+  bool                  tentfilter  = false;
+  uint64_t              seed        = trace_default_seed;
+  trace_bvh_type        bvh         = trace_bvh_type::default_;
+  bool                  noparallel  = false;
+  bool                  precompute  = false;
+  string                bvhcache    = "";
+  bool                  mipmaps     = false;
+  int                   pratio      = 8;
+  float                 exposure    = 0;
+  int                   tilesize    = 32;
+  int                   tilesamples = 4;
+  trace_tileorder_type  tileorder   = trace_tileorder_type::hilbert;
+  bool                  adaptive    = false;
+  int                   minsamples  = 16;
+  float                 targeterror = 0.01f;
+  int                   maxratio    = 4;
+  float                 timelimit   = 0;
 };
 
 const auto trace_sampler_names = std::vector<std::string>{
-    "path", "naive", "eyelight", "falsecolor", "dalbedo", "dnormal"};
+    "path", "naive", "eyelight", "falsecolor", "dalbedo", "dnormal",
+    "wavefront"};
 
 const auto trace_falsecolor_names = vector<string>{"position", "normal",
     "frontfacing", "gnormal", "gfrontfacing", "texcoord", "color", "emission",
     "diffuse", "specular", "coat", "metal", "transmission", "translucency",
     "refraction", "roughness", "opacity", "ior", "instance", "element",
     "highlight"};
+const auto trace_tileorder_names  = vector<string>{
+    "scanline", "morton", "hilbert"};
 const auto trace_bvh_names        = vector<string>{
-    "default", "highquality", "middle", "balanced",
+    "default", "highquality", "middle", "balanced", "wide", "compressed",
+    "spatial",
 #ifdef YOCTO_EMBREE
     "embree-default", "embree-highquality", "embree-compact"
 #endif
@@ -436,10 +505,34 @@ image<vec4f> trace_image(const trace_scene* scene, const trace_camera* camera,
 namespace yocto {
 
 // Scene lights used during rendering. These are created automatically.
+// Elements are sampled with alias tables, proportionally to their area for
+// instances and to their emission for environment texels. Environments
+// pick a row of texels first, then a texel in that row, using one alias
+// table per row stored consecutively in the element tables.
 struct trace_light {
-  trace_instance*    instance     = nullptr;
-  trace_environment* environment  = nullptr;
-  vector<float>      elements_cdf = {};
+  trace_instance*    instance         = nullptr;
+  trace_environment* environment      = nullptr;
+  vector<float>      elements_weights = {};
+  float              elements_total   = 0;
+  vector<float>      elements_probs   = {};
+  vector<int>        elements_aliases = {};
+  vector<float>      rows_probs       = {};
+  vector<int>        rows_aliases     = {};
+};
+
+// Node of the light hierarchy built over instance lights. Each node bounds
+// the positions, normals and emitted power of its lights, so that their
+// contribution at a point can be estimated. Internal nodes have two children
+// starting at `start`, leaves refer to the light at `start`. Normal bounds
+// are cones with half-angle `angle`, and include opposite normals since
+// lights emit on both sides.
+struct trace_light_node {
+  bbox3f bbox     = invalidb3f;
+  vec3f  axis     = {0, 0, 1};
+  float  angle    = 0;
+  float  power    = 0;
+  int    start    = 0;
+  bool   internal = false;
 };
 
 // Scene lights
@@ -447,6 +540,10 @@ struct trace_lights {
   // light elements
   vector<trace_light*> lights = {};
 
+  // light selection, with a hierarchy over instance lights
+  vector<trace_light_node> nodes        = {};
+  vector<trace_light*>     environments = {};
+
   // cleanup
   ~trace_lights();
 };
@@ -462,7 +559,8 @@ using trace_bvh = bvh_scene;
 void init_bvh(trace_bvh* bvh, const trace_scene* scene,
     const trace_params& params, const progress_callback& progress_cb = {});
 
-// Refit bvh data
+// Refit bvh data. Instances are updated also when the opacity of their
+// material changes, since cutouts are tracked in the bvh.
 void update_bvh(trace_bvh* bvh, const trace_scene* scene,
     const vector<trace_instance*>& updated_instances,
     const vector<trace_shape*>& updated_shapes, const trace_params& params);
@@ -476,21 +574,32 @@ image<vec4f> trace_image(const trace_scene* scene, const trace_camera* camera,
 // Check is a sampler requires lights
 bool is_sampler_lit(const trace_params& params);
 
-// [experimental] Asynchronous state
+// [experimental] Asynchronous state. Pixels are rendered in square tiles,
+// stored as {min_i, min_j, max_i, max_j}, in the order given by the params.
+// For adaptive sampling, we also store the sum of squared sample luminance.
 struct trace_state {
-  image<vec4f>     render       = {};
-  image<vec4f>     accumulation = {};
-  image<int>       samples      = {};
-  image<rng_state> rngs         = {};
-  future<void>     worker       = {};  // async
-  atomic<bool>     stop         = {};  // async
+  image<vec4f>          render       = {};
+  image<vec4f>          accumulation = {};
+  image<float>          moments      = {};
+  image<int>            samples      = {};
+  image<rng_state>      rngs         = {};
+  vector<vec4i>         tiles        = {};
+  vector<vector<vec2i>> active       = {};  // pixels still sampling, per tile
+  future<void>          worker       = {};  // async
+  atomic<bool>          stop         = {};  // async
 };
 
+// [experimental] Estimated relative error of a pixel, computed from the
+// sample variance. Used to stop sampling converged pixels.
+float eval_error(const trace_state* state, const vec2i& ij);
+
 // [experimental] Callback used to report partially computed image
 using async_callback = function<void(
     const image<vec4f>& render, int current, int total, const vec2i& ij)>;
 
-// [experimental] Asynchronous interface
+// [experimental] Asynchronous interface. The image callback is called after
+// each batch of `tilesamples` samples, and the async callback after each
+// pixel sample.
 struct trace_state;
 void trace_start(trace_state* state, const trace_scene* scene,
     const trace_camera* camera, const trace_bvh* bvh,